@@ -0,0 +1,118 @@
+//
+//  ArgParse.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ArgParse.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <string.h>
+#include <strings.h>
+
+using namespace ECCCorrection;
+
+uint64_t parseNumber(const char *str){
+    if (strncasecmp(str, "0x", 2) == 0) {
+        return strtoull(str, NULL, 16);
+    }else{
+        return strtoull(str, NULL, 10);
+    }
+}
+
+PageStructure parsePageStructure(const char *str){
+    PageStructure ret;
+    std::vector<std::string> parts;
+    {
+        std::string argstr = str;
+        ssize_t commaPos = 0;
+        while ((commaPos = argstr.find(",")) != std::string::npos) {
+            std::string sp = argstr.substr(0, commaPos);
+            parts.push_back(sp);
+            argstr = argstr.substr(commaPos+1);
+        }
+        parts.push_back(argstr);
+    }
+    
+    for (auto p : parts) {
+        ssize_t posCol1 = 0;
+        ssize_t posCol2 = 0;
+        posCol1 = p.find(":");
+        posCol2 = p.rfind(":");
+        retassure(posCol1 != std::string::npos, "parsePageStructure failed to find first ':' in codeword descriptor");
+        retassure(posCol2 != std::string::npos, "parsePageStructure failed to find second ':' in codeword descriptor");
+        retassure(posCol1 < posCol2, "parsePageStructure failed to two ':' in codeword descriptor");
+        
+        std::string str_tag  = p.substr(0,posCol1);
+        std::string str_len  = p.substr(posCol1+1,posCol2-posCol1-1);
+        std::string str_type = p.substr(posCol2+1);
+        
+        retassure(str_type.size() >= 1, "parsePageStructure type got invalid len");
+        
+        PageCodeword ps = {
+            .tag = static_cast<uint32_t>(atoi(str_tag.c_str())),
+            .len = static_cast<uint32_t>(atoi(str_len.c_str())),
+        };
+        
+        switch (str_type.at(0)) {
+            case 'd':
+            case 'D':
+                ps.type = kPageCodewordTypeData;
+                break;
+
+            case 'e':
+            case 'E':
+                ps.type = kPageCodewordTypeECC;
+                break;
+
+            case 's':
+            case 'S':
+                ps.type = kPageCodewordTypeServiceArea;
+                break;
+
+            default:
+                reterror("unexpected page structure type '%s'",str_type.c_str());
+                break;
+        }
+        ret.push_back(ps);
+    }
+    
+    return ret;
+}
+
+SimNandReader::Config parseSimConfig(const char *str, std::string &imagePath){
+    SimNandReader::Config ret = SimNandReader::defaultConfig();
+    std::string paramstring = str;
+    size_t commaPos = paramstring.find(",");
+    imagePath = paramstring.substr(0, commaPos);
+    while (commaPos != std::string::npos) {
+        paramstring = paramstring.substr(commaPos+1);
+        commaPos = paramstring.find(",");
+        std::string part = paramstring.substr(0, commaPos);
+        size_t eqPos = part.find("=");
+        retassure(eqPos != std::string::npos, "Invalid simulator parameter '%s'",part.c_str());
+        std::string key = part.substr(0, eqPos);
+        const char *value = part.c_str() + eqPos + 1;
+        if (key == "latency") {
+            ret.latencyUs = atof(value);
+        }else if (key == "bandwidth") {
+            ret.bandwidth = atof(value);
+        }else if (key == "bitflips") {
+            ret.bitflipRate = atof(value);
+        }else if (key == "failures") {
+            ret.failureRate = atof(value);
+        }else if (key == "ce-pages") {
+            ret.cePages = parseNumber(value);
+        }else if (key == "page-size") {
+            ret.pageSize = (uint32_t)parseNumber(value);
+        }else if (key == "seed") {
+            ret.seed = (uint32_t)parseNumber(value);
+        }else{
+            reterror("Unknown simulator parameter '%s'",key.c_str());
+        }
+    }
+    retassure(imagePath.size(), "No simulator image specified");
+    return ret;
+}
@@ -0,0 +1,37 @@
+//
+//  ArgParse.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ArgParse_hpp
+#define ArgParse_hpp
+
+#include "ECCCorrection.hpp"
+#include "SimNandReader.hpp"
+
+#include <string>
+
+#include <stdint.h>
+
+/*
+    Argument parsers shared by bnd and bnd-bench
+ */
+
+/*
+    Decimal, or hex with a 0x prefix
+ */
+uint64_t parseNumber(const char *str);
+
+/*
+    <N:size:type,N:size:type,...> as accepted by --page-structure
+ */
+ECCCorrection::PageStructure parsePageStructure(const char *str);
+
+/*
+    <image>[,latency=<us>][,bandwidth=<bytes/s>][,bitflips=<rate>][,failures=<rate>][,ce-pages=<num>][,page-size=<num>][,seed=<num>]
+ */
+SimNandReader::Config parseSimConfig(const char *str, std::string &imagePath);
+
+#endif /* ArgParse_hpp */
@@ -0,0 +1,286 @@
+//
+//  BadBlockTable.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "BadBlockTable.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define BBT_MAGIC "BNDBBT"
+#define BBT_VERSION 1
+#define SCAN_BATCH_PAGES 256
+
+static void writeAll(int fd, const void *buf, size_t size){
+    const uint8_t *ptr = (const uint8_t*)buf;
+    while (size) {
+        ssize_t didWrite = write(fd, ptr, size);
+        if (didWrite < 0 && errno == EINTR) continue;
+        retassure(didWrite > 0, "Failed to write with err=%d (%s)",errno,strerror(errno));
+        ptr += didWrite;
+        size -= didWrite;
+    }
+}
+
+static void readAll(int fd, void *buf, size_t size){
+    uint8_t *ptr = (uint8_t*)buf;
+    while (size) {
+        ssize_t didRead = read(fd, ptr, size);
+        if (didRead < 0 && errno == EINTR) continue;
+        retassure(didRead > 0, "Failed to read with err=%d (%s)",errno,strerror(errno));
+        ptr += didRead;
+        size -= didRead;
+    }
+}
+
+/*
+    data holds the page starting at column base
+ */
+static bool isMarkerBad(const uint8_t *data, uint32_t base, const BadBlockTable::MarkerConfig &cfg){
+    for (uint32_t col : cfg.columns) {
+        if (data[col - base] != 0xFF) return true;
+    }
+    return false;
+}
+
+#pragma mark BadBlockTable
+BadBlockTable::BadBlockTable(uint32_t pagesPerBlock, uint64_t blocksCnt, uint64_t firstPage)
+: _pagesPerBlock(pagesPerBlock), _blocksCnt(blocksCnt), _firstPage(firstPage)
+{
+    retassure(_pagesPerBlock, "Pages per block cannot be 0");
+    _bitmap.resize((_blocksCnt + 63) / 64);
+}
+
+BadBlockTable::BadBlockTable(const char *path)
+: _pagesPerBlock(0), _blocksCnt(0), _firstPage(0)
+{
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    Header hdr = {};
+
+    retassure((fd = open(path, O_RDONLY)) != -1,"Failed to open '%s' with err=%d (%s)",path,errno,strerror(errno));
+    readAll(fd, &hdr, sizeof(hdr));
+    retassure(!memcmp(hdr.magic, BBT_MAGIC, sizeof(BBT_MAGIC)), "'%s' is not a bad block table",path);
+    retassure(hdr.version == BBT_VERSION, "Unsupported bad block table version %u",hdr.version);
+    retassure(hdr.pagesPerBlock, "Pages per block cannot be 0");
+    _pagesPerBlock = hdr.pagesPerBlock;
+    _blocksCnt = hdr.blocksCnt;
+    _firstPage = hdr.firstPage;
+    _bitmap.resize((_blocksCnt + 63) / 64);
+    readAll(fd, _bitmap.data(), (_blocksCnt + 7) / 8);
+}
+
+#pragma mark private
+std::vector<uint32_t> BadBlockTable::markerPages(uint32_t pagesPerBlock, const MarkerConfig &cfg){
+    std::vector<uint32_t> ret;
+    if (cfg.pages & kMarkerPageFirst) ret.push_back(0);
+    if ((cfg.pages & kMarkerPageSecond) && pagesPerBlock > 1) ret.push_back(1);
+    if ((cfg.pages & kMarkerPageLast) && pagesPerBlock > 2) ret.push_back(pagesPerBlock-1);
+    retassure(ret.size(), "No marker pages selected");
+    return ret;
+}
+
+#pragma mark public
+void BadBlockTable::markBad(uint64_t block){
+    retassure(block < _blocksCnt, "Block %llu is out of range",(unsigned long long)block);
+    _bitmap[block/64] |= 1ULL << (block%64);
+}
+
+uint64_t BadBlockTable::badBlocksCnt() const{
+    uint64_t ret = 0;
+    for (uint64_t w : _bitmap) {
+        ret += __builtin_popcountll(w);
+    }
+    return ret;
+}
+
+std::vector<uint64_t> BadBlockTable::badBlocks() const{
+    std::vector<uint64_t> ret;
+    for (uint64_t i = 0; i < _bitmap.size(); i++) {
+        for (uint64_t w = _bitmap[i]; w; w &= w - 1) {
+            ret.push_back(i*64 + __builtin_ctzll(w));
+        }
+    }
+    return ret;
+}
+
+void BadBlockTable::write(const char *path) const{
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    Header hdr = {
+        .version = BBT_VERSION,
+        .pagesPerBlock = _pagesPerBlock,
+        .blocksCnt = _blocksCnt,
+        .firstPage = _firstPage,
+    };
+    memcpy(hdr.magic, BBT_MAGIC, sizeof(BBT_MAGIC));
+
+    retassure((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",path,errno,strerror(errno));
+    writeAll(fd, &hdr, sizeof(hdr));
+    writeAll(fd, _bitmap.data(), (_blocksCnt + 7) / 8);
+}
+
+void BadBlockTable::checkDump(uint64_t firstPage, uint64_t pagesCnt) const{
+    uint64_t endBlock = (firstPage + pagesCnt + _pagesPerBlock - 1) / _pagesPerBlock;
+    retassure(firstPage == _firstPage, "Bad block table is for a dump starting at page 0x%llx, but the dump starts at page 0x%llx (-a)",(unsigned long long)_firstPage,(unsigned long long)firstPage);
+    retassure(endBlock <= _blocksCnt, "Bad block table covers %llu blocks of %u pages, but the dump reaches into block %llu",(unsigned long long)_blocksCnt,_pagesPerBlock,(unsigned long long)endBlock-1);
+}
+
+BadBlockTable::MarkerConfig BadBlockTable::defaultMarkerConfig(uint32_t pageSize){
+    uint32_t dataSize = 1;
+    while (dataSize*2 <= pageSize) dataSize *= 2;
+    /* small page chips keep the marker in byte 5 of the spare area, large page chips in byte 0 */
+    uint32_t column = (dataSize <= 512) ? dataSize + 5 : dataSize;
+    if (column >= pageSize) column = 0; //no spare area in the dump
+    return {
+        .columns = {column},
+        .pages = kMarkerPageFirst | kMarkerPageLast,
+    };
+}
+
+uint32_t BadBlockTable::parseMarkerPages(const char *str){
+    uint32_t ret = 0;
+    std::string s = str;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        std::string e = s.substr(pos, end - pos);
+        if (strcasecmp(e.c_str(), "first") == 0) {
+            ret |= kMarkerPageFirst;
+        }else if (strcasecmp(e.c_str(), "second") == 0) {
+            ret |= kMarkerPageSecond;
+        }else if (strcasecmp(e.c_str(), "last") == 0) {
+            ret |= kMarkerPageLast;
+        }else{
+            reterror("Unexpected marker page '%s'",e.c_str());
+        }
+        pos = end + 1;
+    }
+    return ret;
+}
+
+BadBlockTable BadBlockTable::scanDump(const FileMapping *inmap, uint32_t pageSize, uint32_t pagesPerBlock, const MarkerConfig &cfg, uint64_t firstPage, uint32_t threadsCnt){
+    uint64_t pagesCnt = 0;
+    uint64_t firstBlock = 0;
+    uint64_t endBlock = 0;
+
+    retassure(pageSize, "Pagesize not set!");
+    retassure(pagesPerBlock, "Pages per block cannot be 0");
+    retassure(cfg.columns.size(), "No marker columns specified");
+    for (uint32_t col : cfg.columns) {
+        retassure(col < pageSize, "Marker column 0x%x is outside of the page",col);
+    }
+    pagesCnt = inmap->memSize() / pageSize;
+    retassure(pagesCnt, "Input is smaller than a single page");
+    firstBlock = firstPage / pagesPerBlock;
+    endBlock = (firstPage + pagesCnt + pagesPerBlock - 1) / pagesPerBlock;
+    if (!threadsCnt) threadsCnt = PageScheduler::defaultWorkersCnt();
+
+    const std::vector<uint32_t> mpages = markerPages(pagesPerBlock, cfg);
+    BadBlockTable ret(pagesPerBlock, endBlock, firstPage);
+    std::mutex retLck;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    /* the scheduler hands out blocks instead of pages here */
+    PageScheduler scheduler(threadsCnt);
+    scheduler.addSection(0, firstBlock, endBlock);
+    scheduler.distribute();
+
+    for (uint32_t i=0; i<threadsCnt; i++) {
+        wthreads.push_back(std::thread([&](uint32_t tid){
+            try {
+                FileMapping::Cursor cursor(inmap);
+                std::vector<uint64_t> bad;
+                PageScheduler::Range r = {};
+                while (scheduler.next(tid, r)) {
+                    for (uint64_t block = r.begin; block < r.end; block++) {
+                        for (uint32_t mp : mpages) {
+                            /* the first and last block may only be partially in the dump */
+                            uint64_t chipPage = block*pagesPerBlock + mp;
+                            if (chipPage < firstPage || chipPage - firstPage >= pagesCnt) continue;
+                            uint64_t page = chipPage - firstPage;
+                            if (isMarkerBad(cursor.advance(page*pageSize, pageSize), 0, cfg)) {
+                                bad.push_back(block);
+                                break;
+                            }
+                        }
+                    }
+                }
+                std::unique_lock<std::mutex> ul(retLck);
+                for (uint64_t block : bad) ret.markBad(block);
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(retLck);
+                if (!workerException) workerException = std::current_exception();
+            }
+        },i));
+    }
+    for (auto &t : wthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+    return ret;
+}
+
+BadBlockTable BadBlockTable::scanChip(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t numPages, uint32_t pageSize, uint32_t pagesPerBlock, const MarkerConfig &cfg){
+    retassure(pageSize, "Pagesize not set!");
+    retassure(pagesPerBlock, "Pages per block cannot be 0");
+    retassure(numPages, "No pages to scan");
+    retassure(cfg.columns.size(), "No marker columns specified");
+    for (uint32_t col : cfg.columns) {
+        retassure(col < pageSize, "Marker column 0x%x is outside of the page",col);
+    }
+
+    uint64_t firstBlock = pageAddress / pagesPerBlock;
+    uint64_t endBlock = ((uint64_t)pageAddress + numPages + pagesPerBlock - 1) / pagesPerBlock;
+    const std::vector<uint32_t> mpages = markerPages(pagesPerBlock, cfg);
+    BadBlockTable ret(pagesPerBlock, endBlock, pageAddress);
+
+    /* only the bytes between the first and the last marker column are transferred */
+    uint32_t minCol = *std::min_element(cfg.columns.begin(), cfg.columns.end());
+    uint32_t span = *std::max_element(cfg.columns.begin(), cfg.columns.end()) - minCol + 1;
+    std::vector<uint32_t> addresses;
+    std::vector<uint64_t> blocks;
+    std::vector<uint8_t> markers(SCAN_BATCH_PAGES*span);
+
+    auto flush = [&]{
+        if (!addresses.size()) return;
+        pnr.readPages(CE, addresses.data(), addresses.size(), (uint16_t)span, markers.data(), (uint16_t)minCol);
+        for (size_t i = 0; i < addresses.size(); i++) {
+            if (isMarkerBad(&markers[i*span], minCol, cfg)) ret.markBad(blocks[i]);
+        }
+        addresses.clear();
+        blocks.clear();
+    };
+
+    debug("Scanning blocks %llu-%llu for bad block markers",(unsigned long long)firstBlock,(unsigned long long)endBlock-1);
+    for (uint64_t block = firstBlock; block < endBlock; block++) {
+        for (uint32_t mp : mpages) {
+            addresses.push_back((uint32_t)(block*pagesPerBlock + mp));
+            blocks.push_back(block);
+            if (addresses.size() == SCAN_BATCH_PAGES) flush();
+        }
+    }
+    flush();
+    return ret;
+}
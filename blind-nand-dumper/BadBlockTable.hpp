@@ -0,0 +1,111 @@
+//
+//  BadBlockTable.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef BadBlockTable_hpp
+#define BadBlockTable_hpp
+
+#include "FileMapping.hpp"
+#include "NandReader.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    One bit per erase block, set for bad blocks.
+    Block numbers are counted from page 0 of the chip, firstPage is the chip page
+    which page 0 of the dump starts at, so pages of the dump can be looked up directly.
+    Blocks are found bad by their factory bad block marker, any marker byte which is not 0xFF
+    in one of the checked pages of the block marks the whole block bad.
+ */
+class BadBlockTable {
+public:
+    enum MarkerPage : uint32_t{
+        kMarkerPageFirst    = 1 << 0,
+        kMarkerPageSecond   = 1 << 1,
+        kMarkerPageLast     = 1 << 2,
+    };
+
+    struct MarkerConfig{
+        std::vector<uint32_t> columns;  /* byte offsets of the marker within the page */
+        uint32_t pages;                 /* MarkerPage */
+    };
+
+#pragma pack(push, 1)
+    struct Header{
+        char magic[8];              /* "BNDBBT\0\0" */
+        uint32_t version;
+        uint32_t pagesPerBlock;
+        uint64_t blocksCnt;
+        uint64_t firstPage;
+    };
+#pragma pack(pop)
+
+private:
+    uint32_t _pagesPerBlock;
+    uint64_t _blocksCnt;
+    uint64_t _firstPage;
+    std::vector<uint64_t> _bitmap;
+
+    static std::vector<uint32_t> markerPages(uint32_t pagesPerBlock, const MarkerConfig &cfg);
+public:
+    BadBlockTable(uint32_t pagesPerBlock, uint64_t blocksCnt, uint64_t firstPage = 0);
+
+    /*
+        Loads a table which was written by write()
+     */
+    BadBlockTable(const char *path);
+
+    inline uint32_t pagesPerBlock() const{return _pagesPerBlock;}
+    inline uint64_t blocksCnt() const{return _blocksCnt;}
+    inline uint64_t firstPage() const{return _firstPage;}
+    inline bool isBad(uint64_t block) const{return block < _blocksCnt && (_bitmap[block/64] >> (block%64)) & 1;}
+    /*
+        page - relative to the dump
+     */
+    inline bool isBadPage(uint64_t page) const{return isBad((_firstPage + page) / _pagesPerBlock);}
+    void markBad(uint64_t block);
+    uint64_t badBlocksCnt() const;
+    std::vector<uint64_t> badBlocks() const;
+
+    /*
+        Writes a Header followed by the bitmap, one bit per block starting with the lowest bit of the first byte
+     */
+    void write(const char *path) const;
+
+    /*
+        Fails unless the table was made for a dump of pagesCnt pages starting at chip page firstPage
+        and covers all of its blocks
+     */
+    void checkDump(uint64_t firstPage, uint64_t pagesCnt) const;
+
+    /*
+        Marker columns and pages as used by the chip vendors for pages of pageSize bytes:
+        the first spare byte of the first and last page (byte 5 of the spare area for small page chips)
+     */
+    static MarkerConfig defaultMarkerConfig(uint32_t pageSize);
+
+    /*
+        <first|second|last,...>
+     */
+    static uint32_t parseMarkerPages(const char *str);
+
+    /*
+        Checks the marker pages of every block of the dump, without touching any other page.
+        firstPage  - chip page which the dump starts at
+        threadsCnt - number of worker threads, 0 = one per cpu core
+     */
+    static BadBlockTable scanDump(const FileMapping *inmap, uint32_t pageSize, uint32_t pagesPerBlock, const MarkerConfig &cfg, uint64_t firstPage = 0, uint32_t threadsCnt = 0);
+
+    /*
+        Checks the blocks in [pageAddress, pageAddress+numPages) of a chip,
+        only the marker bytes of the marker pages are read. The table is made for a dump starting at pageAddress.
+     */
+    static BadBlockTable scanChip(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t numPages, uint32_t pageSize, uint32_t pagesPerBlock, const MarkerConfig &cfg);
+};
+
+#endif /* BadBlockTable_hpp */
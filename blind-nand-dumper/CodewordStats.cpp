@@ -0,0 +1,238 @@
+//
+//  CodewordStats.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "CodewordStats.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BITFLIP_MAP_MAGIC "BNDFLIPS"
+#define BITFLIP_MAP_VERSION 1
+#define RECORDS_BUFFER_CNT 0x4000
+
+namespace {
+struct ThreadShard{
+    uint64_t serial;
+    CodewordStats::Shard *shard;
+    std::weak_ptr<bool> alive;
+};
+}
+
+static void writeAll(int fd, const void *buf, size_t size){
+    const uint8_t *ptr = (const uint8_t*)buf;
+    while (size) {
+        ssize_t didWrite = write(fd, ptr, size);
+        retassure(didWrite > 0, "Failed to write with err=%d (%s)",errno,strerror(errno));
+        ptr += didWrite;
+        size -= didWrite;
+    }
+}
+
+#pragma mark CodewordStats::Shard
+CodewordStats::Shard::Shard(CodewordStats *owner)
+: _owner(owner), _good(0), _corrected(0), _uncorrectable(0), _erased(0), _correctedBitflips(0), _erasedBitflips(0)
+, _lastBlock(0), _lastBlockSummary(nullptr)
+{
+    if (_owner->_mapFd != -1) _records.reserve(RECORDS_BUFFER_CNT);
+}
+
+CodewordStats::BlockSummary &CodewordStats::Shard::block(uint32_t pagenum){
+    uint32_t blk = pagenum / _owner->_pagesPerBlock;
+    /* workers process consecutive pages, so the previous block is almost always the right one */
+    if (!_lastBlockSummary || _lastBlock != blk) {
+        _lastBlockSummary = &_blocks[blk];
+        _lastBlock = blk;
+    }
+    return *_lastBlockSummary;
+}
+
+void CodewordStats::Shard::flushRecords(){
+    if (!_records.size()) return;
+    _owner->writeRecords(_records.data(), _records.size());
+    _records.clear();
+}
+
+void CodewordStats::Shard::record(uint32_t pagenum, uint32_t cwnum, Result result, uint32_t bitflips){
+    BlockSummary &bs = block(pagenum);
+    bs.codewords++;
+    switch (result) {
+        case kResultGood:
+            inc(_good, 1);
+            bs.good++;
+            bitflips = 0;
+            break;
+        case kResultCorrected:
+            inc(_corrected, 1);
+            inc(_correctedBitflips, bitflips);
+            bs.corrected++;
+            bs.bitflips += bitflips;
+            bs.maxBitflips = std::max(bs.maxBitflips, bitflips);
+            break;
+        case kResultUncorrectable:
+            inc(_uncorrectable, 1);
+            bs.uncorrectable++;
+            bitflips = 0;
+            if (!_uncorrectablePages.size() || _uncorrectablePages.back() != pagenum) {
+                _uncorrectablePages.push_back(pagenum);
+            }
+            break;
+        case kResultErased:
+            inc(_erased, 1);
+            inc(_erasedBitflips, bitflips);
+            bs.erased++;
+            bs.erasedBitflips += bitflips;
+            break;
+        default:
+            reterror("Unknown codeword result %d",result);
+    }
+
+    if (_owner->_mapFd != -1) {
+        _records.push_back({
+            .page = pagenum,
+            .codeword = (uint16_t)cwnum,
+            .result = result,
+            .bitflips = (uint8_t)std::min<uint32_t>(bitflips, UINT8_MAX),
+        });
+        if (_records.size() >= RECORDS_BUFFER_CNT) flushRecords();
+    }
+}
+
+#pragma mark CodewordStats
+CodewordStats::CodewordStats(uint32_t pagesPerBlock)
+: _serial(0), _alive(std::make_shared<bool>(true)), _pagesPerBlock(pagesPerBlock), _mapFd(-1)
+{
+    static std::atomic<uint64_t> gSerial = 1;
+    retassure(_pagesPerBlock, "Pages per block cannot be 0");
+    _serial = gSerial++;
+}
+
+CodewordStats::~CodewordStats(){
+    //
+}
+
+#pragma mark private
+void CodewordStats::writeRecords(const BitflipRecord *records, size_t cnt){
+    std::unique_lock<std::mutex> ul(_mapLck);
+    writeAll(_mapFd, records, cnt*sizeof(BitflipRecord));
+}
+
+#pragma mark public
+void CodewordStats::setBitflipMap(int fd, uint32_t pageSize){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        retassure(!_shards.size(), "Bitflip map needs to be set before recording");
+    }
+    BitflipMapHeader hdr = {
+        .version = BITFLIP_MAP_VERSION,
+        .recordSize = sizeof(BitflipRecord),
+        .pageSize = pageSize,
+        .pagesPerBlock = _pagesPerBlock,
+    };
+    memcpy(hdr.magic, BITFLIP_MAP_MAGIC, sizeof(hdr.magic));
+    writeAll(fd, &hdr, sizeof(hdr));
+    _mapFd = fd;
+}
+
+CodewordStats::Shard &CodewordStats::shard(){
+    /* keyed by serial rather than address, so a new object at the same address never picks up stale shards */
+    thread_local std::vector<ThreadShard> tShards;
+
+    for (auto &s : tShards) {
+        if (s.serial == _serial) return *s.shard;
+    }
+    /* drop entries of destroyed objects, so the list never outgrows the objects this thread still uses */
+    tShards.erase(std::remove_if(tShards.begin(), tShards.end(), [](const ThreadShard &s){return s.alive.expired();}), tShards.end());
+
+    Shard *ret = nullptr;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _shards.push_back(std::make_unique<Shard>(this));
+        ret = _shards.back().get();
+    }
+    tShards.push_back({_serial, ret, _alive});
+    return *ret;
+}
+
+CodewordStats::Totals CodewordStats::totals() const{
+    Totals ret = {};
+    std::unique_lock<std::mutex> ul(_lck);
+    for (auto &s : _shards) {
+        ret.good += s->_good.load(std::memory_order_relaxed);
+        ret.corrected += s->_corrected.load(std::memory_order_relaxed);
+        ret.uncorrectable += s->_uncorrectable.load(std::memory_order_relaxed);
+        ret.erased += s->_erased.load(std::memory_order_relaxed);
+        ret.correctedBitflips += s->_correctedBitflips.load(std::memory_order_relaxed);
+        ret.erasedBitflips += s->_erasedBitflips.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+void CodewordStats::flush(){
+    std::unique_lock<std::mutex> ul(_lck);
+    for (auto &s : _shards) {
+        s->flushRecords();
+    }
+}
+
+std::vector<uint32_t> CodewordStats::uncorrectablePages() const{
+    std::vector<uint32_t> ret;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        for (auto &s : _shards) {
+            ret.insert(ret.end(), s->_uncorrectablePages.begin(), s->_uncorrectablePages.end());
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+std::map<uint32_t, CodewordStats::BlockSummary> CodewordStats::blockSummary() const{
+    std::map<uint32_t, BlockSummary> ret;
+    std::unique_lock<std::mutex> ul(_lck);
+    for (auto &s : _shards) {
+        for (auto &b : s->_blocks) {
+            BlockSummary &dst = ret[b.first];
+            dst.codewords += b.second.codewords;
+            dst.good += b.second.good;
+            dst.corrected += b.second.corrected;
+            dst.uncorrectable += b.second.uncorrectable;
+            dst.erased += b.second.erased;
+            dst.maxBitflips = std::max(dst.maxBitflips, b.second.maxBitflips);
+            dst.bitflips += b.second.bitflips;
+            dst.erasedBitflips += b.second.erasedBitflips;
+        }
+    }
+    return ret;
+}
+
+void CodewordStats::writeBlockSummary(const char *path) const{
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    std::string csv = "block,first_page,codewords,good,corrected,uncorrectable,erased,bitflips,max_bitflips,erased_bitflips\n";
+
+    for (auto &b : blockSummary()) {
+        char line[0x100];
+        snprintf(line, sizeof(line), "%u,%llu,%u,%u,%u,%u,%u,%llu,%u,%llu\n",b.first,(unsigned long long)b.first*_pagesPerBlock,
+                 b.second.codewords,b.second.good,b.second.corrected,b.second.uncorrectable,b.second.erased,
+                 (unsigned long long)b.second.bitflips,b.second.maxBitflips,(unsigned long long)b.second.erasedBitflips);
+        csv += line;
+    }
+
+    retassure((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",path,errno,strerror(errno));
+    writeAll(fd, csv.data(), csv.size());
+}
@@ -0,0 +1,149 @@
+//
+//  CodewordStats.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef CodewordStats_hpp
+#define CodewordStats_hpp
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Collects the per codeword results of an ECC pass.
+    Every thread records into its own shard, so the hot path neither shares cache lines nor takes locks.
+    Shards are only merged when totals are requested.
+    Optionally every codeword is also written as a BitflipRecord to a bitflip map,
+    records are buffered per thread and appended in batches, so the map is NOT sorted by page.
+ */
+class CodewordStats {
+public:
+    enum Result : uint8_t{
+        kResultGood          = 0,
+        kResultCorrected     = 1,
+        kResultUncorrectable = 2,
+        kResultErased        = 3,
+    };
+
+#pragma pack(push, 1)
+    struct BitflipMapHeader{
+        char magic[8];              /* "BNDFLIPS" */
+        uint32_t version;
+        uint32_t recordSize;
+        uint32_t pageSize;
+        uint32_t pagesPerBlock;
+    };
+    struct BitflipRecord{
+        uint32_t page;
+        uint16_t codeword;
+        uint8_t result;             /* Result */
+        uint8_t bitflips;           /* corrected or cleaned bits, saturates at 255, 0 for uncorrectable */
+    };
+#pragma pack(pop)
+
+    struct Totals{
+        uint64_t good;
+        uint64_t corrected;
+        uint64_t uncorrectable;
+        uint64_t erased;
+        uint64_t correctedBitflips;
+        uint64_t erasedBitflips;
+    };
+
+    struct BlockSummary{
+        uint32_t codewords;
+        uint32_t good;
+        uint32_t corrected;
+        uint32_t uncorrectable;
+        uint32_t erased;
+        uint32_t maxBitflips;
+        uint64_t bitflips;
+        uint64_t erasedBitflips;
+    };
+
+    class alignas(64) Shard{
+        CodewordStats *_owner;
+        /* single writer, readers only need a consistent-enough snapshot for progress output */
+        std::atomic<uint64_t> _good;
+        std::atomic<uint64_t> _corrected;
+        std::atomic<uint64_t> _uncorrectable;
+        std::atomic<uint64_t> _erased;
+        std::atomic<uint64_t> _correctedBitflips;
+        std::atomic<uint64_t> _erasedBitflips;
+
+        std::unordered_map<uint32_t, BlockSummary> _blocks;
+        uint32_t _lastBlock;
+        BlockSummary *_lastBlockSummary;
+        std::vector<uint32_t> _uncorrectablePages;
+        std::vector<BitflipRecord> _records;
+
+        static inline void inc(std::atomic<uint64_t> &v, uint64_t amount){
+            v.store(v.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+        BlockSummary &block(uint32_t pagenum);
+        void flushRecords();
+        friend CodewordStats;
+    public:
+        Shard(CodewordStats *owner);
+
+        /*
+            bitflips - corrected bits for kResultCorrected, cleaned bits for kResultErased, ignored otherwise
+         */
+        void record(uint32_t pagenum, uint32_t cwnum, Result result, uint32_t bitflips);
+    };
+
+private:
+    uint64_t _serial;
+    std::shared_ptr<bool> _alive;   /* thread local shard lookups hold weak references to drop entries of dead objects */
+    uint32_t _pagesPerBlock;
+    int _mapFd;
+    std::mutex _mapLck;
+
+    mutable std::mutex _lck;
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+    void writeRecords(const BitflipRecord *records, size_t cnt);
+public:
+    /*
+        pagesPerBlock - pages per erase block, used for the block summary
+     */
+    CodewordStats(uint32_t pagesPerBlock);
+    CodewordStats(const CodewordStats &) = delete;
+    CodewordStats &operator=(const CodewordStats &) = delete;
+    ~CodewordStats();
+
+    /*
+        Writes a BitflipMapHeader and enables appending one BitflipRecord per codeword to fd.
+        The stats object does not take ownership of fd.
+     */
+    void setBitflipMap(int fd, uint32_t pageSize);
+
+    /*
+        Returns the shard of the calling thread, creating it on first use
+     */
+    Shard &shard();
+
+    Totals totals() const;
+
+    /*
+        The following must only be called once all recording threads are done
+     */
+    void flush();
+    std::vector<uint32_t> uncorrectablePages() const;
+    std::map<uint32_t, BlockSummary> blockSummary() const;
+
+    /*
+        Writes blockSummary() as csv to path
+     */
+    void writeBlockSummary(const char *path) const;
+};
+
+#endif /* CodewordStats_hpp */
@@ -0,0 +1,401 @@
+//
+//  DumpContainer.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif //HAVE_CONFIG_H
+
+#include "DumpContainer.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZSTD
+#   include <zstd.h>
+#endif //HAVE_LIBZSTD
+
+#define CONTAINER_MAGIC "BNDDUMP"
+#define CONTAINER_VERSION 1
+#define BLOCK_MAGIC 0x42444E42 /* "BNDB" */
+
+static_assert(sizeof(DumpContainer::Header) == 64, "Header needs to be 64 bytes");
+static_assert(sizeof(DumpContainer::BlockHeader) == 64, "BlockHeader needs to be 64 bytes");
+
+using namespace DumpContainer;
+
+static void pwriteAll(int fd, const void *buf, size_t size, uint64_t offset){
+    const uint8_t *ptr = (const uint8_t*)buf;
+    while (size) {
+        ssize_t didWrite = pwrite(fd, ptr, size, (off_t)offset);
+        if (didWrite < 0 && errno == EINTR) continue;
+        retassure(didWrite > 0, "Failed to write container at 0x%llx with err=%d (%s)",(unsigned long long)offset,errno,strerror(errno));
+        ptr += didWrite;
+        size -= didWrite;
+        offset += didWrite;
+    }
+}
+
+static bool isErasedPage(const uint8_t *page, size_t size){
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, &page[i], sizeof(v));
+        if (v != UINT64_MAX) return false;
+    }
+    for (; i < size; i++) {
+        if (page[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_LIBZSTD
+static ZSTD_CCtx *threadCCtx(){
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t(*)(ZSTD_CCtx*)> tCtx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    return tCtx.get();
+}
+
+static ZSTD_DCtx *threadDCtx(){
+    thread_local std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)> tCtx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    return tCtx.get();
+}
+#endif //HAVE_LIBZSTD
+
+#pragma mark DumpContainer
+bool DumpContainer::isContainer(const char *path, Header *hdr){
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    Header tmp = {};
+    if ((fd = open(path, O_RDONLY)) == -1) return false;
+    if (read(fd, &tmp, sizeof(tmp)) != sizeof(tmp)) return false;
+    if (!isContainer((const uint8_t*)&tmp, sizeof(tmp))) return false;
+    if (hdr) *hdr = tmp;
+    return true;
+}
+
+bool DumpContainer::isContainer(const uint8_t *mem, size_t memSize){
+    return mem && memSize >= sizeof(Header) && memcmp(mem, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) == 0;
+}
+
+#pragma mark DumpContainer::Writer
+Writer::Writer(const char *path, uint32_t pageSize, uint64_t pagesCnt, uint32_t blockPages, int level)
+: _fd(-1), _pageSize(pageSize), _blockPages(blockPages), _pagesCnt(pagesCnt), _level(level), _finished(false)
+, _appendOffset(sizeof(Header))
+{
+    retassure(_pageSize, "Page size cannot be 0");
+    retassure(_pagesCnt, "Container needs at least one page");
+    retassure(_blockPages && _blockPages <= DUMP_CONTAINER_MAX_BLOCK_PAGES, "Block pages needs to be between 1 and %d",DUMP_CONTAINER_MAX_BLOCK_PAGES);
+
+    uint64_t blocksCnt = (_pagesCnt + _blockPages - 1) / _blockPages;
+    _written.resize(blocksCnt);
+    _index.resize(blocksCnt);
+
+    retassure((_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",path,errno,strerror(errno));
+
+    Header hdr = {
+        .version = CONTAINER_VERSION,
+        .pageSize = _pageSize,
+        .blockPages = _blockPages,
+        .pagesCnt = _pagesCnt,
+        .blocksCnt = blocksCnt,
+    };
+    memcpy(hdr.magic, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    pwriteAll(_fd, &hdr, sizeof(hdr), 0);
+#ifndef HAVE_LIBZSTD
+    warning("Built without zstd, container blocks will only drop erased pages");
+#endif //HAVE_LIBZSTD
+}
+
+Writer::~Writer(){
+    if (!_finished) {
+        debug("Container was not finished, the reader will rebuild its index");
+    }
+    safeClose(_fd);
+}
+
+#pragma mark private
+uint32_t Writer::blockPagesCnt(uint64_t block) const{
+    uint64_t first = block*_blockPages;
+    return (uint32_t)std::min<uint64_t>(_blockPages, _pagesCnt - first);
+}
+
+void Writer::writeBlock(uint64_t block, const uint8_t *pages){
+    uint32_t pagesCnt = blockPagesCnt(block);
+    BlockHeader bh = {
+        .magic = BLOCK_MAGIC,
+        .block = block,
+    };
+
+    /* erased pages are only a bit in the header, the rest is stored back to back */
+    std::vector<uint8_t> stored;
+    stored.reserve((size_t)pagesCnt*_pageSize);
+    for (uint32_t i = 0; i < pagesCnt; i++) {
+        const uint8_t *page = &pages[(size_t)i*_pageSize];
+        if (isErasedPage(page, _pageSize)) {
+            bh.erased[i/64] |= 1ULL << (i%64);
+        } else {
+            stored.insert(stored.end(), page, page + _pageSize);
+        }
+    }
+
+    const uint8_t *data = stored.data();
+    size_t dataSize = stored.size();
+    bh.method = kMethodStored;
+#ifdef HAVE_LIBZSTD
+    std::vector<uint8_t> compressed;
+#endif //HAVE_LIBZSTD
+    if (!dataSize) {
+        bh.method = kMethodErased;
+    } else {
+#ifdef HAVE_LIBZSTD
+        compressed.resize(ZSTD_compressBound(dataSize));
+        size_t didCompress = ZSTD_compressCCtx(threadCCtx(), compressed.data(), compressed.size(), data, dataSize, _level);
+        if (!ZSTD_isError(didCompress) && didCompress < dataSize) {
+            bh.method = kMethodZstd;
+            data = compressed.data();
+            dataSize = didCompress;
+        }
+#endif //HAVE_LIBZSTD
+    }
+    bh.storedSize = (uint32_t)dataSize;
+
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        bh.offset = _appendOffset;
+        _appendOffset += sizeof(bh) + dataSize;
+    }
+    pwriteAll(_fd, &bh, sizeof(bh), bh.offset);
+    if (dataSize) pwriteAll(_fd, data, dataSize, bh.offset + sizeof(bh));
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _index[block] = bh;
+    }
+}
+
+#pragma mark public
+void Writer::writePages(uint64_t firstPage, const void *pages, uint64_t count){
+    const uint8_t *src = (const uint8_t*)pages;
+    retassure(!_finished, "Container was already finished");
+    retassure(firstPage + count <= _pagesCnt, "Pages 0x%llx-0x%llx are out of range",(unsigned long long)firstPage,(unsigned long long)(firstPage+count));
+
+    while (count) {
+        uint64_t block = firstPage / _blockPages;
+        uint32_t inBlock = (uint32_t)(firstPage % _blockPages);
+        uint32_t blockCnt = blockPagesCnt(block);
+        uint32_t cnt = (uint32_t)std::min<uint64_t>(count, blockCnt - inBlock);
+        std::vector<uint8_t> complete;
+        const uint8_t *completePages = NULL;
+
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            if (!_written[block]) {
+                auto st = _staged.find(block);
+                if (inBlock == 0 && cnt == blockCnt && st == _staged.end()) {
+                    /* the whole block arrived at once, no need to stage it */
+                    _written[block] = true;
+                    completePages = src;
+                } else {
+                    if (st == _staged.end()) {
+                        st = _staged.emplace(block, Staged{}).first;
+                        st->second.pages.resize((size_t)blockCnt*_pageSize);
+                        st->second.filled.resize(blockCnt);
+                        st->second.filledCnt = 0;
+                    }
+                    Staged &s = st->second;
+                    memcpy(&s.pages[(size_t)inBlock*_pageSize], src, (size_t)cnt*_pageSize);
+                    for (uint32_t i = inBlock; i < inBlock + cnt; i++) {
+                        if (!s.filled[i]) {
+                            s.filled[i] = true;
+                            s.filledCnt++;
+                        }
+                    }
+                    if (s.filledCnt == blockCnt) {
+                        complete = std::move(s.pages);
+                        completePages = complete.data();
+                        _staged.erase(st);
+                        _written[block] = true;
+                    }
+                }
+            }
+        }
+        /* compress outside of the lock, so multiple writers compress in parallel */
+        if (completePages) writeBlock(block, completePages);
+
+        src += (size_t)cnt*_pageSize;
+        firstPage += cnt;
+        count -= cnt;
+    }
+}
+
+void Writer::finish(){
+    std::unique_lock<std::mutex> ul(_lck);
+    retassure(!_finished, "Container was already finished");
+    uint64_t missingBlocks = 0;
+    for (bool w : _written) {
+        if (!w) missingBlocks++;
+    }
+    retassure(!missingBlocks, "Container is missing pages of %llu blocks",(unsigned long long)missingBlocks);
+
+    uint64_t indexOffset = _appendOffset;
+    pwriteAll(_fd, _index.data(), _index.size()*sizeof(BlockHeader), indexOffset);
+
+    Header hdr = {
+        .version = CONTAINER_VERSION,
+        .pageSize = _pageSize,
+        .blockPages = _blockPages,
+        .pagesCnt = _pagesCnt,
+        .indexOffset = indexOffset,
+        .blocksCnt = _index.size(),
+    };
+    memcpy(hdr.magic, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    /* the index has to be on disk before the header points to it */
+    retassure(!fsync(_fd), "Failed to sync container with err=%d (%s)",errno,strerror(errno));
+    pwriteAll(_fd, &hdr, sizeof(hdr), 0);
+    retassure(!fsync(_fd), "Failed to sync container with err=%d (%s)",errno,strerror(errno));
+    _finished = true;
+}
+
+#pragma mark DumpContainer::Reader
+Reader::Reader(const uint8_t *mem, size_t memSize)
+: _mem(mem), _memSize(memSize), _hdr{}
+{
+    retassure(isContainer(_mem, _memSize), "Not a dump container");
+    memcpy(&_hdr, _mem, sizeof(_hdr));
+    retassure(_hdr.version == CONTAINER_VERSION, "Unsupported container version %u",_hdr.version);
+    retassure(_hdr.pageSize, "Container page size cannot be 0");
+    retassure(_hdr.blockPages && _hdr.blockPages <= DUMP_CONTAINER_MAX_BLOCK_PAGES, "Bad container block pages %u",_hdr.blockPages);
+
+    uint64_t blocksCnt = (_hdr.pagesCnt + _hdr.blockPages - 1) / _hdr.blockPages;
+    if (!_hdr.indexOffset) {
+        _index.resize(blocksCnt);
+        rebuildIndex();
+        return;
+    }
+
+    retassure(_hdr.blocksCnt == blocksCnt, "Container index has %llu blocks, but expected %llu",(unsigned long long)_hdr.blocksCnt,(unsigned long long)blocksCnt);
+    retassure(_hdr.indexOffset <= _memSize && (_memSize - _hdr.indexOffset) / sizeof(BlockHeader) >= blocksCnt, "Container index is truncated");
+    _index.resize(blocksCnt);
+    memcpy(_index.data(), &_mem[_hdr.indexOffset], blocksCnt*sizeof(BlockHeader));
+    for (uint64_t i = 0; i < blocksCnt; i++) {
+        const BlockHeader &bh = _index[i];
+        retassure(bh.magic == BLOCK_MAGIC && bh.block == i, "Container index entry %llu is corrupted",(unsigned long long)i);
+        retassure(bh.offset + sizeof(bh) + bh.storedSize <= _hdr.indexOffset, "Container block %llu is out of bounds",(unsigned long long)i);
+    }
+}
+
+#pragma mark private
+void Reader::rebuildIndex(){
+    uint64_t foundCnt = 0;
+    uint64_t offset = sizeof(Header);
+    warning("Container was not finished, rebuilding its index");
+    while (offset + sizeof(BlockHeader) <= _memSize) {
+        BlockHeader bh;
+        memcpy(&bh, &_mem[offset], sizeof(bh));
+        if (bh.magic != BLOCK_MAGIC || bh.offset != offset) break;
+        if (offset + sizeof(bh) + bh.storedSize > _memSize) break; //block was only partially written
+        if (bh.block < _index.size() && _index[bh.block].magic != BLOCK_MAGIC) {
+            _index[bh.block] = bh;
+            foundCnt++;
+        }
+        offset += sizeof(bh) + bh.storedSize;
+    }
+    if (foundCnt != _index.size()) {
+        warning("Container is missing %llu of %llu blocks",(unsigned long long)(_index.size()-foundCnt),(unsigned long long)_index.size());
+    }
+}
+
+#pragma mark public
+void Reader::readBlock(uint64_t block, uint8_t *out) const{
+    retassure(block < _index.size(), "Block %llu is out of range",(unsigned long long)block);
+    const BlockHeader &bh = _index[block];
+    retassure(bh.magic == BLOCK_MAGIC, "Block %llu is missing from the container",(unsigned long long)block);
+
+    uint32_t pagesCnt = (uint32_t)std::min<uint64_t>(_hdr.blockPages, _hdr.pagesCnt - block*_hdr.blockPages);
+    uint32_t storedCnt = 0;
+    for (uint32_t i = 0; i < pagesCnt; i++) {
+        if (!(bh.erased[i/64] & (1ULL << (i%64)))) storedCnt++;
+    }
+    size_t storedSize = (size_t)storedCnt*_hdr.pageSize;
+    const uint8_t *data = &_mem[bh.offset + sizeof(bh)];
+
+    switch (bh.method) {
+        case kMethodErased:
+            retassure(!storedCnt, "Erased block %llu has stored pages",(unsigned long long)block);
+            break;
+        case kMethodStored:
+            retassure(bh.storedSize == storedSize, "Block %llu has a bad size",(unsigned long long)block);
+            memcpy(out, data, storedSize);
+            break;
+        case kMethodZstd:
+        {
+#ifdef HAVE_LIBZSTD
+            size_t didDecompress = ZSTD_decompressDCtx(threadDCtx(), out, storedSize, data, bh.storedSize);
+            retassure(!ZSTD_isError(didDecompress), "Failed to decompress block %llu (%s)",(unsigned long long)block,ZSTD_getErrorName(didDecompress));
+            retassure(didDecompress == storedSize, "Block %llu decompressed to 0x%zx bytes, but expected 0x%zx",(unsigned long long)block,didDecompress,storedSize);
+#else
+            reterror("Built without zstd, can't unpack block %llu",(unsigned long long)block);
+#endif //HAVE_LIBZSTD
+        }
+            break;
+        default:
+            reterror("Block %llu has unknown method %d",(unsigned long long)block,bh.method);
+    }
+
+    /* stored pages are at the front of out, spread them back to front so nothing is overwritten before it was moved */
+    uint32_t src = storedCnt;
+    for (uint32_t i = pagesCnt; i-- > 0;) {
+        uint8_t *dst = &out[(size_t)i*_hdr.pageSize];
+        if (bh.erased[i/64] & (1ULL << (i%64))) {
+            memset(dst, 0xFF, _hdr.pageSize);
+        } else {
+            src--;
+            if (src != i) memmove(dst, &out[(size_t)src*_hdr.pageSize], _hdr.pageSize);
+        }
+    }
+}
+
+void Reader::unpack(uint8_t *out, uint32_t threadsCnt) const{
+    std::atomic<uint64_t> nextBlock = 0;
+    std::atomic<bool> abortWork = false;
+    std::mutex workerExceptionLck;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    if (threadsCnt == 0) {
+        threadsCnt = PageScheduler::defaultWorkersCnt();
+    }
+    for (uint32_t i = 0; i < threadsCnt; i++) {
+        wthreads.push_back(std::thread([&]{
+            try {
+                uint64_t block = 0;
+                while (!abortWork && (block = nextBlock++) < _index.size()) {
+                    readBlock(block, &out[block*blockSize()]);
+                }
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(workerExceptionLck);
+                if (!workerException) workerException = std::current_exception();
+                abortWork = true;
+            }
+        }));
+    }
+    for (auto &t : wthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+}
@@ -0,0 +1,144 @@
+//
+//  DumpContainer.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DumpContainer_hpp
+#define DumpContainer_hpp
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DUMP_CONTAINER_MAX_BLOCK_PAGES 256
+
+/*
+    Container for raw dumps which are mostly erased.
+    Pages are grouped into blocks of blockPages pages. A block only stores its pages which are not all 0xFF,
+    compressed on their own (zstd if available), erased pages are just a bit in the block's index entry.
+    Every block is preceded by a BlockHeader, the index at the end of the file is a copy of those,
+    so the index of a container which was never finished can be rebuilt by walking the blocks.
+ */
+namespace DumpContainer {
+enum Method : uint8_t{
+    kMethodStored   = 0,
+    kMethodZstd     = 1,
+    kMethodErased   = 2,   /* all pages of the block are erased, there is no data */
+};
+
+#pragma pack(push, 1)
+struct Header{
+    char magic[8];              /* "BNDDUMP\0" */
+    uint32_t version;
+    uint32_t pageSize;
+    uint32_t blockPages;
+    uint32_t reserved;
+    uint64_t pagesCnt;
+    uint64_t indexOffset;       /* 0 while the container is being written */
+    uint64_t blocksCnt;
+    uint8_t pad[16];
+};
+struct BlockHeader{
+    uint32_t magic;             /* "BNDB" */
+    uint32_t storedSize;        /* bytes following the header */
+    uint64_t offset;            /* file offset of this header */
+    uint64_t block;
+    uint8_t method;             /* Method */
+    uint8_t pad[7];
+    uint64_t erased[DUMP_CONTAINER_MAX_BLOCK_PAGES/64];
+};
+#pragma pack(pop)
+
+/*
+    Returns true if the file at path starts with a container header, which is copied to hdr if set
+ */
+bool isContainer(const char *path, Header *hdr = NULL);
+bool isContainer(const uint8_t *mem, size_t memSize);
+
+/*
+    Writes a container, pages may arrive in any order and from any thread.
+    Complete blocks are compressed by the thread which completed them.
+ */
+class Writer {
+    struct Staged{
+        std::vector<uint8_t> pages;
+        std::vector<bool> filled;
+        uint32_t filledCnt;
+    };
+    int _fd;
+    uint32_t _pageSize;
+    uint32_t _blockPages;
+    uint64_t _pagesCnt;
+    int _level;
+    bool _finished;
+
+    std::mutex _lck;
+    std::map<uint64_t, Staged> _staged;
+    std::vector<bool> _written;
+    std::vector<BlockHeader> _index;
+    uint64_t _appendOffset;
+
+    uint32_t blockPagesCnt(uint64_t block) const;
+    void writeBlock(uint64_t block, const uint8_t *pages);
+public:
+    /*
+        pagesCnt   - pages of the raw dump
+        blockPages - pages per block, at most DUMP_CONTAINER_MAX_BLOCK_PAGES
+        level      - zstd compression level
+     */
+    Writer(const char *path, uint32_t pageSize, uint64_t pagesCnt, uint32_t blockPages = 64, int level = 3);
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+    ~Writer();
+
+    /*
+        Pages of blocks which were already written are ignored, so retried transfers may deliver pages twice
+     */
+    void writePages(uint64_t firstPage, const void *pages, uint64_t count);
+
+    /*
+        Writes the index, fails if pages are missing
+     */
+    void finish();
+};
+
+/*
+    Reads blocks of a container, which is mapped by the caller
+ */
+class Reader {
+    const uint8_t *_mem;
+    size_t _memSize;
+    Header _hdr;
+    std::vector<BlockHeader> _index;
+
+    void rebuildIndex();
+public:
+    Reader(const uint8_t *mem, size_t memSize);
+
+    inline uint32_t pageSize() const{return _hdr.pageSize;}
+    inline uint32_t blockPages() const{return _hdr.blockPages;}
+    inline uint64_t pagesCnt() const{return _hdr.pagesCnt;}
+    inline size_t blockSize() const{return (size_t)_hdr.blockPages*_hdr.pageSize;}
+    inline uint64_t rawSize() const{return _hdr.pagesCnt*_hdr.pageSize;}
+
+    /*
+        Unpacks block into out, which needs to hold blockSize() bytes.
+        Only the pages of the block are written, which are less than that for the last one.
+        Safe to call from multiple threads at once.
+     */
+    void readBlock(uint64_t block, uint8_t *out) const;
+
+    /*
+        Unpacks all blocks into out, which needs to hold rawSize() bytes.
+        threadsCnt - number of worker threads, 0 = one per cpu core
+     */
+    void unpack(uint8_t *out, uint32_t threadsCnt = 0) const;
+};
+}
+
+#endif /* DumpContainer_hpp */
@@ -0,0 +1,217 @@
+//
+//  DumpGenerator.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "DumpGenerator.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <string.h>
+
+using namespace ECCCorrection;
+
+namespace {
+inline uint64_t mix64(uint64_t z){
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* splitmix64, cheap enough to be seeded for every single page */
+class PageRng {
+    uint64_t _state;
+public:
+    using result_type = uint64_t;
+    PageRng(uint64_t seed, uint64_t page) : _state(mix64(seed ^ mix64(page + 0x9E3779B97F4A7C15ULL))) {}
+
+    static constexpr result_type min(){return 0;}
+    static constexpr result_type max(){return UINT64_MAX;}
+    inline result_type operator()(){
+        return mix64(_state += 0x9E3779B97F4A7C15ULL);
+    }
+    inline double uniform(){
+        return (double)(operator()() >> 11) * 0x1.0p-53;
+    }
+};
+
+struct GeneratorParams{
+    std::vector<CodewordPlan> plan;
+    size_t structureSize;
+    uint32_t strength;
+    uint32_t eccFlipBytes;      /* leading ecc bytes which only hold parity bits, flips in the padding bits are invisible to the decoder */
+};
+}
+
+static uint32_t drawBitflips(PageRng &rng, uint64_t bits, double rate, uint32_t cap){
+    if (rate <= 0) return 0;
+    std::binomial_distribution<uint64_t> dist(bits, std::min(rate, 1.0));
+    return (uint32_t)std::min<uint64_t>(dist(rng), cap);
+}
+
+/*
+    Flips cnt distinct bits in the first cwBits bits of codeword followed by the first eccBits bits of eccdata
+ */
+static void flipBits(PageRng &rng, uint8_t *codeword, uint64_t cwBits, uint8_t *eccdata, uint64_t eccBits, uint32_t cnt){
+    if (!cnt) return;
+    uint64_t positions[cnt];
+    const uint64_t totalBits = cwBits + eccBits;
+    for (uint32_t i = 0; i < cnt; i++) {
+        uint64_t pos = 0;
+        bool dup = false;
+        do {
+            pos = rng() % totalBits;
+            dup = std::find(positions, positions+i, pos) != positions+i;
+        } while (dup);
+        positions[i] = pos;
+        if (pos < cwBits) {
+            codeword[pos >> 3] ^= 1 << (pos & 7);
+        }else{
+            pos -= cwBits;
+            eccdata[pos >> 3] ^= 1 << (pos & 7);
+        }
+    }
+}
+
+static void generatePage(uint8_t *page, uint64_t pagenum, const DumpGenerator::Config &cfg, const GeneratorParams &params, DumpGenerator::Stats &st){
+    PageRng rng(cfg.seed, pagenum);
+
+    st.pages++;
+    if (rng.uniform() < cfg.erasedPageRate) {
+        memset(page, 0xFF, cfg.pageSize);
+        st.erasedPages++;
+        for (auto &cp : params.plan) {
+            uint32_t flips = drawBitflips(rng, ((uint64_t)cp.cwSize + cp.eccSize)*8, cfg.erasedBitflipRate, params.strength);
+            flipBits(rng, &page[cp.cwStart], cp.cwSize*8, &page[cp.eccStart], cp.eccSize*8, flips);
+            st.erasedCodewords++;
+            st.erasedBitflips += flips;
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < params.structureSize; i += sizeof(uint64_t)) {
+        uint64_t r = rng();
+        memcpy(&page[i], &r, std::min(sizeof(r), params.structureSize - i));
+    }
+    memset(&page[params.structureSize], 0xFF, cfg.pageSize - params.structureSize);
+
+    for (auto &cp : params.plan) {
+        uint8_t *cw = &page[cp.cwStart];
+        uint8_t *ecc = &page[cp.eccStart];
+        uint32_t flips = 0;
+        eccBCHEncode(cw, cp.cwSize, ecc, cp.eccSize, cfg.poly, cfg.swapBits, cfg.invert);
+
+        if (cfg.uncorrectableRate > 0 && rng.uniform() < cfg.uncorrectableRate) {
+            flips = params.strength + 1 + (uint32_t)(rng() % params.strength);
+            st.uncorrectableCodewords++;
+        }else{
+            flips = drawBitflips(rng, ((uint64_t)cp.cwSize + params.eccFlipBytes)*8, cfg.bitflipRate, params.strength);
+            if (flips) {
+                st.correctableCodewords++;
+                st.bitflips += flips;
+            }else{
+                st.goodCodewords++;
+            }
+        }
+        flipBits(rng, cw, cp.cwSize*8, ecc, params.eccFlipBytes*8, flips);
+    }
+}
+
+#pragma mark DumpGenerator
+DumpGenerator::Config DumpGenerator::defaultConfig(){
+    return {
+        .pageSize = 0,
+        .pageStructure = {},
+        .poly = 0,
+        .swapBits = false,
+        .invert = false,
+        .bitflipRate = 1e-4,
+        .erasedPageRate = 0.1,
+        .erasedBitflipRate = 1e-5,
+        .uncorrectableRate = 0,
+        .seed = 0,
+    };
+}
+
+DumpGenerator::Stats DumpGenerator::generate(FileMapping *outmap, const Config &cfg, uint32_t threadsCnt){
+    Stats ret = {};
+    GeneratorParams params = {};
+    uint64_t pagesCnt = 0;
+
+    retassure(outmap->isWriteable(), "Output mapping is not writeable");
+    retassure(cfg.pageSize, "Pagesize not set!");
+    retassure(cfg.poly, "BCH polynom cannot be 0!");
+    retassure(outmap->memSize() % cfg.pageSize == 0, "Output size 0x%zx is not a multiple of the pagesize",outmap->memSize());
+    pagesCnt = outmap->memSize() / cfg.pageSize;
+
+    params.plan = compileCodewordPlan(cfg.pageStructure, cfg.pageSize);
+    for (auto &cw : cfg.pageStructure) params.structureSize += cw.len;
+    {
+        const uint32_t polyDegree = 31 - __builtin_clz(cfg.poly);
+        const uint32_t eccSize = params.plan.front().eccSize;
+        for (auto &cp : params.plan) {
+            retassure(cp.eccSize == eccSize, "All codewords need the same ecc size");
+            retassure(((uint64_t)cp.cwSize + eccSize)*8 < (1ULL << polyDegree), "Codeword of %u bytes too large for poly 0x%x",cp.cwSize,cfg.poly);
+        }
+        params.strength = BCHDecoder::threadDecoder(cfg.poly, eccSize, cfg.swapBits)->strength();
+        retassure(params.strength, "ECC size %u too small for poly 0x%x",eccSize,cfg.poly);
+        params.eccFlipBytes = params.strength*polyDegree/8;
+    }
+
+    if (threadsCnt == 0) {
+        threadsCnt = PageScheduler::defaultWorkersCnt();
+    }
+    PageScheduler scheduler(threadsCnt);
+    scheduler.addSection(0, 0, pagesCnt);
+    scheduler.distribute();
+
+    uint8_t *mem = outmap->mem();
+    std::mutex statsLck;
+    std::atomic<bool> abortWork = false;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    for (uint32_t i=0; i<threadsCnt; i++) {
+        wthreads.push_back(std::thread([&](uint32_t tid){
+            Stats localStats = {};
+            try {
+                PageScheduler::Range r = {};
+                while (!abortWork && scheduler.next(tid, r)) {
+                    for (uint64_t page = r.begin; page < r.end; page++) {
+                        generatePage(&mem[page*cfg.pageSize], page, cfg, params, localStats);
+                    }
+                }
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(statsLck);
+                if (!workerException) workerException = std::current_exception();
+                abortWork = true;
+            }
+            std::unique_lock<std::mutex> ul(statsLck);
+            ret.pages += localStats.pages;
+            ret.erasedPages += localStats.erasedPages;
+            ret.goodCodewords += localStats.goodCodewords;
+            ret.correctableCodewords += localStats.correctableCodewords;
+            ret.uncorrectableCodewords += localStats.uncorrectableCodewords;
+            ret.erasedCodewords += localStats.erasedCodewords;
+            ret.bitflips += localStats.bitflips;
+            ret.erasedBitflips += localStats.erasedBitflips;
+        },i));
+    }
+
+    for (auto &t : wthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+//
+//  DumpGenerator.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DumpGenerator_hpp
+#define DumpGenerator_hpp
+
+#include "ECCCorrection.hpp"
+#include "FileMapping.hpp"
+
+#include <stdint.h>
+
+/*
+    Produces synthetic NAND dumps with valid BCH ecc for any page structure.
+    Programmed pages get random data, erased pages are left 0xFF.
+    Every page is generated from its own seed, so the output does not depend on the number of threads.
+ */
+namespace DumpGenerator {
+struct Config{
+    size_t pageSize;
+    ECCCorrection::PageStructure pageStructure;
+    uint32_t poly;
+    bool swapBits;
+    bool invert;
+    double bitflipRate;         /* probability of every bit of a programmed codeword to flip, capped at the ecc strength */
+    double erasedPageRate;      /* share of pages which are left erased */
+    double erasedBitflipRate;   /* same as bitflipRate for codewords of erased pages */
+    double uncorrectableRate;   /* share of programmed codewords which get more bitflips than the ecc can correct */
+    uint64_t seed;
+};
+
+/*
+    What a correct decoder is expected to find in the generated dump
+ */
+struct Stats{
+    uint64_t pages;
+    uint64_t erasedPages;
+    uint64_t goodCodewords;
+    uint64_t correctableCodewords;
+    uint64_t uncorrectableCodewords;
+    uint64_t erasedCodewords;
+    uint64_t bitflips;          /* in correctable codewords */
+    uint64_t erasedBitflips;
+};
+
+Config defaultConfig();
+
+/*
+    Fills all pages of outmap.
+    threadsCnt - number of worker threads, 0 = one per cpu core
+ */
+Stats generate(FileMapping *outmap, const Config &cfg, uint32_t threadsCnt = 0);
+}
+
+#endif /* DumpGenerator_hpp */
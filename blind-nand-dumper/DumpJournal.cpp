@@ -0,0 +1,145 @@
+//
+//  DumpJournal.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "DumpJournal.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "bnd-journal 1"
+
+#pragma mark DumpJournal
+DumpJournal::DumpJournal(const char *path, const std::vector<uint8_t> &CEs, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, bool discard)
+: _path(path), _numPages(0), _fd(-1)
+{
+    retassure(CEs.size(), "No CE specified");
+    retassure((uint64_t)numPages*CEs.size() <= UINT32_MAX, "Too many pages for a journal");
+    _numPages = numPages*(uint32_t)CEs.size();
+
+    char header[0x100] = {};
+    std::string ces;
+    for (uint8_t CE : CEs) {
+        if (ces.size()) ces += ",";
+        ces += std::to_string(CE);
+    }
+    snprintf(header, sizeof(header), JOURNAL_MAGIC " ce=%s address=%u pagesize=%u pages=%u\n",ces.c_str(),pageAddress,pageSize,numPages);
+    _header = header;
+
+    bool didInit = false;
+    cleanup([&]{
+        if (!didInit) safeClose(_fd);
+    });
+
+    if (discard) unlink(_path.c_str());
+    retassure((_fd = open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)) != -1, "Failed to open journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+    load();
+
+    didInit = true;
+}
+
+DumpJournal::~DumpJournal(){
+    safeClose(_fd);
+}
+
+#pragma mark private
+void DumpJournal::load(){
+    std::string content;
+    {
+        char buf[0x1000];
+        ssize_t didRead = 0;
+        while ((didRead = pread(_fd, buf, sizeof(buf), content.size())) > 0) {
+            content.append(buf, didRead);
+        }
+        retassure(didRead == 0, "Failed to read journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+    }
+
+    size_t headerEnd = content.find('\n');
+    if (headerEnd == std::string::npos) {
+        /*
+            A new journal, or our own header was cut off before it made it to disk.
+            Anything else without a complete first line is not ours to overwrite.
+         */
+        retassure(_header.compare(0, content.size(), content) == 0, "Journal '%s' belongs to a different dump, delete it to start over",_path.c_str());
+        retassure(!ftruncate(_fd, 0), "Failed to truncate journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+        retassure(write(_fd, _header.data(), _header.size()) == (ssize_t)_header.size(), "Failed to write journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+        retassure(!fsync(_fd), "Failed to sync journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+        return;
+    }
+    retassure(content.compare(0, headerEnd + 1, _header) == 0, "Journal '%s' belongs to a different dump, delete it to start over",_path.c_str());
+
+    size_t pos = _header.size();
+    size_t validEnd = pos;
+    while (pos < content.size()) {
+        size_t eol = content.find('\n', pos);
+        if (eol == std::string::npos) break; /* line was cut off by a crash */
+        unsigned first = 0;
+        unsigned count = 0;
+        std::string line = content.substr(pos, eol - pos);
+        retassure(sscanf(line.c_str(), "%u %u", &first, &count) == 2, "Malformed journal line '%s'",line.c_str());
+        retassure((uint64_t)first + count <= _numPages, "Journal range %u+%u out of bounds",first,count);
+        addRange(first, count);
+        pos = validEnd = eol + 1;
+    }
+    if (validEnd != content.size()) {
+        retassure(!ftruncate(_fd, validEnd), "Failed to truncate journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+    }
+}
+
+void DumpJournal::addRange(uint32_t first, uint32_t count){
+    if (!count) return;
+    auto it = std::lower_bound(_done.begin(), _done.end(), first, [](const Range &r, uint32_t v){return (uint64_t)r.first + r.count < v;});
+    uint64_t start = first;
+    uint64_t end = (uint64_t)first + count;
+    while (it != _done.end() && it->first <= end) {
+        start = std::min<uint64_t>(start, it->first);
+        end = std::max<uint64_t>(end, (uint64_t)it->first + it->count);
+        it = _done.erase(it);
+    }
+    _done.insert(it, {(uint32_t)start, (uint32_t)(end - start)});
+}
+
+#pragma mark public
+std::vector<DumpJournal::Range> DumpJournal::missingRanges() const{
+    std::vector<Range> ret;
+    uint32_t cur = 0;
+    for (auto &r : _done) {
+        if (r.first > cur) ret.push_back({cur, r.first - cur});
+        cur = r.first + r.count;
+    }
+    if (cur < _numPages) ret.push_back({cur, _numPages - cur});
+    return ret;
+}
+
+uint64_t DumpJournal::donePages() const{
+    uint64_t ret = 0;
+    for (auto &r : _done) {
+        ret += r.count;
+    }
+    return ret;
+}
+
+void DumpJournal::markDone(uint32_t first, uint32_t count){
+    if (!count) return;
+    retassure((uint64_t)first + count <= _numPages, "Range %u+%u out of bounds",first,count);
+    char line[0x40] = {};
+    int len = snprintf(line, sizeof(line), "%u %u\n",first,count);
+    retassure(write(_fd, line, len) == len, "Failed to write journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+    retassure(!fsync(_fd), "Failed to sync journal '%s' with err=%d (%s)",_path.c_str(),errno,strerror(errno));
+    addRange(first, count);
+}
+
+void DumpJournal::remove(){
+    safeClose(_fd);
+    unlink(_path.c_str());
+}
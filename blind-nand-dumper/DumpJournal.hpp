@@ -0,0 +1,63 @@
+//
+//  DumpJournal.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DumpJournal_hpp
+#define DumpJournal_hpp
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Records which pages of a dump already made it into the output file.
+    The journal is a text file with a header describing the dump, followed by one "<first> <count>" line
+    per completed range of pages (relative to the dump start). Lines are only appended and synced,
+    so a journal which was interrupted at any point stays valid.
+ */
+class DumpJournal {
+public:
+    struct Range{
+        uint32_t first;
+        uint32_t count;
+    };
+private:
+    std::string _path;
+    std::string _header;
+    uint32_t _numPages; /* over all CEs */
+    int _fd;
+    std::vector<Range> _done; /* sorted and merged */
+
+    void load();
+    void addRange(uint32_t first, uint32_t count);
+public:
+    /*
+        Opens the journal at path, or creates it if it does not exist.
+        The dump covers numPages pages of every CE, stored one CE after the other.
+        An existing journal for a different dump is an error, discard = true starts over instead.
+     */
+    DumpJournal(const char *path, const std::vector<uint8_t> &CEs, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, bool discard = false);
+    ~DumpJournal();
+
+    /*
+        Ranges which are not recorded as done yet
+     */
+    std::vector<Range> missingRanges() const;
+    uint64_t donePages() const;
+
+    /*
+        Records the pages as done. The caller must make sure the data is durable in the output file first.
+     */
+    void markDone(uint32_t first, uint32_t count);
+
+    /*
+        Deletes the journal once the dump is complete
+     */
+    void remove();
+};
+
+#endif /* DumpJournal_hpp */
@@ -0,0 +1,276 @@
+//
+//  DumpPipeline.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "DumpPipeline.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#pragma mark DumpPipeline
+DumpPipeline::DumpPipeline(size_t pageSize, ECCCorrection::NandStructure nstructure, ECCCorrection::cbPage cb, void *userarg, uint32_t threadsCnt, bool pinThreads, uint32_t batchPages, uint32_t batchesCnt)
+: _pageSize(pageSize), _cb(cb), _userarg(userarg)
+, _threadsCnt(threadsCnt), _pinThreads(pinThreads), _batchPages(batchPages)
+, _rawFd(-1), _outFd(-1), _progress(NULL)
+, _producerDone(false), _abort(false), _processedPages(0)
+{
+    retassure(_pageSize, "Pagesize not set!");
+    retassure(_batchPages, "Batch needs at least one page");
+    if (!_threadsCnt) _threadsCnt = PageScheduler::defaultWorkersCnt();
+    if (!batchesCnt) batchesCnt = _threadsCnt*2;
+
+    for (auto &ns : nstructure) {
+        _sections.push_back({
+            .plan = ECCCorrection::compileCodewordPlan(ns.pageStructure, _pageSize),
+            .startPage = ns.startPage,
+            .endPage = ns.pagesCnt ? (uint64_t)ns.startPage + ns.pagesCnt : UINT64_MAX,
+        });
+    }
+
+    _batches.resize(batchesCnt);
+    for (auto &b : _batches) {
+        b.raw.resize(_batchPages*_pageSize);
+        b.corrected.resize(_batchPages*_pageSize);
+    }
+}
+
+#pragma mark private
+void DumpPipeline::writeBatch(int fd, const std::vector<uint8_t> &buf, const Batch *b){
+    size_t size = b->pagesCnt*_pageSize;
+    off_t offset = (off_t)(b->firstPage*_pageSize);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t didWrite = pwrite(fd, &buf[done], size - done, offset + done);
+        if (didWrite < 0 && errno == EINTR) continue;
+        retassure(didWrite > 0, "Failed to write page 0x%llx with err=%d (%s)",(unsigned long long)b->firstPage,errno,strerror(errno));
+        done += didWrite;
+    }
+}
+
+void DumpPipeline::processBatch(Batch *b){
+    if (_rawFd != -1) writeBatch(_rawFd, b->raw, b);
+    if (_outFd != -1) memcpy(b->corrected.data(), b->raw.data(), b->pagesCnt*_pageSize);
+
+    uint32_t processed = 0;
+    for (uint32_t i = 0; i < b->pagesCnt; i++) {
+        uint64_t pagenum = b->firstPage + i;
+        const Section *sec = NULL;
+        for (auto &s : _sections) {
+            if (pagenum >= s.startPage && pagenum < s.endPage) {
+                sec = &s;
+                break;
+            }
+        }
+        if (!sec) continue;
+        processed++;
+
+        const uint8_t *curPage = &b->raw[i*_pageSize];
+        uint8_t *curOutPage = (_outFd != -1) ? &b->corrected[i*_pageSize] : NULL;
+        _cb((uint32_t)pagenum, sec->plan.data(), (uint32_t)sec->plan.size(), curPage, curOutPage, _userarg);
+    }
+
+    if (_outFd != -1) writeBatch(_outFd, b->corrected, b);
+    _processedPages += processed;
+}
+
+void DumpPipeline::workerLoop(uint32_t tid){
+    if (_pinThreads) PageScheduler::pinCurrentThread(tid);
+    ProgressReporter::Worker *pw = (_progress) ? &_progress->worker(tid) : NULL;
+    while (true) {
+        Batch *b = NULL;
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            _fullCond.wait(ul, [&]{return _full.size() || _producerDone || _abort;});
+            if (_abort || !_full.size()) break;
+            b = _full.front();
+            _full.pop_front();
+        }
+        auto start = std::chrono::steady_clock::now();
+        processBatch(b);
+        if (pw) {
+            pw->add(b->pagesCnt, b->pagesCnt*_pageSize);
+            pw->addBusy(std::chrono::steady_clock::now() - start);
+        }
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            _free.push_back(b);
+        }
+        _freeCond.notify_one();
+    }
+}
+
+uint64_t DumpPipeline::runProducer(uint64_t totalPages, uint64_t maxPages, std::function<void(NandReader::f_dumpCB cb)> produce, f_progressCB progressCB){
+    std::mutex workerExceptionLck;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    _free.clear();
+    _full.clear();
+    for (auto &b : _batches) {
+        _free.push_back(&b);
+    }
+    _producerDone = false;
+    _abort = false;
+    _processedPages = 0;
+
+    debug("Starting %d ecc threads with %zu batches of %d pages",_threadsCnt,_batches.size(),_batchPages);
+    if (_progress) _progress->start(totalPages);
+    for (uint32_t i=0; i<_threadsCnt; i++) {
+        wthreads.push_back(std::thread([&](uint32_t tid){
+            try {
+                workerLoop(tid);
+            } catch (...) {
+                {
+                    std::unique_lock<std::mutex> ul(workerExceptionLck);
+                    if (!workerException) workerException = std::current_exception();
+                }
+                {
+                    std::unique_lock<std::mutex> ul(_lck);
+                    _abort = true;
+                }
+                _freeCond.notify_all();
+                _fullCond.notify_all();
+            }
+        },i));
+    }
+
+    auto finishWorkers = [&]{
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            _producerDone = true;
+        }
+        _fullCond.notify_all();
+        for (auto &t : wthreads) {
+            t.join();
+        }
+        wthreads.clear();
+        if (_progress) _progress->stop();
+    };
+
+    uint64_t readPages = 0;
+    uint64_t receivedBytes = 0;
+    const uint64_t maxBytes = (maxPages < UINT64_MAX / _pageSize) ? maxPages*_pageSize : UINT64_MAX;
+    Batch *cur = NULL;
+    size_t curFill = 0;
+
+    /* the input counts as busy unless it waits for the ECC workers to free a batch */
+    ProgressReporter::Worker *input = (_progress) ? &_progress->input() : NULL;
+    auto activeSince = std::chrono::steady_clock::now();
+
+    auto getFreeBatch = [&]()->Batch*{
+        std::unique_lock<std::mutex> ul(_lck);
+        if (input && !_free.size()) {
+            input->addBusy(std::chrono::steady_clock::now() - activeSince);
+            _freeCond.wait(ul, [&]{return _free.size() || _abort;});
+            activeSince = std::chrono::steady_clock::now();
+        }
+        _freeCond.wait(ul, [&]{return _free.size() || _abort;});
+        if (_abort) return NULL;
+        Batch *b = _free.front();
+        _free.pop_front();
+        return b;
+    };
+
+    auto pushBatch = [&]{
+        cur->firstPage = readPages;
+        cur->pagesCnt = (uint32_t)(curFill / _pageSize);
+        readPages += cur->pagesCnt;
+        if (input) input->add(cur->pagesCnt, 0);
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            _full.push_back(cur);
+        }
+        _fullCond.notify_one();
+        cur = NULL;
+        curFill = 0;
+        if (progressCB) progressCB(readPages, _processedPages);
+    };
+
+    try {
+        produce([&](const void *chunk_, size_t chunkSize, void *arg)->bool{
+            const uint8_t *chunk = (const uint8_t *)chunk_;
+            if (input) {
+                auto now = std::chrono::steady_clock::now();
+                input->add(0, chunkSize);
+                input->addBusy(now - activeSince);
+                activeSince = now;
+            }
+            chunkSize = (size_t)std::min<uint64_t>(chunkSize, maxBytes - receivedBytes);
+            receivedBytes += chunkSize;
+            while (chunkSize) {
+                if (!cur && !(cur = getFreeBatch())) return false;
+                size_t batchSize = _batchPages*_pageSize;
+                size_t copySize = std::min(chunkSize, batchSize - curFill);
+                memcpy(&cur->raw[curFill], chunk, copySize);
+                curFill += copySize;
+                chunk += copySize;
+                chunkSize -= copySize;
+                if (curFill == batchSize) pushBatch();
+            }
+            return receivedBytes < maxBytes;
+        });
+        if (input) input->addBusy(std::chrono::steady_clock::now() - activeSince);
+        if (cur && curFill >= _pageSize) {
+            if (curFill % _pageSize) warning("Dropping %zu bytes of incomplete last page",curFill % _pageSize);
+            pushBatch();
+        }
+    } catch (...) {
+        {
+            std::unique_lock<std::mutex> ul(_lck);
+            _abort = true;
+        }
+        finishWorkers();
+        throw;
+    }
+
+    finishWorkers();
+    if (workerException) std::rethrow_exception(workerException);
+    if (progressCB) progressCB(readPages, _processedPages);
+    return _processedPages;
+}
+
+#pragma mark public
+void DumpPipeline::setRawOutput(int fd){
+    _rawFd = fd;
+}
+
+void DumpPipeline::setOutput(int fd){
+    _outFd = fd;
+}
+
+void DumpPipeline::setProgress(ProgressReporter *progress){
+    retassure(!progress || progress->workersCnt() >= _threadsCnt, "Progress reporter has %u worker slots for %u threads",progress->workersCnt(),_threadsCnt);
+    _progress = progress;
+}
+
+uint64_t DumpPipeline::run(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t numPages, f_progressCB progressCB){
+    return runProducer(numPages, UINT64_MAX, [&](NandReader::f_dumpCB cb){
+        pnr.dumpPages(CE, pageAddress, (uint16_t)_pageSize, numPages, cb, NULL);
+    }, progressCB);
+}
+
+uint64_t DumpPipeline::run(StreamReader &input, f_progressCB progressCB){
+    /* pages past the last page structure are only copied, without outputs they don't need to be read at all */
+    uint64_t maxPages = UINT64_MAX;
+    if (_rawFd == -1 && _outFd == -1 && _sections.size()) {
+        maxPages = 0;
+        for (auto &s : _sections) {
+            maxPages = std::max(maxPages, s.endPage);
+        }
+    }
+    return runProducer(std::min(input.size() / _pageSize, maxPages), maxPages, [&](NandReader::f_dumpCB cb){
+        input.read(cb, NULL);
+    }, progressCB);
+}
@@ -0,0 +1,110 @@
+//
+//  DumpPipeline.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DumpPipeline_hpp
+#define DumpPipeline_hpp
+
+#include "ECCCorrection.hpp"
+#include "NandReader.hpp"
+#include "ProgressReporter.hpp"
+#include "StreamReader.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Runs ECC correction on pages while they are being dumped or streamed from a file.
+    Input chunks are reassembled into batches of pages, which are handed to a pool of ECC workers.
+    Workers write raw and corrected pages to their final file offset, so batches may complete in any order.
+    The number of batches is fixed, when all are in flight the input side waits for a worker to finish one.
+ */
+class DumpPipeline {
+public:
+    /*
+        readPages      - pages received from the reader so far
+        processedPages - pages which went through ECC correction so far
+     */
+    using f_progressCB = std::function<void(uint64_t readPages, uint64_t processedPages)>;
+private:
+    struct Batch{
+        uint64_t firstPage;
+        uint32_t pagesCnt;
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> corrected;
+    };
+    struct Section{
+        std::vector<ECCCorrection::CodewordPlan> plan;
+        uint64_t startPage;
+        uint64_t endPage;
+    };
+    size_t _pageSize;
+    std::vector<Section> _sections;
+    ECCCorrection::cbPage _cb;
+    void *_userarg;
+    uint32_t _threadsCnt;
+    bool _pinThreads;
+    uint32_t _batchPages;
+    int _rawFd;
+    int _outFd;
+    ProgressReporter *_progress;
+
+    std::vector<Batch> _batches;
+    std::mutex _lck;
+    std::condition_variable _freeCond;
+    std::condition_variable _fullCond;
+    std::deque<Batch*> _free;
+    std::deque<Batch*> _full;
+    bool _producerDone;
+    std::atomic<bool> _abort;
+    std::atomic<uint64_t> _processedPages;
+
+    void workerLoop(uint32_t tid);
+    void processBatch(Batch *b);
+    void writeBatch(int fd, const std::vector<uint8_t> &buf, const Batch *b);
+    uint64_t runProducer(uint64_t totalPages, uint64_t maxPages, std::function<void(NandReader::f_dumpCB cb)> produce, f_progressCB progressCB);
+public:
+    /*
+        threadsCnt  - number of ECC worker threads, 0 = one per cpu core
+        batchPages  - pages handed to a worker at once
+        batchesCnt  - number of batch buffers, 0 = two per worker
+     */
+    DumpPipeline(size_t pageSize, ECCCorrection::NandStructure nstructure, ECCCorrection::cbPage cb, void *userarg = NULL, uint32_t threadsCnt = 0, bool pinThreads = false, uint32_t batchPages = 64, uint32_t batchesCnt = 0);
+
+    /*
+        File descriptors for the raw and corrected output, -1 disables the output.
+        The pipeline does not take ownership.
+     */
+    void setRawOutput(int fd);
+    void setOutput(int fd);
+
+    /*
+        Reports the reader as input and the ECC workers as workers, needs at least threadsCnt worker slots.
+        run() starts and stops it.
+     */
+    void setProgress(ProgressReporter *progress);
+
+    /*
+        Dumps numPages pages from pageAddress and processes them.
+        Returns the number of processed pages, pages outside of the page structures only go to the outputs.
+     */
+    uint64_t run(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t numPages, f_progressCB progressCB = nullptr);
+
+    /*
+        Processes all pages of a dump file or pipe.
+        Without any output the input is only read up to the end of the last page structure.
+        Returns the number of processed pages.
+     */
+    uint64_t run(StreamReader &input, f_progressCB progressCB = nullptr);
+};
+
+#endif /* DumpPipeline_hpp */
@@ -9,15 +9,28 @@
 
 #include "external/linux_bch.h"
 
+#include "BadBlockTable.hpp"
+#include "CodewordStats.hpp"
+#include "DumpContainer.hpp"
+#include "ECCEngine.hpp"
+#include "PageScheduler.hpp"
+#include "ProgressReporter.hpp"
+
 #include <libgeneral/macros.h>
-#include <libgeneral/DeliveryEvent.hpp>
 
 #include <thread>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <exception>
 
-#include <sys/mman.h>
+#include <string.h>
 
-//#define WITH_MADVICE
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 inline void invertblock(void *blk_, size_t blocksize){
     uint8_t *blk = (uint8_t *)blk_;
@@ -52,54 +65,517 @@ inline void invertblock(void *blk_, size_t blocksize){
     }
 }
 
-int ECCCorrection::eccBCH(void *codeword, size_t codewordSize, void *eccdata, size_t eccdataSize, uint32_t poly, bool swap_bits, bool invert){
-    struct bch_control *bch = NULL;
-    cleanup([&]{
-        safeFreeCustom(bch, bch_free);
-    });
+/*
+    Count zero bits in buf, stops early once more than limit were found
+ */
+#define ZEROBITS_BODY(popcnt)                                               \
+    const uint8_t *p = (const uint8_t *)buf;                                \
+    int zeros = 0;                                                          \
+    while (size >= 32) {                                                    \
+        uint64_t w[4];                                                      \
+        memcpy(w, p, sizeof(w));                                            \
+        zeros += popcnt(~w[0]) + popcnt(~w[1]) + popcnt(~w[2]) + popcnt(~w[3]); \
+        if (zeros > limit) return zeros;                                    \
+        p += 32;                                                            \
+        size -= 32;                                                         \
+    }                                                                       \
+    while (size--) {                                                        \
+        zeros += popcnt((uint64_t)(uint8_t)~*p++);                          \
+    }                                                                       \
+    return zeros;
+
+static int countZeroBitsGeneric(const void *buf, size_t size, int limit){
+    ZEROBITS_BODY(__builtin_popcountll)
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static int countZeroBitsPopcnt(const void *buf, size_t size, int limit){
+    ZEROBITS_BODY(__builtin_popcountll)
+}
+
+/*
+    Nibble lookup popcount over 32 bytes at a time, the per byte counts are summed up with psadbw
+ */
+__attribute__((target("avx2,popcnt")))
+static int countZeroBitsAVX2(const void *buf, size_t size, int limit){
+    const uint8_t *p = (const uint8_t *)buf;
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    int zeros = 0;
+    while (size >= 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), ones);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, lowMask)),
+                                      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask)));
+        uint64_t sums[4];
+        _mm256_storeu_si256((__m256i *)sums, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+        zeros += (int)(sums[0] + sums[1] + sums[2] + sums[3]);
+        if (zeros > limit) return zeros;
+        p += 32;
+        size -= 32;
+    }
+    while (size--) {
+        zeros += __builtin_popcount((uint8_t)~*p++);
+    }
+    return zeros;
+}
+#elif defined(__aarch64__)
+static int countZeroBitsNEON(const void *buf, size_t size, int limit){
+    const uint8_t *p = (const uint8_t *)buf;
+    int zeros = 0;
+    while (size >= 32) {
+        uint8x16_t cnt = vaddq_u8(vcntq_u8(vmvnq_u8(vld1q_u8(p))), vcntq_u8(vmvnq_u8(vld1q_u8(p+16))));
+        zeros += vaddlvq_u8(cnt);
+        if (zeros > limit) return zeros;
+        p += 32;
+        size -= 32;
+    }
+    while (size--) {
+        zeros += __builtin_popcount((uint8_t)~*p++);
+    }
+    return zeros;
+}
+#endif
+#undef ZEROBITS_BODY
+
+static int countZeroBits(const void *buf, size_t size, int limit){
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    static const bool hasPopcnt = __builtin_cpu_supports("popcnt");
+    if (hasAVX2) return countZeroBitsAVX2(buf, size, limit);
+    if (hasPopcnt) return countZeroBitsPopcnt(buf, size, limit);
+#elif defined(__aarch64__)
+    return countZeroBitsNEON(buf, size, limit);
+#endif
+    return countZeroBitsGeneric(buf, size, limit);
+}
+
+#pragma mark BCHDecoder
+ECCCorrection::BCHDecoder::BCHDecoder(uint32_t poly, size_t eccdataSize, bool swap_bits)
+: _tables{nullptr}, _bch{NULL}
+, _poly(poly), _eccdataSize(eccdataSize), _swapBits(swap_bits)
+{
+    struct bch_control *tables = NULL;
+    retassure(tables = bch_init(0, 0, poly, swap_bits, (int)eccdataSize), "Failed to init BCH with poly=0x%x eccsize=%zu",poly,eccdataSize);
+    _tables = std::shared_ptr<struct bch_control>(tables, bch_free);
+    retassure(_bch = bch_clone(_tables.get()), "Failed to clone BCH decoder");
+}
+
+ECCCorrection::BCHDecoder::BCHDecoder(const BCHDecoder &cpy)
+: _tables{cpy._tables}, _bch{NULL}
+, _poly(cpy._poly), _eccdataSize(cpy._eccdataSize), _swapBits(cpy._swapBits)
+{
+    retassure(_bch = bch_clone(_tables.get()), "Failed to clone BCH decoder");
+}
+
+ECCCorrection::BCHDecoder::~BCHDecoder(){
+    safeFreeCustom(_bch, bch_free);
+}
+
+int ECCCorrection::BCHDecoder::decode(void *codeword, size_t codewordSize, void *eccdata, bool invert){
     int ret = 0;
-    
-    assure(bch = bch_init(0, 0, poly, swap_bits, (int)eccdataSize));
-    
+
     if (invert) {
         invertblock(codeword, codewordSize);
-        invertblock(eccdata, eccdataSize);
+        invertblock(eccdata, _eccdataSize);
     }
-        
-    ret = bch_decode(bch, (uint8_t *)codeword, (unsigned int)codewordSize, (uint8_t *)eccdata, NULL, NULL);
-        
+
+    ret = bch_decode(_bch, (uint8_t *)codeword, (unsigned int)codewordSize, (uint8_t *)eccdata, NULL, NULL);
+
     if (invert) {
         invertblock(codeword, codewordSize);
-        invertblock(eccdata, eccdataSize);
+        invertblock(eccdata, _eccdataSize);
     }
-    
+
     return ret;
 }
 
+void ECCCorrection::BCHDecoder::encode(void *codeword, size_t codewordSize, void *eccdata, bool invert){
+    if (invert) invertblock(codeword, codewordSize);
+
+    memset(eccdata, 0, _eccdataSize);
+    bch_encode(_bch, (const uint8_t *)codeword, (unsigned int)codewordSize, (uint8_t *)eccdata);
+
+    if (invert) {
+        invertblock(codeword, codewordSize);
+        invertblock(eccdata, _eccdataSize);
+    }
+}
+
+uint32_t ECCCorrection::BCHDecoder::strength() const{
+    return _bch->t;
+}
+
+ECCCorrection::BCHDecoder *ECCCorrection::BCHDecoder::threadDecoder(uint32_t poly, size_t eccdataSize, bool swap_bits){
+    static std::mutex gPrototypesLck;
+    static std::vector<std::shared_ptr<BCHDecoder>> gPrototypes;
+    thread_local std::vector<std::unique_ptr<BCHDecoder>> tDecoders;
+
+    for (auto it = tDecoders.begin(); it != tDecoders.end(); it++) {
+        auto &d = *it;
+        if (d->_poly == poly && d->_eccdataSize == eccdataSize && d->_swapBits == swap_bits) {
+            /* keep the list in lru order, the front is evicted first */
+            if (it+1 != tDecoders.end()) std::rotate(it, it+1, tDecoders.end());
+            return tDecoders.back().get();
+        }
+    }
+
+    std::shared_ptr<BCHDecoder> proto = nullptr;
+    {
+        std::unique_lock<std::mutex> ul(gPrototypesLck);
+        for (auto &p : gPrototypes) {
+            if (p->_poly == poly && p->_eccdataSize == eccdataSize && p->_swapBits == swap_bits) {
+                proto = p;
+                break;
+            }
+        }
+        if (!proto) {
+            proto = std::make_shared<BCHDecoder>(poly, eccdataSize, swap_bits);
+            /* copies share the tables, so dropping a prototype never invalidates a decoder */
+            if (gPrototypes.size() >= BCH_DECODER_CACHE_CNT) gPrototypes.erase(gPrototypes.begin());
+            gPrototypes.push_back(proto);
+        }
+    }
+    if (tDecoders.size() >= BCH_DECODER_CACHE_CNT) tDecoders.erase(tDecoders.begin());
+    tDecoders.push_back(std::make_unique<BCHDecoder>(*proto));
+    return tDecoders.back().get();
+}
+
+#pragma mark ECCCorrection
+int ECCCorrection::checkErased(const void *codeword, size_t codewordSize, const void *eccdata, size_t eccdataSize, int bitflipsThreshold){
+    int bitflips = 0;
+    if (bitflipsThreshold < 0) return -1;
+
+    bitflips = countZeroBits(eccdata, eccdataSize, bitflipsThreshold);
+    if (bitflips > bitflipsThreshold) return -1;
+
+    bitflips += countZeroBits(codeword, codewordSize, bitflipsThreshold - bitflips);
+    if (bitflips > bitflipsThreshold) return -1;
+
+    return bitflips;
+}
+
+ECCCorrection::cbPage ECCCorrection::makeECCCallback(const ECCEngine &engine, CodewordStats &cwStats, int erasedBitflips){
+    return [&engine, &cwStats, erasedBitflips]
+           (uint32_t pagenum, const CodewordPlan *plan, uint32_t cwCnt, const uint8_t *page, uint8_t *outPage, void *userarg){
+        /* decoders correct in place, codewords are copied to the same offsets of a scratch page */
+        thread_local std::vector<uint8_t> scratch;
+        thread_local std::vector<ECCEngine::Codeword> cws;
+        thread_local std::vector<uint32_t> cwnums;
+        CodewordStats::Shard &stats = cwStats.shard();
+
+        cws.clear();
+        cwnums.clear();
+        for (uint32_t cwnum = 0; cwnum < cwCnt; cwnum++) {
+            const CodewordPlan &cp = plan[cwnum];
+            /* a codeword which is all 0xFF stays untouched whatever the decoder says, don't bother decoding it */
+            if ((erasedBitflips == INT_MIN || erasedBitflips >= 0) && checkErased(&page[cp.cwStart], cp.cwSize, &page[cp.eccStart], cp.eccSize, 0) == 0) {
+                stats.record(pagenum, cwnum, CodewordStats::kResultErased, 0);
+                continue;
+            }
+            size_t extent = std::max(cp.cwStart + cp.cwSize, cp.eccStart + cp.eccSize);
+            if (scratch.size() < extent) scratch.resize(extent);
+            memcpy(&scratch[cp.cwStart], &page[cp.cwStart], cp.cwSize);
+            memcpy(&scratch[cp.eccStart], &page[cp.eccStart], cp.eccSize);
+            cwnums.push_back(cwnum);
+        }
+        /* scratch may have grown while collecting, take the pointers afterwards */
+        for (uint32_t cwnum : cwnums) {
+            const CodewordPlan &cp = plan[cwnum];
+            cws.push_back({
+                .data = &scratch[cp.cwStart],
+                .dataSize = cp.cwSize,
+                .ecc = &scratch[cp.eccStart],
+                .eccSize = cp.eccSize,
+                .bitflips = 0,
+            });
+        }
+        if (!cws.size()) return;
+
+        engine.decode(cws.data(), cws.size());
+
+        for (size_t i = 0; i < cws.size(); i++) {
+            const uint32_t cwnum = cwnums[i];
+            const CodewordPlan &cp = plan[cwnum];
+            const ECCEngine::Codeword &cw = cws[i];
+            if (cw.bitflips < 0) {
+                /* only codewords which don't decode may be erased pages with bitflips */
+                int threshold = (erasedBitflips != INT_MIN) ? erasedBitflips : (int)engine.strength(cp.eccSize);
+                int flips = checkErased(&page[cp.cwStart], cp.cwSize, &page[cp.eccStart], cp.eccSize, threshold);
+                if (flips >= 0) {
+                    stats.record(pagenum, cwnum, CodewordStats::kResultErased, flips);
+                    if (outPage) {
+                        memset(&outPage[cp.cwStart], 0xFF, cp.cwSize);
+                        memset(&outPage[cp.eccStart], 0xFF, cp.eccSize);
+                    }
+                }else{
+                    stats.record(pagenum, cwnum, CodewordStats::kResultUncorrectable, 0);
+                }
+            }else if (cw.bitflips > 0) {
+                stats.record(pagenum, cwnum, CodewordStats::kResultCorrected, cw.bitflips);
+                debug("Corrected %d bits in Page 0x%x CW %d",cw.bitflips,pagenum,cwnum);
+                /* output starts as a copy of the input, only touch what changed */
+                if (outPage) {
+                    memcpy(&outPage[cp.cwStart], cw.data, cp.cwSize);
+                    memcpy(&outPage[cp.eccStart], cw.ecc, cp.eccSize);
+                }
+            }else{
+                stats.record(pagenum, cwnum, CodewordStats::kResultGood, 0);
+            }
+        }
+    };
+}
+
+int ECCCorrection::eccBCH(void *codeword, size_t codewordSize, void *eccdata, size_t eccdataSize, uint32_t poly, bool swap_bits, bool invert){
+    return BCHDecoder::threadDecoder(poly, eccdataSize, swap_bits)->decode(codeword, codewordSize, eccdata, invert);
+}
+
+void ECCCorrection::eccBCHEncode(void *codeword, size_t codewordSize, void *eccdata, size_t eccdataSize, uint32_t poly, bool swap_bits, bool invert){
+    BCHDecoder::threadDecoder(poly, eccdataSize, swap_bits)->encode(codeword, codewordSize, eccdata, invert);
+}
+
+struct PageExtent{
+    uint32_t offset;
+    uint32_t len;
+};
+
 struct InternalPageStructure{
 public:
-    ECCCorrection::PageStructure ps;
-    uint32_t tagmin;
-    uint32_t tagmax;
+    std::vector<ECCCorrection::CodewordPlan> plan;
+    std::vector<PageExtent> dataExtents;
+    std::vector<PageExtent> serviceExtents;
+    size_t pageExtent;
     uint32_t startPage;
     uint32_t pagesCnt;
+    uint32_t dataPerPage;
+    uint32_t servicePerPage;
+
+    /* pages actually processed for this section and where they land in the linear outputs */
+    uint64_t begin;
+    uint64_t end;
+    uint64_t dataBase;
+    uint64_t serviceBase;
 
-    InternalPageStructure() : tagmin(-1), tagmax(0), startPage(0), pagesCnt(0){}
+    InternalPageStructure() : pageExtent(0), startPage(0), pagesCnt(0), dataPerPage(0), servicePerPage(0), begin(0), end(0), dataBase(0), serviceBase(0){}
 };
 
-uint32_t ECCCorrection::processPages(const FileMapping *inmap, FileMapping *outmap, size_t pageSize, NandStructure nstructure, cbCodeWord cb, void *userarg, uint32_t threadsCnt){
-    const uint8_t *mem = NULL;
+/*
+    Appends the data and service extents of page to their slots in the linear outputs
+ */
+static void writeLinearOutputs(const InternalPageStructure *ips, uint32_t pagenum, const uint8_t *page, uint8_t *dataMem, uint8_t *serviceMem){
+    if (dataMem) {
+        uint8_t *dst = &dataMem[ips->dataBase + (pagenum - ips->begin)*ips->dataPerPage];
+        for (auto &e : ips->dataExtents) {
+            memcpy(dst, &page[e.offset], e.len);
+            dst += e.len;
+        }
+    }
+    if (serviceMem) {
+        uint8_t *dst = &serviceMem[ips->serviceBase + (pagenum - ips->begin)*ips->servicePerPage];
+        for (auto &e : ips->serviceExtents) {
+            memcpy(dst, &page[e.offset], e.len);
+            dst += e.len;
+        }
+    }
+}
+
+std::vector<ECCCorrection::CodewordPlan> ECCCorrection::compileCodewordPlan(const PageStructure &pageStructure, size_t pageSize){
+    std::vector<CodewordPlan> ret;
+    uint32_t tagmin = -1;
+    uint32_t tagmax = 0;
+
+    for (auto cw : pageStructure){
+        if (cw.tag < tagmin) {
+            tagmin = cw.tag;
+        }
+        if (cw.tag > tagmax) {
+            tagmax = cw.tag;
+        }
+    }
+    retassure(pageStructure.size(), "Empty page structure");
+    retassure(tagmax != (uint32_t)-1, "max page structure tag too large!");
+
+    for (uint32_t tag = tagmin; tag <= tagmax; tag++) {
+        size_t cwStart = 0;
+        size_t cwSize = 0;
+        size_t eccStart = 0;
+        size_t eccSize = 0;
+        size_t pageOffset = 0;
+        bool hasData = false;
+        bool hasTag = false;
+
+        for (auto cw : pageStructure) {
+            if (cw.tag == tag) {
+                hasTag = true;
+                if (cw.type == kPageCodewordTypeECC) {
+                    if (!eccSize) {
+                        eccSize = cw.len;
+                        eccStart = pageOffset;
+                    }else{
+                        reterror("Multiple ECC definitions for codeword!");
+                    }
+                }else{
+                    if (cw.type == kPageCodewordTypeData) hasData = true;
+                    if (!cwSize) {
+                        cwSize = cw.len;
+                        cwStart = pageOffset;
+                    }else{
+                        if (cwStart + cwSize == pageOffset) {
+                            cwSize += cw.len;
+                        }else{
+                            reterror("Ecc correction not supported for codewords with holes");
+                        }
+                    }
+                }
+            }
+            pageOffset += cw.len;
+        }
+        retassure(pageOffset <= pageSize, "Page structure (%zu bytes) exceeds pagesize (%zu bytes)",pageOffset,pageSize);
+        retassure(hasTag, "Failed to find codeword with tag '%d'",tag);
+        if (!hasData && !eccSize) {
+            /* service area bytes without ecc are not protected, nothing to correct */
+            continue;
+        }
+        retassure(cwSize, "Failed to find codeword with tag '%d'",tag);
+        retassure(eccSize, "Failed to find ecc with tag '%d'",tag);
+
+        ret.push_back({
+            .cwStart = (uint32_t)cwStart,
+            .cwSize = (uint32_t)cwSize,
+            .eccStart = (uint32_t)eccStart,
+            .eccSize = (uint32_t)eccSize,
+        });
+    }
+    retassure(ret.size(), "Page structure contains no ecc protected codewords");
+    return ret;
+}
+
+std::string ECCCorrection::pageStructureToString(const PageStructure &pageStructure){
+    std::string ret;
+    for (auto cw : pageStructure) {
+        char type = '?';
+        switch (cw.type) {
+            case kPageCodewordTypeData:
+                type = 'd';
+                break;
+            case kPageCodewordTypeECC:
+                type = 'e';
+                break;
+            case kPageCodewordTypeServiceArea:
+                type = 's';
+                break;
+            default:
+                reterror("unexpected page codeword type %d",cw.type);
+        }
+        if (ret.size()) ret += ",";
+        ret += std::to_string(cw.tag) + ":" + std::to_string(cw.len) + ":" + type;
+    }
+    return ret;
+}
+
+/*
+    Resolve the tag based page description into one flat entry per codeword.
+    All validation happens here, so workers only need to index into the plan.
+ */
+static InternalPageStructure compilePageStructure(const ECCCorrection::NandSection &section, size_t pageSize){
+    InternalPageStructure ret;
+    ret.plan = ECCCorrection::compileCodewordPlan(section.pageStructure, pageSize);
+    for (auto &p : ret.plan) {
+        ret.pageExtent = std::max(ret.pageExtent, (size_t)std::max(p.cwStart + p.cwSize, p.eccStart + p.eccSize));
+    }
+
+    /* data and service area bytes in logical (codeword, then page offset) order */
+    {
+        std::vector<std::pair<uint32_t, PageExtent>> data;
+        std::vector<std::pair<uint32_t, PageExtent>> service;
+        uint32_t pageOffset = 0;
+        for (auto &cw : section.pageStructure) {
+            if (cw.type == ECCCorrection::kPageCodewordTypeData) {
+                data.push_back({cw.tag, {pageOffset, cw.len}});
+            }else if (cw.type == ECCCorrection::kPageCodewordTypeServiceArea) {
+                service.push_back({cw.tag, {pageOffset, cw.len}});
+            }
+            pageOffset += cw.len;
+        }
+        auto byTag = [](const std::pair<uint32_t, PageExtent> &a, const std::pair<uint32_t, PageExtent> &b){return a.first < b.first;};
+        std::stable_sort(data.begin(), data.end(), byTag);
+        std::stable_sort(service.begin(), service.end(), byTag);
+        for (auto &e : data) {
+            ret.dataExtents.push_back(e.second);
+            ret.dataPerPage += e.second.len;
+            ret.pageExtent = std::max(ret.pageExtent, (size_t)e.second.offset + e.second.len);
+        }
+        for (auto &e : service) {
+            ret.serviceExtents.push_back(e.second);
+            ret.servicePerPage += e.second.len;
+            ret.pageExtent = std::max(ret.pageExtent, (size_t)e.second.offset + e.second.len);
+        }
+    }
+    ret.startPage = section.startPage;
+    ret.pagesCnt = section.pagesCnt;
+    return ret;
+}
+
+/*
+    Resolves which pages every section processes (later sections never go back before earlier ones,
+    nothing follows a section with implicit length) and where their bytes go in the linear outputs.
+ */
+static void layoutSections(std::vector<InternalPageStructure> &ips, uint64_t memPages){
+    uint64_t prevEnd = 0;
+    uint64_t dataBase = 0;
+    uint64_t serviceBase = 0;
+    bool reachedEnd = false;
+    for (auto &curIPS : ips) {
+        if (reachedEnd) {
+            curIPS.begin = curIPS.end = prevEnd;
+        }else{
+            curIPS.begin = std::max<uint64_t>(curIPS.startPage, prevEnd);
+            curIPS.end = (curIPS.pagesCnt) ? std::min<uint64_t>((uint64_t)curIPS.startPage + curIPS.pagesCnt, memPages) : memPages;
+            if (curIPS.end < curIPS.begin) curIPS.end = curIPS.begin;
+            if (!curIPS.pagesCnt) reachedEnd = true;
+        }
+        curIPS.dataBase = dataBase;
+        curIPS.serviceBase = serviceBase;
+        dataBase += (curIPS.end - curIPS.begin) * curIPS.dataPerPage;
+        serviceBase += (curIPS.end - curIPS.begin) * curIPS.servicePerPage;
+        if (curIPS.end > prevEnd) prevEnd = curIPS.end;
+    }
+}
+
+void ECCCorrection::linearOutputSizes(size_t inputSize, size_t pageSize, NandStructure nstructure, uint64_t &dataSize, uint64_t &serviceSize){
+    std::vector<InternalPageStructure> ips;
+    for (auto &ps : nstructure){
+        ips.push_back(compilePageStructure(ps, pageSize));
+    }
+    layoutSections(ips, inputSize / pageSize);
+    dataSize = 0;
+    serviceSize = 0;
+    for (auto &curIPS : ips) {
+        dataSize += (curIPS.end - curIPS.begin) * curIPS.dataPerPage;
+        serviceSize += (curIPS.end - curIPS.begin) * curIPS.servicePerPage;
+    }
+}
+
+uint32_t ECCCorrection::processPages(const FileMapping *inmap, FileMapping *outmap, size_t pageSize, NandStructure nstructure, cbPage cb, void *userarg, uint32_t threadsCnt, bool pinThreads, FileMapping *dataOutmap, FileMapping *serviceOutmap, ProgressReporter *progress, const BadBlockTable *badBlocks){
     size_t memSize = 0;
     
     uint8_t *outMem = NULL;
     size_t outMemSize = 0;
+
+    uint8_t *dataMem = NULL;
+    uint8_t *serviceMem = NULL;
         
-    mem = inmap->mem();
     memSize = inmap->memSize();
+    if (const DumpContainer::Reader *container = inmap->container()) {
+        retassure(container->pageSize() == pageSize, "Container has a pagesize of %u, but expected %zu",container->pageSize(),pageSize);
+    }
     
     if (threadsCnt == 0) {
-        threadsCnt = 1;
+        threadsCnt = PageScheduler::defaultWorkersCnt();
     }
+    retassure(!progress || progress->workersCnt() >= threadsCnt, "Progress reporter has %u worker slots for %u threads",progress ? progress->workersCnt() : 0,threadsCnt);
     
     if (outmap) {
         outMem = outmap->mem();
@@ -109,161 +585,126 @@ uint32_t ECCCorrection::processPages(const FileMapping *inmap, FileMapping *outm
     
     std::vector<InternalPageStructure> ips;
 
-    for (auto ps : nstructure){
-        InternalPageStructure ip;
-        for (auto cw : ps.pageStructure){
-            if (cw.tag < ip.tagmin) {
-                ip.tagmin = cw.tag;
-            }
-            if (cw.tag > ip.tagmax) {
-                ip.tagmax = cw.tag;
-            }
+    for (auto &ps : nstructure){
+        ips.push_back(compilePageStructure(ps, pageSize));
+    }
+    /* only full pages are processed, a partial last page stays as it is in the output */
+    layoutSections(ips, memSize / pageSize);
+
+    if (dataOutmap || serviceOutmap) {
+        uint64_t dataSize = 0;
+        uint64_t serviceSize = 0;
+        linearOutputSizes(memSize, pageSize, nstructure, dataSize, serviceSize);
+        if (dataOutmap) {
+            retassure(dataOutmap->memSize() >= dataSize, "Data output too small (0x%llx < 0x%llx)",(unsigned long long)dataOutmap->memSize(),(unsigned long long)dataSize);
+            dataMem = dataOutmap->mem();
+        }
+        if (serviceOutmap) {
+            retassure(serviceOutmap->memSize() >= serviceSize, "Service area output too small (0x%llx < 0x%llx)",(unsigned long long)serviceOutmap->memSize(),(unsigned long long)serviceSize);
+            serviceMem = serviceOutmap->mem();
         }
-        retassure(ip.tagmax != (uint32_t)-1, "max page structure tag too large!");
-        ip.ps = ps.pageStructure;
-        ip.startPage = ps.startPage;
-        ip.pagesCnt = ps.pagesCnt;
-        ips.push_back(ip);
     }
+    /* linear outputs want corrected bytes, without an output mapping correct into a scratch page */
+    const bool needScratch = !outMemSize && (dataMem || serviceMem);
     
-    std::atomic<uint32_t> processedPages = 0;
-    auto processPageFunc =  [mem, memSize, outMem, outMemSize, pageSize, cb, userarg, &processedPages]
-                        (InternalPageStructure ips, size_t memOffset)->bool{
+    PageScheduler scheduler(threadsCnt);
+    {
+        for (uint32_t i = 0; i < ips.size(); i++) {
+            const InternalPageStructure *curIPS = &ips[i];
+            uint32_t printEndPage = (curIPS->pagesCnt) ? curIPS->startPage+curIPS->pagesCnt : 0;
+            info("[%d] Processing pagestructure from page 0x%08x (%10d) until page 0x%08x (%10d)",i,curIPS->startPage,curIPS->startPage,printEndPage,printEndPage);
+            scheduler.addSection(i, curIPS->begin, curIPS->end);
+            if (!curIPS->pagesCnt) break;
+        }
+        scheduler.distribute();
+    }
+    
+    const bool printPages = !progress;
+    auto processPageFunc =  [memSize, outMem, outMemSize, dataMem, serviceMem, pageSize, cb, userarg, printPages]
+                        (const InternalPageStructure *ips, size_t memOffset, FileMapping::Cursor &inCursor, FileMapping::Cursor &outCursor, uint8_t *scratch)->bool{
         //process page
-        const uint8_t *curPage = &mem[memOffset];
-        uint8_t *curOutPage = &outMem[memOffset]; //may be invalid!
+        uint8_t *curOutPage = (outMemSize) ? &outMem[memOffset] : scratch;
         
         uint32_t pagenum = (uint32_t)(memOffset / pageSize);
-        if ((pagenum & 0xffff) == 0) {
+        if (printPages && (pagenum & 0xffff) == 0) {
             info("Processing page 0x%08x",pagenum);
         }
-        uint32_t cwnum = 0;
-        for (uint32_t tag = ips.tagmin; tag <= ips.tagmax; tag++,cwnum++) {
-            //process codewords in page
-            
-            size_t cwStart = 0;
-            size_t cwSize = 0;
-            size_t eccStart = 0;
-            size_t eccSize = 0;
-            size_t pageOffset = 0;
-            
-            for (auto cw : ips.ps) {
-                if (cw.tag == tag) {
-                    if (cw.type == kPageCodewordTypeECC) {
-                        if (!eccSize) {
-                            eccSize = cw.len;
-                            eccStart = pageOffset;
-                        }else{
-                            reterror("Multiple ECC definitions for codeword!");
-                        }
-                    }else{
-                        if (!cwSize) {
-                            cwSize = cw.len;
-                            cwStart = pageOffset;
-                        }else{
-                            if (cwStart + cwSize == pageOffset) {
-                                cwSize += cw.len;
-                            }else{
-                                reterror("Ecc correction not supported for codewords with holes");
-                            }
-                        }
-                    }
-                }
-                pageOffset += cw.len;
-            }
-            retassure(cwSize, "Failed to find codeword with tag '%d'",tag);
-            retassure(eccSize, "Failed to find ecc with tag '%d'",tag);
-
-            retassure(memOffset + cwStart + cwSize < memSize, "codeword goes out of memory bounds");
-            retassure(memOffset + eccStart + eccSize < memSize, "ecc goes out of memory bounds");
-
-            if (outMemSize) {
-                cb(pagenum, cwnum, &curPage[cwStart], cwSize, &curPage[eccStart], eccSize, &curOutPage[cwStart], &curOutPage[eccStart], userarg);
-            }else{
-                cb(pagenum, cwnum, &curPage[cwStart], cwSize, &curPage[eccStart], eccSize, NULL, NULL, userarg);
-            }
+        if (memOffset + ips->pageExtent > memSize) {
+            error("Page 0x%x goes out of memory bounds",pagenum);
+            return false;
         }
-        ++processedPages;
+        const uint8_t *curPage = inCursor.advance(memOffset, ips->pageExtent);
+        outCursor.advance(memOffset, ips->pageExtent);
+        if (scratch) memcpy(scratch, curPage, ips->pageExtent);
+        
+        //process all codewords of the page at once
+        cb(pagenum, ips->plan.data(), (uint32_t)ips->plan.size(), curPage, curOutPage, userarg);
+
+        writeLinearOutputs(ips, pagenum, curOutPage, dataMem, serviceMem);
         return true;
     };
     
-    tihmstar::DeliveryEvent<std::pair<InternalPageStructure, size_t>> workerChunks;
-    
+    std::atomic<uint32_t> processedPages = 0;
+    std::atomic<uint64_t> skippedPages = 0;
+    std::atomic<bool> abortWork = false;
+    std::mutex workerExceptionLck;
+    std::exception_ptr workerException = nullptr;
     std::vector<std::thread> wthreads;
     
-    debug("Starting %d threads",threadsCnt);
+    debug("Starting %d threads for %llu pages",threadsCnt,(unsigned long long)scheduler.totalPages());
+    if (progress) progress->start(scheduler.totalPages());
     for (uint32_t i=0; i<threadsCnt; i++) {
-        wthreads.push_back(std::thread([&workerChunks,&processPageFunc](int tid){
+        wthreads.push_back(std::thread([&](uint32_t tid){
             debug("[%d] Starting thread",tid);
-            while (true) {
-                std::pair<InternalPageStructure, size_t> wchunk = {};
-                try {
-                    wchunk = workerChunks.wait();
-                } catch (tihmstar::exception &e) {
-                    break;
+            uint32_t localProcessedPages = 0;
+            uint64_t localSkippedPages = 0;
+            if (pinThreads) PageScheduler::pinCurrentThread(tid);
+            ProgressReporter::Worker *pw = (progress) ? &progress->worker(tid) : NULL;
+            FileMapping::Cursor inCursor(inmap);
+            FileMapping::Cursor outCursor(outmap);
+            try {
+                std::vector<uint8_t> scratch(needScratch ? pageSize : 0);
+                PageScheduler::Range r = {};
+                while (!abortWork && scheduler.next(tid, r)) {
+                    const InternalPageStructure *curIPS = &ips[r.section];
+                    for (uint64_t page = r.begin; page < r.end; page++) {
+                        if (badBlocks && badBlocks->isBadPage(page)) {
+                            /* uncorrected, but the linear outputs keep their layout without holes */
+                            if ((dataMem || serviceMem) && page*pageSize + curIPS->pageExtent <= memSize) {
+                                writeLinearOutputs(curIPS, (uint32_t)page, inCursor.advance(page*pageSize, curIPS->pageExtent), dataMem, serviceMem);
+                            }
+                            localSkippedPages++;
+                            if (pw) pw->add(1, pageSize);
+                            continue;
+                        }
+                        auto start = (pw) ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+                        if (processPageFunc(curIPS, page*pageSize, inCursor, outCursor, needScratch ? scratch.data() : NULL)) localProcessedPages++;
+                        if (pw) {
+                            pw->add(1, pageSize);
+                            pw->addBusy(std::chrono::steady_clock::now() - start);
+                        }
+                    }
                 }
-                processPageFunc(wchunk.first,wchunk.second);
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(workerExceptionLck);
+                if (!workerException) workerException = std::current_exception();
+                abortWork = true;
             }
+            processedPages += localProcessedPages;
+            skippedPages += localSkippedPages;
             debug("[%d] Stopping thread",tid);
         },i));
     }
     
-    if (ips.size()) {
-        std::reverse(ips.begin(), ips.end());
-        InternalPageStructure curIPS = ips.back(); ips.pop_back();
-        uint32_t processedIPS = 0;
-        {
-            uint32_t printEndPage = (curIPS.pagesCnt) ? curIPS.startPage+curIPS.pagesCnt : 0;
-            info("[%d] Processing pagestructure from page 0x%08x (%10d) until page 0x%08x (%10d)",processedIPS,curIPS.startPage,curIPS.startPage,printEndPage,printEndPage);
-#ifdef WITH_MADVICE
-            if (curIPS.pagesCnt) {
-                madvise((void*)&mem[pageSize*curIPS.startPage], pageSize*curIPS.pagesCnt, MADV_SEQUENTIAL);
-            }else{
-                madvise((void*)&mem[pageSize*curIPS.startPage], memSize-pageSize*curIPS.startPage, MADV_SEQUENTIAL);
-            }
-#endif
-        }
-        
-        for (size_t memOffset = curIPS.startPage*pageSize; memOffset < memSize; memOffset+=pageSize) {
-#define curPage (memOffset/pageSize)
-            if (curIPS.pagesCnt && curPage >= curIPS.startPage + curIPS.pagesCnt) {
-                while (curIPS.pagesCnt && curPage >= curIPS.startPage + curIPS.pagesCnt) {
-                    if (!ips.size()) goto endPostingWork;
-                    /*
-                        move to next page structure
-                     */
-                    ++processedIPS;
-                    curIPS = ips.back(); ips.pop_back();
-                    if (curIPS.startPage > curPage) {
-                        memOffset = curIPS.startPage*pageSize;
-                    }
-                }
-                {
-                    uint32_t printEndPage = (curIPS.pagesCnt) ? curIPS.startPage+curIPS.pagesCnt : 0;
-                    info("[%d] Processing pagestructure from page 0x%08x (%10d) until page 0x%08x (%10d)",processedIPS,curIPS.startPage,curIPS.startPage,printEndPage,printEndPage);
-#ifdef WITH_MADVICE
-                    if (curIPS.pagesCnt) {
-                        madvise((void*)&mem[pageSize*curIPS.startPage], pageSize*curIPS.pagesCnt, MADV_SEQUENTIAL);
-                    }else{
-                        madvise((void*)&mem[pageSize*curIPS.startPage], memSize-pageSize*curIPS.startPage, MADV_SEQUENTIAL);
-                    }
-#endif
-                }
-            }
-
-            workerChunks.post({curIPS,memOffset});
-        }
-        endPostingWork:;
-#undef curPage
-    }
-    workerChunks.finish();
-    
     debug("waiting for threads to finish");
     for (auto &t : wthreads) {
         t.join();
     }
     
     debug("all threads finished");
+    if (progress) progress->stop();
+    if (workerException) std::rethrow_exception(workerException);
+    if (skippedPages) info("Skipped %llu pages of bad blocks",(unsigned long long)skippedPages.load());
 
 error:
     return processedPages;
@@ -11,10 +11,21 @@
 #include "FileMapping.hpp"
 
 #include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include <limits.h>
 #include <stdlib.h>
 
+#define BCH_DECODER_CACHE_CNT 16
+
+struct bch_control;
+class BadBlockTable;
+class CodewordStats;
+class ECCEngine;
+class ProgressReporter;
+
 namespace ECCCorrection {
 enum PageCodewordType{
     kPageCodewordTypeUndefined = 0,
@@ -37,13 +48,110 @@ struct NandSection{
 };
 
 using NandStructure = std::vector<NandSection>;
-using cbCodeWord = std::function<void(uint32_t pagenum, uint32_t cwnum, const uint8_t *codeword, size_t codewordSize, const uint8_t *eccdata, size_t eccdataSize, uint8_t *outCodeword, uint8_t *outECC, void *userarg)>;
 
+struct CodewordPlan{
+    uint32_t cwStart;
+    uint32_t cwSize;
+    uint32_t eccStart;
+    uint32_t eccSize;
+};
+/*
+    Called once per page with all its codewords, codeword cwnum is at plan[cwnum] in page.
+    outPage is NULL if there is no output, otherwise it starts out as a copy of page.
+ */
+using cbPage = std::function<void(uint32_t pagenum, const CodewordPlan *plan, uint32_t cwCnt, const uint8_t *page, uint8_t *outPage, void *userarg)>;
+
+
+/*
+    BCH decoder for a fixed (poly, ecc bytes, swap_bits) parameter set.
+    Lookup tables are built once and shared between copies, every copy owns its own scratch buffers.
+    A single instance must not be used by multiple threads at once, copy it for every thread instead.
+ */
+class BCHDecoder {
+    std::shared_ptr<struct bch_control> _tables;
+    struct bch_control *_bch;
+    uint32_t _poly;
+    size_t _eccdataSize;
+    bool _swapBits;
+public:
+    BCHDecoder(uint32_t poly, size_t eccdataSize, bool swap_bits = false);
+    BCHDecoder(const BCHDecoder &cpy);
+    BCHDecoder &operator=(const BCHDecoder &) = delete;
+    ~BCHDecoder();
+
+    inline uint32_t poly() const{return _poly;}
+    inline size_t eccdataSize() const{return _eccdataSize;}
+    inline bool swapBits() const{return _swapBits;}
+
+    /*
+        Number of bitflips a codeword can be corrected for
+     */
+    uint32_t strength() const;
+
+    int decode(void *codeword, size_t codewordSize, void *eccdata, bool invert = false);
+
+    /*
+        Computes the ecc bytes for codeword, the inverse of decode.
+        With invert the codeword is stored inverted and the ecc is written inverted as well.
+     */
+    void encode(void *codeword, size_t codewordSize, void *eccdata, bool invert = false);
+
+    /*
+        Returns the decoder for the given parameters owned by the calling thread.
+        Tables are only built the first time a parameter set is seen by any thread.
+        Only the most recently used parameter sets are kept, the returned decoder stays valid
+        until the calling thread asked for BCH_DECODER_CACHE_CNT other ones.
+     */
+    static BCHDecoder *threadDecoder(uint32_t poly, size_t eccdataSize, bool swap_bits);
+};
 
 int eccBCH(void *codeword, size_t codewordSize, void *eccdata, size_t eccdataSize, uint32_t poly, bool swap_bits=false, bool invert=false);
 
+void eccBCHEncode(void *codeword, size_t codewordSize, void *eccdata, size_t eccdataSize, uint32_t poly, bool swap_bits=false, bool invert=false);
+
+/*
+    Checks whether a codeword looks like erased flash (all 0xFF in data and ecc).
+    Returns the number of zero bits (bitflips) if it does not exceed bitflipsThreshold, -1 otherwise.
+ */
+int checkErased(const void *codeword, size_t codewordSize, const void *eccdata, size_t eccdataSize, int bitflipsThreshold);
+
+/*
+    The correction callback of bnd, decodes the codewords of a page with engine in one batch and records the results in cwStats.
+    Codewords which don't decode count as erased if they have at most erasedBitflips zero bits,
+    INT_MIN uses the ecc strength, a negative threshold never treats codewords as erased.
+    Corrected and cleaned codewords are written to the output page.
+ */
+cbPage makeECCCallback(const ECCEngine &engine, CodewordStats &cwStats, int erasedBitflips = INT_MIN);
+
+/*
+    Resolves the tag based page structure into one entry per ecc protected codeword (in tag order).
+    Tags which only consist of service area entries are unprotected spare bytes and produce no entry.
+ */
+std::vector<CodewordPlan> compileCodewordPlan(const PageStructure &pageStructure, size_t pageSize);
+
+/*
+    Formats a page structure in the format accepted by --page-structure.
+ */
+std::string pageStructureToString(const PageStructure &pageStructure);
+
+/*
+    Sizes of the linear data and service area outputs of processPages for an input of inputSize bytes,
+    a partial last page is not part of them
+ */
+void linearOutputSizes(size_t inputSize, size_t pageSize, NandStructure nstructure, uint64_t &dataSize, uint64_t &serviceSize);
 
-uint32_t processPages(const FileMapping *inmap, FileMapping *outmap, size_t pageSize, NandStructure nstructure, cbCodeWord cb, void *userarg = NULL, uint32_t threadsCnt = 0);
+/*
+    inmap         - raw dump or container
+    outmap        - corrected in place, needs to start out as a copy of the raw dump (cloneFile or DumpContainer::Reader::unpack)
+    threadsCnt    - number of worker threads, 0 = one per cpu core
+    pinThreads    - pin every worker thread to its own core
+    dataOutmap    - receives the (corrected) data bytes of all processed pages packed in logical order
+    serviceOutmap - receives the service area bytes the same way
+    progress      - started and stopped by processPages, needs at least threadsCnt worker slots
+    badBlocks     - pages of bad blocks are not corrected, they are left untouched in outmap
+                    and copied raw into the linear outputs
+ */
+uint32_t processPages(const FileMapping *inmap, FileMapping *outmap, size_t pageSize, NandStructure nstructure, cbPage cb, void *userarg = NULL, uint32_t threadsCnt = 0, bool pinThreads = false, FileMapping *dataOutmap = NULL, FileMapping *serviceOutmap = NULL, ProgressReporter *progress = NULL, const BadBlockTable *badBlocks = NULL);
 
 }
 
@@ -0,0 +1,181 @@
+//
+//  ECCEngine.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ECCEngine.hpp"
+#include "ArgParse.hpp"
+#include "ECCCorrection.hpp"
+#include "HammingECC.hpp"
+#include "ReedSolomonECC.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <string.h>
+#include <strings.h>
+
+using namespace ECCCorrection;
+
+namespace {
+class BCHThreadDecoder : public ECCEngine::Decoder {
+    uint32_t _poly;
+    bool _swapBits;
+    bool _invert;
+public:
+    BCHThreadDecoder(uint32_t poly, bool swapBits, bool invert)
+    : _poly(poly), _swapBits(swapBits), _invert(invert)
+    {}
+
+    virtual void decode(ECCEngine::Codeword *cws, size_t cnt) override{
+        /* only kept for this batch, the thread cache may evict it once other parameter sets are looked up */
+        BCHDecoder *dec = NULL;
+        for (size_t i = 0; i < cnt; i++) {
+            ECCEngine::Codeword &cw = cws[i];
+            if (!dec || dec->eccdataSize() != cw.eccSize) {
+                dec = BCHDecoder::threadDecoder(_poly, cw.eccSize, _swapBits);
+            }
+            cw.bitflips = dec->decode(cw.data, cw.dataSize, cw.ecc, _invert);
+        }
+    }
+};
+
+struct ThreadDecoder{
+    uint64_t serial;
+    ECCEngine::Decoder *decoder;
+    std::weak_ptr<bool> alive;
+};
+}
+
+#pragma mark ECCEngine::Decoder
+ECCEngine::Decoder::~Decoder(){
+    //
+}
+
+#pragma mark ECCEngine
+ECCEngine::ECCEngine()
+: _serial(0), _alive(std::make_shared<bool>(true))
+{
+    static std::atomic<uint64_t> gSerial = 1;
+    _serial = gSerial++;
+}
+
+ECCEngine::~ECCEngine(){
+    //
+}
+
+ECCEngine::Decoder &ECCEngine::threadDecoder() const{
+    /* keyed by serial rather than address, so a new engine at the same address never picks up stale decoders */
+    thread_local std::vector<ThreadDecoder> tDecoders;
+
+    for (auto &d : tDecoders) {
+        if (d.serial == _serial) return *d.decoder;
+    }
+
+    /* drop the entries of destroyed engines, their decoders are gone with them */
+    tDecoders.erase(std::remove_if(tDecoders.begin(), tDecoders.end(), [](const ThreadDecoder &d){
+        return d.alive.expired();
+    }), tDecoders.end());
+
+    Decoder *ret = nullptr;
+    {
+        std::unique_ptr<Decoder> dec = makeDecoder();
+        std::unique_lock<std::mutex> ul(_decodersLck);
+        _decoders.push_back(std::move(dec));
+        ret = _decoders.back().get();
+    }
+    tDecoders.push_back({_serial, ret, _alive});
+    return *ret;
+}
+
+void ECCEngine::decode(Codeword *cws, size_t cnt) const{
+    threadDecoder().decode(cws, cnt);
+}
+
+int ECCEngine::decode(uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const{
+    Codeword cw = {
+        .data = data,
+        .dataSize = dataSize,
+        .ecc = ecc,
+        .eccSize = eccSize,
+        .bitflips = 0,
+    };
+    threadDecoder().decode(&cw, 1);
+    return cw.bitflips;
+}
+
+std::unique_ptr<ECCEngine> ECCEngine::create(const std::vector<std::string> &args){
+    retassure(args.size(), "No ECC algorithm specified");
+    const std::string &alg = args.front();
+    std::vector<std::string> params{args.begin()+1, args.end()};
+
+    if (strcasecmp(alg.c_str(), "bch") == 0) {
+        return BCHEngine::create(params);
+    }else if (strcasecmp(alg.c_str(), "hamming") == 0) {
+        return HammingEngine::create(params);
+    }else if (strcasecmp(alg.c_str(), "rs") == 0) {
+        return ReedSolomonEngine::create(params);
+    }
+    reterror("Unknown ECC algorithm '%s'",alg.c_str());
+}
+
+#pragma mark BCHEngine
+BCHEngine::BCHEngine(uint32_t poly, bool swapBits, bool invert)
+: _poly(poly), _swapBits(swapBits), _invert(invert), _polyDegree(0)
+{
+    retassure(_poly > 1, "BCH polynom cannot be 0!");
+    _polyDegree = 31 - __builtin_clz(_poly);
+}
+
+std::unique_ptr<ECCEngine> BCHEngine::create(const std::vector<std::string> &params){
+    uint32_t poly = 0;
+    bool swapBits = false;
+    bool invert = false;
+
+    retassure(params.size(), "missing poly argument for BCH");
+    poly = (uint32_t)parseNumber(params.front().c_str());
+    for (size_t i = 1; i < params.size(); i++) {
+        const std::string &arg = params[i];
+        if (strcasecmp(arg.c_str(), "i") == 0) {
+            invert = true;
+        }else if (strcasecmp(arg.c_str(), "r") == 0) {
+            swapBits = true;
+        }else{
+            reterror("unexpected BCH arg '%s'",arg.c_str());
+        }
+    }
+    return std::make_unique<BCHEngine>(poly, swapBits, invert);
+}
+
+#pragma mark protected
+std::unique_ptr<ECCEngine::Decoder> BCHEngine::makeDecoder() const{
+    return std::make_unique<BCHThreadDecoder>(_poly, _swapBits, _invert);
+}
+
+#pragma mark public
+std::string BCHEngine::description() const{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "BCH poly 0x%x inverse=%d swapbits=%d",_poly,_invert,_swapBits);
+    return buf;
+}
+
+void BCHEngine::checkGeometry(size_t dataSize, size_t eccSize) const{
+    retassure(eccSize*8 >= (size_t)_polyDegree, "BCH with poly 0x%x needs at least %d ecc bits, codeword has %zu",_poly,_polyDegree,eccSize*8);
+    retassure((dataSize+eccSize)*8 < (1ULL << _polyDegree), "Codeword of %zu bytes is too long for BCH with poly 0x%x",dataSize+eccSize,_poly);
+    /* throws if bch_init rejects the parameters */
+    BCHDecoder::threadDecoder(_poly, eccSize, _swapBits);
+}
+
+uint32_t BCHEngine::strength(size_t eccSize) const{
+    return (uint32_t)(eccSize*8/_polyDegree);
+}
+
+void BCHEngine::encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const{
+    /* BCHDecoder::encode works on a mutable buffer */
+    std::vector<uint8_t> cw{data, data+dataSize};
+    BCHDecoder::threadDecoder(_poly, eccSize, _swapBits)->encode(cw.data(), dataSize, ecc, _invert);
+}
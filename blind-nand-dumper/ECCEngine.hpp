@@ -0,0 +1,127 @@
+//
+//  ECCEngine.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ECCEngine_hpp
+#define ECCEngine_hpp
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    An ECC scheme with its parameters, as selected with --ecc <alg,params>.
+    The engine is shared read only between all workers, every thread decodes with its own Decoder,
+    which holds the scratch state of the algorithm.
+ */
+class ECCEngine {
+public:
+    struct Codeword{
+        uint8_t *data;
+        size_t dataSize;
+        uint8_t *ecc;
+        size_t eccSize;
+        int bitflips;       /* set by decode, corrected bits or -1 if uncorrectable */
+    };
+
+    class Decoder{
+    public:
+        virtual ~Decoder();
+
+        /*
+            Corrects the codewords in place
+         */
+        virtual void decode(Codeword *cws, size_t cnt) = 0;
+    };
+
+private:
+    uint64_t _serial;
+    std::shared_ptr<bool> _alive;
+    mutable std::mutex _decodersLck;
+    mutable std::vector<std::unique_ptr<Decoder>> _decoders;
+
+protected:
+    virtual std::unique_ptr<Decoder> makeDecoder() const = 0;
+
+public:
+    ECCEngine();
+    ECCEngine(const ECCEngine &) = delete;
+    ECCEngine &operator=(const ECCEngine &) = delete;
+    virtual ~ECCEngine();
+
+    virtual std::string description() const = 0;
+
+    /*
+        Throws if codewords with dataSize data and eccSize ecc bytes can't be handled
+     */
+    virtual void checkGeometry(size_t dataSize, size_t eccSize) const = 0;
+
+    /*
+        Bitflips a codeword with eccSize ecc bytes can be corrected for
+     */
+    virtual uint32_t strength(size_t eccSize) const = 0;
+
+    /*
+        Computes the ecc bytes of data, the inverse of decode
+     */
+    virtual void encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const = 0;
+
+    /*
+        Returns the decoder of the calling thread, creating it on first use
+     */
+    Decoder &threadDecoder() const;
+
+    /*
+        Decodes the codewords with the decoder of the calling thread
+     */
+    void decode(Codeword *cws, size_t cnt) const;
+
+    /*
+        Decodes a single codeword with the decoder of the calling thread.
+        return - corrected bits or -1 if uncorrectable
+     */
+    int decode(uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const;
+
+    /*
+        args - algorithm followed by its parameters:
+               bch,<poly>[,i][,r]
+               hamming[,sm]
+               rs[,<poly>][,fcr=<num>][,prim=<num>][,msb]
+     */
+    static std::unique_ptr<ECCEngine> create(const std::vector<std::string> &args);
+};
+
+/*
+    Binary BCH with the given primitive polynomial, the strength follows from the ecc size.
+    swapBits - bits are stored lsb first, invert - data and ecc are stored inverted
+ */
+class BCHEngine : public ECCEngine {
+    uint32_t _poly;
+    bool _swapBits;
+    bool _invert;
+    int _polyDegree;
+
+protected:
+    virtual std::unique_ptr<Decoder> makeDecoder() const override;
+public:
+    BCHEngine(uint32_t poly, bool swapBits = false, bool invert = false);
+
+    /*
+        <poly>[,i][,r]
+     */
+    static std::unique_ptr<ECCEngine> create(const std::vector<std::string> &params);
+
+    virtual std::string description() const override;
+    virtual void checkGeometry(size_t dataSize, size_t eccSize) const override;
+    virtual uint32_t strength(size_t eccSize) const override;
+    virtual void encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const override;
+};
+
+#endif /* ECCEngine_hpp */
@@ -0,0 +1,334 @@
+//
+//  ECCSearch.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ECCSearch.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <string.h>
+
+using namespace ECCCorrection;
+
+#define QUICK_REJECT_CODEWORDS      2
+#define MIN_TESTED_CODEWORDS        8
+#define MIN_ECC_STRENGTH            2
+#define MAX_ECC_STRENGTH            128
+#define BBM_BYTES                   2
+
+namespace {
+struct Candidate{
+    uint32_t m;
+    uint32_t poly;
+    uint32_t dataSize;
+    uint32_t eccSize;
+};
+
+struct Layout{
+    PageStructure pageStructure;
+    std::vector<CodewordPlan> plan;
+};
+
+struct Score{
+    uint32_t tested;
+    uint32_t decoded;
+    uint32_t bitflips;
+};
+}
+
+/* polynomials which are used by common controllers, tried before the exhaustive search */
+static const uint32_t gKnownPolys[] = {
+    0x201b, 0x402b, 0x4443, 0x8003, 0x1100b,
+};
+
+static bool isPrimitivePoly(uint32_t poly, uint32_t m){
+    const uint32_t n = (1u << m) - 1;
+    uint32_t x = 1;
+    for (uint32_t i = 1; i <= n; i++) {
+        x <<= 1;
+        if (x & (1u << m)) x ^= poly;
+        if (x == 1) return i == n;
+    }
+    return false;
+}
+
+static std::vector<uint32_t> primitivePolys(uint32_t m){
+    std::vector<uint32_t> ret;
+    for (uint32_t poly = (1u << m) | 1; poly < (2u << m); poly += 2) {
+        /* polynomials with an even number of terms are divisible by (x+1) */
+        if ((__builtin_popcount(poly) & 1) == 0) continue;
+        if (isPrimitivePoly(poly, m)) ret.push_back(poly);
+    }
+    return ret;
+}
+
+static bool isProgrammedPage(const uint8_t *page, size_t pageSize){
+    size_t ffCnt = 0;
+    bool uniform = true;
+    for (size_t i = 0; i < pageSize; i++) {
+        if (page[i] == 0xFF) ffCnt++;
+        if (page[i] != page[0]) uniform = false;
+    }
+    return !uniform && ffCnt < pageSize - pageSize/8;
+}
+
+static bool isUniform(const uint8_t *buf, size_t bufSize, uint8_t val){
+    for (size_t i = 0; i < bufSize; i++) {
+        if (buf[i] != val) return false;
+    }
+    return true;
+}
+
+/*
+    Common ways of placing dataSize codewords with eccSize bytes of ecc into a page:
+    the main area is the biggest power of two which fits the page, the rest is spare.
+ */
+static std::vector<Layout> layoutsForCandidate(size_t pageSize, uint32_t dataSize, uint32_t eccSize){
+    std::vector<Layout> ret;
+    size_t mainSize = 1;
+    while (mainSize*2 <= pageSize) mainSize *= 2;
+    if (mainSize < dataSize) return ret;
+
+    uint32_t cwCnt = (uint32_t)(mainSize / dataSize);
+    uint32_t spareSize = (uint32_t)(pageSize - mainSize);
+    uint32_t oobPerCw = spareSize / cwCnt;
+    uint32_t unprotTag = cwCnt + 1;
+    if (spareSize < cwCnt*eccSize) return ret;
+
+    auto addLayout = [&](PageStructure ps){
+        for (auto &l : ret) {
+            if (pageStructureToString(l.pageStructure) == pageStructureToString(ps)) return;
+        }
+        ret.push_back({ps, compileCodewordPlan(ps, pageSize)});
+    };
+
+    if (oobPerCw >= eccSize) {
+        PageStructure dse;
+        PageStructure des;
+        PageStructure de;
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            /* data, protected service area, ecc */
+            dse.push_back({i, dataSize, kPageCodewordTypeData});
+            if (oobPerCw > eccSize) dse.push_back({i, oobPerCw - eccSize, kPageCodewordTypeServiceArea});
+            dse.push_back({i, eccSize, kPageCodewordTypeECC});
+
+            /* data, ecc, unprotected service area */
+            des.push_back({i, dataSize, kPageCodewordTypeData});
+            des.push_back({i, eccSize, kPageCodewordTypeECC});
+            if (oobPerCw > eccSize) des.push_back({unprotTag++, oobPerCw - eccSize, kPageCodewordTypeServiceArea});
+
+            /* data, ecc packed without gaps */
+            de.push_back({i, dataSize, kPageCodewordTypeData});
+            de.push_back({i, eccSize, kPageCodewordTypeECC});
+        }
+        if (uint32_t rest = spareSize - oobPerCw*cwCnt) {
+            dse.push_back({unprotTag, rest, kPageCodewordTypeServiceArea});
+            des.push_back({unprotTag + 1, rest, kPageCodewordTypeServiceArea});
+        }
+        if (uint32_t rest = spareSize - eccSize*cwCnt) {
+            de.push_back({cwCnt + 1, rest, kPageCodewordTypeServiceArea});
+        }
+        addLayout(dse);
+        addLayout(des);
+        addLayout(de);
+    }
+
+    {
+        /* all data first, ecc at the end of the spare area */
+        PageStructure linear;
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            linear.push_back({i, dataSize, kPageCodewordTypeData});
+        }
+        if (uint32_t rest = spareSize - eccSize*cwCnt) {
+            linear.push_back({cwCnt + 1, rest, kPageCodewordTypeServiceArea});
+        }
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            linear.push_back({i, eccSize, kPageCodewordTypeECC});
+        }
+        addLayout(linear);
+    }
+
+    if (spareSize >= BBM_BYTES + eccSize*cwCnt) {
+        /* all data first, ecc right after the bad block marker */
+        PageStructure linear;
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            linear.push_back({i, dataSize, kPageCodewordTypeData});
+        }
+        linear.push_back({cwCnt + 1, BBM_BYTES, kPageCodewordTypeServiceArea});
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            linear.push_back({i, eccSize, kPageCodewordTypeECC});
+        }
+        if (uint32_t rest = spareSize - BBM_BYTES - eccSize*cwCnt) {
+            linear.push_back({cwCnt + 2, rest, kPageCodewordTypeServiceArea});
+        }
+        addLayout(linear);
+    }
+    return ret;
+}
+
+/*
+    Decodes the sample with the given parameters.
+    Gives up as soon as one of the first codewords fails, wrong parameters practically never decode.
+ */
+static Score scoreLayout(BCHDecoder &decoder, const Layout &layout, bool invert, const std::vector<const uint8_t *> &samples, uint32_t m){
+    Score ret = {};
+    uint8_t cw[0x1000];
+    uint8_t ecc[0x400];
+    const int erasedThreshold = (int)(decoder.eccdataSize()*8/m);
+
+    for (auto page : samples) {
+        for (auto &cp : layout.plan) {
+            if (cp.cwSize > sizeof(cw) || cp.eccSize > sizeof(ecc)) return ret;
+            const uint8_t *pcw = &page[cp.cwStart];
+            const uint8_t *pecc = &page[cp.eccStart];
+            if (checkErased(pcw, cp.cwSize, pecc, cp.eccSize, erasedThreshold) >= 0) continue;
+            /* all zero data and ecc is a valid codeword for every polynomial */
+            if (isUniform(pcw, cp.cwSize, invert ? 0xFF : 0x00) && isUniform(pecc, cp.eccSize, invert ? 0xFF : 0x00)) continue;
+
+            memcpy(cw, pcw, cp.cwSize);
+            memcpy(ecc, pecc, cp.eccSize);
+            int errbits = decoder.decode(cw, cp.cwSize, ecc, invert);
+            ret.tested++;
+            if (errbits >= 0) {
+                ret.decoded++;
+                ret.bitflips += errbits;
+            }else if (ret.tested <= QUICK_REJECT_CODEWORDS) {
+                return ret;
+            }
+        }
+    }
+    return ret;
+}
+
+static bool isBetter(const Score &a, const Score &b){
+    /* compare decoded shares without dividing */
+    uint64_t lhs = (uint64_t)a.decoded * b.tested;
+    uint64_t rhs = (uint64_t)b.decoded * a.tested;
+    if (lhs != rhs) return lhs > rhs;
+    return (uint64_t)a.bitflips * b.decoded < (uint64_t)b.bitflips * a.decoded;
+}
+
+bool ECCSearch::searchBCH(const FileMapping *inmap, size_t pageSize, BCHConfig &out, uint32_t threadsCnt, uint32_t samplePagesCnt, double minShare){
+    const uint8_t *mem = inmap->mem();
+    size_t pagesCnt = 0;
+    std::vector<const uint8_t *> samples;
+    std::vector<Candidate> candidates;
+
+    retassure(pageSize, "Pagesize not set!");
+    retassure(mem, "ECC search does not support dump containers");
+    pagesCnt = inmap->memSize() / pageSize;
+    retassure(pagesCnt, "Input is smaller than a single page");
+    if (!threadsCnt) threadsCnt = PageScheduler::defaultWorkersCnt();
+
+    /* spread samples over the whole dump, skipping erased pages */
+    for (uint32_t s = 0; s < samplePagesCnt; s++) {
+        size_t first = pagesCnt * s / samplePagesCnt;
+        size_t last = pagesCnt * (s+1) / samplePagesCnt;
+        for (size_t p = first; p < last; p++) {
+            if (isProgrammedPage(&mem[p*pageSize], pageSize)) {
+                samples.push_back(&mem[p*pageSize]);
+                break;
+            }
+        }
+    }
+    retassure(samples.size(), "Failed to find programmed pages to sample");
+    info("Sampling %zu programmed pages",samples.size());
+
+    /* known polynomials first, then every primitive polynomial of the same degree */
+    for (int exhaustive = 0; exhaustive < 2; exhaustive++) {
+        for (uint32_t dataSize : {512, 1024}) {
+            uint32_t mmin = 5;
+            while (dataSize*8 + mmin*MIN_ECC_STRENGTH >= (1u << mmin) - 1) mmin++;
+            for (uint32_t m = mmin; m <= std::min(mmin + 1, 16u); m++) {
+                std::vector<uint32_t> polys;
+                if (exhaustive) {
+                    for (auto poly : primitivePolys(m)) {
+                        if (std::find(std::begin(gKnownPolys), std::end(gKnownPolys), poly) == std::end(gKnownPolys)) polys.push_back(poly);
+                    }
+                }else{
+                    for (auto poly : gKnownPolys) {
+                        if (31 - __builtin_clz(poly) == m && isPrimitivePoly(poly, m)) polys.push_back(poly);
+                    }
+                }
+                for (uint32_t eccSize = (m*MIN_ECC_STRENGTH + 7)/8; ; eccSize++) {
+                    uint32_t t = eccSize*8/m;
+                    if (t > MAX_ECC_STRENGTH || dataSize*8 + m*t >= (1u << m) - 1) break;
+                    if (layoutsForCandidate(pageSize, dataSize, eccSize).empty()) break;
+                    for (auto poly : polys) {
+                        candidates.push_back({m, poly, dataSize, eccSize});
+                    }
+                }
+            }
+        }
+    }
+    retassure(candidates.size(), "No ecc layouts fit pagesize %zu",pageSize);
+    info("Testing %zu candidate configurations with %u threads",candidates.size(),threadsCnt);
+
+    std::atomic<size_t> nextCandidate = 0;
+    std::atomic<bool> found = false;
+    std::mutex bestLck;
+    bool haveBest = false;
+    Score bestScore = {};
+    size_t bestCandidate = 0;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    for (uint32_t i=0; i<threadsCnt; i++) {
+        wthreads.push_back(std::thread([&](uint32_t tid){
+            try {
+                size_t cidx = 0;
+                while (!found && (cidx = nextCandidate++) < candidates.size()) {
+                    const Candidate &c = candidates[cidx];
+                    std::vector<Layout> layouts = layoutsForCandidate(pageSize, c.dataSize, c.eccSize);
+                    for (int swap = 0; swap < 2; swap++) {
+                        BCHDecoder decoder(c.poly, c.eccSize, swap);
+                        for (auto &l : layouts) {
+                            for (int invert = 0; invert < 2; invert++) {
+                                Score s = scoreLayout(decoder, l, invert, samples, c.m);
+                                if (s.tested < MIN_TESTED_CODEWORDS || s.decoded < s.tested * minShare) continue;
+                                std::unique_lock<std::mutex> ul(bestLck);
+                                if (!haveBest || isBetter(s, bestScore) || (!isBetter(bestScore, s) && cidx < bestCandidate)) {
+                                    haveBest = true;
+                                    bestScore = s;
+                                    bestCandidate = cidx;
+                                    out = {
+                                        .poly = c.poly,
+                                        .swapBits = (bool)swap,
+                                        .invert = (bool)invert,
+                                        .pageStructure = l.pageStructure,
+                                        .testedCodewords = s.tested,
+                                        .decodedCodewords = s.decoded,
+                                        .bitflips = s.bitflips,
+                                    };
+                                }
+                                /* let running candidates finish, but don't start new ones */
+                                found = true;
+                            }
+                        }
+                    }
+                }
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(bestLck);
+                if (!workerException) workerException = std::current_exception();
+                found = true;
+            }
+            debug("[%d] Stopping search thread",tid);
+        },i));
+    }
+
+    for (auto &t : wthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+    return haveBest;
+}
@@ -0,0 +1,38 @@
+//
+//  ECCSearch.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ECCSearch_hpp
+#define ECCSearch_hpp
+
+#include "ECCCorrection.hpp"
+#include "FileMapping.hpp"
+
+#include <stdint.h>
+
+namespace ECCSearch {
+struct BCHConfig{
+    uint32_t poly;
+    bool swapBits;
+    bool invert;
+    ECCCorrection::PageStructure pageStructure;
+
+    uint32_t testedCodewords;
+    uint32_t decodedCodewords;
+    uint32_t bitflips;
+};
+
+/*
+    Blindly searches BCH parameters and page layout of a raw dump.
+    A sample of programmed pages is decoded with every candidate primitive polynomial,
+    bit order, inversion and ecc size/position that fits the page size.
+    The search stops early once a configuration decodes at least minShare of the sampled codewords.
+    Returns true and fills out if a configuration was found.
+ */
+bool searchBCH(const FileMapping *inmap, size_t pageSize, BCHConfig &out, uint32_t threadsCnt = 0, uint32_t samplePagesCnt = 64, double minShare = 0.75);
+}
+
+#endif /* ECCSearch_hpp */
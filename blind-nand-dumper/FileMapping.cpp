@@ -6,9 +6,12 @@
 //
 
 #include "FileMapping.hpp"
+#include "DumpContainer.hpp"
 
 #include <libgeneral/macros.h>
 
+#include <algorithm>
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -16,46 +19,270 @@
 #include <errno.h>
 #include <string.h>
 
-FileMapping::FileMapping(const char *path, bool writeable, size_t fileSize)
-: _mem{NULL}, _memSize{0}, _writeable(writeable)
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define COPY_BUFFER_SIZE 0x100000
+
+#ifdef MAP_POPULATE
+#   define MAP_POPULATE_FLAG MAP_POPULATE
+#else
+#   define MAP_POPULATE_FLAG 0
+#endif
+
+static size_t osPageSize(){
+    static const size_t gPageSize = (size_t)sysconf(_SC_PAGESIZE);
+    return gPageSize;
+}
+
+static inline size_t alignDown(size_t v){
+    return v & ~(osPageSize()-1);
+}
+
+static inline size_t alignUp(size_t v){
+    return alignDown(v + osPageSize()-1);
+}
+
+#pragma mark FileMapping::Cursor
+FileMapping::Cursor::Cursor(const FileMapping *map)
+: _map(map), _runStart(0), _pos(0), _prefetched(0), _active(false)
+, _blockNum(0), _blockValid(false)
+{
+    //
+}
+
+FileMapping::Cursor::~Cursor(){
+    finish();
+}
+
+const uint8_t *FileMapping::Cursor::advance(size_t offset, size_t size){
+    if (!_map) return NULL;
+    if (const DumpContainer::Reader *container = _map->_container) {
+        /* workers walk consecutive pages, so every block is only unpacked once */
+        uint64_t blockNum = offset / container->blockSize();
+        size_t inBlock = offset % container->blockSize();
+        retassure(inBlock + size <= container->blockSize(), "Access at 0x%zx crosses a container block",offset);
+        if (!_blockValid || _blockNum != blockNum) {
+            _block.resize(container->blockSize());
+            _blockValid = false;
+            container->readBlock(blockNum, _block.data());
+            _blockNum = blockNum;
+            _blockValid = true;
+        }
+        return &_block[inBlock];
+    }
+    if (!_map->_window) return &_map->_mem[offset];
+    const size_t window = _map->_window;
+    const size_t half = window/2;
+
+    if (_active && (offset < _runStart || offset > _pos + half)) finish();
+    if (!_active) {
+        _runStart = _prefetched = alignDown(offset);
+        _pos = offset;
+        _active = true;
+    }
+    _pos = std::max(_pos, offset + size);
+
+    /* refill once less than half a window is left, so there is one madvise per half window instead of one per page */
+    if (_prefetched < std::min(_pos + half, _map->_memSize)) {
+        size_t from = std::max(_prefetched, alignDown(offset));
+        size_t to = std::min(alignUp(_pos + window), _map->_memSize);
+        _map->prefetch(from, to - from);
+        _prefetched = to;
+    }
+
+    size_t done = alignDown(offset);
+    if (done > _runStart + half) {
+        _map->release(_runStart, done - _runStart);
+        _runStart = done;
+    }
+    return &_map->_mem[offset];
+}
+
+void FileMapping::Cursor::finish(){
+    if (!_active) return;
+    size_t end = std::min(std::max(alignUp(_pos), _prefetched), _map->_memSize);
+    if (end > _runStart) _map->release(_runStart, end - _runStart);
+    _active = false;
+}
+
+#pragma mark FileMapping
+FileMapping::FileMapping(const char *path, bool writeable, size_t fileSize, uint32_t flags)
+: _mem{NULL}, _memSize{0}, _writeable(writeable), _fd(-1), _window(0), _container(NULL)
 {
     bool didInit = false;
-    int fd = -1;
     cleanup([&]{
-        safeClose(fd);
         if (!didInit){
             this->~FileMapping();
         }
     });
     struct stat st = {};
+    int mapFlags = (writeable) ? MAP_SHARED : MAP_PRIVATE;
     
     if (writeable) {
-        retassure((fd = open(path, O_RDWR | O_CREAT, 0644)), "Faile to open '%s' writeable",path);
+        retassure((_fd = open(path, O_RDWR | O_CREAT, 0644)) != -1, "Faile to open '%s' writeable",path);
     }else{
-        retassure((fd = open(path, O_RDONLY)), "Faile to open '%s' readonly",path);
+        retassure((_fd = open(path, O_RDONLY)) != -1, "Faile to open '%s' readonly",path);
     }
     
-    retassure(!fstat(fd, &st), "stat failed");
+    retassure(!fstat(_fd, &st), "stat failed");
     _memSize = st.st_size;
-    if (_memSize < fileSize) {
-        retassure(lseek(fd, fileSize, SEEK_SET) == fileSize,"Failed to seek in file");
-        retassure(write(fd, &_mem, 1) == 1, "Failed to write to file during file grow");
+    if (fileSize && _memSize != fileSize) {
+        retassure(writeable, "Can't resize readonly file '%s'",path);
+        retassure(!ftruncate(_fd, fileSize), "Failed to resize '%s' with err=%d (%s)",path,errno,strerror(errno));
     }
     if (fileSize) _memSize = fileSize;
+
+#ifdef MAP_POPULATE
+    /* huge pages need to be requested before faulting in */
+    if ((flags & kFlagPopulate) && !(flags & kFlagHugePages)) mapFlags |= MAP_POPULATE;
+#endif
     
     if (writeable) {
-        retassure((_mem = (uint8_t*)mmap(NULL, _memSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED, "Failed to map file writeable! errno=%d (%s)",errno,strerror(errno));
+        retassure((_mem = (uint8_t*)mmap(NULL, _memSize, PROT_READ | PROT_WRITE, mapFlags, _fd, 0)) != MAP_FAILED, "Failed to map file writeable! errno=%d (%s)",errno,strerror(errno));
     }else{
-        retassure((_mem = (uint8_t*)mmap(NULL, _memSize, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED, "Failed to map file readonly! errno=%d (%s)",errno,strerror(errno));
+        retassure((_mem = (uint8_t*)mmap(NULL, _memSize, PROT_READ, mapFlags, _fd, 0)) != MAP_FAILED, "Failed to map file readonly! errno=%d (%s)",errno,strerror(errno));
+    }
+
+    if (flags & kFlagHugePages) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(_mem, _memSize, MADV_HUGEPAGE)) {
+            warning("Failed to enable huge pages for '%s' with err=%d (%s)",path,errno,strerror(errno));
+        }
+#else
+        warning("Huge pages are not supported on this platform");
+#endif
+    }
+    if ((flags & kFlagPopulate) && !(mapFlags & MAP_POPULATE_FLAG)) {
+        /* populate for write would dirty every page of a writeable mapping, reading is enough */
+#ifdef MADV_POPULATE_READ
+        if (madvise(_mem, _memSize, MADV_POPULATE_READ))
+#endif
+        {
+            madvise(_mem, _memSize, MADV_WILLNEED);
+        }
+    }
+
+    if (!writeable && DumpContainer::isContainer(_mem, _memSize)) {
+        _container = new DumpContainer::Reader(_mem, _memSize);
+        debug("'%s' is a dump container of 0x%llx pages",path,(unsigned long long)_container->pagesCnt());
     }
     
     didInit = true;
 }
 
 FileMapping::~FileMapping(){
+    safeDelete(_container);
     if (_mem){
         munmap(_mem, _memSize); _mem = NULL; _memSize = 0;
     }
+    safeClose(_fd);
+}
+
+#pragma mark private
+void FileMapping::prefetch(size_t offset, size_t size) const{
+    madvise(&_mem[alignDown(offset)], alignUp(offset + size) - alignDown(offset), MADV_WILLNEED);
+}
+
+void FileMapping::release(size_t offset, size_t size) const{
+    size_t start = alignDown(offset);
+    size_t len = alignUp(offset + size) - start;
+#ifdef __linux__
+    /* kick off writeback now, dirty pages can't be dropped from the page cache */
+    if (_writeable) sync_file_range(_fd, start, len, SYNC_FILE_RANGE_WRITE);
+#endif
+    madvise(&_mem[start], len, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(_fd, start, len, POSIX_FADV_DONTNEED);
+#endif
 }
 
+#pragma mark public
+size_t FileMapping::memSize() const{
+    return (_container) ? (size_t)_container->rawSize() : _memSize;
+}
+
+void FileMapping::setWindow(size_t windowSize){
+    _window = (windowSize) ? std::max(alignUp(windowSize), 2*osPageSize()) : 0;
+}
+
+uint64_t FileMapping::physicalMemory(){
+    long pages = sysconf(_SC_PHYS_PAGES);
+    if (pages <= 0) return 0;
+    return (uint64_t)pages * osPageSize();
+}
+
+bool FileMapping::isSameFile(const char *pathA, const char *pathB){
+    struct stat stA = {};
+    struct stat stB = {};
+    if (stat(pathA, &stA) || stat(pathB, &stB)) return false;
+    return stA.st_dev == stB.st_dev && stA.st_ino == stB.st_ino;
+}
 
+void FileMapping::cloneFile(const char *srcPath, const char *dstPath){
+    int sfd = -1;
+    int dfd = -1;
+    uint8_t *buf = NULL;
+    cleanup([&]{
+        safeFree(buf);
+        safeClose(dfd);
+        safeClose(sfd);
+    });
+    struct stat st = {};
+    off_t copied = 0;
+
+    retassure((sfd = open(srcPath, O_RDONLY)) != -1, "Failed to open '%s' readonly with err=%d (%s)",srcPath,errno,strerror(errno));
+    retassure(!fstat(sfd, &st), "stat failed");
+    {
+        /* the destination is truncated before anything is copied, which would wipe the source */
+        struct stat dst = {};
+        retassure(stat(dstPath, &dst) || dst.st_dev != st.st_dev || dst.st_ino != st.st_ino, "'%s' and '%s' are the same file",srcPath,dstPath);
+    }
+
+#ifdef __APPLE__
+    unlink(dstPath);
+    if (!clonefile(srcPath, dstPath, 0)) {
+        debug("Cloned '%s' to '%s'",srcPath,dstPath);
+        return;
+    }
+#endif
+
+    retassure((dfd = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to open '%s' writeable with err=%d (%s)",dstPath,errno,strerror(errno));
+
+#ifdef __linux__
+    if (!ioctl(dfd, FICLONE, sfd)) {
+        debug("Cloned '%s' to '%s'",srcPath,dstPath);
+        return;
+    }
+    while (copied < st.st_size) {
+        ssize_t didCopy = copy_file_range(sfd, NULL, dfd, NULL, st.st_size - copied, 0);
+        if (didCopy <= 0) break;
+        copied += didCopy;
+    }
+    if (copied == st.st_size) {
+        debug("Copied '%s' to '%s' with copy_file_range",srcPath,dstPath);
+        return;
+    }
+#endif
+
+    retassure(buf = (uint8_t*)malloc(COPY_BUFFER_SIZE), "Failed to alloc copy buffer");
+    while (copied < st.st_size) {
+        ssize_t didRead = pread(sfd, buf, COPY_BUFFER_SIZE, copied);
+        if (didRead < 0 && errno == EINTR) continue;
+        retassure(didRead > 0, "Failed to read '%s' with err=%d (%s)",srcPath,errno,strerror(errno));
+        for (ssize_t done = 0; done < didRead;) {
+            ssize_t didWrite = pwrite(dfd, &buf[done], didRead - done, copied + done);
+            if (didWrite < 0 && errno == EINTR) continue;
+            retassure(didWrite > 0, "Failed to write '%s' with err=%d (%s)",dstPath,errno,strerror(errno));
+            done += didWrite;
+        }
+        copied += didRead;
+    }
+    debug("Copied '%s' to '%s'",srcPath,dstPath);
+}
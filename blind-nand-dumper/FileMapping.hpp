@@ -8,21 +8,114 @@
 #ifndef FileMapping_hpp
 #define FileMapping_hpp
 
+#include <vector>
+
 #include <stdint.h>
 #include <stdlib.h>
 
+namespace DumpContainer {
+class Reader;
+}
+
+/*
+    Maps a file into memory.
+    A readonly DumpContainer is detected automatically, mem() is NULL for it
+    and its pages can only be accessed through Cursors, which unpack one block at a time.
+ */
 class FileMapping {
+public:
+    enum Flags : uint32_t{
+        kFlagNone       = 0,
+        kFlagPopulate   = 1 << 0,   /* fault in the whole file while mapping, for inputs which comfortably fit in ram */
+        kFlagHugePages  = 1 << 1,   /* ask for transparent huge pages, best effort */
+    };
+
+    /*
+        Walks a mapping in windowed mode for one worker.
+        Data up to the window size ahead of the last access is prefetched,
+        data behind it is released again once half a window has been passed.
+        Jumping to a non consecutive offset (eg. a stolen range) releases the previous run.
+        Does nothing if the mapping has no window set.
+        For containers the cursor instead unpacks the block holding the accessed data.
+     */
+    class Cursor{
+        const FileMapping *_map;
+        size_t _runStart;   /* everything before was released */
+        size_t _pos;        /* end of the last access */
+        size_t _prefetched; /* end of the prefetched area */
+        bool _active;
+        std::vector<uint8_t> _block;    /* unpacked container block */
+        uint64_t _blockNum;
+        bool _blockValid;
+    public:
+        Cursor(const FileMapping *map);
+        Cursor(const Cursor &) = delete;
+        Cursor &operator=(const Cursor &) = delete;
+        ~Cursor();
+
+        /*
+            The worker is about to access [offset, offset+size)
+
+            return - pointer to the data, valid until the next advance. NULL if the cursor has no mapping
+         */
+        const uint8_t *advance(size_t offset, size_t size);
+
+        /*
+            Releases the current run
+         */
+        void finish();
+    };
+
+private:
     uint8_t *_mem;
     size_t _memSize;
     bool _writeable;
+    int _fd;
+    size_t _window;
+    DumpContainer::Reader *_container;
+
+    void prefetch(size_t offset, size_t size) const;
+    void release(size_t offset, size_t size) const;
 public:
-    FileMapping(const char *path, bool writeable = false, size_t fileSize = 0);
+    /*
+        fileSize - if set, the (writeable) file is resized to exactly this size
+        flags    - Flags
+     */
+    FileMapping(const char *path, bool writeable = false, size_t fileSize = 0, uint32_t flags = kFlagNone);
     ~FileMapping();
     
     inline bool isWriteable() const{return _writeable;}
-    inline const uint8_t *mem() const{return _mem;}
-    inline uint8_t *mem(){return _mem;}
-    inline size_t memSize() const{return _memSize;}
+    inline const uint8_t *mem() const{return (_container) ? NULL : _mem;}
+    inline uint8_t *mem(){return (_container) ? NULL : _mem;}
+    /*
+        Size of the raw data, for containers this is the unpacked size
+     */
+    size_t memSize() const;
+    inline const DumpContainer::Reader *container() const{return _container;}
+
+    /*
+        Enables windowed access through Cursors, 0 disables it.
+        Every cursor keeps about 1.5 windows resident, the rest of the file stays out of ram.
+     */
+    void setWindow(size_t windowSize);
+    inline size_t window() const{return _window;}
+
+    /*
+        Creates dstPath as a copy of srcPath, fails if both are the same file.
+        Uses a copy-on-write clone if the filesystem supports it, copy_file_range or a plain copy otherwise.
+     */
+    static void cloneFile(const char *srcPath, const char *dstPath);
+
+    /*
+        Returns true if both paths lead to the same file (also through hardlinks or symlinks),
+        false if either of them does not exist
+     */
+    static bool isSameFile(const char *pathA, const char *pathB);
+
+    /*
+        Physical memory of this machine, 0 if unknown
+     */
+    static uint64_t physicalMemory();
 };
 
 #endif /* FileMapping_hpp */
@@ -0,0 +1,169 @@
+//
+//  HammingECC.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "HammingECC.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <string.h>
+#include <strings.h>
+
+#define HAMMING_ECC_SIZE 3
+
+namespace {
+class HammingDecoder : public ECCEngine::Decoder {
+    const HammingEngine *_engine;
+public:
+    HammingDecoder(const HammingEngine *engine) : _engine(engine) {}
+
+    virtual void decode(ECCEngine::Codeword *cws, size_t cnt) override{
+        for (size_t i = 0; i < cnt; i++) {
+            cws[i].bitflips = _engine->correct(cws[i].data, cws[i].dataSize, cws[i].ecc);
+        }
+    }
+};
+}
+
+static inline int parity64(uint64_t v){
+    return __builtin_parityll(v);
+}
+
+/*
+    Only bits 1,3,5,7 carry address information, those are the odd halves of the parity pairs
+ */
+static inline uint32_t addressbits(uint8_t v){
+    return ((v >> 1) & 1) | ((v >> 2) & 2) | ((v >> 3) & 4) | ((v >> 4) & 8);
+}
+
+/*
+    Instead of folding every byte into the parities, 64 bit words are xored together:
+    the parity of all bytes whose address has bit k set is the parity of the xor of those bytes.
+    Address bits 0-2 select bytes within a word, the higher ones select words.
+ */
+static void calculate(const uint8_t *data, size_t dataSize, bool smOrder, uint8_t code[HAMMING_ECC_SIZE]){
+    static const uint64_t byteMasks[3] = {
+        0xFF00FF00FF00FF00ULL,
+        0xFFFF0000FFFF0000ULL,
+        0xFFFFFFFF00000000ULL,
+    };
+    const uint32_t wordsCnt = (uint32_t)(dataSize / 8);
+    const uint32_t addrBits = (dataSize == 512) ? 9 : 8;
+    uint64_t total = 0;
+    uint64_t acc[6] = {};
+    uint32_t rp = 0; //bit 2k is rp(2k), bit 2k+1 is rp(2k+1)
+
+    for (uint32_t w = 0; w < wordsCnt; w++) {
+        uint64_t v;
+        memcpy(&v, &data[w*8], sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        total ^= v;
+        for (uint32_t k = 0; k < addrBits - 3; k++) {
+            acc[k] ^= v & -(uint64_t)((w >> k) & 1);
+        }
+    }
+
+    const int totalParity = parity64(total);
+    for (uint32_t k = 0; k < addrBits; k++) {
+        int odd = (k < 3) ? parity64(total & byteMasks[k]) : parity64(acc[k-3]);
+        int even = totalParity ^ odd;
+        rp |= (even << (2*k)) | (odd << (2*k+1));
+    }
+
+    uint8_t par = 0;
+    for (int i = 0; i < 8; i++) {
+        par ^= (uint8_t)(total >> (i*8));
+    }
+    uint8_t cp = (__builtin_parity(par & 0x55) << 0) | (__builtin_parity(par & 0xaa) << 1)
+               | (__builtin_parity(par & 0x33) << 2) | (__builtin_parity(par & 0xcc) << 3)
+               | (__builtin_parity(par & 0x0f) << 4) | (__builtin_parity(par & 0xf0) << 5);
+
+    uint8_t lo = (uint8_t)~rp;          //rp0-rp7
+    uint8_t hi = (uint8_t)~(rp >> 8);   //rp8-rp15
+    code[0] = smOrder ? lo : hi;
+    code[1] = smOrder ? hi : lo;
+    code[2] = (uint8_t)(~cp << 2);
+    if (addrBits == 9) {
+        code[2] |= (uint8_t)(~(rp >> 16) & 3);
+    }else{
+        code[2] |= 3;
+    }
+}
+
+#pragma mark HammingEngine
+HammingEngine::HammingEngine(bool smOrder)
+: _smOrder(smOrder)
+{
+    //
+}
+
+std::unique_ptr<ECCEngine> HammingEngine::create(const std::vector<std::string> &params){
+    bool smOrder = false;
+    for (auto &arg : params) {
+        if (strcasecmp(arg.c_str(), "sm") == 0) {
+            smOrder = true;
+        }else{
+            reterror("unexpected Hamming arg '%s'",arg.c_str());
+        }
+    }
+    return std::make_unique<HammingEngine>(smOrder);
+}
+
+#pragma mark protected
+std::unique_ptr<ECCEngine::Decoder> HammingEngine::makeDecoder() const{
+    return std::make_unique<HammingDecoder>(this);
+}
+
+#pragma mark public
+std::string HammingEngine::description() const{
+    return _smOrder ? "Hamming (SmartMedia order)" : "Hamming";
+}
+
+void HammingEngine::checkGeometry(size_t dataSize, size_t eccSize) const{
+    retassure(dataSize == 256 || dataSize == 512, "Hamming codewords need 256 or 512 data bytes, got %zu",dataSize);
+    retassure(eccSize == HAMMING_ECC_SIZE, "Hamming codewords need %d ecc bytes, got %zu",HAMMING_ECC_SIZE,eccSize);
+}
+
+uint32_t HammingEngine::strength(size_t) const{
+    return 1;
+}
+
+void HammingEngine::encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const{
+    checkGeometry(dataSize, eccSize);
+    calculate(data, dataSize, _smOrder, ecc);
+}
+
+int HammingEngine::correct(uint8_t *data, size_t dataSize, uint8_t *ecc) const{
+    uint8_t calc[HAMMING_ECC_SIZE];
+    calculate(data, dataSize, _smOrder, calc);
+
+    /* b0 holds rp0-rp7, b1 rp8-rp15 */
+    uint8_t b0 = _smOrder ? ecc[0] ^ calc[0] : ecc[1] ^ calc[1];
+    uint8_t b1 = _smOrder ? ecc[1] ^ calc[1] : ecc[0] ^ calc[0];
+    uint8_t b2 = ecc[2] ^ calc[2];
+    if ((b0 | b1 | b2) == 0) return 0;
+
+    /* a single bitflip in the data flips exactly one parity of every pair */
+    const bool large = (dataSize == 512);
+    if ((((b0 ^ (b0 >> 1)) & 0x55) == 0x55)
+        && (((b1 ^ (b1 >> 1)) & 0x55) == 0x55)
+        && (((b2 ^ (b2 >> 1)) & (large ? 0x55 : 0x54)) == (large ? 0x55 : 0x54))) {
+        uint32_t byteAddr = (addressbits(b1) << 4) | addressbits(b0);
+        if (large) byteAddr |= addressbits(b2 & 3) << 8;
+        uint32_t bitAddr = addressbits(b2 >> 2);
+        data[byteAddr] ^= (1 << bitAddr);
+        return 1;
+    }
+
+    /* a single bitflip in the ecc itself */
+    if (__builtin_popcount(b0) + __builtin_popcount(b1) + __builtin_popcount(b2) == 1) {
+        memcpy(ecc, calc, sizeof(calc));
+        return 1;
+    }
+    return -1;
+}
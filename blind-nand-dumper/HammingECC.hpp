@@ -0,0 +1,44 @@
+//
+//  HammingECC.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef HammingECC_hpp
+#define HammingECC_hpp
+
+#include "ECCEngine.hpp"
+
+/*
+    The 1-bit Hamming code of SLC NAND controllers (and the Linux software ecc),
+    3 ecc bytes for every 256 or 512 data bytes, single bitflips are corrected.
+    The line parities are stored in the first two bytes, rp8-rp15 first unless smOrder is set
+    (SmartMedia order), the column parities in the upper six bits of the third byte. All parities are stored inverted.
+ */
+class HammingEngine : public ECCEngine {
+    bool _smOrder;
+
+protected:
+    virtual std::unique_ptr<Decoder> makeDecoder() const override;
+public:
+    HammingEngine(bool smOrder = false);
+
+    /*
+        [sm]
+     */
+    static std::unique_ptr<ECCEngine> create(const std::vector<std::string> &params);
+
+    virtual std::string description() const override;
+    virtual void checkGeometry(size_t dataSize, size_t eccSize) const override;
+    virtual uint32_t strength(size_t eccSize) const override;
+    virtual void encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const override;
+
+    /*
+        Corrects a single codeword, data is 256 or 512 bytes, ecc is 3 bytes.
+        return - corrected bits or -1 if uncorrectable
+     */
+    int correct(uint8_t *data, size_t dataSize, uint8_t *ecc) const;
+};
+
+#endif /* HammingECC_hpp */
@@ -0,0 +1,320 @@
+//
+//  LayoutDetect.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "LayoutDetect.hpp"
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <math.h>
+#include <string.h>
+
+using namespace ECCCorrection;
+
+#define MIN_PROGRAMMED_PAGES        64
+#define MIN_ECC_RUN                 3
+#define MIN_INTERLEAVED_GAP         128
+#define MAX_ECC_BIT_BIAS            0.1
+#define CONST_BIT_BIAS              0.45
+#define UNUSED_FF_SHARE             0.9
+#define MIN_ERASED_PAGES            16
+#define ERASED_FF_SHARE             0.9
+
+namespace {
+enum ColumnClass{
+    kColumnClassData = 0,
+    kColumnClassECC,
+    kColumnClassUnused,
+    kColumnClassService,
+};
+
+struct ColumnRun{
+    size_t start;
+    size_t end;
+};
+}
+
+/*
+    Spare bytes which don't belong to a codeword
+ */
+static inline bool isSpareColumn(ColumnClass c){
+    return c == kColumnClassUnused || c == kColumnClassService;
+}
+
+static bool isErasedPage(const uint8_t *page, size_t pageSize){
+    size_t ffCnt = 0;
+    for (size_t i = 0; i < pageSize; i++) {
+        ffCnt += (page[i] == 0xFF);
+    }
+    return ffCnt >= pageSize - pageSize/8;
+}
+
+static bool isUniformPage(const uint8_t *page, size_t pageSize){
+    for (size_t i = 1; i < pageSize; i++) {
+        if (page[i] != page[0]) return false;
+    }
+    return true;
+}
+
+LayoutDetect::PageStats LayoutDetect::collectPageStats(const FileMapping *inmap, size_t pageSize, uint32_t threadsCnt){
+    PageStats ret = {};
+    const uint8_t *mem = inmap->mem();
+    uint64_t pagesCnt = 0;
+
+    retassure(pageSize, "Pagesize not set!");
+    retassure(mem, "Layout detection does not support dump containers");
+    pagesCnt = inmap->memSize() / pageSize;
+    retassure(pagesCnt, "Input is smaller than a single page");
+    if (!threadsCnt) threadsCnt = PageScheduler::defaultWorkersCnt();
+
+    /*
+        Every byte of a page hits a different column histogram, so there are no update conflicts
+        within a page. 16bit counters keep the per thread histograms cache resident,
+        they are flushed into the shared totals before they can overflow.
+     */
+    std::vector<uint64_t> hist(pageSize*256);
+    std::vector<uint64_t> erasedFF(pageSize);
+    std::mutex totalsLck;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> wthreads;
+
+    PageScheduler scheduler(threadsCnt);
+    scheduler.addSection(0, 0, pagesCnt);
+    scheduler.distribute();
+
+    for (uint32_t i=0; i<threadsCnt; i++) {
+        wthreads.push_back(std::thread([&](uint32_t tid){
+            try {
+                std::vector<uint16_t> lhist(pageSize*256);
+                std::vector<uint32_t> lerasedFF(pageSize);
+                uint32_t histPages = 0;
+                uint64_t programmedPages = 0;
+                uint64_t erasedPages = 0;
+
+                auto flush = [&]{
+                    std::unique_lock<std::mutex> ul(totalsLck);
+                    for (size_t j = 0; j < lhist.size(); j++) hist[j] += lhist[j];
+                    for (size_t j = 0; j < pageSize; j++) erasedFF[j] += lerasedFF[j];
+                    std::fill(lhist.begin(), lhist.end(), 0);
+                    std::fill(lerasedFF.begin(), lerasedFF.end(), 0);
+                    histPages = 0;
+                };
+
+                PageScheduler::Range r = {};
+                while (scheduler.next(tid, r)) {
+                    for (uint64_t p = r.begin; p < r.end; p++) {
+                        const uint8_t *page = &mem[p*pageSize];
+                        if (isErasedPage(page, pageSize)) {
+                            for (size_t c = 0; c < pageSize; c++) lerasedFF[c] += (page[c] == 0xFF);
+                            erasedPages++;
+                        }else if (!isUniformPage(page, pageSize)) {
+                            uint16_t *h = lhist.data();
+                            size_t c = 0;
+                            for (; c + 4 <= pageSize; c += 4, h += 4*256) {
+                                h[0*256 + page[c+0]]++;
+                                h[1*256 + page[c+1]]++;
+                                h[2*256 + page[c+2]]++;
+                                h[3*256 + page[c+3]]++;
+                            }
+                            for (; c < pageSize; c++, h += 256) {
+                                h[page[c]]++;
+                            }
+                            programmedPages++;
+                        }
+                        if (++histPages == 0xFFFF) flush();
+                    }
+                }
+                flush();
+                std::unique_lock<std::mutex> ul(totalsLck);
+                ret.programmedPages += programmedPages;
+                ret.erasedPages += erasedPages;
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(totalsLck);
+                if (!workerException) workerException = std::current_exception();
+            }
+        },i));
+    }
+    for (auto &t : wthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+
+    for (size_t c = 0; c < pageSize; c++) {
+        const uint64_t *h = &hist[c*256];
+        ColumnStats cs = {};
+        if (ret.programmedPages) {
+            double n = (double)ret.programmedPages;
+            uint64_t ones[8] = {};
+            for (int v = 0; v < 256; v++) {
+                if (!h[v]) continue;
+                double prob = h[v] / n;
+                cs.entropy -= prob * log2(prob);
+                for (int b = 0; b < 8; b++) {
+                    if (v & (1 << b)) ones[b] += h[v];
+                }
+            }
+            for (int b = 0; b < 8; b++) {
+                double bias = fabs(ones[b] / n - 0.5);
+                cs.maxBitBias = std::max(cs.maxBitBias, bias);
+                if (bias <= MAX_ECC_BIT_BIAS) cs.randomBits |= 1 << b;
+                if (bias >= CONST_BIT_BIAS) cs.constBits |= 1 << b;
+            }
+            cs.ffProgrammed = h[0xFF] / n;
+        }
+        if (ret.erasedPages) {
+            cs.ffErased = erasedFF[c] / (double)ret.erasedPages;
+        }
+        ret.columns.push_back(cs);
+    }
+    return ret;
+}
+
+#pragma mark classification
+static std::vector<ColumnClass> classifyColumns(const LayoutDetect::PageStats &stats){
+    std::vector<ColumnClass> ret;
+    /* the entropy estimate is capped by the number of samples */
+    double eccEntropy = 0.9 * log2((double)std::min<uint64_t>(stats.programmedPages, 256));
+
+    for (auto &cs : stats.columns) {
+        if (cs.entropy >= eccEntropy && cs.maxBitBias <= MAX_ECC_BIT_BIAS) {
+            ret.push_back(kColumnClassECC);
+        }else if (stats.erasedPages >= MIN_ERASED_PAGES && cs.ffErased < ERASED_FF_SHARE) {
+            /* erased pages have all their data bytes 0xFF, whatever is written there is metadata (markers, counters) */
+            ret.push_back(kColumnClassService);
+        }else if (cs.ffProgrammed >= UNUSED_FF_SHARE) {
+            ret.push_back(kColumnClassUnused);
+        }else{
+            ret.push_back(kColumnClassData);
+        }
+    }
+    return ret;
+}
+
+static std::vector<ColumnRun> findECCRuns(const LayoutDetect::PageStats &stats, const std::vector<ColumnClass> &classes){
+    std::vector<ColumnRun> ret;
+    for (size_t c = 0; c < classes.size(); c++) {
+        if (classes[c] != kColumnClassECC) continue;
+        size_t start = c;
+        while (c < classes.size() && classes[c] == kColumnClassECC) c++;
+        if (c < classes.size()) {
+            /*
+                ecc bits which don't fill the last byte leave the low (or high when bit swapped) bits constant,
+                take such a byte if the remaining bits are uniformly random.
+             */
+            const LayoutDetect::ColumnStats &cs = stats.columns[c];
+            uint8_t rb = cs.randomBits;
+            bool isMask = rb && (((uint8_t)(rb | (rb - 1)) == 0xFF) || ((rb & (rb + 1)) == 0));
+            double needEntropy = 0.9 * std::min<double>(__builtin_popcount(rb), log2((double)std::min<uint64_t>(stats.programmedPages, 256)));
+            if (isMask && (rb | cs.constBits) == 0xFF && cs.entropy >= needEntropy) c++;
+        }
+        if (c - start >= MIN_ECC_RUN) ret.push_back({start, c});
+        c--;
+    }
+    return ret;
+}
+
+ECCCorrection::PageStructure LayoutDetect::inferPageStructure(const PageStats &stats){
+    PageStructure ret;
+    const size_t pageSize = stats.columns.size();
+    retassure(stats.programmedPages >= MIN_PROGRAMMED_PAGES, "Need at least %d programmed pages, got %llu",MIN_PROGRAMMED_PAGES,(unsigned long long)stats.programmedPages);
+
+    std::vector<ColumnClass> classes = classifyColumns(stats);
+    std::vector<ColumnRun> eccRuns = findECCRuns(stats, classes);
+    size_t eccColumns = 0;
+    for (auto &r : eccRuns) eccColumns += r.end - r.start;
+    retassure(eccRuns.size(), "Failed to find ecc columns");
+    retassure(eccColumns*2 < pageSize, "Data area looks random, can't tell data and ecc apart (try --ecc-search)");
+
+    bool interleaved = eccRuns.size() > 1;
+    for (size_t i = 1; i < eccRuns.size(); i++) {
+        if (eccRuns[i].start - eccRuns[i-1].end < MIN_INTERLEAVED_GAP) interleaved = false;
+    }
+
+    if (interleaved) {
+        /* data [service] ecc per codeword, service after an ecc run belongs to nobody */
+        uint32_t cwCnt = (uint32_t)eccRuns.size();
+        uint32_t unprotTag = cwCnt + 1;
+        size_t pos = 0;
+        for (uint32_t i = 0; i < cwCnt; i++) {
+            const ColumnRun &r = eccRuns[i];
+            size_t dataStart = pos;
+            while (dataStart < r.start && isSpareColumn(classes[dataStart])) dataStart++;
+            if (dataStart > pos) {
+                ret.push_back({unprotTag++, (uint32_t)(dataStart - pos), kPageCodewordTypeServiceArea});
+            }
+            size_t dataEnd = r.start;
+            while (dataEnd > dataStart && isSpareColumn(classes[dataEnd-1])) dataEnd--;
+            retassure(dataEnd > dataStart, "Failed to find data in front of ecc at column %zu",r.start);
+            ret.push_back({i+1, (uint32_t)(dataEnd - dataStart), kPageCodewordTypeData});
+            if (r.start > dataEnd) {
+                ret.push_back({i+1, (uint32_t)(r.start - dataEnd), kPageCodewordTypeServiceArea});
+            }
+            ret.push_back({i+1, (uint32_t)(r.end - r.start), kPageCodewordTypeECC});
+            pos = r.end;
+        }
+        if (pos < pageSize) {
+            ret.push_back({unprotTag, (uint32_t)(pageSize - pos), kPageCodewordTypeServiceArea});
+        }
+    }else{
+        /* main area followed by all ecc in one block, split it evenly between codewords */
+        size_t eccStart = eccRuns.front().start;
+        size_t eccEnd = eccRuns.back().end;
+        size_t eccLen = eccEnd - eccStart;
+        size_t mainSize = 1;
+        while (mainSize*2 <= eccStart) mainSize *= 2;
+        retassure(eccStart >= 512, "ecc block at column %zu leaves no room for data",eccStart);
+
+        uint32_t cwCnt = 1;
+        for (size_t cwSize = 512; cwSize <= mainSize; cwSize *= 2) {
+            uint32_t cnt = (uint32_t)(mainSize / cwSize);
+            if (eccLen % cnt == 0 && eccLen / cnt >= MIN_ECC_RUN) {
+                cwCnt = cnt;
+                break;
+            }
+        }
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            ret.push_back({i, (uint32_t)(mainSize / cwCnt), kPageCodewordTypeData});
+        }
+        if (eccStart > mainSize) {
+            ret.push_back({cwCnt + 1, (uint32_t)(eccStart - mainSize), kPageCodewordTypeServiceArea});
+        }
+        for (uint32_t i = 1; i <= cwCnt; i++) {
+            ret.push_back({i, (uint32_t)(eccLen / cwCnt), kPageCodewordTypeECC});
+        }
+        if (eccEnd < pageSize) {
+            ret.push_back({cwCnt + 2, (uint32_t)(pageSize - eccEnd), kPageCodewordTypeServiceArea});
+        }
+    }
+    return ret;
+}
+
+void LayoutDetect::printColumnMap(const PageStats &stats){
+    static const char *classNames[] = {"data", "ecc", "unused", "spare"};
+    std::vector<ColumnClass> classes = classifyColumns(stats);
+
+    info("Programmed pages: %llu erased pages: %llu",(unsigned long long)stats.programmedPages,(unsigned long long)stats.erasedPages);
+    for (size_t c = 0; c < classes.size();) {
+        size_t start = c;
+        double entropy = 0;
+        double ffProgrammed = 0;
+        double ffErased = 0;
+        while (c < classes.size() && classes[c] == classes[start]) {
+            entropy += stats.columns[c].entropy;
+            ffProgrammed += stats.columns[c].ffProgrammed;
+            ffErased += stats.columns[c].ffErased;
+            c++;
+        }
+        size_t len = c - start;
+        info("0x%04zx-0x%04zx %5zu bytes %-6s entropy %4.2f 0xFF programmed %5.1f%% erased %5.1f%%",
+             start, c, len, classNames[classes[start]], entropy/len, ffProgrammed/len*100, ffErased/len*100);
+    }
+}
@@ -0,0 +1,53 @@
+//
+//  LayoutDetect.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef LayoutDetect_hpp
+#define LayoutDetect_hpp
+
+#include "ECCCorrection.hpp"
+#include "FileMapping.hpp"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace LayoutDetect {
+struct ColumnStats{
+    double entropy;         /* shannon entropy in bits over programmed pages (0..8) */
+    double maxBitBias;      /* max distance of any bit's ones share from 0.5 over programmed pages */
+    uint8_t randomBits;     /* bits which are set in about half of the programmed pages */
+    uint8_t constBits;      /* bits which (almost) never change over programmed pages */
+    double ffProgrammed;    /* share of programmed pages where the column is 0xFF */
+    double ffErased;        /* share of erased pages where the column is 0xFF */
+};
+
+struct PageStats{
+    std::vector<ColumnStats> columns;
+    uint64_t programmedPages;
+    uint64_t erasedPages;
+};
+
+/*
+    Collects per byte column statistics over all pages of the dump.
+    threadsCnt - number of worker threads, 0 = one per cpu core
+ */
+PageStats collectPageStats(const FileMapping *inmap, size_t pageSize, uint32_t threadsCnt = 0);
+
+/*
+    Guesses the page structure from column statistics.
+    High entropy columns without bit bias are taken as ecc, the regions in front of them as the protected data.
+    Columns which are (almost) always 0xFF, or which are not 0xFF on erased pages, are spare bytes outside of the data.
+ */
+ECCCorrection::PageStructure inferPageStructure(const PageStats &stats);
+
+/*
+    Prints the detected column regions
+ */
+void printColumnMap(const PageStats &stats);
+}
+
+#endif /* LayoutDetect_hpp */
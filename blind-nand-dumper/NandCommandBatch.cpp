@@ -0,0 +1,97 @@
+//
+//  NandCommandBatch.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "NandCommandBatch.hpp"
+#include "PNR-proto.h"
+
+#include <libgeneral/macros.h>
+
+#include <libusb.h>
+
+#include <algorithm>
+
+#include <string.h>
+
+#define USB_MAX_TRANSFER_SIZE 0x1000
+
+#ifndef MIN
+#define MIN(a, b) ((b)>(a)?(a):(b))
+#endif
+
+#pragma mark NandCommandBatch
+NandCommandBatch::NandCommandBatch(size_t reserveBytes, size_t reserveSteps)
+: _used(0)
+{
+    _buf.resize(reserveBytes);
+    _steps.reserve(reserveSteps);
+}
+
+#pragma mark private
+uint8_t *NandCommandBatch::addStep(size_t payloadSize, uint8_t *rsp, size_t rspSize){
+    size_t length = LIBUSB_CONTROL_SETUP_SIZE + payloadSize;
+    /* keep every transfer buffer aligned */
+    size_t offset = (_used + 7) & ~(size_t)7;
+    if (offset + length > _buf.size()) {
+        _buf.resize(std::max(_buf.size()*2, offset + length));
+    }
+    _used = offset + length;
+    _steps.push_back({
+        .offset = offset,
+        .length = length,
+        .rsp = rsp,
+        .rspSize = rspSize,
+    });
+    return &_buf[offset];
+}
+
+#pragma mark public
+void NandCommandBatch::clear(){
+    _steps.clear();
+    _used = 0;
+}
+
+void NandCommandBatch::addCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp_, size_t rspSize, bool isMultiCommand){
+    uint8_t *rsp = (uint8_t*)rsp_;
+    uint16_t len = 0;
+
+    cmdLen &= 0xffff;
+    addrLen &= 0xffff;
+    dataLen &= 0xffff;
+    size_t payloadSize = 1 + 2 + cmdLen + 2 + addrLen + 2 + dataLen;
+    retassure(payloadSize <= 0xffff, "NAND command too large");
+    retassure(rspSize <= 0xffff, "NAND command response too large");
+
+    uint8_t *buf = addStep(payloadSize, NULL, 0);
+    libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandChipCommandSend, (uint16_t)rspSize, isMultiCommand, (uint16_t)payloadSize);
+    uint8_t *p = buf + LIBUSB_CONTROL_SETUP_SIZE;
+    *p++ = CE;
+    len = (uint16_t)cmdLen; memcpy(p, &len, 2); p += 2;
+    if (cmdLen) memcpy(p, cmd, cmdLen);
+    p += cmdLen;
+    len = (uint16_t)addrLen; memcpy(p, &len, 2); p += 2;
+    if (addrLen) memcpy(p, addr, addrLen);
+    p += addrLen;
+    len = (uint16_t)dataLen; memcpy(p, &len, 2); p += 2;
+    if (dataLen) memcpy(p, data, dataLen);
+
+    while (rspSize) {
+        size_t actualSize = MIN(rspSize,USB_MAX_TRANSFER_SIZE);
+        buf = addStep(actualSize, rsp, actualSize);
+        libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandChipCommandReceive, 0, 0, (uint16_t)actualSize);
+        rspSize -= actualSize;
+        rsp += actualSize;
+    }
+}
+
+void NandCommandBatch::addPageRead(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, void *out, uint16_t column){
+    uint64_t addr = ((uint64_t)pageAddress << 16) | column;
+    uint8_t cmd1 = 0x00;
+    uint8_t cmd2 = 0x30;
+
+    addCommand(CE, &cmd1, sizeof(cmd1), &addr, 5, NULL, 0, NULL, 0, true);
+    addCommand(CE, &cmd2, sizeof(cmd2), NULL, 0, NULL, 0, out, pageSize);
+}
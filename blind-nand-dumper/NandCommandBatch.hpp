@@ -0,0 +1,57 @@
+//
+//  NandCommandBatch.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef NandCommandBatch_hpp
+#define NandCommandBatch_hpp
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Records a sequence of NAND commands as ready to submit USB control transfers in one buffer.
+    Every command becomes one ChipCommandSend transfer followed by ChipCommandReceive transfers for its response,
+    responses are scattered into the caller's buffers once the batch was executed by NandReader::executeBatch.
+    clear() keeps all buffers, so a batch which is reused does not allocate anymore.
+ */
+class NandCommandBatch {
+public:
+    struct Step{
+        size_t offset;      /* setup packet + payload of the control transfer in the buffer */
+        size_t length;
+        uint8_t *rsp;       /* NULL for OUT transfers */
+        size_t rspSize;
+    };
+private:
+    std::vector<uint8_t> _buf;
+    std::vector<Step> _steps;
+    size_t _used;
+
+    uint8_t *addStep(size_t payloadSize, uint8_t *rsp, size_t rspSize);
+public:
+    NandCommandBatch(size_t reserveBytes = 0x10000, size_t reserveSteps = 64);
+
+    void clear();
+
+    /*
+        Same semantics as NandReader::sendNandCommand.
+        rsp must stay valid until the batch was executed.
+     */
+    void addCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp, size_t rspSize, bool isMultiCommand = false);
+
+    /*
+        Reads pageSize bytes of a page starting at column with the READ (0x00 0x30) command pair
+     */
+    void addPageRead(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, void *out, uint16_t column = 0);
+
+    inline size_t stepsCnt() const{return _steps.size();}
+    inline const Step &step(size_t i) const{return _steps[i];}
+    inline uint8_t *stepBuffer(size_t i){return &_buf[_steps[i].offset];}
+};
+
+#endif /* NandCommandBatch_hpp */
@@ -0,0 +1,71 @@
+//
+//  NandReader.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "NandReader.hpp"
+
+#include <libgeneral/macros.h>
+
+#define DUMP_PACKET_SIZE            64
+#define DEFAULT_TRANSFERS_CNT       8
+#define DEFAULT_TRANSFER_SIZE       0x4000
+
+#pragma mark NandReader
+NandReader::NandReader()
+: _chipProto{kChipProtocolUndefined}
+, _transfersCnt(DEFAULT_TRANSFERS_CNT), _transferSize(DEFAULT_TRANSFER_SIZE)
+, _lastDumpStats{}
+{
+    //
+}
+
+NandReader::~NandReader(){
+    //
+}
+
+#pragma mark public
+void NandReader::setTransferConfig(uint32_t transfersCnt, uint32_t transferSize){
+    if (transfersCnt) _transfersCnt = transfersCnt;
+    if (transferSize) {
+        retassure((transferSize % DUMP_PACKET_SIZE) == 0, "Transfer size must be a multiple of %d",DUMP_PACKET_SIZE);
+        _transferSize = transferSize;
+    }
+}
+
+#pragma mark NAND commands
+void NandReader::sendNandCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp, size_t rspSize, bool isMultiCommand){
+    _cmdBatch.clear();
+    _cmdBatch.addCommand(CE, cmd, cmdLen, addr, addrLen, data, dataLen, rsp, rspSize, isMultiCommand);
+    executeBatch(_cmdBatch);
+}
+
+uint64_t NandReader::readChipIDForCE(uint8_t CE){
+    uint64_t ret = 0;
+    
+    uint8_t cmd = 0x90;
+    uint8_t addr = 0x00;
+    
+    sendNandCommand(CE, &cmd, sizeof(cmd), &addr, sizeof(addr), NULL, 0, &ret, sizeof(ret));
+    return ret;
+}
+
+tihmstar::Mem NandReader::readPage(uint8_t CE, uint32_t pageAddress, uint16_t pageSize){
+    tihmstar::Mem ret;
+
+    ret.resize(pageSize);
+    readPages(CE, &pageAddress, 1, pageSize, ret.data());
+    return ret;
+}
+
+void NandReader::readPages(uint8_t CE, const uint32_t *pageAddresses, size_t pagesCnt, uint16_t pageSize, void *out_, uint16_t column){
+    uint8_t *out = (uint8_t*)out_;
+
+    _cmdBatch.clear();
+    for (size_t i = 0; i < pagesCnt; i++) {
+        _cmdBatch.addPageRead(CE, pageAddresses[i], pageSize, &out[i*pageSize], column);
+    }
+    executeBatch(_cmdBatch);
+}
@@ -0,0 +1,98 @@
+//
+//  NandReader.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef NandReader_hpp
+#define NandReader_hpp
+
+#include "PNR-proto.h"
+#include "NandCommandBatch.hpp"
+
+#include <libgeneral/Mem.hpp>
+
+#include <functional>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Interface of a NAND reader backend.
+    Backends implement the transport (executeBatch, dumpPages), NAND commands are built on top of executeBatch.
+ */
+class NandReader {
+public:
+    /*
+        chunk   - current data chunk read from device
+        bufSize - current chunk size
+        userArg - custom user arg
+     
+        return - true=continue dumping, false=stop dumping
+     */
+    using f_dumpCB = std::function<bool(const void *chunk, size_t chunkSize, void *userArg)>;
+
+    struct TransferStats{
+        uint64_t transfers;
+        uint64_t bytes;
+        double seconds;
+        double minLatencyUs;
+        double maxLatencyUs;
+        double avgLatencyUs;
+    };
+protected:
+    t_ChipProtocol _chipProto;
+    uint32_t _transfersCnt;
+    uint32_t _transferSize;
+    TransferStats _lastDumpStats;
+    NandCommandBatch _cmdBatch;
+
+public:
+    NandReader();
+    virtual ~NandReader();
+
+    /*
+        location - backend specific reader to connect to, NULL = first reader.
+        The location is remembered for reconnecting.
+     */
+    virtual void connectReader(const char *location = NULL) = 0;
+    virtual void disconnectReader() = 0;
+
+    virtual void selectProtocol(t_ChipProtocol proto) = 0;
+    virtual void resetChip() = 0;
+    /*
+        Reconnects after a failed transfer, discards stale dump data,
+        restores the selected protocol and resets the chip
+     */
+    virtual void recoverReader() = 0;
+
+    /*
+        transfersCnt - number of transfers kept in flight by dumpPages
+        transferSize - size of a single transfer, multiple of the endpoint packet size
+        0 keeps the current value
+     */
+    void setTransferConfig(uint32_t transfersCnt, uint32_t transferSize);
+    inline const TransferStats &lastDumpStats() const{return _lastDumpStats;}
+
+#pragma mark NAND commands
+    void sendNandCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp, size_t rspSize, bool isMultiCommand = false);
+    uint64_t readChipIDForCE(uint8_t CE);
+    
+    tihmstar::Mem readPage(uint8_t CE, uint32_t pageAddress, uint16_t pageSize);
+    /*
+        Reads pagesCnt pages from arbitrary addresses into out (pagesCnt*pageSize bytes) with a single batch.
+        With column set, pageSize bytes starting at column are read from every page instead.
+     */
+    void readPages(uint8_t CE, const uint32_t *pageAddresses, size_t pagesCnt, uint16_t pageSize, void *out, uint16_t column = 0);
+
+    /*
+        Executes all commands of the batch in order,
+        responses end up in the buffers passed when recording the batch.
+     */
+    virtual void executeBatch(NandCommandBatch &batch) = 0;
+    
+    virtual void dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg) = 0;
+};
+
+#endif /* NandReader_hpp */
@@ -0,0 +1,155 @@
+//
+//  PageRecovery.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "PageRecovery.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_READS_CNT 0xFFFF
+
+#pragma mark PageRecovery
+PageRecovery::PageRecovery(size_t pageSize, ECCCorrection::NandStructure nstructure, cbDecode decode, uint32_t maxWeakBits)
+: _pageSize(pageSize), _decode(decode), _maxWeakBits(maxWeakBits), _stats{}
+{
+    retassure(_pageSize && _pageSize <= 0xFFFF, "Invalid pagesize %zu",_pageSize);
+    retassure(_maxWeakBits < 32, "Too many weak bits");
+    for (auto &ns : nstructure) {
+        _sections.push_back({
+            .plan = ECCCorrection::compileCodewordPlan(ns.pageStructure, _pageSize),
+            .startPage = ns.startPage,
+            .endPage = ns.pagesCnt ? (uint64_t)ns.startPage + ns.pagesCnt : UINT64_MAX,
+        });
+    }
+}
+
+#pragma mark private
+bool PageRecovery::decodeCodeword(const ECCCorrection::CodewordPlan &cp, uint32_t readsCnt, uint8_t *outPage){
+    uint8_t cw[cp.cwSize];
+    uint8_t ecc[cp.eccSize];
+
+    /* plain majority vote */
+    memcpy(cw, &_voted[cp.cwStart], cp.cwSize);
+    memcpy(ecc, &_voted[cp.eccStart], cp.eccSize);
+    if (_decode(cw, cp.cwSize, ecc, cp.eccSize) >= 0) {
+        memcpy(&outPage[cp.cwStart], cw, cp.cwSize);
+        memcpy(&outPage[cp.eccStart], ecc, cp.eccSize);
+        _stats.votedCodewords++;
+        return true;
+    }
+
+    /* collect the bits the reads disagreed on, least reliable first */
+    struct WeakBit{
+        uint32_t bit;
+        uint32_t reliability;
+    };
+    std::vector<WeakBit> weak;
+    auto collect = [&](uint32_t start, uint32_t size){
+        for (uint32_t b = start*8; b < (start+size)*8; b++) {
+            uint32_t ones = _ones[b];
+            uint32_t reliability = (ones*2 > readsCnt) ? ones*2 - readsCnt : readsCnt - ones*2;
+            if (reliability < readsCnt) weak.push_back({b, reliability});
+        }
+    };
+    collect(cp.cwStart, cp.cwSize);
+    collect(cp.eccStart, cp.eccSize);
+    if (!weak.size()) return false;
+    std::stable_sort(weak.begin(), weak.end(), [](const WeakBit &a, const WeakBit &b){return a.reliability < b.reliability;});
+    uint32_t weakCnt = std::min((uint32_t)weak.size(), _maxWeakBits);
+
+    for (uint32_t flips = 1; flips <= weakCnt; flips++) {
+        for (uint32_t mask = 1; mask < (1u << weakCnt); mask++) {
+            if (__builtin_popcount(mask) != flips) continue;
+            memcpy(cw, &_voted[cp.cwStart], cp.cwSize);
+            memcpy(ecc, &_voted[cp.eccStart], cp.eccSize);
+            for (uint32_t i = 0; i < weakCnt; i++) {
+                if (!(mask & (1u << i))) continue;
+                uint32_t byte = weak[i].bit / 8;
+                uint8_t bitmask = 1 << (weak[i].bit % 8);
+                if (byte >= cp.cwStart && byte < cp.cwStart + cp.cwSize) {
+                    cw[byte - cp.cwStart] ^= bitmask;
+                }else{
+                    ecc[byte - cp.eccStart] ^= bitmask;
+                }
+            }
+            if (_decode(cw, cp.cwSize, ecc, cp.eccSize) >= 0) {
+                memcpy(&outPage[cp.cwStart], cw, cp.cwSize);
+                memcpy(&outPage[cp.eccStart], ecc, cp.eccSize);
+                _stats.softCodewords++;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+#pragma mark public
+bool PageRecovery::recoverPage(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t pagenum, uint32_t readsCnt, uint8_t *outPage){
+    const Section *sec = NULL;
+    for (auto &s : _sections) {
+        if (pagenum >= s.startPage && pagenum < s.endPage) {
+            sec = &s;
+            break;
+        }
+    }
+    retassure(sec, "Page 0x%x is not covered by the page structure",pagenum);
+    retassure(readsCnt && readsCnt <= MAX_READS_CNT, "Invalid number of reads %u",readsCnt);
+    _stats.triedPages++;
+
+    {
+        std::vector<uint32_t> addresses(readsCnt, pageAddress + pagenum);
+        _reads.resize(readsCnt*_pageSize);
+        pnr.readPages(CE, addresses.data(), readsCnt, (uint16_t)_pageSize, _reads.data());
+    }
+
+    _ones.assign(_pageSize*8, 0);
+    for (uint32_t r = 0; r < readsCnt; r++) {
+        const uint8_t *read = &_reads[r*_pageSize];
+        for (size_t i = 0; i < _pageSize; i++) {
+            uint8_t v = read[i];
+            for (int k = 0; k < 8; k++) {
+                _ones[i*8+k] += (v >> k) & 1;
+            }
+        }
+    }
+    _voted.assign(_pageSize, 0);
+    for (size_t i = 0; i < _pageSize; i++) {
+        uint8_t v = 0;
+        for (int k = 0; k < 8; k++) {
+            /* ties go to 1, which is what an erased cell reads as */
+            if (_ones[i*8+k]*2 >= readsCnt) v |= 1 << k;
+        }
+        _voted[i] = v;
+    }
+
+    memcpy(outPage, _voted.data(), _pageSize);
+    for (uint32_t cwnum = 0; cwnum < sec->plan.size(); cwnum++) {
+        if (!decodeCodeword(sec->plan[cwnum], readsCnt, outPage)) {
+            debug("Page 0x%x CW %d is still uncorrectable",pagenum,cwnum);
+            return false;
+        }
+    }
+    _stats.recoveredPages++;
+    return true;
+}
+
+void PageRecovery::recoverPages(NandReader &pnr, uint8_t CE, uint32_t pageAddress, const std::vector<uint32_t> &pages, uint32_t readsCnt, cbPatch patchCB){
+    std::vector<uint8_t> page(_pageSize);
+    info("Re-reading %zu pages %u times each",pages.size(),readsCnt);
+    for (uint32_t pagenum : pages) {
+        if (recoverPage(pnr, CE, pageAddress, pagenum, readsCnt, page.data())) {
+            info("Recovered Page 0x%x",pagenum);
+            patchCB(pagenum, page.data(), _pageSize);
+        }else{
+            fprintf(stderr,"Page 0x%x stays uncorrectable\n",pagenum);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+//
+//  PageRecovery.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef PageRecovery_hpp
+#define PageRecovery_hpp
+
+#include "ECCCorrection.hpp"
+#include "NandReader.hpp"
+
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Recovers pages with uncorrectable codewords by reading them again.
+    Every page is read readsCnt times, each bit is set by majority vote and the voted page is decoded again.
+    Codewords which still fail are retried with the least reliable bits (the ones the reads disagreed on most) flipped,
+    fewest flips first.
+ */
+class PageRecovery {
+public:
+    /*
+        Decodes the codeword in place.
+        return - number of corrected bits, negative if uncorrectable
+     */
+    using cbDecode = std::function<int(uint8_t *codeword, size_t codewordSize, uint8_t *eccdata, size_t eccdataSize)>;
+    /*
+        Receives the corrected page of pagenum
+     */
+    using cbPatch = std::function<void(uint32_t pagenum, const uint8_t *page, size_t pageSize)>;
+
+    struct Stats{
+        uint32_t triedPages;
+        uint32_t recoveredPages;
+        uint32_t votedCodewords;    /* decoded after the plain majority vote */
+        uint32_t softCodewords;     /* decoded after flipping unreliable bits */
+    };
+private:
+    struct Section{
+        std::vector<ECCCorrection::CodewordPlan> plan;
+        uint64_t startPage;
+        uint64_t endPage;
+    };
+    size_t _pageSize;
+    std::vector<Section> _sections;
+    cbDecode _decode;
+    uint32_t _maxWeakBits;
+    Stats _stats;
+
+    std::vector<uint8_t> _reads;
+    std::vector<uint16_t> _ones;
+    std::vector<uint8_t> _voted;
+
+    bool decodeCodeword(const ECCCorrection::CodewordPlan &cp, uint32_t readsCnt, uint8_t *outPage);
+public:
+    /*
+        maxWeakBits - max number of unreliable bits per codeword which are tried flipped (2^maxWeakBits decodes)
+     */
+    PageRecovery(size_t pageSize, ECCCorrection::NandStructure nstructure, cbDecode decode, uint32_t maxWeakBits = 10);
+
+    /*
+        Re-reads pagenum (at pageAddress + pagenum on the chip) and tries to decode it.
+        Returns true and fills outPage if every codeword of the page decodes.
+     */
+    bool recoverPage(NandReader &pnr, uint8_t CE, uint32_t pageAddress, uint32_t pagenum, uint32_t readsCnt, uint8_t *outPage);
+
+    /*
+        Runs recoverPage on all pages, recovered pages are handed to patchCB
+     */
+    void recoverPages(NandReader &pnr, uint8_t CE, uint32_t pageAddress, const std::vector<uint32_t> &pages, uint32_t readsCnt, cbPatch patchCB);
+
+    inline const Stats &stats() const{return _stats;}
+};
+
+#endif /* PageRecovery_hpp */
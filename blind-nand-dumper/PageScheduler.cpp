@@ -0,0 +1,106 @@
+//
+//  PageScheduler.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "PageScheduler.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define MIN_GRAIN_PAGES     16
+#define MAX_GRAIN_PAGES     0x1000
+#define CHUNKS_PER_WORKER   32
+
+PageScheduler::PageScheduler(uint32_t workersCnt)
+: _queues(workersCnt ? workersCnt : 1), _totalPages(0)
+{
+    //
+}
+
+#pragma mark private
+bool PageScheduler::steal(uint32_t worker, Range &out){
+    uint32_t cnt = (uint32_t)_queues.size();
+    for (uint32_t i = 1; i < cnt; i++) {
+        WorkerQueue &victim = _queues[(worker + i) % cnt];
+        std::unique_lock<std::mutex> ul(victim.lck);
+        if (victim.ranges.size()) {
+            out = victim.ranges.back(); victim.ranges.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+#pragma mark public
+void PageScheduler::addSection(uint32_t section, uint64_t begin, uint64_t end){
+    if (begin >= end) return;
+    _pending.push_back({section, begin, end});
+    _totalPages += end - begin;
+}
+
+void PageScheduler::distribute(uint64_t grain){
+    uint32_t cnt = (uint32_t)_queues.size();
+    std::vector<Range> chunks;
+
+    if (!grain) {
+        grain = _totalPages / (cnt * CHUNKS_PER_WORKER);
+        grain = std::max<uint64_t>(grain, MIN_GRAIN_PAGES);
+        grain = std::min<uint64_t>(grain, MAX_GRAIN_PAGES);
+    }
+
+    for (auto &r : _pending) {
+        for (uint64_t p = r.begin; p < r.end; p += grain) {
+            chunks.push_back({r.section, p, std::min(p + grain, r.end)});
+        }
+    }
+    _pending.clear();
+
+    /*
+        Worker i gets the i-th consecutive block of chunks
+     */
+    for (size_t i = 0; i < chunks.size(); i++) {
+        WorkerQueue &q = _queues[(i * cnt) / chunks.size()];
+        std::unique_lock<std::mutex> ul(q.lck);
+        q.ranges.push_back(chunks[i]);
+    }
+}
+
+bool PageScheduler::next(uint32_t worker, Range &out){
+    {
+        WorkerQueue &own = _queues[worker];
+        std::unique_lock<std::mutex> ul(own.lck);
+        if (own.ranges.size()) {
+            out = own.ranges.front(); own.ranges.pop_front();
+            return true;
+        }
+    }
+    return steal(worker, out);
+}
+
+uint32_t PageScheduler::defaultWorkersCnt(){
+    uint32_t ret = std::thread::hardware_concurrency();
+    return ret ? ret : 1;
+}
+
+void PageScheduler::pinCurrentThread(uint32_t cpu){
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu % defaultWorkersCnt(), &cpuset);
+    if (int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+        warning("Failed to pin thread to cpu %d with err=%d",cpu,err);
+    }
+#else
+    debug("Thread pinning not supported on this platform");
+#endif
+}
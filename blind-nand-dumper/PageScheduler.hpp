@@ -0,0 +1,66 @@
+//
+//  PageScheduler.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef PageScheduler_hpp
+#define PageScheduler_hpp
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Hands out contiguous page ranges to a fixed set of workers.
+    Every worker owns a deque which it consumes from the front (keeping access sequential),
+    idle workers steal from the back of other workers' deques.
+ */
+class PageScheduler {
+public:
+    struct Range{
+        uint32_t section;
+        uint64_t begin;
+        uint64_t end;
+    };
+private:
+    struct WorkerQueue{
+        std::mutex lck;
+        std::deque<Range> ranges;
+    };
+    std::vector<WorkerQueue> _queues;
+    std::vector<Range> _pending;
+    uint64_t _totalPages;
+
+    bool steal(uint32_t worker, Range &out);
+public:
+    PageScheduler(uint32_t workersCnt);
+
+    /*
+        Queue pages [begin, end) of a section, must be called before distribute()
+     */
+    void addSection(uint32_t section, uint64_t begin, uint64_t end);
+
+    /*
+        Split all queued sections into chunks of at most grain pages (0 = automatic)
+        and assign consecutive chunks to the workers
+     */
+    void distribute(uint64_t grain = 0);
+
+    /*
+        Get next range for worker, returns false once there is no more work left
+     */
+    bool next(uint32_t worker, Range &out);
+
+    inline uint32_t workersCnt() const{return (uint32_t)_queues.size();}
+    inline uint64_t totalPages() const{return _totalPages;}
+
+    static uint32_t defaultWorkersCnt();
+    static void pinCurrentThread(uint32_t cpu);
+};
+
+#endif /* PageScheduler_hpp */
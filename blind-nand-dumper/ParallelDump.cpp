@@ -0,0 +1,280 @@
+//
+//  ParallelDump.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ParallelDump.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_INTERVAL std::chrono::seconds(1)
+
+static void addTransferStats(NandReader::TransferStats &total, const NandReader::TransferStats &st){
+    if (!st.transfers) return;
+    if (!total.transfers || st.minLatencyUs < total.minLatencyUs) total.minLatencyUs = st.minLatencyUs;
+    if (st.maxLatencyUs > total.maxLatencyUs) total.maxLatencyUs = st.maxLatencyUs;
+    total.avgLatencyUs = (total.avgLatencyUs*total.transfers + st.avgLatencyUs*st.transfers) / (total.transfers + st.transfers);
+    total.transfers += st.transfers;
+    total.bytes += st.bytes;
+    total.seconds += st.seconds;
+}
+
+#pragma mark ParallelDump
+ParallelDump::ParallelDump(std::vector<NandReader*> readers, uint32_t pageAddress, uint16_t pageSize, int retries, uint32_t slicePages)
+: _readers(readers), _pageAddress(pageAddress), _pageSize(pageSize), _retries(retries), _slicePages(slicePages)
+, _activeReaders(0), _busyReaders(0), _donePages(0), _totalPages(0)
+{
+    retassure(_readers.size(), "No reader specified");
+    retassure(_pageSize, "Pagesize not set!");
+    retassure(_slicePages, "Slices need at least one page");
+    _stats.resize(_readers.size());
+}
+
+#pragma mark private
+ParallelDump::Output *ParallelDump::newOutput(int fd, DumpJournal *journal, DumpContainer::Writer *container){
+    _outputs.emplace_back();
+    Output *out = &_outputs.back();
+    out->fd = fd;
+    out->journal = journal;
+    out->container = container;
+    return out;
+}
+
+void ParallelDump::addSlices(Output *out, std::vector<DumpJournal::Range> missing, const std::vector<uint8_t> &CEs, uint32_t numPages){
+    uint64_t pagesCnt = (uint64_t)numPages*CEs.size();
+    uint64_t missingCnt = 0;
+    for (DumpJournal::Range r : missing) {
+        missingCnt += r.count;
+        while (r.count) {
+            uint32_t chipPage = r.first % numPages;
+            uint32_t count = std::min({r.count, numPages - chipPage, _slicePages});
+            _slices.push_back({
+                .out = out,
+                .CE = CEs[r.first / numPages],
+                .chipPage = chipPage,
+                .filePage = r.first,
+                .count = count,
+            });
+            r.first += count;
+            r.count -= count;
+        }
+    }
+    _totalPages += pagesCnt;
+    _donePages += pagesCnt - missingCnt;
+}
+
+void ParallelDump::writeContainer(const Slice &s, std::vector<uint8_t> &pageBuf, uint64_t received, const uint8_t *chunk, size_t chunkSize){
+    /* the container only takes whole pages, pages split between chunks are collected in pageBuf */
+    while (chunkSize) {
+        size_t inPage = received % _pageSize;
+        uint64_t page = s.filePage + received / _pageSize;
+        if (!inPage && chunkSize >= _pageSize) {
+            size_t pagesCnt = chunkSize / _pageSize;
+            s.out->container->writePages(page, chunk, pagesCnt);
+            chunk += pagesCnt*_pageSize;
+            chunkSize -= pagesCnt*_pageSize;
+            received += pagesCnt*_pageSize;
+            continue;
+        }
+        size_t take = std::min<size_t>(_pageSize - inPage, chunkSize);
+        memcpy(&pageBuf[inPage], chunk, take);
+        if (inPage + take == _pageSize) s.out->container->writePages(page, pageBuf.data(), 1);
+        chunk += take;
+        chunkSize -= take;
+        received += take;
+    }
+}
+
+bool ParallelDump::nextSlice(Slice &s){
+    std::unique_lock<std::mutex> ul(_lck);
+    /* a busy reader may still fail and hand back its slice */
+    _cond.wait(ul, [&]{return _slices.size() || !_busyReaders;});
+    if (!_slices.size()) return false;
+    s = _slices.front();
+    _slices.pop_front();
+    _busyReaders++;
+    return true;
+}
+
+void ParallelDump::finishSlice(const Slice *remainder){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        if (remainder && remainder->count) _slices.push_front(*remainder);
+        _busyReaders--;
+    }
+    _cond.notify_all();
+}
+
+void ParallelDump::dumpSlice(NandReader *pnr, Slice &s, NandReader::TransferStats &stats, ProgressReporter::Worker *pw){
+    int failures = 0;
+    std::vector<uint8_t> pageBuf((s.out->container) ? _pageSize : 0);
+    while (s.count) {
+        uint64_t received = 0;
+        uint32_t checkpointedPages = 0;
+        uint32_t reportedPages = 0;
+        auto lastCheckpoint = std::chrono::steady_clock::now();
+        auto activeSince = lastCheckpoint;
+
+        auto checkpoint = [&]{
+            uint32_t pages = (uint32_t)(received / _pageSize);
+            if (pages == checkpointedPages) return;
+            if (s.out->journal) {
+                retassure(!fsync(s.out->fd), "Failed to sync output with err=%d (%s)",errno,strerror(errno));
+                std::unique_lock<std::mutex> ul(s.out->lck);
+                s.out->journal->markDone(s.filePage + checkpointedPages, pages - checkpointedPages);
+            }
+            _donePages += pages - checkpointedPages;
+            checkpointedPages = pages;
+            lastCheckpoint = std::chrono::steady_clock::now();
+        };
+
+        try {
+            pnr->dumpPages(s.CE, _pageAddress + s.chipPage, _pageSize, s.count, [&](const void *chunk_, size_t chunkSize, void *arg)->bool{
+                const uint8_t *chunk = (const uint8_t *)chunk_;
+                if (s.out->container) {
+                    writeContainer(s, pageBuf, received, chunk, chunkSize);
+                }else{
+                    off_t offset = (off_t)((uint64_t)s.filePage*_pageSize + received);
+                    size_t done = 0;
+                    while (done < chunkSize) {
+                        ssize_t didWrite = pwrite(s.out->fd, &chunk[done], chunkSize - done, offset + done);
+                        if (didWrite < 0 && errno == EINTR) continue;
+                        retassure(didWrite > 0, "Failed to write output with err=%d (%s)",errno,strerror(errno));
+                        done += didWrite;
+                    }
+                }
+                received += chunkSize;
+                if (pw) {
+                    auto now = std::chrono::steady_clock::now();
+                    pw->add((uint32_t)(received / _pageSize) - reportedPages, chunkSize);
+                    pw->addBusy(now - activeSince);
+                    reportedPages = (uint32_t)(received / _pageSize);
+                    activeSince = now;
+                }
+                if (std::chrono::steady_clock::now() - lastCheckpoint >= CHECKPOINT_INTERVAL) checkpoint();
+                return true;
+            }, NULL);
+            addTransferStats(stats, pnr->lastDumpStats());
+            checkpoint();
+            s.count = 0;
+        } catch (tihmstar::exception &e) {
+            checkpoint();
+            if (pw) {
+                /* pages past the last checkpoint are dumped again */
+                pw->rewind(reportedPages - checkpointedPages);
+                pw->addBusy(std::chrono::steady_clock::now() - activeSince);
+            }
+            s.chipPage += checkpointedPages;
+            s.filePage += checkpointedPages;
+            s.count -= checkpointedPages;
+            if (checkpointedPages) failures = 0;
+            if (!s.count) break;
+            if (++failures > _retries) throw;
+            warning("Dump of CE%d failed at page 0x%x: %s",s.CE,_pageAddress + s.chipPage,e.what());
+            warning("Recovering reader and retrying (%d/%d)",failures,_retries);
+            std::this_thread::sleep_for(std::chrono::seconds(failures));
+            try {
+                pnr->recoverReader();
+            } catch (tihmstar::exception &e) {
+                warning("Failed to recover reader: %s",e.what());
+            }
+        }
+    }
+}
+
+void ParallelDump::readerLoop(uint32_t rid, ProgressReporter::Worker *pw){
+    Slice s = {};
+    while (nextSlice(s)) {
+        try {
+            dumpSlice(_readers[rid], s, _stats[rid], pw);
+        } catch (...) {
+            finishSlice(&s);
+            throw;
+        }
+        finishSlice(NULL);
+    }
+}
+
+#pragma mark public
+void ParallelDump::addOutput(int fd, DumpJournal *journal, const std::vector<uint8_t> &CEs, uint32_t numPages){
+    retassure(CEs.size(), "No CE specified");
+    retassure(numPages, "No pages to dump");
+    Output *out = newOutput(fd, journal, NULL);
+
+    std::vector<DumpJournal::Range> missing;
+    if (journal) {
+        missing = journal->missingRanges();
+    }else{
+        missing.push_back({0, (uint32_t)((uint64_t)numPages*CEs.size())});
+    }
+    addSlices(out, missing, CEs, numPages);
+}
+
+void ParallelDump::addOutput(DumpContainer::Writer *container, const std::vector<uint8_t> &CEs, uint32_t numPages){
+    retassure(container, "No container specified");
+    retassure(CEs.size(), "No CE specified");
+    retassure(numPages, "No pages to dump");
+    Output *out = newOutput(-1, NULL, container);
+    addSlices(out, {{0, (uint32_t)((uint64_t)numPages*CEs.size())}}, CEs, numPages);
+}
+
+void ParallelDump::run(ProgressReporter *progress){
+    std::mutex readerExceptionLck;
+    std::exception_ptr readerException = nullptr;
+    std::vector<std::thread> rthreads;
+
+    _activeReaders = (uint32_t)_readers.size();
+    _busyReaders = 0;
+    debug("Dumping %zu slices with %zu readers",_slices.size(),_readers.size());
+    retassure(!progress || progress->workersCnt() >= _readers.size(), "Progress reporter has %u worker slots for %zu readers",progress ? progress->workersCnt() : 0,_readers.size());
+    if (progress) progress->start(_totalPages, _donePages);
+    for (uint32_t i = 0; i < _readers.size(); i++) {
+        rthreads.push_back(std::thread([&](uint32_t rid){
+            try {
+                readerLoop(rid, (progress) ? &progress->worker(rid) : NULL);
+            } catch (tihmstar::exception &e) {
+                error("Reader %d gave up: %s",rid,e.what());
+                std::unique_lock<std::mutex> ul(readerExceptionLck);
+                if (!readerException) readerException = std::current_exception();
+            } catch (...) {
+                std::unique_lock<std::mutex> ul(readerExceptionLck);
+                if (!readerException) readerException = std::current_exception();
+            }
+            {
+                std::unique_lock<std::mutex> ul(_lck);
+                _activeReaders--;
+            }
+            _cond.notify_all();
+        },i));
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _cond.wait(ul, [&]{return !_activeReaders;});
+    }
+    for (auto &t : rthreads) {
+        t.join();
+    }
+    if (progress) progress->stop();
+
+    if (_slices.size()) {
+        if (readerException) std::rethrow_exception(readerException);
+        reterror("%zu slices left without a reader",_slices.size());
+    }
+}
+
+const NandReader::TransferStats &ParallelDump::transferStats(size_t rid) const{
+    retassure(rid < _stats.size(), "Reader %zu out of bounds",rid);
+    return _stats[rid];
+}
@@ -0,0 +1,99 @@
+//
+//  ParallelDump.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ParallelDump_hpp
+#define ParallelDump_hpp
+
+#include "DumpContainer.hpp"
+#include "DumpJournal.hpp"
+#include "NandReader.hpp"
+#include "ProgressReporter.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Dumps page ranges of one or more CEs with any number of readers at once.
+    The work is cut into slices which idle readers pick up, so faster readers take over more of the dump.
+    Slices are written with pwrite to their final offset and checkpointed into the output's journal,
+    or handed to a DumpContainer::Writer page by page.
+    A reader which keeps failing hands its remaining pages back to the others.
+ */
+class ParallelDump {
+    struct Output{
+        int fd;
+        DumpJournal *journal;
+        DumpContainer::Writer *container;
+        std::mutex lck;
+    };
+    struct Slice{
+        Output *out;
+        uint8_t CE;
+        uint32_t chipPage;  /* relative to the dump's page address */
+        uint32_t filePage;  /* page index in the output and its journal */
+        uint32_t count;
+    };
+    std::vector<NandReader*> _readers;
+    uint32_t _pageAddress;
+    uint16_t _pageSize;
+    int _retries;
+    uint32_t _slicePages;
+
+    std::deque<Output> _outputs;
+    std::mutex _lck;
+    std::condition_variable _cond;
+    std::deque<Slice> _slices;
+    uint32_t _activeReaders;    /* reader threads which are still running */
+    uint32_t _busyReaders;      /* readers working on a slice, which might still hand it back */
+    std::atomic<uint64_t> _donePages;
+    uint64_t _totalPages;
+    std::vector<NandReader::TransferStats> _stats; /* per reader, only touched by its own thread */
+
+    Output *newOutput(int fd, DumpJournal *journal, DumpContainer::Writer *container);
+    void addSlices(Output *out, std::vector<DumpJournal::Range> missing, const std::vector<uint8_t> &CEs, uint32_t numPages);
+    void writeContainer(const Slice &s, std::vector<uint8_t> &pageBuf, uint64_t received, const uint8_t *chunk, size_t chunkSize);
+    bool nextSlice(Slice &s);
+    void finishSlice(const Slice *remainder);
+    void dumpSlice(NandReader *pnr, Slice &s, NandReader::TransferStats &stats, ProgressReporter::Worker *pw);
+    void readerLoop(uint32_t rid, ProgressReporter::Worker *pw);
+public:
+    /*
+        retries    - retries after a failed transfer without progress before a reader gives up
+        slicePages - pages a reader dumps at once
+     */
+    ParallelDump(std::vector<NandReader*> readers, uint32_t pageAddress, uint16_t pageSize, int retries, uint32_t slicePages);
+
+    /*
+        Dumps numPages pages from pageAddress of every CE into fd, one CE after the other.
+        Pages already recorded in the journal are skipped, journal may be NULL.
+        The dump does not take ownership of fd or journal.
+     */
+    void addOutput(int fd, DumpJournal *journal, const std::vector<uint8_t> &CEs, uint32_t numPages);
+
+    /*
+        Same as above, but into a container which needs to hold numPages*CEs.size() pages.
+        Containers have no journal, finishing the container is left to the caller.
+     */
+    void addOutput(DumpContainer::Writer *container, const std::vector<uint8_t> &CEs, uint32_t numPages);
+
+    /*
+        progress - gets a worker slot per reader, started and stopped by run()
+     */
+    void run(ProgressReporter *progress = NULL);
+
+    /*
+        USB statistics of all dumpPages calls of a reader which completed during run()
+     */
+    const NandReader::TransferStats &transferStats(size_t rid) const;
+};
+
+#endif /* ParallelDump_hpp */
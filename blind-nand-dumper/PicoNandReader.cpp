@@ -10,7 +10,14 @@
 #include <libgeneral/macros.h>
 #include <libgeneral/Mem.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
 #include <arpa/inet.h>
+#include <string.h>
 
 #define USB_VID 0x6874
 #define USB_PID 0x7064
@@ -19,14 +26,95 @@
 
 #define USB_MAX_TRANSFER_SIZE 0x1000
 
+#define USB_DUMP_ENDPOINT               (LIBUSB_ENDPOINT_IN | 1)
+#define USB_DUMP_PACKET_SIZE            64
+#define USB_MAX_CONTROL_TRANSFERS       64
+#define USB_DRAIN_TIMEOUT               100
+#define USB_MAX_DRAIN_SIZE              0x1000000
+#define USB_REAP_MAX_ERRORS             16
+
 #ifndef MIN
 #define MIN(a, b) ((b)>(a)?(a):(b))
 #endif
 
+namespace {
+struct AsyncTransfer{
+    struct libusb_transfer *xfer;
+    std::vector<uint8_t> buf;
+    bool inflight;
+    std::chrono::steady_clock::time_point submitTime;
+    std::chrono::steady_clock::time_point completeTime;
+};
+}
+
+static void LIBUSB_CALL asyncTransferCB(struct libusb_transfer *xfer){
+    AsyncTransfer *t = (AsyncTransfer*)xfer->user_data;
+    /* taken here, the main loop only gets to a transfer after all earlier ones were handed to the callback */
+    t->completeTime = std::chrono::steady_clock::now();
+    t->inflight = false;
+}
+
+static void LIBUSB_CALL controlTransferCB(struct libusb_transfer *xfer){
+    *(bool*)xfer->user_data = false;
+}
+
+/*
+    Pumps USB events until stillInflight() returns false, interrupted event handling is retried.
+    return - false if event handling failed USB_REAP_MAX_ERRORS times in a row,
+             the transfers still in flight are then owned by libusb and must not be freed
+ */
+template <typename F>
+static bool reapTransfers(libusb_context *ctx, F stillInflight){
+    int errs = 0;
+    while (stillInflight()) {
+        int err = libusb_handle_events_completed(ctx, NULL);
+        if (!err || err == LIBUSB_ERROR_INTERRUPTED) {
+            errs = 0;
+        }else if (++errs >= USB_REAP_MAX_ERRORS) {
+            error("Failed to reap cancelled USB transfers with err=%d (%s)",err,libusb_error_name(err));
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Opens the reader at "<bus>:<address>" or with the given serial number
+ */
+static libusb_device_handle *openReader(libusb_context *ctx, const char *location){
+    libusb_device_handle *ret = NULL;
+    libusb_device **devs = NULL;
+    ssize_t devsCnt = 0;
+    cleanup([&]{
+        if (devs) libusb_free_device_list(devs, 1);
+    });
+    if ((devsCnt = libusb_get_device_list(ctx, &devs)) < 0) return NULL;
+
+    for (ssize_t i = 0; i < devsCnt && !ret; i++) {
+        struct libusb_device_descriptor desc = {};
+        libusb_device_handle *hdl = NULL;
+        char busaddr[0x10] = {};
+        if (libusb_get_device_descriptor(devs[i], &desc)) continue;
+        if (desc.idVendor != USB_VID || desc.idProduct != USB_PID) continue;
+        snprintf(busaddr, sizeof(busaddr), "%d:%d",libusb_get_bus_number(devs[i]),libusb_get_device_address(devs[i]));
+        if (libusb_open(devs[i], &hdl)) continue;
+        if (strcmp(busaddr, location) == 0) {
+            ret = hdl; hdl = NULL;
+        }else if (desc.iSerialNumber) {
+            unsigned char serial[0x100] = {};
+            if (libusb_get_string_descriptor_ascii(hdl, desc.iSerialNumber, serial, sizeof(serial)-1) > 0
+                && strcmp((const char*)serial, location) == 0) {
+                ret = hdl; hdl = NULL;
+            }
+        }
+        safeFreeCustom(hdl, libusb_close);
+    }
+    return ret;
+}
+
 #pragma mark PicoNandReader
 PicoNandReader::PicoNandReader()
 : _ctx{NULL}, _dev{NULL}
-, _chipProto{kChipProtocolUndefined}
 {
     bool didInit = false;
     cleanup([&]{
@@ -38,6 +126,9 @@ PicoNandReader::PicoNandReader()
 }
 
 PicoNandReader::~PicoNandReader(){
+    for (auto &xfer : _ctrlTransfers) {
+        safeFreeCustom(xfer, libusb_free_transfer);
+    }
     disconnectReader();
     safeFreeCustom(_ctx, libusb_exit);
 }
@@ -54,19 +145,58 @@ void PicoNandReader::disconnectReader(){
     safeFreeCustom(_dev, libusb_close);
 }
 
-void PicoNandReader::connectReader(){
+void PicoNandReader::connectReader(const char *location){
     int err = 0;
+    if (location) _location = location;
     if (!_dev) {
-        retassure(_dev = libusb_open_device_with_vid_pid(_ctx, USB_VID, USB_PID),"Failed to open PNR device");
+        if (_location.size()) {
+            retassure(_dev = openReader(_ctx, _location.c_str()),"Failed to open PNR device '%s'",_location.c_str());
+        }else{
+            retassure(_dev = libusb_open_device_with_vid_pid(_ctx, USB_VID, USB_PID),"Failed to open PNR device");
+        }
         retassure((err = libusb_claim_interface(_dev, 0)) == 0,"Failed to configure device with err=%d",err);
     }
 }
 
+std::vector<PicoNandReader::ReaderInfo> PicoNandReader::listReaders(){
+    std::vector<ReaderInfo> ret;
+    libusb_context *ctx = NULL;
+    libusb_device **devs = NULL;
+    ssize_t devsCnt = 0;
+    cleanup([&]{
+        if (devs) libusb_free_device_list(devs, 1);
+        safeFreeCustom(ctx, libusb_exit);
+    });
+    retassure(!libusb_init(&ctx), "Failed to init libusb");
+    retassure((devsCnt = libusb_get_device_list(ctx, &devs)) >= 0, "Failed to list USB devices with err=%zd",devsCnt);
+
+    for (ssize_t i = 0; i < devsCnt; i++) {
+        struct libusb_device_descriptor desc = {};
+        libusb_device_handle *hdl = NULL;
+        if (libusb_get_device_descriptor(devs[i], &desc)) continue;
+        if (desc.idVendor != USB_VID || desc.idProduct != USB_PID) continue;
+        ReaderInfo ri = {
+            .bus = libusb_get_bus_number(devs[i]),
+            .address = libusb_get_device_address(devs[i]),
+        };
+        if (desc.iSerialNumber && !libusb_open(devs[i], &hdl)) {
+            unsigned char serial[0x100] = {};
+            if (libusb_get_string_descriptor_ascii(hdl, desc.iSerialNumber, serial, sizeof(serial)-1) > 0) {
+                ri.serial = (const char*)serial;
+            }
+            libusb_close(hdl);
+        }
+        ret.push_back(ri);
+    }
+    return ret;
+}
+
 void PicoNandReader::selectProtocol(t_ChipProtocol proto){
     t_ReaderResponse rrsp = kReaderResponseUndefined;
     int err = 0;
     retassure((err = libusb_control_transfer(_dev, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandSelectProtocol, 0, proto, (unsigned char *)&rrsp, sizeof(rrsp), USB_TIMEOUT)) == sizeof(rrsp),"faild to receive rrsp with err=%d",err);
     retassure(rrsp == kReaderResponseSuccess, "selectProtocol failed with err=%d",rrsp);
+    _chipProto = proto;
 }
 
 void PicoNandReader::resetChip(){
@@ -76,58 +206,139 @@ void PicoNandReader::resetChip(){
     retassure(rrsp == kReaderResponseSuccess, "resetChip failed with err=%d",rrsp);
 }
 
-#pragma mark NAND commands
-void PicoNandReader::sendNandCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp_, size_t rspSize, bool isMultiCommand){
+void PicoNandReader::recoverReader(){
     int err = 0;
-    
-    uint8_t *rsp = (uint8_t*)rsp_;
-    
-    tihmstar::Mem commandbuf;
-    commandbuf.append(&CE, 1);
-    commandbuf.append(&cmdLen, 2);
-    commandbuf.append(cmd, cmdLen & 0xffff);
-    commandbuf.append(&addrLen, 2);
-    commandbuf.append(addr, addrLen & 0xffff);
-    commandbuf.append(&dataLen, 2);
-    commandbuf.append(data, dataLen & 0xffff);
-    
-    retassure((err = libusb_control_transfer(_dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandChipCommandSend, (uint16_t)rspSize, isMultiCommand, (unsigned char *)commandbuf.data(), commandbuf.size(), USB_TIMEOUT)) == commandbuf.size(),"faild to send command data with err=%d",err);
-    while (rspSize){
-        size_t actualSize = MIN(rspSize,USB_MAX_TRANSFER_SIZE);
-        retassure((err = libusb_control_transfer(_dev, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandChipCommandReceive, 0, 0, (unsigned char *)rsp, actualSize, USB_TIMEOUT)) == actualSize,"faild to receive command data with err=%d",err);
-        rspSize -= actualSize;
-        rsp += actualSize;
+    disconnectReader();
+    connectReader();
+
+    /* drop whatever the reader still queued for an aborted dump, so it doesn't prefix the next one */
+    {
+        uint8_t buf[USB_DUMP_PACKET_SIZE*16];
+        int actual = 0;
+        size_t drained = 0;
+        while (drained < USB_MAX_DRAIN_SIZE
+               && (err = libusb_interrupt_transfer(_dev, USB_DUMP_ENDPOINT, buf, sizeof(buf), &actual, USB_DRAIN_TIMEOUT)) == 0
+               && actual > 0) {
+            drained += actual;
+        }
+        if (drained) debug("Drained %zu stale bytes from the reader",drained);
+        if (drained >= USB_MAX_DRAIN_SIZE) warning("Reader keeps sending data after draining %zu bytes",drained);
     }
-}
 
-uint64_t PicoNandReader::readChipIDForCE(uint8_t CE){
-    uint64_t ret = 0;
-    
-    uint8_t cmd = 0x90;
-    uint8_t addr = 0x00;
-    
-    sendNandCommand(CE, &cmd, sizeof(cmd), &addr, sizeof(addr), NULL, 0, &ret, sizeof(ret));
-    return ret;
+    if (_chipProto != kChipProtocolUndefined) selectProtocol(_chipProto);
+    resetChip();
 }
 
-tihmstar::Mem PicoNandReader::readPage(uint8_t CE, uint32_t pageAddress, uint16_t pageSize){
-    tihmstar::Mem ret;
-    uint64_t addr = pageAddress << 16;
-    uint8_t cmd1 = 0x00;
-    uint8_t cmd2 = 0x30;
+#pragma mark NAND commands
+void PicoNandReader::executeBatch(NandCommandBatch &batch){
+    int err = 0;
+    size_t stepsCnt = batch.stepsCnt();
+    size_t windowSize = MIN(stepsCnt, (size_t)USB_MAX_CONTROL_TRANSFERS);
+    size_t nextSubmit = 0;
+    size_t nextComplete = 0;
+    /* heap allocated, so it can be leaked together with transfers that can't be reaped */
+    bool *inflight = NULL;
 
+    if (!stepsCnt) return;
+    if (_ctrlTransfers.size() < windowSize) _ctrlTransfers.resize(windowSize, NULL);
+    for (size_t i = 0; i < windowSize; i++) {
+        if (!_ctrlTransfers[i]) retassure(_ctrlTransfers[i] = libusb_alloc_transfer(0), "Failed to alloc USB transfer");
+    }
+    inflight = new bool[windowSize]();
 
-    ret.resize(pageSize);
-    
-    sendNandCommand(CE, &cmd1, sizeof(cmd1), &addr, 5, NULL, 0, NULL, 0, true);
-    sendNandCommand(CE, &cmd2, sizeof(cmd2), NULL, 0, NULL, 0, ret.data(), ret.size());
+    cleanup([&]{
+        bool reaped = true;
+        for (size_t i = nextComplete; i < nextSubmit; i++) {
+            if (inflight[i % windowSize]) libusb_cancel_transfer(_ctrlTransfers[i % windowSize]);
+        }
+        reaped = reapTransfers(_ctx, [&]{
+            for (size_t i = nextComplete; i < nextSubmit; i++) {
+                if (inflight[i % windowSize]) return true;
+            }
+            return false;
+        });
+        if (!reaped) {
+            /* libusb may still complete these, leak them rather than handing out memory it writes to */
+            for (size_t i = 0; i < windowSize; i++) {
+                if (inflight[i]) _ctrlTransfers[i] = NULL;
+            }
+            warning("Leaking USB transfers which could not be cancelled");
+            inflight = NULL;
+        }
+        delete [] inflight;
+    });
 
-    return ret;
+    /* EP0 executes control transfers in submission order, so the device sees the same sequence as before */
+    while (nextComplete < stepsCnt) {
+        while (nextSubmit < stepsCnt && nextSubmit - nextComplete < windowSize) {
+            size_t slot = nextSubmit % windowSize;
+            struct libusb_transfer *xfer = _ctrlTransfers[slot];
+            libusb_fill_control_transfer(xfer, _dev, batch.stepBuffer(nextSubmit), controlTransferCB, &inflight[slot], USB_TIMEOUT);
+            inflight[slot] = true;
+            if ((err = libusb_submit_transfer(xfer))) {
+                inflight[slot] = false;
+                reterror("Failed to submit control transfer with err=%d (%s)",err,libusb_error_name(err));
+            }
+            nextSubmit++;
+        }
+
+        size_t slot = nextComplete % windowSize;
+        struct libusb_transfer *xfer = _ctrlTransfers[slot];
+        while (inflight[slot]) {
+            retassure(!(err = libusb_handle_events_completed(_ctx, NULL)), "Failed to handle USB events with err=%d (%s)",err,libusb_error_name(err));
+        }
+        const NandCommandBatch::Step &step = batch.step(nextComplete);
+        retassure(xfer->status == LIBUSB_TRANSFER_COMPLETED, "NAND command transfer %zu failed with status=%d",nextComplete,xfer->status);
+        retassure(xfer->actual_length == step.length - LIBUSB_CONTROL_SETUP_SIZE, "NAND command transfer %zu transferred %d of %zu bytes",nextComplete,xfer->actual_length,step.length - LIBUSB_CONTROL_SETUP_SIZE);
+        if (step.rsp) memcpy(step.rsp, libusb_control_transfer_get_data(xfer), step.rspSize);
+        nextComplete++;
+    }
 }
 
 void PicoNandReader::dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg){
     int err = 0;
-    uint8_t chunk[0x1000] = {};
+    std::vector<std::unique_ptr<AsyncTransfer>> slots;
+    std::vector<AsyncTransfer*> freeSlots;
+    std::deque<AsyncTransfer*> inflight;
+    
+    auto cancelAll = [&]{
+        for (auto t : inflight) {
+            if (t->inflight) libusb_cancel_transfer(t->xfer);
+        }
+        bool reaped = reapTransfers(_ctx, [&]{
+            for (auto t : inflight) {
+                if (t->inflight) return true;
+            }
+            return false;
+        });
+        if (!reaped) {
+            /* libusb may still complete these and write to the transfer and its buffer, leak them instead of freeing */
+            size_t leaked = 0;
+            for (auto &t : slots) {
+                if (t->inflight) {
+                    t.release();
+                    leaked++;
+                }
+            }
+            warning("Leaking %zu USB transfers which could not be cancelled",leaked);
+            slots.erase(std::remove(slots.begin(), slots.end(), nullptr), slots.end());
+        }
+        inflight.clear();
+    };
+    cleanup([&]{
+        cancelAll();
+        for (auto &t : slots) {
+            safeFreeCustom(t->xfer, libusb_free_transfer);
+        }
+    });
+    for (uint32_t i = 0; i < _transfersCnt; i++) {
+        auto t = std::make_unique<AsyncTransfer>();
+        retassure(t->xfer = libusb_alloc_transfer(0), "Failed to alloc USB transfer");
+        t->buf.resize(_transferSize);
+        t->inflight = false;
+        freeSlots.push_back(t.get());
+        slots.push_back(std::move(t));
+    }
     
     tihmstar::Mem commandbuf;
     commandbuf.append(&pageAddress, sizeof(pageAddress));
@@ -136,13 +347,58 @@ void PicoNandReader::dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSi
     commandbuf.append(&CE, sizeof(CE));
     retassure((err = libusb_control_transfer(_dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, kReaderCommandChipReadPages, 0, 0, (unsigned char *)commandbuf.data(), commandbuf.size(), USB_TIMEOUT)) == commandbuf.size(),"faild to send command data with err=%d",err);
 
-    uint64_t fullSize = pageSize*numPages;
-    while (fullSize) {
-        uint64_t chunkSize = MIN(sizeof(chunk),fullSize);
-        int actualLen = 0;
-        retassure((err = libusb_interrupt_transfer(_dev, LIBUSB_ENDPOINT_IN | 1, chunk, (int)chunkSize, &actualLen, USB_TIMEOUT)) == 0, "Failed to read page data");
-        retassure(actualLen > 0, "Failed to read a single byte");
-        if (!cbFunc(chunk, actualLen, cbArg)) break;
-        fullSize -= actualLen;
+    const uint64_t fullSize = (uint64_t)pageSize*numPages;
+    uint64_t received = 0;
+    uint64_t requested = 0;
+    double latencySumUs = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    _lastDumpStats = {};
+
+    /*
+        Keep as many transfers as possible in flight. Transfers complete in submission order,
+        bytes a short transfer did not receive are requested again by the next submission.
+     */
+    auto submitMore = [&]{
+        while (freeSlots.size() && received + requested < fullSize) {
+            AsyncTransfer *t = freeSlots.back();
+            int len = (int)MIN((uint64_t)_transferSize, fullSize - received - requested);
+            libusb_fill_interrupt_transfer(t->xfer, _dev, USB_DUMP_ENDPOINT, t->buf.data(), len, asyncTransferCB, t, USB_TIMEOUT);
+            t->inflight = true;
+            t->submitTime = std::chrono::steady_clock::now();
+            if ((err = libusb_submit_transfer(t->xfer))) {
+                t->inflight = false;
+                reterror("Failed to submit USB transfer with err=%d (%s)",err,libusb_error_name(err));
+            }
+            freeSlots.pop_back();
+            inflight.push_back(t);
+            requested += len;
+        }
+    };
+
+    submitMore();
+    while (inflight.size()) {
+        AsyncTransfer *t = inflight.front();
+        while (t->inflight) {
+            retassure(!(err = libusb_handle_events_completed(_ctx, NULL)), "Failed to handle USB events with err=%d (%s)",err,libusb_error_name(err));
+        }
+        inflight.pop_front();
+        freeSlots.push_back(t);
+        requested -= t->xfer->length;
+        retassure(t->xfer->status == LIBUSB_TRANSFER_COMPLETED, "Failed to read page data, transfer status=%d",t->xfer->status);
+        retassure(t->xfer->actual_length > 0, "Failed to read a single byte");
+
+        double latencyUs = std::chrono::duration<double, std::micro>(t->completeTime - t->submitTime).count();
+        if (!_lastDumpStats.transfers || latencyUs < _lastDumpStats.minLatencyUs) _lastDumpStats.minLatencyUs = latencyUs;
+        if (latencyUs > _lastDumpStats.maxLatencyUs) _lastDumpStats.maxLatencyUs = latencyUs;
+        latencySumUs += latencyUs;
+        _lastDumpStats.transfers++;
+        _lastDumpStats.bytes += t->xfer->actual_length;
+        received += t->xfer->actual_length;
+
+        if (!cbFunc(t->buf.data(), t->xfer->actual_length, cbArg)) break;
+        submitMore();
     }
+
+    _lastDumpStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (_lastDumpStats.transfers) _lastDumpStats.avgLatencyUs = latencySumUs / _lastDumpStats.transfers;
 }
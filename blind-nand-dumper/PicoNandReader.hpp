@@ -8,48 +8,58 @@
 #ifndef PicoNandReader_hpp
 #define PicoNandReader_hpp
 
-#include "PNR-proto.h"
+#include "NandReader.hpp"
 
 #include <libgeneral/macros.h>
 #include <libgeneral/Mem.hpp>
 
 #include <libusb.h>
 
+#include <string>
+#include <vector>
+
 #include <stdio.h>
 
-class PicoNandReader {
-    /*
-        chunk   - current data chunk read from device
-        bufSize - current chunk size
-        userArg - custom user arg
-     
-        return - true=continue dumping, false=stop dumping
-     */
-    using f_dumpCB = std::function<bool(const void *chunk, size_t chunkSize, void *userArg)>;
+class PicoNandReader : public NandReader {
+public:
+    struct ReaderInfo{
+        uint8_t bus;
+        uint8_t address;
+        std::string serial;
+    };
 private:
     libusb_context *_ctx;
     libusb_device_handle *_dev;
-    t_ChipProtocol _chipProto;
+    std::string _location;
+    std::vector<struct libusb_transfer *> _ctrlTransfers;
     
     void sendReaderCommand(t_ReaderCommand cmd, const void *data, size_t dataSize);
     
 public:
     PicoNandReader();
-    ~PicoNandReader();
+    virtual ~PicoNandReader() override;
     
-    void connectReader();
-    void disconnectReader();
+    /*
+        location - "<bus>:<address>" or serial number of the reader, NULL = first attached reader.
+     */
+    virtual void connectReader(const char *location = NULL) override;
+    virtual void disconnectReader() override;
 
-    void selectProtocol(t_ChipProtocol proto);
-    void resetChip();
-    
-#pragma mark NAND commands
-    void sendNandCommand(uint8_t CE, const void *cmd, size_t cmdLen, const void *addr, size_t addrLen, const void *data, size_t dataLen, void *rsp, size_t rspSize, bool isMultiCommand = false);
-    uint64_t readChipIDForCE(uint8_t CE);
-    
-    tihmstar::Mem readPage(uint8_t CE, uint32_t pageAddress, uint16_t pageSize);
+    /*
+        Lists all attached readers
+     */
+    static std::vector<ReaderInfo> listReaders();
+
+    virtual void selectProtocol(t_ChipProtocol proto) override;
+    virtual void resetChip() override;
+    virtual void recoverReader() override;
+
+    /*
+        Submits all transfers of the batch back to back and waits for them to finish
+     */
+    virtual void executeBatch(NandCommandBatch &batch) override;
     
-    void dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg);
+    virtual void dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg) override;
 };
 
 #endif /* PicoNandReader_hpp */
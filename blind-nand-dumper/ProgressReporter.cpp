@@ -0,0 +1,206 @@
+//
+//  ProgressReporter.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ProgressReporter.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static std::string formatDuration(double seconds){
+    char buf[32];
+    if (seconds < 0) return "--:--";
+    uint64_t s = (uint64_t)seconds;
+    if (s >= 3600) {
+        snprintf(buf, sizeof(buf), "%llu:%02llu:%02llu",(unsigned long long)(s/3600),(unsigned long long)(s/60%60),(unsigned long long)(s%60));
+    }else{
+        snprintf(buf, sizeof(buf), "%02llu:%02llu",(unsigned long long)(s/60),(unsigned long long)(s%60));
+    }
+    return buf;
+}
+
+static void appendf(std::string &str, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void appendf(std::string &str, const char *fmt, ...){
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    str += buf;
+}
+
+#pragma mark ProgressReporter
+ProgressReporter::ProgressReporter(const char *name, uint32_t workersCnt, double intervalSecs)
+: _name(name), _interval(intervalSecs), _workersCnt(workersCnt), _workers(new Worker[workersCnt]{}), _input{}
+, _jsonFd(-1), _quiet(false), _cwCounts(nullptr)
+, _totalPages(0), _basePages(0), _last{}
+, _running(false)
+{
+    retassure(intervalSecs > 0, "Progress interval must be positive");
+}
+
+ProgressReporter::~ProgressReporter(){
+    stop();
+}
+
+#pragma mark private
+ProgressReporter::Sample ProgressReporter::sample(){
+    Sample ret = {
+        .time = std::chrono::steady_clock::now(),
+        .pages = 0,
+        .bytes = 0,
+        .inputBytes = _input.bytes.load(std::memory_order_relaxed),
+        .inputBusyNs = _input.busyNs.load(std::memory_order_relaxed),
+    };
+    ret.workerPages.resize(_workersCnt);
+    ret.workerBusyNs.resize(_workersCnt);
+    for (uint32_t i = 0; i < _workersCnt; i++) {
+        ret.workerPages[i] = _workers[i].pages.load(std::memory_order_relaxed);
+        ret.workerBusyNs[i] = _workers[i].busyNs.load(std::memory_order_relaxed);
+        ret.pages += ret.workerPages[i];
+        ret.bytes += _workers[i].bytes.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+void ProgressReporter::report(bool final){
+    Sample cur = sample();
+    const Sample &ref = (final) ? Sample{.time = _startTime} : _last;
+    double dt = std::max(std::chrono::duration<double>(cur.time - ref.time).count(), 1e-9);
+    double elapsed = std::chrono::duration<double>(cur.time - _startTime).count();
+    uint64_t donePages = _basePages + cur.pages;
+
+    double pagesPerSec = (cur.pages - ref.pages) / dt;
+    double mbPerSec = (cur.bytes - ref.bytes) / dt / 1e6;
+    double inputMbPerSec = (cur.inputBytes - ref.inputBytes) / dt / 1e6;
+    double inputUtil = (cur.inputBusyNs - ref.inputBusyNs) / dt / 1e9;
+    double avgPagesPerSec = (elapsed > 0) ? cur.pages / elapsed : 0;
+    double eta = -1;
+    if (donePages >= _totalPages) {
+        eta = 0;
+    }else if (avgPagesPerSec > 0) {
+        eta = (_totalPages - donePages) / avgPagesPerSec;
+    }
+
+    if (cur.pages != _last.pages || cur.inputBytes != _last.inputBytes) _progressTime = cur.time;
+    double stalledSecs = std::chrono::duration<double>(cur.time - _progressTime).count();
+    bool stalled = !final && stalledSecs >= _interval.count();
+
+    std::vector<double> util(_workersCnt);
+    double utilSum = 0;
+    double utilMin = _workersCnt ? 1e9 : 0;
+    double utilMax = 0;
+    for (uint32_t i = 0; i < _workersCnt; i++) {
+        uint64_t refBusy = (final) ? 0 : ref.workerBusyNs[i];
+        util[i] = (cur.workerBusyNs[i] - refBusy) / dt / 1e9;
+        utilSum += util[i];
+        utilMin = std::min(utilMin, util[i]);
+        utilMax = std::max(utilMax, util[i]);
+    }
+    double utilAvg = _workersCnt ? utilSum / _workersCnt : 0;
+
+    CodewordCounts cw = {};
+    if (_cwCounts) cw = _cwCounts();
+
+    if (!_quiet) {
+        std::string line;
+        appendf(line, "[%s] %llu/%llu pages (%5.1f%%) %8.0f pages/s %7.2f MB/s %s %s",_name.c_str(),
+                (unsigned long long)donePages,(unsigned long long)_totalPages,_totalPages ? donePages*100.0/_totalPages : 100.0,
+                pagesPerSec,mbPerSec,final ? "took" : "ETA",formatDuration(final ? elapsed : eta).c_str());
+        if (cur.inputBytes) appendf(line, " | read %.2f MB/s busy %.0f%%",inputMbPerSec,inputUtil*100);
+        if (_cwCounts) {
+            appendf(line, " | good %llu corrected %llu uncorrectable %llu erased %llu",
+                    (unsigned long long)cw.good,(unsigned long long)cw.corrected,(unsigned long long)cw.uncorrectable,(unsigned long long)cw.erased);
+        }
+        appendf(line, " | util avg %.0f%% min %.0f%% max %.0f%%",utilAvg*100,utilMin*100,utilMax*100);
+        info("%s",line.c_str());
+        if (stalled) warning("[%s] No progress for %.0fs",_name.c_str(),stalledSecs);
+    }
+
+    if (_jsonFd != -1) {
+        std::string json;
+        appendf(json, "{\"time\":%.3f,\"phase\":\"%s\",\"final\":%s,\"elapsed\":%.3f,\"done_pages\":%llu,\"total_pages\":%llu,"
+                "\"pages_per_s\":%.1f,\"mb_per_s\":%.3f,\"eta_s\":%.1f,\"stalled_s\":%.1f",
+                std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count(),_name.c_str(),final ? "true" : "false",elapsed,
+                (unsigned long long)donePages,(unsigned long long)_totalPages,pagesPerSec,mbPerSec,eta,stalled ? stalledSecs : 0.0);
+        if (cur.inputBytes) appendf(json, ",\"input_mb_per_s\":%.3f,\"input_util\":%.3f",inputMbPerSec,inputUtil);
+        if (_cwCounts) {
+            appendf(json, ",\"codewords\":{\"good\":%llu,\"corrected\":%llu,\"uncorrectable\":%llu,\"erased\":%llu}",
+                    (unsigned long long)cw.good,(unsigned long long)cw.corrected,(unsigned long long)cw.uncorrectable,(unsigned long long)cw.erased);
+        }
+        json += ",\"workers\":[";
+        for (uint32_t i = 0; i < _workersCnt; i++) {
+            uint64_t refPages = (final) ? 0 : ref.workerPages[i];
+            appendf(json, "%s{\"pages\":%llu,\"pages_per_s\":%.1f,\"util\":%.3f}",i ? "," : "",
+                    (unsigned long long)cur.workerPages[i],(cur.workerPages[i] - refPages) / dt,util[i]);
+        }
+        json += "]}\n";
+        if (write(_jsonFd, json.data(), json.size()) != (ssize_t)json.size()) {
+            warning("Failed to write progress json");
+        }
+    }
+
+    _last = std::move(cur);
+}
+
+void ProgressReporter::loop(){
+    std::unique_lock<std::mutex> ul(_lck);
+    while (true) {
+        if (_cond.wait_for(ul, _interval, [&]{return !_running;})) break;
+        ul.unlock();
+        report(false);
+        ul.lock();
+    }
+}
+
+#pragma mark public
+void ProgressReporter::setJSONOutput(int fd){
+    _jsonFd = fd;
+}
+
+void ProgressReporter::setQuiet(bool quiet){
+    _quiet = quiet;
+}
+
+void ProgressReporter::setCodewordCounts(f_codewordCounts cb){
+    _cwCounts = cb;
+}
+
+void ProgressReporter::start(uint64_t totalPages, uint64_t donePages){
+    retassure(!_running, "Progress reporter already running");
+    for (uint32_t i = 0; i < _workersCnt; i++) {
+        _workers[i].pages = 0;
+        _workers[i].bytes = 0;
+        _workers[i].busyNs = 0;
+    }
+    _input.pages = 0;
+    _input.bytes = 0;
+    _input.busyNs = 0;
+    _totalPages = totalPages;
+    _basePages = donePages;
+    _startTime = _progressTime = std::chrono::steady_clock::now();
+    _last = sample();
+    _running = true;
+    _thread = std::thread([this]{
+        loop();
+    });
+}
+
+void ProgressReporter::stop(){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        if (!_running) return;
+        _running = false;
+    }
+    _cond.notify_all();
+    _thread.join();
+    report(true);
+}
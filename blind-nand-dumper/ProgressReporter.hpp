@@ -0,0 +1,127 @@
+//
+//  ProgressReporter.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ProgressReporter_hpp
+#define ProgressReporter_hpp
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Periodically reports the progress of a dump or processing pass from its own thread.
+    Every worker thread owns a counter slot on its own cache line which only it writes (relaxed),
+    the timer thread sums them up and reports pages/s, MB/s, ETA and per worker utilization.
+    An optional input slot tracks the producer of a pipeline (the reader), it does not count towards progress.
+ */
+class ProgressReporter {
+public:
+    struct alignas(64) Worker{
+        std::atomic<uint64_t> pages;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> busyNs;
+
+        /* only called by the owning thread, so there is no need for an atomic read-modify-write */
+        inline void add(uint64_t pagesCnt, uint64_t bytesCnt){
+            pages.store(pages.load(std::memory_order_relaxed) + pagesCnt, std::memory_order_relaxed);
+            bytes.store(bytes.load(std::memory_order_relaxed) + bytesCnt, std::memory_order_relaxed);
+        }
+        /* takes back pages which have to be done again, eg. after a failed transfer */
+        inline void rewind(uint64_t pagesCnt){
+            pages.store(pages.load(std::memory_order_relaxed) - pagesCnt, std::memory_order_relaxed);
+        }
+        inline void addBusy(std::chrono::steady_clock::duration d){
+            busyNs.store(busyNs.load(std::memory_order_relaxed) + std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), std::memory_order_relaxed);
+        }
+    };
+    struct CodewordCounts{
+        uint64_t good;
+        uint64_t corrected;
+        uint64_t uncorrectable;
+        uint64_t erased;
+    };
+    using f_codewordCounts = std::function<CodewordCounts()>;
+private:
+    struct Sample{
+        std::chrono::steady_clock::time_point time;
+        uint64_t pages;
+        uint64_t bytes;
+        uint64_t inputBytes;
+        uint64_t inputBusyNs;
+        std::vector<uint64_t> workerPages;
+        std::vector<uint64_t> workerBusyNs;
+    };
+    std::string _name;
+    std::chrono::duration<double> _interval;
+    uint32_t _workersCnt;
+    std::unique_ptr<Worker[]> _workers;
+    Worker _input;
+    int _jsonFd;
+    bool _quiet;
+    f_codewordCounts _cwCounts;
+
+    uint64_t _totalPages;
+    uint64_t _basePages;
+    std::chrono::steady_clock::time_point _startTime;
+    std::chrono::steady_clock::time_point _progressTime;
+    Sample _last;
+
+    std::thread _thread;
+    std::mutex _lck;
+    std::condition_variable _cond;
+    bool _running;
+
+    Sample sample();
+    void report(bool final);
+    void loop();
+public:
+    /*
+        name           - shown in front of every line and as "phase" in json
+        workersCnt     - number of worker slots
+        intervalSecs   - time between two reports
+     */
+    ProgressReporter(const char *name, uint32_t workersCnt, double intervalSecs = 1.0);
+    ~ProgressReporter();
+
+    /*
+        Additionally appends one json object per report to fd, -1 disables it.
+        The reporter does not take ownership.
+     */
+    void setJSONOutput(int fd);
+
+    /*
+        Only write json, no text lines
+     */
+    void setQuiet(bool quiet);
+
+    void setCodewordCounts(f_codewordCounts cb);
+
+    inline uint32_t workersCnt() const{return _workersCnt;}
+    inline Worker &worker(uint32_t i){return _workers[i];}
+    inline Worker &input(){return _input;}
+
+    /*
+        Resets all counters and starts reporting.
+        donePages - pages which were already done before (eg. resumed from a journal)
+     */
+    void start(uint64_t totalPages, uint64_t donePages = 0);
+
+    /*
+        Stops reporting and prints a final summary
+     */
+    void stop();
+};
+
+#endif /* ProgressReporter_hpp */
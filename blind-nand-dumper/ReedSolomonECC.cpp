@@ -0,0 +1,392 @@
+//
+//  ReedSolomonECC.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ReedSolomonECC.hpp"
+#include "ArgParse.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <numeric>
+
+#include <string.h>
+#include <strings.h>
+
+#define RS_MAX_SYMSIZE 16
+
+/*
+    Reads bitsCnt bits starting at bit bitpos of buf, bits past bufBits read as zero
+ */
+static uint32_t getSymbol(const uint8_t *buf, size_t bufBits, size_t bitpos, uint32_t bitsCnt, bool msbFirst){
+    uint32_t ret = 0;
+    for (uint32_t t = 0; t < bitsCnt; t++) {
+        size_t b = bitpos + t;
+        uint32_t bit = 0;
+        if (b < bufBits) {
+            bit = msbFirst ? (buf[b/8] >> (7 - b%8)) & 1 : (buf[b/8] >> (b%8)) & 1;
+        }
+        ret |= bit << (msbFirst ? bitsCnt-1-t : t);
+    }
+    return ret;
+}
+
+/*
+    Xors sym into the bits starting at bit bitpos of buf.
+    return - false if sym has bits set which fall past bufBits
+ */
+static bool xorSymbol(uint8_t *buf, size_t bufBits, size_t bitpos, uint32_t bitsCnt, uint32_t sym, bool msbFirst){
+    bool ret = true;
+    for (uint32_t t = 0; t < bitsCnt; t++) {
+        size_t b = bitpos + t;
+        uint32_t bit = (sym >> (msbFirst ? bitsCnt-1-t : t)) & 1;
+        if (!bit) continue;
+        if (b >= bufBits) {
+            ret = false;
+            continue;
+        }
+        buf[b/8] ^= msbFirst ? 0x80 >> (b%8) : 1 << (b%8);
+    }
+    return ret;
+}
+
+/*
+    Berlekamp-Massey and Chien search as in Phil Karn's decode_rs, without erasures.
+    Field elements are kept in index form where possible, A0 (= nn) is the log of zero.
+ */
+class ReedSolomonEngine::RSDecoder : public ECCEngine::Decoder {
+    const ReedSolomonEngine *_rs;
+    std::vector<uint16_t> _syms;
+    std::vector<uint32_t> _s;
+    std::vector<uint32_t> _lambda;
+    std::vector<uint32_t> _b;
+    std::vector<uint32_t> _t;
+    std::vector<uint32_t> _omega;
+    std::vector<uint32_t> _reg;
+    std::vector<uint32_t> _root;
+    std::vector<uint32_t> _loc;
+    std::vector<uint32_t> _rootIdx;
+
+    int decodeSymbols(uint32_t nroots, uint32_t len, uint32_t pad);
+public:
+    RSDecoder(const ReedSolomonEngine *rs) : _rs(rs) {}
+
+    virtual void decode(ECCEngine::Codeword *cws, size_t cnt) override;
+};
+
+int ReedSolomonEngine::RSDecoder::decodeSymbols(uint32_t nroots, uint32_t len, uint32_t pad){
+    const uint32_t nn = _rs->_nn;
+    const uint32_t A0 = nn;
+    const uint32_t fcr = _rs->_fcr;
+    const uint16_t *alphaTo = _rs->_alphaTo.data();
+    const uint16_t *indexOf = _rs->_indexOf.data();
+    uint16_t *data = _syms.data();
+    uint32_t *s = _s.data();
+    uint32_t *lambda = _lambda.data();
+    uint32_t *b = _b.data();
+    uint32_t *t = _t.data();
+    uint32_t *omega = _omega.data();
+    uint32_t *reg = _reg.data();
+    uint32_t *root = _root.data();
+    uint32_t *loc = _loc.data();
+    const uint32_t *rootIdx = _rootIdx.data();
+    uint32_t synError = 0;
+    uint32_t degLambda = 0;
+    uint32_t count = 0;
+    uint32_t el = 0;
+
+    /* syndromes, evaluated at the roots of the generator polynomial */
+    for (uint32_t i = 0; i < nroots; i++) {
+        s[i] = data[0];
+    }
+    for (uint32_t j = 1; j < len; j++) {
+        for (uint32_t i = 0; i < nroots; i++) {
+            if (s[i] == 0) {
+                s[i] = data[j];
+            }else{
+                s[i] = data[j] ^ alphaTo[_rs->modnn(indexOf[s[i]] + rootIdx[i])];
+            }
+        }
+    }
+    for (uint32_t i = 0; i < nroots; i++) {
+        synError |= s[i];
+        s[i] = indexOf[s[i]];
+    }
+    if (!synError) return 0;
+
+    /* error locator polynomial */
+    memset(&lambda[1], 0, nroots*sizeof(lambda[0]));
+    lambda[0] = 1;
+    for (uint32_t i = 0; i < nroots+1; i++) {
+        b[i] = indexOf[lambda[i]];
+    }
+    for (uint32_t r = 1; r <= nroots; r++) {
+        uint32_t discr = 0;
+        for (uint32_t i = 0; i < r; i++) {
+            if (lambda[i] != 0 && s[r-i-1] != A0) {
+                discr ^= alphaTo[_rs->modnn(indexOf[lambda[i]] + s[r-i-1])];
+            }
+        }
+        discr = indexOf[discr];
+        if (discr == A0) {
+            memmove(&b[1], b, nroots*sizeof(b[0]));
+            b[0] = A0;
+        }else{
+            t[0] = lambda[0];
+            for (uint32_t i = 0; i < nroots; i++) {
+                t[i+1] = (b[i] != A0) ? lambda[i+1] ^ alphaTo[_rs->modnn(discr + b[i])] : lambda[i+1];
+            }
+            if (2*el <= r-1) {
+                el = r - el;
+                for (uint32_t i = 0; i <= nroots; i++) {
+                    b[i] = (lambda[i] == 0) ? A0 : _rs->modnn(indexOf[lambda[i]] - discr + nn);
+                }
+            }else{
+                memmove(&b[1], b, nroots*sizeof(b[0]));
+                b[0] = A0;
+            }
+            memcpy(lambda, t, (nroots+1)*sizeof(t[0]));
+        }
+    }
+    for (uint32_t i = 0; i < nroots+1; i++) {
+        lambda[i] = indexOf[lambda[i]];
+        if (lambda[i] != A0) degLambda = i;
+    }
+    if (!degLambda) return -1;
+
+    /* chien search for the roots of the locator polynomial */
+    memcpy(&reg[1], &lambda[1], nroots*sizeof(reg[0]));
+    for (uint32_t i = 1, k = _rs->_iprim-1; i <= nn; i++, k = _rs->modnn(k + _rs->_iprim)) {
+        uint32_t q = 1;
+        for (uint32_t j = degLambda; j > 0; j--) {
+            if (reg[j] != A0) {
+                reg[j] = _rs->modnn(reg[j] + j);
+                q ^= alphaTo[reg[j]];
+            }
+        }
+        if (q != 0) continue;
+        root[count] = i;
+        loc[count] = k;
+        if (++count == degLambda) break;
+    }
+    if (count != degLambda) return -1;
+
+    /* error evaluator polynomial */
+    const uint32_t degOmega = degLambda - 1;
+    for (uint32_t i = 0; i <= degOmega; i++) {
+        uint32_t tmp = 0;
+        for (int j = (int)i; j >= 0; j--) {
+            if (s[i-j] != A0 && lambda[j] != A0) {
+                tmp ^= alphaTo[_rs->modnn(s[i-j] + lambda[j])];
+            }
+        }
+        omega[i] = indexOf[tmp];
+    }
+
+    /* forney, errors in the zero padding of a shortened code mean the codeword is beyond repair */
+    for (int j = (int)count-1; j >= 0; j--) {
+        uint32_t num1 = 0;
+        for (int i = (int)degOmega; i >= 0; i--) {
+            if (omega[i] != A0) num1 ^= alphaTo[_rs->modnn(omega[i] + i*root[j])];
+        }
+        if (num1 == 0) continue;
+        uint32_t num2 = alphaTo[_rs->modnn(_rs->modnn(root[j]*fcr) + nn - root[j])];
+        uint32_t den = 0;
+        for (int i = (int)(std::min(degLambda, nroots-1) & ~1); i >= 0; i -= 2) {
+            if (lambda[i+1] != A0) den ^= alphaTo[_rs->modnn(lambda[i+1] + i*root[j])];
+        }
+        if (den == 0 || loc[j] < pad) return -1;
+        data[loc[j]-pad] ^= alphaTo[_rs->modnn(indexOf[num1] + indexOf[num2] + nn - indexOf[den])];
+    }
+    return (int)count;
+}
+
+void ReedSolomonEngine::RSDecoder::decode(ECCEngine::Codeword *cws, size_t cnt){
+    const uint32_t m = _rs->_symSize;
+    for (size_t c = 0; c < cnt; c++) {
+        ECCEngine::Codeword &cw = cws[c];
+        const size_t dataBits = cw.dataSize*8;
+        const uint32_t k = (uint32_t)((dataBits + m - 1) / m);
+        const uint32_t nroots = (uint32_t)(cw.eccSize*8 / m);
+        const uint32_t len = k + nroots;
+        const uint32_t pad = _rs->_nn - len;
+
+        _syms.resize(len);
+        for (auto v : {&_s, &_lambda, &_b, &_t, &_omega, &_reg, &_root, &_loc}) {
+            v->resize(nroots+1);
+        }
+        if (_rootIdx.size() != nroots) {
+            /* log of the roots of the generator polynomial, alpha^((fcr+i)*prim) */
+            _rootIdx.resize(nroots);
+            for (uint32_t i = 0; i < nroots; i++) {
+                _rootIdx[i] = (uint32_t)(((uint64_t)(_rs->_fcr + i) * _rs->_prim) % _rs->_nn);
+            }
+        }
+        for (uint32_t i = 0; i < k; i++) {
+            _syms[i] = getSymbol(cw.data, dataBits, (size_t)i*m, m, _rs->_msbFirst);
+        }
+        for (uint32_t i = 0; i < nroots; i++) {
+            _syms[k+i] = getSymbol(cw.ecc, cw.eccSize*8, (size_t)i*m, m, _rs->_msbFirst);
+        }
+
+        int errs = decodeSymbols(nroots, len, pad);
+        if (errs <= 0) {
+            cw.bitflips = errs;
+            continue;
+        }
+
+        /* write back whatever changed, counting the flipped bits */
+        int bitflips = 0;
+        for (uint32_t i = 0; i < k && bitflips >= 0; i++) {
+            uint32_t diff = _syms[i] ^ getSymbol(cw.data, dataBits, (size_t)i*m, m, _rs->_msbFirst);
+            if (!diff) continue;
+            if (!xorSymbol(cw.data, dataBits, (size_t)i*m, m, diff, _rs->_msbFirst)) {
+                bitflips = -1; //correction falls into the padding bits of the last symbol
+                break;
+            }
+            bitflips += __builtin_popcount(diff);
+        }
+        for (uint32_t i = 0; i < nroots && bitflips >= 0; i++) {
+            uint32_t diff = _syms[k+i] ^ getSymbol(cw.ecc, cw.eccSize*8, (size_t)i*m, m, _rs->_msbFirst);
+            if (!diff) continue;
+            xorSymbol(cw.ecc, cw.eccSize*8, (size_t)i*m, m, diff, _rs->_msbFirst);
+            bitflips += __builtin_popcount(diff);
+        }
+        cw.bitflips = bitflips;
+    }
+}
+
+#pragma mark ReedSolomonEngine
+ReedSolomonEngine::ReedSolomonEngine(uint32_t poly, uint32_t fcr, uint32_t prim, bool msbFirst)
+: _poly(poly), _symSize(0), _nn(0), _fcr(fcr), _prim(prim), _iprim(0), _msbFirst(msbFirst)
+{
+    retassure(_poly > 2, "Invalid Reed-Solomon field polynomial 0x%x",_poly);
+    _symSize = 31 - __builtin_clz(_poly);
+    retassure(_symSize <= RS_MAX_SYMSIZE, "Reed-Solomon symbols can be at most %d bits, poly 0x%x has degree %u",RS_MAX_SYMSIZE,_poly,_symSize);
+    _nn = (1U << _symSize) - 1;
+    retassure(_fcr < (1U << _symSize), "fcr=%u is out of range for %u bit symbols",_fcr,_symSize);
+    retassure(_prim > 0 && _prim < (1U << _symSize), "prim=%u is out of range for %u bit symbols",_prim,_symSize);
+    retassure(std::gcd(_prim, _nn) == 1, "prim=%u has no inverse modulo %u",_prim,_nn);
+
+    _alphaTo.resize(_nn+1);
+    _indexOf.resize(_nn+1);
+    _indexOf[0] = _nn;  //log(0) = A0
+    _alphaTo[_nn] = 0;
+    uint32_t sr = 1;
+    for (uint32_t i = 0; i < _nn; i++) {
+        _indexOf[sr] = i;
+        _alphaTo[i] = sr;
+        sr <<= 1;
+        if (sr & (1U << _symSize)) sr ^= _poly;
+        sr &= _nn;
+    }
+    retassure(sr == 1, "Reed-Solomon field polynomial 0x%x is not primitive",_poly);
+
+    /* prim-th root of 1, needed to map the roots found by the chien search to locations */
+    for (_iprim = 1; (_iprim % _prim) != 0; _iprim += _nn);
+    _iprim /= _prim;
+}
+
+std::unique_ptr<ECCEngine> ReedSolomonEngine::create(const std::vector<std::string> &params){
+    uint32_t poly = 0x409;
+    uint32_t fcr = 0;
+    uint32_t prim = 1;
+    bool msbFirst = false;
+    for (size_t i = 0; i < params.size(); i++) {
+        const std::string &arg = params[i];
+        if (strncasecmp(arg.c_str(), "fcr=", 4) == 0) {
+            fcr = (uint32_t)parseNumber(arg.c_str()+4);
+        }else if (strncasecmp(arg.c_str(), "prim=", 5) == 0) {
+            prim = (uint32_t)parseNumber(arg.c_str()+5);
+        }else if (strcasecmp(arg.c_str(), "msb") == 0) {
+            msbFirst = true;
+        }else if (i == 0 && (poly = (uint32_t)parseNumber(arg.c_str()))) {
+            //field polynomial
+        }else{
+            reterror("unexpected Reed-Solomon arg '%s'",arg.c_str());
+        }
+    }
+    return std::make_unique<ReedSolomonEngine>(poly, fcr, prim, msbFirst);
+}
+
+#pragma mark private
+uint32_t ReedSolomonEngine::modnn(uint32_t x) const{
+    while (x >= _nn) {
+        x -= _nn;
+        x = (x >> _symSize) + (x & _nn);
+    }
+    return x;
+}
+
+std::vector<uint16_t> ReedSolomonEngine::generatorPoly(uint32_t nroots) const{
+    std::vector<uint16_t> ret(nroots+1);
+    ret[0] = 1;
+    for (uint32_t i = 0, root = modnn(_fcr*_prim); i < nroots; i++, root = modnn(root + _prim)) {
+        ret[i+1] = 1;
+        for (uint32_t j = i; j > 0; j--) {
+            if (ret[j] != 0) {
+                ret[j] = ret[j-1] ^ _alphaTo[modnn(_indexOf[ret[j]] + root)];
+            }else{
+                ret[j] = ret[j-1];
+            }
+        }
+        ret[0] = _alphaTo[modnn(_indexOf[ret[0]] + root)];
+    }
+    for (auto &g : ret) {
+        g = _indexOf[g];
+    }
+    return ret;
+}
+
+#pragma mark protected
+std::unique_ptr<ECCEngine::Decoder> ReedSolomonEngine::makeDecoder() const{
+    return std::make_unique<RSDecoder>(this);
+}
+
+#pragma mark public
+std::string ReedSolomonEngine::description() const{
+    char buf[96];
+    snprintf(buf, sizeof(buf), "Reed-Solomon poly 0x%x (%u bit symbols) fcr=%u prim=%u%s",_poly,_symSize,_fcr,_prim,_msbFirst ? " msb first" : "");
+    return buf;
+}
+
+void ReedSolomonEngine::checkGeometry(size_t dataSize, size_t eccSize) const{
+    const size_t k = (dataSize*8 + _symSize - 1) / _symSize;
+    const size_t nroots = eccSize*8 / _symSize;
+    retassure(dataSize, "Reed-Solomon codewords need data");
+    retassure(nroots >= 2, "Reed-Solomon with %u bit symbols needs at least %u ecc bytes, codeword has %zu",_symSize,(2*_symSize+7)/8,eccSize);
+    retassure(k + nroots <= _nn, "Codeword of %zu data and %zu ecc bytes is too long for %u bit Reed-Solomon symbols",dataSize,eccSize,_symSize);
+}
+
+uint32_t ReedSolomonEngine::strength(size_t eccSize) const{
+    return (uint32_t)(eccSize*8 / _symSize / 2);
+}
+
+void ReedSolomonEngine::encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const{
+    checkGeometry(dataSize, eccSize);
+    const uint32_t k = (uint32_t)((dataSize*8 + _symSize - 1) / _symSize);
+    const uint32_t nroots = (uint32_t)(eccSize*8 / _symSize);
+    const uint32_t A0 = _nn;
+    std::vector<uint16_t> genpoly = generatorPoly(nroots);
+    std::vector<uint16_t> parity(nroots);
+
+    /* lfsr division by the generator polynomial, as in Karn's encode_rs */
+    for (uint32_t i = 0; i < k; i++) {
+        uint32_t feedback = _indexOf[getSymbol(data, dataSize*8, (size_t)i*_symSize, _symSize, _msbFirst) ^ parity[0]];
+        if (feedback != A0) {
+            for (uint32_t j = 1; j < nroots; j++) {
+                parity[j] ^= _alphaTo[modnn(feedback + genpoly[nroots-j])];
+            }
+        }
+        memmove(&parity[0], &parity[1], (nroots-1)*sizeof(parity[0]));
+        parity[nroots-1] = (feedback != A0) ? _alphaTo[modnn(feedback + genpoly[0])] : 0;
+    }
+
+    memset(ecc, 0, eccSize);
+    for (uint32_t i = 0; i < nroots; i++) {
+        xorSymbol(ecc, eccSize*8, (size_t)i*_symSize, _symSize, parity[i], _msbFirst);
+    }
+}
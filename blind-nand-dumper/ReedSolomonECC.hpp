@@ -0,0 +1,55 @@
+//
+//  ReedSolomonECC.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ReedSolomonECC_hpp
+#define ReedSolomonECC_hpp
+
+#include "ECCEngine.hpp"
+
+/*
+    Reed-Solomon over GF(2^m), m is the degree of the field polynomial.
+    The data bytes are packed into m bit symbols followed by eccSize*8/m parity symbols,
+    as a bitstream which starts at the lowest bit of the first byte (or the highest one with msbFirst).
+    A last data symbol which is only partially covered by the data is padded with zero bits.
+    Codewords shorter than 2^m-1 symbols are shortened codes, the missing leading symbols are zero.
+ */
+class ReedSolomonEngine : public ECCEngine {
+    uint32_t _poly;
+    uint32_t _symSize;
+    uint32_t _nn;
+    uint32_t _fcr;
+    uint32_t _prim;
+    uint32_t _iprim;
+    bool _msbFirst;
+    std::vector<uint16_t> _alphaTo;
+    std::vector<uint16_t> _indexOf;
+
+    class RSDecoder;
+    uint32_t modnn(uint32_t x) const;
+    std::vector<uint16_t> generatorPoly(uint32_t nroots) const;
+protected:
+    virtual std::unique_ptr<Decoder> makeDecoder() const override;
+public:
+    /*
+        poly - field generator polynomial, 0x409 is x^10+x^3+1
+        fcr  - first consecutive root of the code generator polynomial, as an index
+        prim - primitive element to generate the roots, as an index
+     */
+    ReedSolomonEngine(uint32_t poly = 0x409, uint32_t fcr = 0, uint32_t prim = 1, bool msbFirst = false);
+
+    /*
+        [<poly>][,fcr=<num>][,prim=<num>][,msb]
+     */
+    static std::unique_ptr<ECCEngine> create(const std::vector<std::string> &params);
+
+    virtual std::string description() const override;
+    virtual void checkGeometry(size_t dataSize, size_t eccSize) const override;
+    virtual uint32_t strength(size_t eccSize) const override;
+    virtual void encode(const uint8_t *data, size_t dataSize, uint8_t *ecc, size_t eccSize) const override;
+};
+
+#endif /* ReedSolomonECC_hpp */
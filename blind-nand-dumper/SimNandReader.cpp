@@ -0,0 +1,201 @@
+//
+//  SimNandReader.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "SimNandReader.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <string.h>
+
+#define SIM_DEFAULT_CHIP_ID 0x0000009510dcda98ULL
+
+#pragma mark SimNandReader
+SimNandReader::SimNandReader(const char *imagePath, Config cfg)
+: _imagePath(imagePath), _cfg(cfg), _rng(cfg.seed)
+, _latchedCE(0), _latchedAddress(0), _rspOffset(0)
+{
+    retassure(_cfg.bitflipRate >= 0 && _cfg.bitflipRate < 1, "Invalid bitflip rate %f",_cfg.bitflipRate);
+    retassure(_cfg.failureRate >= 0 && _cfg.failureRate < 1, "Invalid failure rate %f",_cfg.failureRate);
+    _image = std::make_shared<FileMapping>(imagePath);
+    retassure(_image->mem(), "Simulation image '%s' can't be a dump container",imagePath);
+}
+
+SimNandReader::~SimNandReader(){
+    //
+}
+
+SimNandReader::Config SimNandReader::defaultConfig(){
+    return {
+        .chipID = SIM_DEFAULT_CHIP_ID,
+    };
+}
+
+#pragma mark private
+void SimNandReader::readImage(uint8_t CE, uint64_t page, uint32_t column, uint16_t pageSize, uint8_t *out, size_t size){
+    memset(out, 0xFF, size);
+    if (_cfg.cePages) {
+        /* pages past the end of a CE read as erased */
+        if (page >= _cfg.cePages) return;
+        page += CE*_cfg.cePages;
+    }
+    uint64_t offset = page*pageSize + column;
+    if (offset >= _image->memSize()) return;
+    memcpy(out, &_image->mem()[offset], std::min<uint64_t>(size, _image->memSize() - offset));
+}
+
+void SimNandReader::injectBitflips(uint8_t *buf, size_t size){
+    if (!_cfg.bitflipRate) return;
+    std::binomial_distribution<uint64_t> flipsDist(size*8, _cfg.bitflipRate);
+    std::uniform_int_distribution<uint64_t> bitDist(0, size*8 - 1);
+    for (uint64_t flips = flipsDist(_rng); flips; flips--) {
+        uint64_t bit = bitDist(_rng);
+        buf[bit/8] ^= 1 << (bit%8);
+    }
+}
+
+double SimNandReader::transferDelay(size_t bytes){
+    double wireUs = _cfg.bandwidth ? bytes*1e6/_cfg.bandwidth : 0;
+    /* the turnaround latency is hidden by the transfers in flight, the wire time is not */
+    double slotUs = std::max(wireUs, _cfg.latencyUs/std::max<uint32_t>(_transfersCnt, 1));
+    auto now = std::chrono::steady_clock::now();
+    if (_linkBusyUntil < now) _linkBusyUntil = now;
+    _linkBusyUntil += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(slotUs));
+    std::this_thread::sleep_until(_linkBusyUntil);
+    return _cfg.latencyUs + wireUs;
+}
+
+void SimNandReader::chipCommand(const uint8_t *payload, size_t payloadSize, uint16_t rspSize){
+    uint16_t cmdLen = 0;
+    uint16_t addrLen = 0;
+    uint16_t dataLen = 0;
+    size_t pos = 0;
+
+    retassure(payloadSize >= 1 + 2, "NAND command payload too short");
+    uint8_t CE = payload[pos++];
+    memcpy(&cmdLen, &payload[pos], 2); pos += 2;
+    retassure(pos + cmdLen + 2 <= payloadSize, "Malformed NAND command payload");
+    const uint8_t *cmd = &payload[pos]; pos += cmdLen;
+    memcpy(&addrLen, &payload[pos], 2); pos += 2;
+    retassure(pos + addrLen + 2 <= payloadSize, "Malformed NAND command payload");
+    const uint8_t *addr = &payload[pos]; pos += addrLen;
+    memcpy(&dataLen, &payload[pos], 2); pos += 2;
+    retassure(pos + dataLen <= payloadSize, "Malformed NAND command payload");
+
+    _rsp.assign(rspSize, 0xFF);
+    _rspOffset = 0;
+    for (uint16_t i = 0; i < cmdLen; i++) {
+        switch (cmd[i]) {
+            case 0x00: //READ, address cycles follow
+                if (addrLen) {
+                    _latchedAddress = 0;
+                    memcpy(&_latchedAddress, addr, std::min<size_t>(addrLen, sizeof(_latchedAddress)));
+                    _latchedCE = CE;
+                }
+                break;
+            case 0x30: //READ confirm
+            {
+                uint16_t pageSize = _cfg.pageSize ? (uint16_t)_cfg.pageSize : rspSize;
+                readImage(_latchedCE, _latchedAddress >> 16, _latchedAddress & 0xffff, pageSize, _rsp.data(), _rsp.size());
+                injectBitflips(_rsp.data(), _rsp.size());
+                break;
+            }
+            case 0x90: //READ ID
+                memcpy(_rsp.data(), &_cfg.chipID, std::min<size_t>(_rsp.size(), sizeof(_cfg.chipID)));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+#pragma mark public
+void SimNandReader::connectReader(const char *location){
+    if (location) _location = location;
+    debug("Simulating reader '%s' from '%s'",_location.c_str(),_imagePath.c_str());
+}
+
+void SimNandReader::disconnectReader(){
+    //
+}
+
+void SimNandReader::selectProtocol(t_ChipProtocol proto){
+    _chipProto = proto;
+}
+
+void SimNandReader::resetChip(){
+    _rsp.clear();
+    _rspOffset = 0;
+}
+
+void SimNandReader::recoverReader(){
+    disconnectReader();
+    connectReader();
+    resetChip();
+}
+
+void SimNandReader::executeBatch(NandCommandBatch &batch){
+    for (size_t i = 0; i < batch.stepsCnt(); i++) {
+        const NandCommandBatch::Step &step = batch.step(i);
+        const uint8_t *buf = batch.stepBuffer(i);
+        uint8_t bRequest = buf[1];
+        uint16_t wValue = buf[2] | (buf[3] << 8);
+        uint16_t wLength = buf[6] | (buf[7] << 8);
+        const uint8_t *payload = &buf[8];
+
+        transferDelay(wLength);
+        if (bRequest == kReaderCommandChipCommandSend) {
+            chipCommand(payload, wLength, wValue);
+        }else if (bRequest == kReaderCommandChipCommandReceive) {
+            retassure(_rspOffset + wLength <= _rsp.size(), "NAND command transfer %zu requested more data than available",i);
+            if (step.rsp) memcpy(step.rsp, &_rsp[_rspOffset], std::min<size_t>(wLength, step.rspSize));
+            _rspOffset += wLength;
+        }else{
+            reterror("Unexpected reader command %d in batch",bRequest);
+        }
+    }
+}
+
+void SimNandReader::dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg){
+    std::vector<uint8_t> buf(_transferSize);
+    std::uniform_real_distribution<double> failDist(0, 1);
+    const uint64_t fullSize = (uint64_t)pageSize*numPages;
+    uint64_t received = 0;
+    double latencySumUs = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    _lastDumpStats = {};
+
+    while (received < fullSize) {
+        size_t len = (size_t)std::min<uint64_t>(_transferSize, fullSize - received);
+        size_t filled = 0;
+        while (filled < len) {
+            uint64_t pos = received + filled;
+            uint32_t column = (uint32_t)(pos % pageSize);
+            size_t size = std::min<size_t>(len - filled, pageSize - column);
+            readImage(CE, pageAddress + pos / pageSize, column, pageSize, &buf[filled], size);
+            filled += size;
+        }
+        injectBitflips(buf.data(), len);
+
+        double latencyUs = transferDelay(len);
+        retassure(failDist(_rng) >= _cfg.failureRate, "Failed to read page data, simulated transfer failure");
+
+        if (!_lastDumpStats.transfers || latencyUs < _lastDumpStats.minLatencyUs) _lastDumpStats.minLatencyUs = latencyUs;
+        if (latencyUs > _lastDumpStats.maxLatencyUs) _lastDumpStats.maxLatencyUs = latencyUs;
+        latencySumUs += latencyUs;
+        _lastDumpStats.transfers++;
+        _lastDumpStats.bytes += len;
+        received += len;
+
+        if (!cbFunc(buf.data(), len, cbArg)) break;
+    }
+
+    _lastDumpStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (_lastDumpStats.transfers) _lastDumpStats.avgLatencyUs = latencySumUs / _lastDumpStats.transfers;
+}
@@ -0,0 +1,76 @@
+//
+//  SimNandReader.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef SimNandReader_hpp
+#define SimNandReader_hpp
+
+#include "NandReader.hpp"
+#include "FileMapping.hpp"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+    Reader backend which serves pages from an image file instead of a chip.
+    NAND commands are answered by a small chip model (READ 00/30, READ ID 90, everything else reads 0xFF).
+    The link is modelled by a fixed turnaround latency per transfer, which transfers in flight hide,
+    and a bandwidth limit. Reads can be disturbed with random bitflips and failing transfers.
+ */
+class SimNandReader : public NandReader {
+public:
+    struct Config{
+        uint64_t cePages;       /* pages per CE, CE n starts at page n*cePages of the image. 0 = every CE reads the whole image */
+        uint32_t pageSize;      /* page size of the chip model for NAND commands, 0 = size of the read */
+        double latencyUs;       /* turnaround time of a single transfer */
+        double bandwidth;       /* link bandwidth in bytes per second, 0 = unlimited */
+        double bitflipRate;     /* probability of every read bit to flip */
+        double failureRate;     /* probability of a dump transfer to fail */
+        uint64_t chipID;
+        uint32_t seed;
+    };
+private:
+    std::string _imagePath;
+    std::shared_ptr<FileMapping> _image;
+    Config _cfg;
+    std::string _location;
+    std::mt19937_64 _rng;
+    std::chrono::steady_clock::time_point _linkBusyUntil;
+
+    /* chip model */
+    uint8_t _latchedCE;
+    uint64_t _latchedAddress;
+    std::vector<uint8_t> _rsp;
+    size_t _rspOffset;
+
+    void readImage(uint8_t CE, uint64_t page, uint32_t column, uint16_t pageSize, uint8_t *out, size_t size);
+    void injectBitflips(uint8_t *buf, size_t size);
+    double transferDelay(size_t bytes);
+    void chipCommand(const uint8_t *payload, size_t payloadSize, uint16_t rspSize);
+public:
+    SimNandReader(const char *imagePath, Config cfg);
+    virtual ~SimNandReader() override;
+
+    static Config defaultConfig();
+
+    virtual void connectReader(const char *location = NULL) override;
+    virtual void disconnectReader() override;
+
+    virtual void selectProtocol(t_ChipProtocol proto) override;
+    virtual void resetChip() override;
+    virtual void recoverReader() override;
+
+    virtual void executeBatch(NandCommandBatch &batch) override;
+
+    virtual void dumpPages(uint8_t CE, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, f_dumpCB cbFunc, void *cbArg) override;
+};
+
+#endif /* SimNandReader_hpp */
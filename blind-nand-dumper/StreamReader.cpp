@@ -0,0 +1,446 @@
+//
+//  StreamReader.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifdef HAVE_CONFIG_H
+#   include <config.h>
+#endif //HAVE_CONFIG_H
+
+#include "StreamReader.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define STREAM_BUFFER_ALIGNMENT 0x1000
+
+#ifdef HAVE_LINUX_IO_URING_H
+namespace {
+/*
+    Just enough of io_uring for queueing reads, talks to the kernel directly so there is no liburing dependency
+ */
+class IOUring{
+    int _fd;
+    uint8_t *_sqRing;
+    size_t _sqRingSize;
+    uint8_t *_cqRing;
+    size_t _cqRingSize;
+    struct io_uring_sqe *_sqes;
+    size_t _sqesSize;
+
+    unsigned *_sqTail;
+    unsigned _sqMask;
+    unsigned *_sqArray;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe *_cqes;
+    uint32_t _toSubmit;
+public:
+    IOUring(unsigned entries)
+    : _fd(-1), _sqRing(NULL), _sqRingSize(0), _cqRing(NULL), _cqRingSize(0), _sqes(NULL), _sqesSize(0)
+    , _sqTail(NULL), _sqMask(0), _sqArray(NULL), _cqHead(NULL), _cqTail(NULL), _cqMask(0), _cqes(NULL), _toSubmit(0)
+    {
+        bool didInit = false;
+        cleanup([&]{
+            if (!didInit) this->~IOUring();
+        });
+        struct io_uring_params p = {};
+        void *ptr = NULL;
+        retassure((_fd = (int)syscall(__NR_io_uring_setup, entries, &p)) >= 0, "io_uring_setup failed with err=%d (%s)",errno,strerror(errno));
+
+        _sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+        _cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+        _sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+        retassure((ptr = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING)) != MAP_FAILED, "Failed to map sq ring with err=%d (%s)",errno,strerror(errno));
+        _sqRing = (uint8_t*)ptr;
+        retassure((ptr = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING)) != MAP_FAILED, "Failed to map cq ring with err=%d (%s)",errno,strerror(errno));
+        _cqRing = (uint8_t*)ptr;
+        retassure((ptr = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES)) != MAP_FAILED, "Failed to map sqes with err=%d (%s)",errno,strerror(errno));
+        _sqes = (struct io_uring_sqe*)ptr;
+
+        _sqTail = (unsigned*)&_sqRing[p.sq_off.tail];
+        _sqMask = *(unsigned*)&_sqRing[p.sq_off.ring_mask];
+        _sqArray = (unsigned*)&_sqRing[p.sq_off.array];
+        _cqHead = (unsigned*)&_cqRing[p.cq_off.head];
+        _cqTail = (unsigned*)&_cqRing[p.cq_off.tail];
+        _cqMask = *(unsigned*)&_cqRing[p.cq_off.ring_mask];
+        _cqes = (struct io_uring_cqe*)&_cqRing[p.cq_off.cqes];
+        didInit = true;
+    }
+    ~IOUring(){
+        if (_sqes) {
+            munmap(_sqes, _sqesSize); _sqes = NULL;
+        }
+        if (_cqRing) {
+            munmap(_cqRing, _cqRingSize); _cqRing = NULL;
+        }
+        if (_sqRing) {
+            munmap(_sqRing, _sqRingSize); _sqRing = NULL;
+        }
+        safeClose(_fd);
+    }
+
+    void queueReadv(int fd, const struct iovec *iov, uint64_t offset, uint64_t userData){
+        unsigned tail = *_sqTail;
+        unsigned idx = tail & _sqMask;
+        struct io_uring_sqe *sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        _sqArray[idx] = idx;
+        __atomic_store_n(_sqTail, tail+1, __ATOMIC_RELEASE);
+        _toSubmit++;
+    }
+
+    /*
+        Submits queued reads and waits until at least waitCnt completions are available
+     */
+    void enter(uint32_t waitCnt){
+        while (true) {
+            int didSubmit = (int)syscall(__NR_io_uring_enter, _fd, _toSubmit, waitCnt, waitCnt ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (didSubmit < 0 && errno == EINTR) continue;
+            retassure(didSubmit >= 0, "io_uring_enter failed with err=%d (%s)",errno,strerror(errno));
+            _toSubmit -= (uint32_t)didSubmit;
+            if (!_toSubmit) break;
+        }
+    }
+
+    bool reap(uint64_t &userData, int32_t &res){
+        unsigned head = *_cqHead;
+        if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) return false;
+        struct io_uring_cqe *cqe = &_cqes[head & _cqMask];
+        userData = cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(_cqHead, head+1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    static bool available(){
+        struct io_uring_params p = {};
+        int fd = (int)syscall(__NR_io_uring_setup, 1, &p);
+        if (fd < 0) return false;
+        close(fd);
+        return true;
+    }
+};
+}
+#endif
+
+#pragma mark StreamReader
+StreamReader::StreamReader(const char *path, bool direct, uint32_t queueDepth, size_t readSize, Backend backend)
+: _path(path), _fd(-1), _ownsFd(false), _seekable(false), _direct(direct), _size(0)
+, _queueDepth(queueDepth), _readSize(readSize), _backend(backend)
+{
+    bool didInit = false;
+    cleanup([&]{
+        if (!didInit) this->~StreamReader();
+    });
+    struct stat st = {};
+
+    retassure(_queueDepth, "Queue depth cannot be 0");
+    retassure(_readSize, "Read size cannot be 0");
+    _readSize = (_readSize + STREAM_BUFFER_ALIGNMENT-1) & ~((size_t)STREAM_BUFFER_ALIGNMENT-1);
+
+    if (_path == "-") {
+        _fd = STDIN_FILENO;
+    }else{
+        int flags = O_RDONLY;
+#ifdef O_DIRECT
+        if (_direct) flags |= O_DIRECT;
+#endif
+        if ((_fd = open(path, flags)) == -1 && _direct && errno == EINVAL) {
+            warning("'%s' does not support direct I/O, reading through the page cache",path);
+            _direct = false;
+            _fd = open(path, O_RDONLY);
+        }
+        retassure(_fd != -1, "Failed to open '%s' with err=%d (%s)",path,errno,strerror(errno));
+        _ownsFd = true;
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+        if (_direct) fcntl(_fd, F_NOCACHE, 1);
+#endif
+    }
+
+    retassure(!fstat(_fd, &st), "Failed to stat '%s' with err=%d (%s)",path,errno,strerror(errno));
+    if (S_ISREG(st.st_mode)) {
+        _seekable = true;
+        _size = st.st_size;
+    }else if (S_ISBLK(st.st_mode)) {
+        off_t end = lseek(_fd, 0, SEEK_END);
+        retassure(end >= 0, "Failed to get size of '%s' with err=%d (%s)",path,errno,strerror(errno));
+        _seekable = true;
+        _size = end;
+    }
+
+    if (!_seekable) {
+        if (_direct) warning("Direct I/O is not supported on pipes");
+        _direct = false;
+        _backend = kBackendRead;
+    }else if (_backend == kBackendRead) {
+        _backend = kBackendPread;
+    }
+    if (_backend == kBackendAuto || _backend == kBackendIOUring) {
+#ifdef HAVE_LINUX_IO_URING_H
+        bool haveIOUring = IOUring::available();
+#else
+        bool haveIOUring = false;
+#endif
+        if (!haveIOUring && _backend == kBackendIOUring) warning("io_uring is not available, falling back to pread");
+        _backend = (haveIOUring) ? kBackendIOUring : kBackendPread;
+    }
+
+    _slots.resize(_queueDepth);
+    for (auto &s : _slots) {
+        void *buf = NULL;
+        retassure(!posix_memalign(&buf, STREAM_BUFFER_ALIGNMENT, _readSize), "Failed to alloc read buffer");
+        s.buf = (uint8_t*)buf;
+    }
+
+    debug("Streaming '%s' with %s, %u reads of 0x%zx bytes in flight%s",path,backendName(_backend),_queueDepth,_readSize,_direct ? ", direct I/O" : "");
+    didInit = true;
+}
+
+StreamReader::~StreamReader(){
+    for (auto &s : _slots) {
+        safeFree(s.buf);
+    }
+    _slots.clear();
+    if (_ownsFd) safeClose(_fd);
+}
+
+#pragma mark private
+uint64_t StreamReader::readsCnt() const{
+    if (!_seekable) return UINT64_MAX;
+    return (_size + _readSize - 1) / _readSize;
+}
+
+/*
+    Reads until done reaches expected bytes at offset or the input ends, returns the new done.
+    O_DIRECT needs aligned offsets, buffers and lengths, so after a short read the next one
+    starts again at the last aligned position and reads the bytes before done a second time.
+ */
+size_t StreamReader::readAt(uint8_t *buf, uint64_t offset, size_t done, size_t expected){
+    while (done < expected) {
+        size_t pos = (_direct) ? done & ~((size_t)STREAM_BUFFER_ALIGNMENT-1) : done;
+        size_t len = (_direct) ? _readSize - pos : expected - pos;
+        ssize_t didRead = pread(_fd, &buf[pos], len, offset + pos);
+        if (didRead < 0 && errno == EINTR) continue;
+        retassure(didRead >= 0, "Failed to read '%s' at 0x%llx with err=%d (%s)",_path.c_str(),(unsigned long long)(offset + pos),errno,strerror(errno));
+        if (pos + didRead <= done) break;
+        done = std::min(pos + didRead, expected);
+    }
+    return done;
+}
+
+size_t StreamReader::fill(uint8_t *buf, uint64_t seq){
+    const uint64_t offset = seq*_readSize;
+    size_t done = 0;
+    if (_seekable) return readAt(buf, offset, 0, (size_t)std::min<uint64_t>(_readSize, _size - offset));
+    while (done < _readSize) {
+        ssize_t didRead = ::read(_fd, &buf[done], _readSize - done);
+        if (didRead < 0 && errno == EINTR) continue;
+        retassure(didRead >= 0, "Failed to read '%s' at 0x%llx with err=%d (%s)",_path.c_str(),(unsigned long long)(offset + done),errno,strerror(errno));
+        if (!didRead) break;
+        done += didRead;
+    }
+    return done;
+}
+
+bool StreamReader::readThreaded(f_chunkCB cb, void *cbArg){
+    /* a pipe can only be read in order by a single thread */
+    const uint32_t threadsCnt = (_backend == kBackendRead) ? 1 : _queueDepth;
+    const uint64_t total = readsCnt();
+    std::mutex lck;
+    std::condition_variable cond;
+    uint64_t consumed = 0;
+    uint64_t endSeq = total;
+    bool stop = false;
+    bool ret = true;
+    std::exception_ptr workerException = nullptr;
+    std::vector<std::thread> rthreads;
+
+    for (auto &s : _slots) {
+        s.done = false;
+    }
+
+    for (uint32_t i = 0; i < threadsCnt; i++) {
+        rthreads.push_back(std::thread([&](uint32_t tid){
+            try {
+                for (uint64_t seq = tid; true; seq += threadsCnt) {
+                    Slot &s = _slots[seq % _queueDepth];
+                    {
+                        std::unique_lock<std::mutex> ul(lck);
+                        cond.wait(ul, [&]{return stop || seq >= endSeq || seq < consumed + _queueDepth;});
+                        if (stop || seq >= endSeq) break;
+                    }
+                    size_t didRead = fill(s.buf, seq);
+                    {
+                        std::unique_lock<std::mutex> ul(lck);
+                        s.seq = seq;
+                        s.res = didRead;
+                        s.done = true;
+                        if (didRead < _readSize) endSeq = std::min(endSeq, seq+1);
+                    }
+                    cond.notify_all();
+                }
+            } catch (...) {
+                {
+                    std::unique_lock<std::mutex> ul(lck);
+                    if (!workerException) workerException = std::current_exception();
+                    stop = true;
+                }
+                cond.notify_all();
+            }
+        },i));
+    }
+
+    try {
+        for (uint64_t seq = 0; true; seq++) {
+            Slot &s = _slots[seq % _queueDepth];
+            {
+                std::unique_lock<std::mutex> ul(lck);
+                cond.wait(ul, [&]{return stop || seq >= endSeq || (s.done && s.seq == seq);});
+                if (stop || !(s.done && s.seq == seq)) break;
+            }
+            bool cont = !s.res || cb(s.buf, s.res, cbArg);
+            bool last = (size_t)s.res < _readSize;
+            {
+                std::unique_lock<std::mutex> ul(lck);
+                s.done = false;
+                consumed = seq+1;
+                if (!cont) stop = true;
+            }
+            cond.notify_all();
+            if (!cont) {
+                ret = false;
+                break;
+            }
+            if (last) break;
+        }
+    } catch (...) {
+        {
+            std::unique_lock<std::mutex> ul(lck);
+            stop = true;
+        }
+        cond.notify_all();
+        for (auto &t : rthreads) t.join();
+        throw;
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(lck);
+        stop = true;
+    }
+    cond.notify_all();
+    for (auto &t : rthreads) {
+        t.join();
+    }
+    if (workerException) std::rethrow_exception(workerException);
+    return ret;
+}
+
+bool StreamReader::readIOUring(f_chunkCB cb, void *cbArg){
+#ifdef HAVE_LINUX_IO_URING_H
+    const uint64_t total = readsCnt();
+    IOUring ring(_queueDepth);
+    std::vector<struct iovec> iovs(_queueDepth);
+    uint32_t inFlight = 0;
+    cleanup([&]{
+        /* the kernel may still write into the buffers, wait for every read before returning */
+        try {
+            while (inFlight) {
+                uint64_t userData = 0;
+                int32_t res = 0;
+                ring.enter(1);
+                while (ring.reap(userData, res)) inFlight--;
+            }
+        } catch (tihmstar::exception &e) {
+            error("Failed to drain io_uring: %s",e.what());
+        }
+    });
+
+    auto queueSlot = [&](uint64_t seq){
+        Slot &s = _slots[seq % _queueDepth];
+        struct iovec &iov = iovs[seq % _queueDepth];
+        iov.iov_base = s.buf;
+        iov.iov_len = _readSize;
+        s.seq = seq;
+        s.done = false;
+        ring.queueReadv(_fd, &iov, seq*_readSize, seq % _queueDepth);
+        inFlight++;
+    };
+
+    for (uint64_t seq = 0; seq < total && seq < _queueDepth; seq++) {
+        queueSlot(seq);
+    }
+
+    for (uint64_t seq = 0; seq < total; seq++) {
+        Slot &s = _slots[seq % _queueDepth];
+        while (!s.done) {
+            uint64_t userData = 0;
+            int32_t res = 0;
+            ring.enter(1);
+            while (ring.reap(userData, res)) {
+                Slot &done = _slots[userData];
+                inFlight--;
+                retassure(res >= 0, "Failed to read '%s' at 0x%llx with err=%d (%s)",_path.c_str(),(unsigned long long)(done.seq*_readSize),-res,strerror(-res));
+                done.res = res;
+                done.done = true;
+            }
+        }
+
+        uint64_t offset = seq*_readSize;
+        size_t expected = (size_t)std::min<uint64_t>(_readSize, _size - offset);
+        /* short reads are rare, finish them synchronously */
+        if ((size_t)s.res < expected) s.res = readAt(s.buf, offset, s.res, expected);
+
+        if (s.res && !cb(s.buf, s.res, cbArg)) return false;
+        if ((size_t)s.res < expected) break;
+        if (seq + _queueDepth < total) queueSlot(seq + _queueDepth);
+    }
+    return true;
+#else
+    reterror("Built without io_uring support");
+#endif
+}
+
+#pragma mark public
+const char *StreamReader::backendName(Backend backend){
+    switch (backend) {
+        case kBackendAuto:      return "auto";
+        case kBackendIOUring:   return "io_uring";
+        case kBackendPread:     return "pread";
+        case kBackendRead:      return "read";
+        default:                return "unknown";
+    }
+}
+
+bool StreamReader::read(f_chunkCB cbFunc, void *cbArg){
+    if (_seekable && !_size) return true;
+    if (_backend == kBackendIOUring) return readIOUring(cbFunc, cbArg);
+    return readThreaded(cbFunc, cbArg);
+}
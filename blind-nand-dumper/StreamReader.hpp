@@ -0,0 +1,89 @@
+//
+//  StreamReader.hpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef StreamReader_hpp
+#define StreamReader_hpp
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Reads a file, block device or pipe front to back without mapping it.
+    queueDepth reads of readSize bytes are kept in flight into a ring of aligned buffers,
+    which are handed to the consumer strictly in file order.
+    Seekable inputs use io_uring where available and pread threads otherwise, pipes are read sequentially.
+ */
+class StreamReader {
+public:
+    enum Backend{
+        kBackendAuto = 0,
+        kBackendIOUring,
+        kBackendPread,
+        kBackendRead,
+    };
+
+    /*
+        chunk     - next chunk of the input, valid until the callback returns
+        chunkSize - size of the chunk, only the last one may be smaller than readSize
+
+        return - true=continue reading, false=stop reading
+     */
+    using f_chunkCB = std::function<bool(const void *chunk, size_t chunkSize, void *userArg)>;
+
+private:
+    struct Slot{
+        uint8_t *buf;
+        uint64_t seq;
+        ssize_t res;
+        bool done;
+    };
+    std::string _path;
+    int _fd;
+    bool _ownsFd;
+    bool _seekable;
+    bool _direct;
+    uint64_t _size;
+    uint32_t _queueDepth;
+    size_t _readSize;
+    Backend _backend;
+    std::vector<Slot> _slots;
+
+    uint64_t readsCnt() const;
+    size_t readAt(uint8_t *buf, uint64_t offset, size_t done, size_t expected);
+    size_t fill(uint8_t *buf, uint64_t seq);
+    bool readThreaded(f_chunkCB cb, void *cbArg);
+    bool readIOUring(f_chunkCB cb, void *cbArg);
+public:
+    /*
+        path       - input, "-" is stdin
+        direct     - bypass the page cache with O_DIRECT (F_NOCACHE on darwin)
+        queueDepth - reads in flight
+        readSize   - size of a single read, rounded up to the alignment O_DIRECT needs
+     */
+    StreamReader(const char *path, bool direct = false, uint32_t queueDepth = 8, size_t readSize = 0x100000, Backend backend = kBackendAuto);
+    StreamReader(const StreamReader &) = delete;
+    StreamReader &operator=(const StreamReader &) = delete;
+    ~StreamReader();
+
+    /*
+        0 if the size is unknown (eg. a pipe)
+     */
+    inline uint64_t size() const{return _size;}
+    inline Backend backend() const{return _backend;}
+    static const char *backendName(Backend backend);
+
+    /*
+        Reads the whole input once, returns false if the callback stopped early.
+     */
+    bool read(f_chunkCB cbFunc, void *cbArg = NULL);
+};
+
+#endif /* StreamReader_hpp */
@@ -0,0 +1,476 @@
+//
+//  bench.cpp
+//  blind-nand-dumper
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ArgParse.hpp"
+#include "CodewordStats.hpp"
+#include "DumpGenerator.hpp"
+#include "DumpPipeline.hpp"
+#include "ECCCorrection.hpp"
+#include "ECCEngine.hpp"
+#include "FileMapping.hpp"
+#include "HammingECC.hpp"
+#include "PageScheduler.hpp"
+#include "ParallelDump.hpp"
+#include "ReedSolomonECC.hpp"
+#include "SimNandReader.hpp"
+
+#include <libgeneral/macros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define DEFAULT_BENCH_PAGES 0x10000
+#define DEFAULT_BENCH_PAGESIZE 2112
+#define DEFAULT_BENCH_PAGE_STRUCTURE "1:512:d,1:13:e,2:512:d,2:13:e,3:512:d,3:13:e,4:512:d,4:13:e"
+#define DEFAULT_BENCH_POLY 0x201b
+#define BENCH_PAGES_PER_BLOCK 64
+#define DEFAULT_BENCH_RETRIES 5
+#define BENCH_ENGINE_CODEWORDS 0x10000
+
+using namespace ECCCorrection;
+
+static struct option longopts[] = {
+    { "help",           no_argument,        NULL, 'h' },
+    { "input",          required_argument,  NULL, 'i' },
+    { "threads",        required_argument,  NULL, 'j' },
+    { "output",         required_argument,  NULL, 'o' },
+    { "pagesize",       required_argument,  NULL, 'p' },
+    { "bitflips",       required_argument,  NULL,  0  },
+    { "ecc",            required_argument,  NULL,  0  },
+    { "erased",         required_argument,  NULL,  0  },
+    { "erased-bitflips",required_argument,  NULL,  0  },
+    { "generate-only",  no_argument,        NULL,  0  },
+    { "numPages",       required_argument,  NULL,  0  },
+    { "page-structure", required_argument,  NULL,  0  },
+    { "retries",        required_argument,  NULL,  0  },
+    { "seed",           required_argument,  NULL,  0  },
+    { "simulate",       required_argument,  NULL,  0  },
+    { "uncorrectable",  required_argument,  NULL,  0  },
+    { "usb-transfers",  required_argument,  NULL,  0  },
+    { "usb-transfer-size",required_argument,NULL,  0  },
+    { NULL, 0, NULL, 0 }
+};
+
+void cmd_help(){
+    printf(
+           "Usage: bnd-bench [OPTIONS]\n"
+           "Generates a synthetic NAND dump and benchmarks ECC correction and the USB path on it\n"
+           "  -h, --help\t\t\t\t\tprints usage information\n"
+           "  -i, --input\t\t<PATH>\t\t\tBenchmark an existing dump instead of a generated one\n"
+           "  -j, --threads\t\t<num>\t\t\tMax number of threads (default: number of cpu cores)\n"
+           "  -o, --output\t\t<PATH>\t\t\tKeep the generated dump at <PATH>\n"
+           "  -p, --pagesize\t<size>\t\t\tSet page size (default: %d)\n"
+           "      --ecc\t\t<bch,poly,params>\tECC parameters, params r=swapbits i=inverse (default: bch,0x%x)\n"
+           "      --page-structure\t<N:size:type,...>\tPage structure (default: %s)\n"
+           "      --numPages\t<num>\t\t\tNumber of pages to generate (default: 0x%x)\n"
+           "      --generate-only\t\t\t\tOnly generate the dump, requires -o\n"
+           "\n"
+
+           "Generator:\n"
+           "      --bitflips\t<rate>\t\t\tProbability of every bit of a programmed codeword to flip (default: 1e-4)\n"
+           "      --erased\t\t<rate>\t\t\tShare of erased pages (default: 0.1)\n"
+           "      --erased-bitflips\t<rate>\t\t\tSame as --bitflips for erased pages (default: 1e-5)\n"
+           "      --uncorrectable\t<rate>\t\t\tShare of codewords with more bitflips than the ecc can correct (default: 0)\n"
+           "      --seed\t\t<num>\t\t\tGenerator seed\n"
+           "\n"
+
+           "USB path:\n"
+           "      --simulate\t<params>\t\tSimulated reader parameters as for bnd --simulate without the image (eg. latency=500,bandwidth=40e6)\n"
+           "      --retries\t<num>\t\t\tRetries after a failed transfer without progress (default: %d)\n"
+           "      --usb-transfers\t<num>\t\t\tNumber of USB transfers in flight\n"
+           "      --usb-transfer-size <size>\t\tSize of a single USB transfer\n"
+           "\n"
+           "Counts found by the decoder are checked against the generated dump, a mismatch fails the benchmark.\n"
+           "\n",
+           DEFAULT_BENCH_PAGESIZE, DEFAULT_BENCH_POLY, DEFAULT_BENCH_PAGE_STRUCTURE, DEFAULT_BENCH_PAGES, DEFAULT_BENCH_RETRIES
+           );
+}
+
+uint64_t codewordsCnt(const CodewordStats::Totals &t){
+    return t.good + t.corrected + t.uncorrectable + t.erased;
+}
+
+/*
+    Returns false if the decoder disagrees with what was generated.
+    BCH may miscorrect a codeword with more than strength bitflips into a different valid one,
+    so uncorrectable codewords may show up as corrected with 1 to strength bitflips instead.
+ */
+bool verifyCounters(const char *name, const CodewordStats::Totals &cnt, const DumpGenerator::Stats *expected, uint32_t strength){
+    if (!expected) return true;
+    const uint64_t miscorrected = expected->uncorrectableCodewords - std::min(cnt.uncorrectable, expected->uncorrectableCodewords);
+    if (cnt.good == expected->goodCodewords
+        && cnt.corrected == expected->correctableCodewords + miscorrected
+        && cnt.uncorrectable + miscorrected == expected->uncorrectableCodewords
+        && cnt.erased == expected->erasedCodewords
+        && cnt.correctedBitflips >= expected->bitflips + miscorrected
+        && cnt.correctedBitflips <= expected->bitflips + miscorrected*strength
+        && cnt.erasedBitflips == expected->erasedBitflips) {
+        if (miscorrected) info("%s: %llu uncorrectable codewords were miscorrected",name,(unsigned long long)miscorrected);
+        return true;
+    }
+    error("%s: decoder found good %llu corrected %llu (%llu bits) uncorrectable %llu erased %llu (%llu bits), expected good %llu corrected %llu (%llu bits) uncorrectable %llu erased %llu (%llu bits)",name,
+          (unsigned long long)cnt.good,(unsigned long long)cnt.corrected,(unsigned long long)cnt.correctedBitflips,
+          (unsigned long long)cnt.uncorrectable,(unsigned long long)cnt.erased,(unsigned long long)cnt.erasedBitflips,
+          (unsigned long long)expected->goodCodewords,(unsigned long long)expected->correctableCodewords,(unsigned long long)expected->bitflips,
+          (unsigned long long)expected->uncorrectableCodewords,(unsigned long long)expected->erasedCodewords,(unsigned long long)expected->erasedBitflips);
+    return false;
+}
+
+void printResult(const char *name, double seconds, uint64_t codewords, uint64_t bytes){
+    printf("%-24s %9.3fs %14.0f codewords/s %9.3f GB/s\n",name,seconds,codewords/seconds,bytes/seconds/1e9);
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+    Single threaded decoder of engine on cwCnt codewords it encoded itself, handed over batchCnt at a time like the codewords of a page.
+    Every codeword gets 0 to strength bitflips in its data, returns false if the decoder finds different ones.
+ */
+bool benchDecoder(const char *name, const ECCEngine &engine, size_t dataSize, size_t eccSize, uint64_t cwCnt, size_t batchCnt, uint64_t seed){
+    engine.checkGeometry(dataSize, eccSize);
+    const uint32_t strength = engine.strength(eccSize);
+    const size_t cwBytes = dataSize + eccSize;
+    std::vector<uint8_t> buf(cwCnt*cwBytes);
+    std::mt19937_64 rng(seed);
+    uint64_t expectedCorrected = 0;
+    uint64_t expectedBitflips = 0;
+
+    for (uint64_t i = 0; i < cwCnt; i++) {
+        uint8_t *cw = &buf[i*cwBytes];
+        for (size_t j = 0; j < dataSize; j += sizeof(uint64_t)) {
+            uint64_t v = rng();
+            memcpy(&cw[j], &v, std::min(sizeof(v), dataSize - j));
+        }
+        engine.encode(cw, dataSize, &cw[dataSize], eccSize);
+
+        uint32_t flips = (uint32_t)(rng() % (strength + 1));
+        std::vector<uint64_t> positions;
+        while (positions.size() < flips) {
+            uint64_t pos = rng() % (dataSize*8);
+            if (std::find(positions.begin(), positions.end(), pos) != positions.end()) continue;
+            positions.push_back(pos);
+            cw[pos >> 3] ^= 1 << (pos & 7);
+        }
+        if (flips) {
+            expectedCorrected++;
+            expectedBitflips += flips;
+        }
+    }
+
+    uint64_t corrected = 0;
+    uint64_t bitflips = 0;
+    uint64_t uncorrectable = 0;
+    std::vector<ECCEngine::Codeword> cws(batchCnt);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < cwCnt; i += batchCnt) {
+        size_t cnt = (size_t)std::min<uint64_t>(batchCnt, cwCnt - i);
+        for (size_t j = 0; j < cnt; j++) {
+            uint8_t *cw = &buf[(i+j)*cwBytes];
+            cws[j] = {
+                .data = cw,
+                .dataSize = dataSize,
+                .ecc = &cw[dataSize],
+                .eccSize = eccSize,
+                .bitflips = 0,
+            };
+        }
+        engine.decode(cws.data(), cnt);
+        for (size_t j = 0; j < cnt; j++) {
+            if (cws[j].bitflips < 0) {
+                uncorrectable++;
+            }else if (cws[j].bitflips > 0) {
+                corrected++;
+                bitflips += cws[j].bitflips;
+            }
+        }
+    }
+    printResult(name, secondsSince(start), cwCnt, cwCnt*cwBytes);
+
+    if (corrected == expectedCorrected && bitflips == expectedBitflips && !uncorrectable) return true;
+    error("%s: decoder found corrected %llu (%llu bits) uncorrectable %llu, expected corrected %llu (%llu bits) uncorrectable 0",name,
+          (unsigned long long)corrected,(unsigned long long)bitflips,(unsigned long long)uncorrectable,
+          (unsigned long long)expectedCorrected,(unsigned long long)expectedBitflips);
+    return false;
+}
+
+MAINFUNCTION
+int main_r(int argc, const char * argv[]) {
+    info("%s",VERSION_STRING);
+
+    int optindex = 0;
+    int opt = 0;
+
+    const char *inFile = NULL;
+    const char *outFile = NULL;
+    uint32_t maxThreads = 0;
+    uint64_t numPages = DEFAULT_BENCH_PAGES;
+    bool generateOnly = false;
+    std::string simParams;
+    uint32_t usbTransfersCnt = 0;
+    uint32_t usbTransferSize = 0;
+    int retries = DEFAULT_BENCH_RETRIES;
+
+    DumpGenerator::Config gcfg = DumpGenerator::defaultConfig();
+    gcfg.pageSize = DEFAULT_BENCH_PAGESIZE;
+    gcfg.pageStructure = parsePageStructure(DEFAULT_BENCH_PAGE_STRUCTURE);
+    gcfg.poly = DEFAULT_BENCH_POLY;
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "hi:j:o:p:", longopts, &optindex)) >= 0) {
+        switch (opt) {
+            case 0: //long opts
+            {
+                std::string curopt = longopts[optindex].name;
+                if (curopt == "bitflips") {
+                    gcfg.bitflipRate = atof(optarg);
+                }else if (curopt == "ecc") {
+                    std::string paramstring = optarg;
+                    size_t commaPos = paramstring.find(",");
+                    retassure(commaPos != std::string::npos && strncasecmp(optarg, "bch,", 4) == 0, "Only bch,<poly>[,r][,i] is supported");
+                    paramstring = paramstring.substr(commaPos+1);
+                    commaPos = paramstring.find(",");
+                    gcfg.poly = (uint32_t)parseNumber(paramstring.substr(0, commaPos).c_str());
+                    gcfg.swapBits = gcfg.invert = false;
+                    while (commaPos != std::string::npos) {
+                        paramstring = paramstring.substr(commaPos+1);
+                        commaPos = paramstring.find(",");
+                        std::string arg = paramstring.substr(0, commaPos);
+                        if (strcasecmp(arg.c_str(), "i") == 0) {
+                            gcfg.invert = true;
+                        }else if (strcasecmp(arg.c_str(), "r") == 0) {
+                            gcfg.swapBits = true;
+                        }else{
+                            reterror("unexpected BCH arg '%s'",arg.c_str());
+                        }
+                    }
+                }else if (curopt == "erased") {
+                    gcfg.erasedPageRate = atof(optarg);
+                }else if (curopt == "erased-bitflips") {
+                    gcfg.erasedBitflipRate = atof(optarg);
+                }else if (curopt == "generate-only") {
+                    generateOnly = true;
+                }else if (curopt == "numPages") {
+                    numPages = parseNumber(optarg);
+                }else if (curopt == "page-structure") {
+                    gcfg.pageStructure = parsePageStructure(optarg);
+                }else if (curopt == "retries") {
+                    retries = atoi(optarg);
+                }else if (curopt == "seed") {
+                    gcfg.seed = parseNumber(optarg);
+                }else if (curopt == "simulate") {
+                    simParams = optarg;
+                }else if (curopt == "uncorrectable") {
+                    gcfg.uncorrectableRate = atof(optarg);
+                }else if (curopt == "usb-transfers") {
+                    usbTransfersCnt = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "usb-transfer-size") {
+                    usbTransferSize = (uint32_t)parseNumber(optarg);
+                } else {
+                    error("Unknown long option '%s'",curopt.c_str());
+                    cmd_help();
+                    return -1;
+                }
+                break;
+            }
+            case 'h':
+                cmd_help();
+                return 0;
+            case 'i':
+                inFile = optarg;
+                break;
+            case 'j':
+                maxThreads = (uint32_t)parseNumber(optarg);
+                break;
+            case 'o':
+                outFile = optarg;
+                break;
+            case 'p':
+                gcfg.pageSize = (size_t)parseNumber(optarg);
+                break;
+            default:
+                cmd_help();
+                return -1;
+        }
+    }
+
+    if (!maxThreads) maxThreads = PageScheduler::defaultWorkersCnt();
+    retassure(gcfg.pageSize && gcfg.pageSize <= UINT16_MAX, "Invalid pagesize %zu",gcfg.pageSize);
+    retassure(!inFile || !outFile, "Either benchmark an input dump or generate one");
+    retassure(!generateOnly || outFile, "--generate-only requires an output file");
+
+    std::string dumpPath;
+    bool removeDump = false;
+    cleanup([&]{
+        if (removeDump) unlink(dumpPath.c_str());
+    });
+
+    std::unique_ptr<DumpGenerator::Stats> expected = nullptr;
+    std::shared_ptr<FileMapping> dump = nullptr;
+
+    if (inFile) {
+        dumpPath = inFile;
+        dump = std::make_shared<FileMapping>(inFile);
+        numPages = dump->memSize() / gcfg.pageSize;
+    }else{
+        if (outFile) {
+            dumpPath = outFile;
+        }else{
+            char tmpPath[] = "/tmp/bnd-bench.XXXXXX";
+            int fd = -1;
+            retassure((fd = mkstemp(tmpPath)) != -1, "Failed to create temporary dump with err=%d (%s)",errno,strerror(errno));
+            close(fd);
+            dumpPath = tmpPath;
+            removeDump = true;
+        }
+        std::shared_ptr<FileMapping> genmap = std::make_shared<FileMapping>(dumpPath.c_str(), true, numPages*gcfg.pageSize);
+        auto start = std::chrono::steady_clock::now();
+        expected = std::make_unique<DumpGenerator::Stats>(DumpGenerator::generate(genmap.get(), gcfg, maxThreads));
+        double seconds = secondsSince(start);
+        uint64_t codewords = expected->goodCodewords + expected->correctableCodewords + expected->uncorrectableCodewords + expected->erasedCodewords;
+        info("Generated %llu pages (%llu erased) at '%s': good %llu corrected %llu (%llu bits) uncorrectable %llu erased %llu (%llu bits)",
+             (unsigned long long)expected->pages,(unsigned long long)expected->erasedPages,dumpPath.c_str(),
+             (unsigned long long)expected->goodCodewords,(unsigned long long)expected->correctableCodewords,(unsigned long long)expected->bitflips,
+             (unsigned long long)expected->uncorrectableCodewords,(unsigned long long)expected->erasedCodewords,(unsigned long long)expected->erasedBitflips);
+        printResult("generate (bch_encode)", seconds, codewords, numPages*gcfg.pageSize);
+        if (generateOnly) return 0;
+        genmap = nullptr;
+        dump = std::make_shared<FileMapping>(dumpPath.c_str());
+    }
+    retassure(numPages, "Dump has no pages");
+
+    NandStructure nstructure = {{
+        .pageStructure = gcfg.pageStructure,
+        .startPage = 0,
+        .pagesCnt = 0,
+    }};
+    std::vector<CodewordPlan> plan = compileCodewordPlan(gcfg.pageStructure, gcfg.pageSize);
+    const int polyDegree = 31 - __builtin_clz(gcfg.poly);
+    BCHEngine engine(gcfg.poly, gcfg.swapBits, gcfg.invert);
+    const uint32_t strength = engine.strength(plan.front().eccSize);
+    const uint64_t dumpBytes = numPages*gcfg.pageSize;
+    bool failed = false;
+
+    {
+        /* single threaded decoder, erased codewords are skipped */
+        uint64_t codewords = 0;
+        uint64_t bytes = 0;
+        std::vector<uint8_t> scratch(gcfg.pageSize);
+        FileMapping::Cursor cursor(dump.get());
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t page = 0; page < numPages; page++) {
+            /* containers have no mapping, the cursor unpacks them */
+            const uint8_t *curPage = cursor.advance(page*gcfg.pageSize, gcfg.pageSize);
+            for (auto &cp : plan) {
+                if (checkErased(&curPage[cp.cwStart], cp.cwSize, &curPage[cp.eccStart], cp.eccSize, (int)(cp.eccSize*8/polyDegree)) >= 0) continue;
+                memcpy(&scratch[cp.cwStart], &curPage[cp.cwStart], cp.cwSize);
+                memcpy(&scratch[cp.eccStart], &curPage[cp.eccStart], cp.eccSize);
+                eccBCH(&scratch[cp.cwStart], cp.cwSize, &scratch[cp.eccStart], cp.eccSize, gcfg.poly, gcfg.swapBits, gcfg.invert);
+                codewords++;
+                bytes += cp.cwSize + cp.eccSize;
+            }
+        }
+        printResult("eccBCH", secondsSince(start), codewords, bytes);
+    }
+
+    {
+        /* the other engines don't fit the generated dump, they get codewords of their usual geometry */
+        const uint64_t cwCnt = std::min<uint64_t>(numPages*plan.size(), BENCH_ENGINE_CODEWORDS);
+        HammingEngine hamming;
+        ReedSolomonEngine rs;
+        failed |= !benchDecoder("hamming decode", hamming, 512, 3, cwCnt, plan.size(), gcfg.seed);
+        failed |= !benchDecoder("rs decode", rs, 512, 10, cwCnt, plan.size(), gcfg.seed);
+    }
+
+    {
+        std::vector<uint32_t> threadCounts;
+        for (uint32_t t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(maxThreads);
+        for (uint32_t t : threadCounts) {
+            char name[64];
+            snprintf(name, sizeof(name), "processPages %u threads", t);
+            CodewordStats cwStats(BENCH_PAGES_PER_BLOCK);
+            cbPage cb = makeECCCallback(engine, cwStats);
+            auto start = std::chrono::steady_clock::now();
+            processPages(dump.get(), NULL, gcfg.pageSize, nstructure, cb, NULL, t);
+            double seconds = secondsSince(start);
+            CodewordStats::Totals cnt = cwStats.totals();
+            printResult(name, seconds, codewordsCnt(cnt), dumpBytes);
+            failed |= !verifyCounters(name, cnt, expected.get(), strength);
+        }
+    }
+
+    if (dump->container()) {
+        info("Skipping the USB path, simulated readers can't serve a container");
+    }else{
+        std::string simImage;
+        SimNandReader::Config scfg = parseSimConfig((dumpPath + (simParams.size() ? "," + simParams : "")).c_str(), simImage);
+        SimNandReader reader(simImage.c_str(), scfg);
+        if (usbTransfersCnt || usbTransferSize) {
+            reader.setTransferConfig(usbTransfersCnt, usbTransferSize);
+        }
+        reader.connectReader();
+        reader.resetChip();
+
+        {
+            /* same path as the dumps of bnd, so simulated failures go through its retries */
+            int nullFd = -1;
+            cleanup([&]{
+                safeClose(nullFd);
+            });
+            retassure((nullFd = open("/dev/null", O_WRONLY)) != -1, "Failed to open /dev/null with err=%d (%s)",errno,strerror(errno));
+            ParallelDump dump({&reader}, 0, (uint16_t)gcfg.pageSize, retries, (uint32_t)numPages);
+            dump.addOutput(nullFd, NULL, {0}, (uint32_t)numPages);
+            auto start = std::chrono::steady_clock::now();
+            dump.run();
+            printResult("usb dump", secondsSince(start), numPages*plan.size(), dumpBytes);
+        }
+
+        {
+            /* DumpPipeline has no retries, it reads from a reader which doesn't fail */
+            std::unique_ptr<SimNandReader> stableReader = nullptr;
+            NandReader *pipelineReader = &reader;
+            if (scfg.failureRate > 0) {
+                SimNandReader::Config stableCfg = scfg;
+                stableCfg.failureRate = 0;
+                stableReader = std::make_unique<SimNandReader>(simImage.c_str(), stableCfg);
+                if (usbTransfersCnt || usbTransferSize) {
+                    stableReader->setTransferConfig(usbTransfersCnt, usbTransferSize);
+                }
+                stableReader->connectReader();
+                stableReader->resetChip();
+                pipelineReader = stableReader.get();
+            }
+            CodewordStats cwStats(BENCH_PAGES_PER_BLOCK);
+            DumpPipeline pipeline(gcfg.pageSize, nstructure, makeECCCallback(engine, cwStats), NULL, maxThreads);
+            auto start = std::chrono::steady_clock::now();
+            pipeline.run(*pipelineReader, 0, 0, (uint32_t)numPages);
+            double seconds = secondsSince(start);
+            CodewordStats::Totals cnt = cwStats.totals();
+            printResult("usb dump + ecc pipeline", seconds, codewordsCnt(cnt), dumpBytes);
+            if (scfg.bitflipRate == 0) failed |= !verifyCounters("usb dump + ecc pipeline", cnt, expected.get(), strength);
+        }
+    }
+
+    if (failed) {
+        error("Decoder results differ from the generated dump");
+        return -2;
+    }
+    info("Done");
+    return 0;
+}
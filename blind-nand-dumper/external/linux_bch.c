@@ -109,8 +109,8 @@ static __always_inline int fls(unsigned int x){
 #define GF_M(_p)               ((_p)->m)
 #define GF_T(_p)               ((_p)->t)
 #define GF_N(_p)               ((_p)->n)
-#define BCH_MAX_M              15 /* 2KB */
-#define BCH_MAX_T              64 /* 64 bit correction */
+#define BCH_MAX_M              16 /* 4KB */
+#define BCH_MAX_T              128 /* 128 bit correction */
 #endif
 
 #define BCH_ECC_WORDS(_p)      DIV_ROUND_UP(GF_M(_p)*GF_T(_p), 32)
@@ -118,6 +118,28 @@ static __always_inline int fls(unsigned int x){
 
 #define BCH_ECC_MAX_WORDS      DIV_ROUND_UP(BCH_MAX_M * BCH_MAX_T, 32)
 
+/*
+ * correction capability from which syndromes are computed through minimal
+ * polynomial remainders instead of bitwise evaluation (measured crossover)
+ */
+#ifndef BCH_SYN_TAB_MIN_T
+#define BCH_SYN_TAB_MIN_T      12
+#endif
+
+/*
+ * vector kernels may read/write up to this many words past the last ecc word
+ * of remainder buffers and lookup table rows
+ */
+#define BCH_SIMD_PAD_WORDS     8
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define BCH_HAVE_X86_KERNELS
+#   include <immintrin.h>
+#elif defined(__aarch64__)
+#   define BCH_HAVE_NEON_KERNELS
+#   include <arm_neon.h>
+#endif
+
 #ifndef dbg
 #define dbg(_fmt, args...)     do {} while (0)
 #endif
@@ -214,6 +236,233 @@ static void store_ecc8(struct bch_control *bch, uint8_t *dst,
     memcpy(dst, pad, BCH_ECC_BYTES(bch)-4*nwords);
 }
 
+/*
+ * read one 32-bit data word in big-endian format, honouring swap_bits
+ */
+static inline uint32_t load_data_word(const struct bch_control *bch,
+                      const uint32_t *pdata)
+{
+    uint32_t w = ntohl(*pdata);
+
+    if (bch->swap_bits)
+        w = (uint32_t)bitrev8(w) |
+            ((uint32_t)bitrev8(w >> 8) << 8) |
+            ((uint32_t)bitrev8(w >> 16) << 16) |
+            ((uint32_t)bitrev8(w >> 24) << 24);
+    return w;
+}
+
+/*
+ * split each 32-bit word into 4 polynomials of weight 8 as follows:
+ *
+ * 31 ...24  23 ...16  15 ... 8  7 ... 0
+ * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt
+ *                               tttttttt  mod g = r0 (precomputed)
+ *                     zzzzzzzz  00000000  mod g = r1 (precomputed)
+ *           yyyyyyyy  00000000  00000000  mod g = r2 (precomputed)
+ * xxxxxxxx  00000000  00000000  00000000  mod g = r3 (precomputed)
+ * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt  mod g = r0^r1^r2^r3
+ *
+ * All kernels below compute exactly this, they only differ in how many
+ * remainder words are combined per instruction. @r must be followed by
+ * BCH_SIMD_PAD_WORDS zero words.
+ */
+static void bch_encode_words_scalar(const struct bch_control *bch,
+                    const uint32_t *pdata, unsigned int mlen,
+                    uint32_t *r)
+{
+    const unsigned int l = BCH_ECC_WORDS(bch)-1;
+    const uint32_t * const tab0 = bch->mod8_tab;
+    const uint32_t * const tab1 = tab0 + 256*(l+1);
+    const uint32_t * const tab2 = tab1 + 256*(l+1);
+    const uint32_t * const tab3 = tab2 + 256*(l+1);
+    const uint32_t *p0, *p1, *p2, *p3;
+    unsigned int i;
+    uint32_t w;
+
+    while (mlen--) {
+        w = load_data_word(bch, pdata++) ^ r[0];
+        p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+        p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+        p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+        p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+        for (i = 0; i < l; i++)
+            r[i] = r[i+1]^p0[i]^p1[i]^p2[i]^p3[i];
+
+        r[l] = p0[l]^p1[l]^p2[l]^p3[l];
+    }
+}
+
+#if defined(BCH_HAVE_X86_KERNELS)
+__attribute__((target("sse2")))
+static void bch_encode_words_sse2(const struct bch_control *bch,
+                  const uint32_t *pdata, unsigned int mlen,
+                  uint32_t *r)
+{
+    const unsigned int l = BCH_ECC_WORDS(bch)-1;
+    const uint32_t * const tab0 = bch->mod8_tab;
+    const uint32_t * const tab1 = tab0 + 256*(l+1);
+    const uint32_t * const tab2 = tab1 + 256*(l+1);
+    const uint32_t * const tab3 = tab2 + 256*(l+1);
+    const uint32_t *p0, *p1, *p2, *p3;
+    unsigned int i;
+    uint32_t w;
+    __m128i v;
+
+    while (mlen--) {
+        w = load_data_word(bch, pdata++) ^ r[0];
+        p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+        p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+        p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+        p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+        for (i = 0; i <= l; i += 4) {
+            v = _mm_loadu_si128((const __m128i *)&r[i+1]);
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)&p0[i]));
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)&p1[i]));
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)&p2[i]));
+            v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)&p3[i]));
+            _mm_storeu_si128((__m128i *)&r[i], v);
+        }
+        /* drop partial results written past the last ecc word */
+        _mm_storeu_si128((__m128i *)&r[l+1], _mm_setzero_si128());
+    }
+}
+
+__attribute__((target("avx2")))
+static void bch_encode_words_avx2(const struct bch_control *bch,
+                  const uint32_t *pdata, unsigned int mlen,
+                  uint32_t *r)
+{
+    const unsigned int l = BCH_ECC_WORDS(bch)-1;
+    const uint32_t * const tab0 = bch->mod8_tab;
+    const uint32_t * const tab1 = tab0 + 256*(l+1);
+    const uint32_t * const tab2 = tab1 + 256*(l+1);
+    const uint32_t * const tab3 = tab2 + 256*(l+1);
+    const uint32_t *p0, *p1, *p2, *p3;
+    unsigned int i;
+    uint32_t w;
+    __m256i v;
+
+    while (mlen--) {
+        w = load_data_word(bch, pdata++) ^ r[0];
+        p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+        p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+        p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+        p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+        for (i = 0; i <= l; i += 8) {
+            v = _mm256_loadu_si256((const __m256i *)&r[i+1]);
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)&p0[i]));
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)&p1[i]));
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)&p2[i]));
+            v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)&p3[i]));
+            _mm256_storeu_si256((__m256i *)&r[i], v);
+        }
+        /* drop partial results written past the last ecc word */
+        _mm256_storeu_si256((__m256i *)&r[l+1], _mm256_setzero_si256());
+    }
+}
+#endif /* BCH_HAVE_X86_KERNELS */
+
+#if defined(BCH_HAVE_NEON_KERNELS)
+static void bch_encode_words_neon(const struct bch_control *bch,
+                  const uint32_t *pdata, unsigned int mlen,
+                  uint32_t *r)
+{
+    const unsigned int l = BCH_ECC_WORDS(bch)-1;
+    const uint32_t * const tab0 = bch->mod8_tab;
+    const uint32_t * const tab1 = tab0 + 256*(l+1);
+    const uint32_t * const tab2 = tab1 + 256*(l+1);
+    const uint32_t * const tab3 = tab2 + 256*(l+1);
+    const uint32_t *p0, *p1, *p2, *p3;
+    unsigned int i;
+    uint32_t w;
+    uint32x4_t v;
+
+    while (mlen--) {
+        w = load_data_word(bch, pdata++) ^ r[0];
+        p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+        p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+        p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+        p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+        for (i = 0; i <= l; i += 4) {
+            v = vld1q_u32(&r[i+1]);
+            v = veorq_u32(v, vld1q_u32(&p0[i]));
+            v = veorq_u32(v, vld1q_u32(&p1[i]));
+            v = veorq_u32(v, vld1q_u32(&p2[i]));
+            v = veorq_u32(v, vld1q_u32(&p3[i]));
+            vst1q_u32(&r[i], v);
+        }
+        /* drop partial results written past the last ecc word */
+        vst1q_u32(&r[l+1], vdupq_n_u32(0));
+    }
+}
+#endif /* BCH_HAVE_NEON_KERNELS */
+
+/*
+ * ordered by preference; the remainder update is latency bound by the r[0]
+ * dependency, so vector kernels only pay off once there are enough ecc words
+ * per step (min_words was measured, the scalar loop wins below it)
+ */
+static const struct {
+    const char *name;
+    bch_encode_words_fn fn;
+    unsigned int min_words;
+} bch_kernels[] = {
+#if defined(BCH_HAVE_X86_KERNELS)
+    { "avx2",   bch_encode_words_avx2,  12 },
+    { "sse2",   bch_encode_words_sse2,   8 },
+#endif
+#if defined(BCH_HAVE_NEON_KERNELS)
+    { "neon",   bch_encode_words_neon,   8 },
+#endif
+    { "scalar", bch_encode_words_scalar, 0 },
+};
+
+static int bch_kernel_supported(const char *name)
+{
+#if defined(BCH_HAVE_X86_KERNELS)
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+/**
+ * bch_select_kernel - select remainder computation kernel
+ * @bch:   BCH control structure
+ * @name:  kernel name ("avx2", "sse2", "neon", "scalar") or NULL for the
+ *         fastest one supported by the running cpu for this ecc size
+ *
+ * Returns:
+ *  0 on success, -EINVAL if the kernel is unknown or not supported
+ *
+ * All kernels produce bit-identical ecc, this only exists for benchmarking
+ * and verification.
+ */
+int bch_select_kernel(struct bch_control *bch, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(bch_kernels); i++) {
+        if (name && strcmp(name, bch_kernels[i].name))
+            continue;
+        if (!name && BCH_ECC_WORDS(bch) < bch_kernels[i].min_words)
+            continue;
+        if (!bch_kernel_supported(bch_kernels[i].name))
+            continue;
+        bch->encode_words = bch_kernels[i].fn;
+        bch->kernel_name = bch_kernels[i].name;
+        return 0;
+    }
+    return -EINVAL;
+}
+
 /**
  * bch_encode - calculate BCH ecc parity of data
  * @bch:   BCH control structure
@@ -231,16 +480,11 @@ static void store_ecc8(struct bch_control *bch, uint8_t *dst,
 void bch_encode(struct bch_control *bch, const uint8_t *data,
         unsigned int len, uint8_t *ecc)
 {
-    const unsigned int l = BCH_ECC_WORDS(bch)-1;
-    unsigned int i, mlen;
+    unsigned int mlen;
     unsigned long m;
-    uint32_t w, r[BCH_ECC_MAX_WORDS];
+    uint32_t r[BCH_ECC_MAX_WORDS+BCH_SIMD_PAD_WORDS+1];
     const size_t r_bytes = BCH_ECC_WORDS(bch) * sizeof(*r);
-    const uint32_t * const tab0 = bch->mod8_tab;
-    const uint32_t * const tab1 = tab0 + 256*(l+1);
-    const uint32_t * const tab2 = tab1 + 256*(l+1);
-    const uint32_t * const tab3 = tab2 + 256*(l+1);
-    const uint32_t *pdata, *p0, *p1, *p2, *p3;
+    const uint32_t *pdata;
 
     if (WARN_ON(r_bytes > sizeof(r)))
         return;
@@ -267,37 +511,10 @@ void bch_encode(struct bch_control *bch, const uint8_t *data,
     data += 4*mlen;
     len  -= 4*mlen;
     memcpy(r, bch->ecc_buf, r_bytes);
+    memset((uint8_t *)r + r_bytes, 0, sizeof(r) - r_bytes);
 
-    /*
-     * split each 32-bit word into 4 polynomials of weight 8 as follows:
-     *
-     * 31 ...24  23 ...16  15 ... 8  7 ... 0
-     * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt
-     *                               tttttttt  mod g = r0 (precomputed)
-     *                     zzzzzzzz  00000000  mod g = r1 (precomputed)
-     *           yyyyyyyy  00000000  00000000  mod g = r2 (precomputed)
-     * xxxxxxxx  00000000  00000000  00000000  mod g = r3 (precomputed)
-     * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt  mod g = r0^r1^r2^r3
-     */
-    while (mlen--) {
-        /* input data is read in big-endian format */
-        w = ntohl(*pdata++);
-        if (bch->swap_bits)
-            w = (uint32_t)swap_bits(bch, w) |
-                ((uint32_t)swap_bits(bch, w >> 8) << 8) |
-                ((uint32_t)swap_bits(bch, w >> 16) << 16) |
-                ((uint32_t)swap_bits(bch, w >> 24) << 24);
-        w ^= r[0];
-        p0 = tab0 + (l+1)*((w >>  0) & 0xff);
-        p1 = tab1 + (l+1)*((w >>  8) & 0xff);
-        p2 = tab2 + (l+1)*((w >> 16) & 0xff);
-        p3 = tab3 + (l+1)*((w >> 24) & 0xff);
-
-        for (i = 0; i < l; i++)
-            r[i] = r[i+1]^p0[i]^p1[i]^p2[i]^p3[i];
+    bch->encode_words(bch, pdata, mlen, r);
 
-        r[l] = p0[l]^p1[l]^p2[l]^p3[l];
-    }
     memcpy(bch->ecc_buf, r, r_bytes);
 
     /* process last unaligned bytes */
@@ -390,14 +607,24 @@ static inline int a_ilog(struct bch_control *bch, unsigned int x)
 
 /*
  * compute 2t syndromes of ecc polynomial, i.e. ecc(a^j) for j=1..2t
+ *
+ * Instead of evaluating every set ecc bit at every a^j, the ecc polynomial is
+ * first reduced modulo the minimal polynomial m_j(X) of each odd a^j, one byte
+ * at a time like a CRC (see build_syndrome_tables). ecc(a^j) equals the small
+ * remainder evaluated at a^j, which costs at most m lookups. For large t this
+ * is several times faster than the bitwise evaluation, which is still used
+ * for small t.
  */
 static void compute_syndromes(struct bch_control *bch, uint32_t *ecc,
                   unsigned int *syn)
 {
-    int i, j, s;
-    unsigned int m;
+    int i, j, s, b;
+    unsigned int m, e, d, pad, v;
     uint32_t poly;
     const int t = GF_T(bch);
+    const int words = BCH_ECC_WORDS(bch);
+    unsigned int *rem = (unsigned int *)bch->cache;
+    const uint32_t *tab;
 
     s = bch->ecc_bits;
 
@@ -405,21 +632,60 @@ static void compute_syndromes(struct bch_control *bch, uint32_t *ecc,
     m = ((unsigned int)s) & 31;
     if (m)
         ecc[s/32] &= ~((1u << (32-m))-1);
-    memset(syn, 0, 2*t*sizeof(*syn));
-
-    /* compute v(a^j) for j=1 .. 2t-1 */
-    do {
-        poly = *ecc++;
-        s -= 32;
-        while (poly) {
-            i = deg(poly);
-            for (j = 0; j < 2*t; j += 2)
-                syn[j] ^= a_pow(bch, (j+1)*(i+s));
-
-            poly ^= (1 << i);
+
+    if (t < BCH_SYN_TAB_MIN_T) {
+        /* few syndromes: evaluate every set ecc bit directly */
+        memset(syn, 0, 2*t*sizeof(*syn));
+        do {
+            poly = *ecc++;
+            s -= 32;
+            while (poly) {
+                i = deg(poly);
+                /*
+                 * walk the exponents (j+1)*(i+s) incrementally instead
+                 * of reducing a product modulo n for every syndrome
+                 */
+                e = modulo(bch, i+s);
+                d = mod_s(bch, 2*e);
+                for (j = 0; j < 2*t; j += 2) {
+                    syn[j] ^= bch->a_pow_tab[e];
+                    e = mod_s(bch, e+d);
+                }
+                poly ^= (1 << i);
+            }
+        } while (s > 0);
+        goto squares;
+    }
+
+    /* reduce ecc(X).X^pad modulo m_j(X), msb first */
+    memset(rem, 0, t*sizeof(*rem));
+    for (i = 0; i < words; i++) {
+        poly = ecc[i];
+        for (b = 24; b >= 0; b -= 8) {
+            v = (poly >> b) & 0xff;
+            for (j = 0; j < t; j++) {
+                d = bch->syn_mdeg[j];
+                tab = bch->syn_mod_tab + 256*j;
+                e = (rem[j] << 8) | v;
+                rem[j] = (e & ((1u << d)-1)) ^ tab[e >> d];
+            }
+        }
+    }
+
+    /* evaluate remainders at a^(2j+1) and undo the X^pad shift */
+    pad = 32*words-bch->ecc_bits;
+    for (j = 0; j < t; j++) {
+        e = 2*j+1;
+        v = 0;
+        for (poly = rem[j], i = 0; poly; poly >>= 1, i++) {
+            if (poly & 1)
+                v ^= a_pow(bch, e*i);
         }
-    } while (s > 0);
+        syn[2*j] = v ? a_pow(bch, a_log(bch, v)+GF_N(bch)-
+                     modulo(bch, e*pad)) : 0;
+    }
 
+squares:
     /* v(a^(2j)) = v(a^j)^2 */
     for (j = 0; j < t; j++)
         syn[2*j+1] = gf_sqr(bch, syn[j]);
@@ -933,11 +1199,18 @@ static int find_poly_roots(struct bch_control *bch, unsigned int k,
         cnt = find_poly_deg2_roots(bch, poly, roots);
         break;
     case 3:
-        cnt = find_poly_deg3_roots(bch, poly, roots);
-        break;
+        /* the affine solver works on a 16x16 bit matrix, i.e. m < 16 */
+        if (GF_M(bch) < 16) {
+            cnt = find_poly_deg3_roots(bch, poly, roots);
+            break;
+        }
+        /* fallthrough */
     case 4:
-        cnt = find_poly_deg4_roots(bch, poly, roots);
-        break;
+        if (GF_M(bch) < 16) {
+            cnt = find_poly_deg4_roots(bch, poly, roots);
+            break;
+        }
+        /* fallthrough */
     default:
         /* factor polynomial using Berlekamp Trace Algorithm (BTA) */
         cnt = 0;
@@ -1209,6 +1482,55 @@ static int build_deg2_base(struct bch_control *bch)
     return remaining ? -1 : 0;
 }
 
+/*
+ * build byte-wise reduction tables modulo the minimal polynomials of
+ * a^1, a^3, ..., a^(2t-1) for compute_syndromes()
+ */
+static int build_syndrome_tables(struct bch_control *bch)
+{
+    const unsigned int t = GF_T(bch);
+    unsigned int j, k, c, d, r, bit;
+    uint32_t mpoly, v;
+    unsigned int g[BCH_MAX_M+1];
+
+    for (j = 0; j < t; j++) {
+        /* m_j(X) = prod(X+a^c) over the cyclotomic coset c = e.2^k */
+        g[0] = 1;
+        d = 0;
+        c = 2*j+1;
+        do {
+            if (d >= BCH_MAX_M)
+                return -1;
+            r = bch->a_pow_tab[c];
+            g[d+1] = 1;
+            for (k = d; k > 0; k--)
+                g[k] = gf_mul(bch, g[k], r)^g[k-1];
+            g[0] = gf_mul(bch, g[0], r);
+            d++;
+            c = mod_s(bch, 2*c);
+        } while (c != 2*j+1);
+
+        /* coefficients of a minimal polynomial are binary */
+        for (k = 0, mpoly = 0; k <= d; k++) {
+            if (g[k] > 1)
+                return -1;
+            mpoly |= g[k] << k;
+        }
+        bch->syn_mdeg[j] = d;
+
+        /* tab[v] = (v(X).X^d) mod m_j(X) */
+        for (v = 0; v < 256; v++) {
+            uint32_t val = v << d;
+            for (bit = d+7; bit >= d; bit--) {
+                if (val & (1u << bit))
+                    val ^= mpoly << (bit-d);
+            }
+            bch->syn_mod_tab[256*j+v] = val;
+        }
+    }
+    return 0;
+}
+
 static void *bch_alloc(size_t size, int *err)
 {
     void *ptr;
@@ -1219,6 +1541,27 @@ static void *bch_alloc(size_t size, int *err)
     return ptr;
 }
 
+/*
+ * allocate the per-decoder work buffers, which must not be shared between
+ * concurrent users of the same lookup tables
+ */
+static void bch_alloc_scratch(struct bch_control *bch, int *err)
+{
+    const unsigned int t = GF_T(bch);
+    const unsigned int words = BCH_ECC_WORDS(bch);
+    unsigned int i;
+
+    bch->errloc    = bch_alloc(t*sizeof(*bch->errloc), err);
+    bch->ecc_buf   = bch_alloc(words*sizeof(*bch->ecc_buf), err);
+    bch->ecc_buf2  = bch_alloc(words*sizeof(*bch->ecc_buf2), err);
+    bch->syn       = bch_alloc(2*t*sizeof(*bch->syn), err);
+    bch->cache     = bch_alloc(2*t*sizeof(*bch->cache), err);
+    bch->elp       = bch_alloc((t+1)*sizeof(struct gf_poly_deg1), err);
+
+    for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
+        bch->poly_2t[i] = bch_alloc(GF_POLY_SZ(2*t), err);
+}
+
 /*
  * compute generator polynomial for given (m,t) parameters.
  */
@@ -1288,7 +1631,7 @@ finish:
 
 /**
  * bch_init - initialize a BCH encoder/decoder
- * @m:          Galois field order, should be in the range 5-15
+ * @m:          Galois field order, should be in the range 5-16
  * @t:          maximum error correction capability, in bits
  * @prim_poly:  user-provided primitive polynomial (or 0 to use default)
  * @swap_bits:  swap bits within data and syndrome bytes
@@ -1312,7 +1655,7 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
                  bool swap_bits, int ecc_bytes)
 {
     int err = 0;
-    unsigned int i, words;
+    unsigned int words;
     uint32_t *genpoly;
     struct bch_control *bch = NULL;
 
@@ -1331,7 +1674,7 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
     /* default primitive polynomials */
     static const unsigned int prim_poly_tab[] = {
         0x25, 0x43, 0x83, 0x11d, 0x211, 0x409, 0x805, 0x1053, 0x201b,
-        0x402b, 0x8003,
+        0x402b, 0x8003, 0x1100b,
     };
 
 #if defined(CONFIG_BCH_CONST_PARAMS)
@@ -1344,15 +1687,15 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
 #endif
     if ((m < min_m) || (m > BCH_MAX_M))
         /*
-         * values of m greater than 15 are not currently supported;
-         * supporting m > 15 would require changing table base type
-         * (uint16_t) and a small patch in matrix transposition
+         * values of m greater than 16 are not supported, field elements
+         * must fit the uint16_t tables; for m == 16 degree 3 and 4
+         * polynomials are factored with BTA instead of the affine solver
          */
         goto fail;
 
     if (t > BCH_MAX_T)
         /*
-         * we can support larger than 64 bits if necessary, at the
+         * we can support larger than 128 bits if necessary, at the
          * cost of higher stack usage.
          */
         goto fail;
@@ -1370,7 +1713,6 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
     if (bch == NULL)
         goto fail;
 
-    bch->errloc = kzalloc(sizeof(bch->errloc)*t, GFP_KERNEL);
     bch->m = m;
     bch->t = t;
     bch->n = (1 << m)-1;
@@ -1378,17 +1720,16 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
     bch->ecc_bytes = DIV_ROUND_UP(m*t, 8);
     bch->a_pow_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_pow_tab), &err);
     bch->a_log_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_log_tab), &err);
-    bch->mod8_tab  = bch_alloc(words*1024*sizeof(*bch->mod8_tab), &err);
-    bch->ecc_buf   = bch_alloc(words*sizeof(*bch->ecc_buf), &err);
-    bch->ecc_buf2  = bch_alloc(words*sizeof(*bch->ecc_buf2), &err);
+    bch->mod8_tab  = bch_alloc((words*1024+BCH_SIMD_PAD_WORDS)*sizeof(*bch->mod8_tab), &err);
     bch->xi_tab    = bch_alloc(m*sizeof(*bch->xi_tab), &err);
-    bch->syn       = bch_alloc(2*t*sizeof(*bch->syn), &err);
-    bch->cache     = bch_alloc(2*t*sizeof(*bch->cache), &err);
-    bch->elp       = bch_alloc((t+1)*sizeof(struct gf_poly_deg1), &err);
+    if (t >= BCH_SYN_TAB_MIN_T) {
+        /* only read by the table driven path of compute_syndromes() */
+        bch->syn_mdeg  = bch_alloc(t*sizeof(*bch->syn_mdeg), &err);
+        bch->syn_mod_tab = bch_alloc(256*t*sizeof(*bch->syn_mod_tab), &err);
+    }
     bch->swap_bits = swap_bits;
 
-    for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
-        bch->poly_2t[i] = bch_alloc(GF_POLY_SZ(2*t), &err);
+    bch_alloc_scratch(bch, &err);
 
     if (err)
         goto fail;
@@ -1409,6 +1750,16 @@ struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
     if (err)
         goto fail;
 
+    if (t >= BCH_SYN_TAB_MIN_T) {
+        err = build_syndrome_tables(bch);
+        if (err)
+            goto fail;
+    }
+
+    err = bch_select_kernel(bch, NULL);
+    if (err)
+        goto fail;
+
     return bch;
 
 fail:
@@ -1417,6 +1768,51 @@ fail:
 }
 //EXPORT_SYMBOL_GPL(bch_init);
 
+/**
+ * bch_clone - create a BCH decoder sharing the lookup tables of another one
+ * @bch:        initialized BCH control structure
+ *
+ * Returns:
+ *  a newly allocated BCH control structure if successful, NULL otherwise
+ *
+ * The clone references the Galois field and remainder tables of @bch instead
+ * of rebuilding them, but owns its own work buffers. This allows one decoder
+ * per thread for the cost of a few small allocations. @bch must outlive all of
+ * its clones.
+ */
+struct bch_control *bch_clone(const struct bch_control *bch)
+{
+    int err = 0;
+    struct bch_control *clone;
+
+    clone = kzalloc(sizeof(*clone), GFP_KERNEL);
+    if (clone == NULL)
+        return NULL;
+
+    clone->m = bch->m;
+    clone->n = bch->n;
+    clone->t = bch->t;
+    clone->ecc_bits = bch->ecc_bits;
+    clone->ecc_bytes = bch->ecc_bytes;
+    clone->a_pow_tab = bch->a_pow_tab;
+    clone->a_log_tab = bch->a_log_tab;
+    clone->mod8_tab = bch->mod8_tab;
+    clone->xi_tab = bch->xi_tab;
+    clone->syn_mdeg = bch->syn_mdeg;
+    clone->syn_mod_tab = bch->syn_mod_tab;
+    clone->swap_bits = bch->swap_bits;
+    clone->encode_words = bch->encode_words;
+    clone->kernel_name = bch->kernel_name;
+    clone->shared_tables = true;
+
+    bch_alloc_scratch(clone, &err);
+    if (err) {
+        bch_free(clone);
+        return NULL;
+    }
+    return clone;
+}
+
 /**
  *  bch_free - free the BCH control structure
  *  @bch:    BCH control structure to release
@@ -1427,12 +1823,16 @@ void bch_free(struct bch_control *bch)
 
     if (bch) {
         kfree(bch->errloc);
-        kfree(bch->a_pow_tab);
-        kfree(bch->a_log_tab);
-        kfree(bch->mod8_tab);
+        if (!bch->shared_tables) {
+            kfree(bch->a_pow_tab);
+            kfree(bch->a_log_tab);
+            kfree(bch->mod8_tab);
+            kfree(bch->xi_tab);
+            kfree(bch->syn_mdeg);
+            kfree(bch->syn_mod_tab);
+        }
         kfree(bch->ecc_buf);
         kfree(bch->ecc_buf2);
-        kfree(bch->xi_tab);
         kfree(bch->syn);
         kfree(bch->cache);
         kfree(bch->elp);
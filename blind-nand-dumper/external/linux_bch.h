@@ -22,6 +22,12 @@ extern "C" {
 #endif
 
 
+struct bch_control;
+
+typedef void (*bch_encode_words_fn)(const struct bch_control *bch,
+                    const uint32_t *pdata, unsigned int mlen,
+                    uint32_t *r);
+
 /**
  * struct bch_control - BCH control structure
  * @m:          Galois field order
@@ -35,11 +41,17 @@ extern "C" {
  * @ecc_buf:    ecc parity words buffer
  * @ecc_buf2:   ecc parity words buffer
  * @xi_tab:     GF(2^m) base for solving degree 2 polynomial roots
+ * @syn_mdeg:   degrees of the minimal polynomials of a^(2j+1), j=0..t-1
+ * @syn_mod_tab: byte-wise reduction tables modulo those minimal polynomials
  * @syn:        syndrome buffer
  * @cache:      log-based polynomial representation buffer
  * @elp:        error locator polynomial
  * @poly_2t:    temporary polynomials of degree 2t
  * @swap_bits:  swap bits within data and syndrome bytes
+ * @errloc:     error locations found by the last decode
+ * @shared_tables: lookup tables are borrowed from another bch_control
+ * @encode_words: remainder kernel selected by bch_select_kernel()
+ * @kernel_name: name of the selected remainder kernel
  */
 struct bch_control {
     unsigned int    m;
@@ -54,19 +66,28 @@ struct bch_control {
     uint32_t       *ecc_buf;
     uint32_t       *ecc_buf2;
     unsigned int   *xi_tab;
+    unsigned int   *syn_mdeg;
+    uint32_t       *syn_mod_tab;
     unsigned int   *syn;
     int            *cache;
     struct gf_poly *elp;
     struct gf_poly *poly_2t[4];
     bool        swap_bits;
     unsigned int *errloc;
+    bool        shared_tables;
+    bch_encode_words_fn encode_words;
+    const char *kernel_name;
 };
 
 struct bch_control *bch_init(int m, int t, unsigned int prim_poly,
                              bool swap_bits, int ecc_bytes);
 
+struct bch_control *bch_clone(const struct bch_control *bch);
+
 void bch_free(struct bch_control *bch);
 
+int bch_select_kernel(struct bch_control *bch, const char *name);
+
 void bch_encode(struct bch_control *bch, const uint8_t *data,
                 unsigned int len, uint8_t *ecc);
 
@@ -6,13 +6,30 @@
 //
 
 #include "PicoNandReader.hpp"
+#include "SimNandReader.hpp"
 #include "ECCCorrection.hpp"
 #include "FileMapping.hpp"
+#include "ECCSearch.hpp"
+#include "LayoutDetect.hpp"
+#include "DumpPipeline.hpp"
+#include "DumpJournal.hpp"
+#include "PageRecovery.hpp"
+#include "ParallelDump.hpp"
+#include "ArgParse.hpp"
+#include "PageScheduler.hpp"
+#include "ProgressReporter.hpp"
+#include "CodewordStats.hpp"
+#include "StreamReader.hpp"
+#include "DumpContainer.hpp"
+#include "BadBlockTable.hpp"
+#include "ECCEngine.hpp"
 
 #include <libgeneral/macros.h>
 #include <libgeneral/Mem.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
 
 #include <getopt.h>
@@ -20,6 +37,18 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define ALT_PAGEREAD_BATCH_PAGES 16u
+#define DEFAULT_DUMP_RETRIES 5
+#define DUMP_SLICE_PAGES 0x1000
+#define DEFAULT_PROGRESS_INTERVAL 1.0
+#define DEFAULT_PAGES_PER_BLOCK 64
+#define MAX_LISTED_UNCORRECTABLE_PAGES 32
+#define DEFAULT_MAP_WINDOW 0x4000000
+#define DEFAULT_IO_DEPTH 8
+#define DEFAULT_IO_SIZE 0x100000
 
 using namespace ECCCorrection;
 
@@ -36,7 +65,21 @@ static struct option longopts[] = {
     { "protocol",       required_argument,  NULL, 'P' },
 
     { "alt-pageread",   no_argument,        NULL,  0  },
+    { "container",      no_argument,        NULL,  0  },
     { "inplace",        no_argument,        NULL,  0  },
+    { "pin-threads",    no_argument,        NULL,  0  },
+    { "progress-interval",required_argument,NULL,  0  },
+    { "progress-json",  required_argument,  NULL,  0  },
+    { "list-readers",   no_argument,        NULL,  0  },
+    { "raw-output",     required_argument,  NULL,  0  },
+    { "reader",         required_argument,  NULL,  0  },
+    { "reread",         required_argument,  NULL,  0  },
+    { "restart",        no_argument,        NULL,  0  },
+    { "retries",        required_argument,  NULL,  0  },
+    { "simulate",       required_argument,  NULL,  0  },
+    { "split-ce",       no_argument,        NULL,  0  },
+    { "usb-transfers",  required_argument,  NULL,  0  },
+    { "usb-transfer-size",required_argument,NULL,  0  },
 
     //Send raw NAND command
     { "cmd-address",    required_argument,  NULL,  0  },
@@ -45,9 +88,28 @@ static struct option longopts[] = {
     { "cmd-read-size",  required_argument,  NULL,  0  },
 
     //Dump processing
+    { "bad-blocks",     required_argument,  NULL,  0  },
+    { "bbm-columns",    required_argument,  NULL,  0  },
+    { "bbm-pages",      required_argument,  NULL,  0  },
+    { "bitflip-map",    required_argument,  NULL,  0  },
+    { "block-summary",  required_argument,  NULL,  0  },
+    { "data-output",    required_argument,  NULL,  0  },
     { "ecc",            required_argument,  NULL,  0  },
+    { "ecc-search",     no_argument,        NULL,  0  },
+    { "direct",         no_argument,        NULL,  0  },
+    { "detect-layout",  no_argument,        NULL,  0  },
+    { "erased-bitflips",required_argument,  NULL,  0  },
+    { "io-depth",       required_argument,  NULL,  0  },
+    { "io-size",        required_argument,  NULL,  0  },
+    { "map-hugepages",  no_argument,        NULL,  0  },
+    { "map-populate",   no_argument,        NULL,  0  },
+    { "map-window",     required_argument,  NULL,  0  },
     { "page-structure", required_argument,  NULL,  0  },
+    { "pages-per-block",required_argument,  NULL,  0  },
+    { "scan-bad-blocks",required_argument,  NULL,  0  },
     { "seekPages",      required_argument,  NULL,  0  },
+    { "service-output", required_argument,  NULL,  0  },
+    { "stream",         no_argument,        NULL,  0  },
     { "numPages",       required_argument,  NULL,  0  },
 
     { NULL, 0, NULL, 0 }
@@ -59,16 +121,30 @@ void cmd_help(){
            "Controlls nand reader\n"
            "  -h, --help\t\t\t\t\tprints usage information\n"
            "  -a, --pageAddr\t<addr>\t\t\tSet start page for reading/writing\n"
-           "  -c, --ce\t\t<CE>\t\t\tSelect Crystal\n"
+           "  -c, --ce\t\t<CE,...>\t\tSelect Crystal, dumps accept a list of CEs\n"
            "  -i, --input\t\t<PATH>\t\t\tSet input for reading\n"
-           "  -j, --threads\t\t<num>\t\t\tSet number of threads\n"
+           "  -j, --threads\t\t<num>\t\t\tSet number of threads (default: number of cpu cores)\n"
            "  -o, --output\t\t<PATH>\t\t\tSet output for writing\n"
            "  -p, --pagesize\t<size>\t\t\tSet page size\n"
            "  -r, --readPage\t<num>\t\t\tRead number of pages\n"
            "  -I, --readID\t\t\t\t\tRead NAND chip ID\n"
            "  -P, --protocol\t<protocol>\t\tSelect Protocol ('nand8')\n"
            "      --alt-pageread\t\t\t\tUse alternative USB method for downloading page memory from pico\n"
+           "      --container\t\t\t\tWrite the dump as a compressed container of --pages-per-block page blocks\n"
            "      --inplace\t\t\t\t\tModify infile inplace\n"
+           "      --pin-threads\t\t\t\tPin worker threads to cpu cores\n"
+           "      --progress-interval <sec>\t\tTime between progress reports (default: 1)\n"
+           "      --progress-json\t<PATH>\t\t\tAppend every progress report as a json line to <PATH>\n"
+           "      --list-readers\t\t\t\tList attached readers\n"
+           "      --raw-output\t<PATH>\t\t\tAlso write uncorrected pages when correcting while dumping\n"
+           "      --reader\t\t<bus:addr|serial|all>\tSelect reader, repeat to dump with multiple readers (default: first reader)\n"
+           "      --reread\t\t<num>\t\t\tRe-read uncorrectable pages <num> times and decode the majority vote\n"
+           "      --restart\t\t\t\t\tIgnore the journal of an interrupted dump and start over\n"
+           "      --retries\t<num>\t\t\tRetries after a failed transfer without progress (default: 5)\n"
+           "      --simulate\t<image,params>\t\tServe pages from an image instead of a reader (eg. dump.bin,latency=500,bandwidth=1e6,bitflips=1e-6)\n"
+           "      --split-ce\t\t\t\tWrite every CE of a dump to <output>.ce<N> instead of one after the other\n"
+           "      --usb-transfers\t<num>\t\t\tNumber of USB transfers in flight while dumping (default: 8)\n"
+           "      --usb-transfer-size <size>\t\tSize of a single USB transfer while dumping (default: 0x4000)\n"
            "\n"
 
            "Send raw NAND command:\n"
@@ -79,11 +155,46 @@ void cmd_help(){
            "\n"
 
            "Dump processing:\n"
-           "      --ecc\t\t<alg,poly,params>\tSpecify ECC correction parameters (eg. bch,17475,ir)\n"
+           "      --bad-blocks\t<PATH>\t\t\tSkip the blocks listed in bad block table <PATH>, -a must match the scan\n"
+           "      --bbm-columns\t<col,...>\t\tBad block marker bytes within the page (default: first spare byte, byte 5 for small pages)\n"
+           "      --bbm-pages\t<first,second,last>\tPages of a block which carry the marker (default: first,last)\n"
+           "      --bitflip-map\t<PATH>\t\t\tWrite a binary record (page, codeword, result, bitflips) for every decoded codeword to <PATH>\n"
+           "      --block-summary\t<PATH>\t\t\tWrite decoder results per erase block as csv to <PATH>\n"
+           "      --data-output\t<PATH>\t\t\tWrite corrected data bytes only, packed in logical order\n"
+           "      --ecc\t\t<alg,params>\t\tSpecify ECC correction parameters:\n"
+           "                             \t\t\tbch,<poly>[,i][,r]  BCH, i=inverted, r=swapped bits (eg. bch,17475,i,r)\n"
+           "                             \t\t\thamming[,sm]  1 bit Hamming for 256/512 byte codewords, sm=SmartMedia byte order\n"
+           "                             \t\t\trs[,<poly>][,fcr=<num>][,prim=<num>][,msb]  Reed-Solomon, symbol size follows from poly (default: 0x409)\n"
+           "      --ecc-search\t\t\t\tSearch BCH parameters and page structure of the input dump\n"
+           "      --detect-layout\t\t\t\tGuess page structure of the input dump from column statistics\n"
+           "      --direct\t\t\t\t\tBypass the page cache when streaming the input (O_DIRECT)\n"
+           "      --erased-bitflips\t<num>\t\t\tMax zero bits for a codeword to count as erased (default: ECC strength, -1 disables)\n"
+           "      --io-depth\t<num>\t\t\tReads in flight when streaming the input (default: 8)\n"
+           "      --io-size\t<size>\t\t\tSize of a single read when streaming the input (default: 0x100000)\n"
+           "      --map-hugepages\t\t\t\tAsk for transparent huge pages when mapping dumps\n"
+           "      --map-populate\t\t\t\tRead the whole dump into ram before processing, for dumps which fit\n"
+           "      --map-window\t<size>\t\t\tPrefetch <size> bytes ahead of every thread and drop what is done (default: 64MiB if the dump exceeds half of the ram, 0 disables)\n"
            "      --page-structure\t<N:size:type,N:size:type,...>\n"
            "                             \t\t\tSpecify page structure. Types d=data, s=service area, e=ecc (eg. 1:512:d,1:10:s,1:53:e,2:512:d,2:53:e,...)\n"
+           "      --pages-per-block\t<num>\t\t\tPages per erase block for --block-summary, --scan-bad-blocks and --container (default: 64)\n"
+           "      --scan-bad-blocks <PATH>\t\tWrite a bad block table of the input dump, or of the -r pages of the chip without input, to <PATH>\n"
            "      --seekPages\t\t\t\tNumber of pages to skip\n"
            "      --numPages\t\t\t\tNumber of pages to process\n"
+           "      --service-output\t<PATH>\t\t\tWrite service area bytes only, packed in logical order\n"
+           "      --stream\t\t\t\t\tRead the input with io_uring/pread instead of mapping it (default for pipes and '-')\n"
+           "\n"
+           "When --ecc is combined with -r and no input file, pages are corrected while they are dumped.\n"
+           "-o receives the corrected pages, --raw-output the uncorrected ones.\n"
+           "\n"
+           "With --reread, pages which stay uncorrectable are read again from the chip (at -a plus their page number)\n"
+           "and patched into the corrected output if the voted copy decodes.\n"
+           "\n"
+           "Dumps with -r and -o keep a journal of completed pages in <output>.journal.\n"
+           "Running the same command again after an interruption continues where it stopped.\n"
+           "With multiple CEs or readers, the readers take turns dumping slices of all CEs in parallel.\n"
+           "\n"
+           "Simulator parameters: latency=<us> per transfer, bandwidth=<bytes/s>, bitflips=<rate per bit>,\n"
+           "failures=<rate per transfer>, ce-pages=<pages per CE in the image>, page-size=<num>, seed=<num>\n"
            "\n"
            );
 }
@@ -141,14 +252,6 @@ tihmstar::Mem parseHexdata(const char *str){
     return ret;
 }
 
-uint64_t parseNumber(const char *str){
-    if (strncasecmp(str, "0x", 2) == 0) {
-        return strtoull(str, NULL, 16);
-    }else{
-        return strtoull(str, NULL, 10);
-    }
-}
-
 struct RawNandCommand{
     tihmstar::Mem cmdAddress;
     tihmstar::Mem cmdCommand;
@@ -156,64 +259,90 @@ struct RawNandCommand{
     size_t cmdResponseSize;
 };
 
-PageStructure parsePageStructure(const char *str){
-    PageStructure ret;
-    std::vector<std::string> parts;
-    {
-        std::string argstr = str;
-        ssize_t commaPos = 0;
-        while ((commaPos = argstr.find(",")) != std::string::npos) {
-            std::string sp = argstr.substr(0, commaPos);
-            parts.push_back(sp);
-            argstr = argstr.substr(commaPos+1);
-        }
-        parts.push_back(argstr);
+void printTransferStats(const NandReader::TransferStats &st, const char *name = "USB"){
+    if (!st.transfers) return;
+    info("%s: %llu bytes in %.2fs (%.1f KiB/s), %llu transfers, latency avg %.0fus min %.0fus max %.0fus",
+         name,(unsigned long long)st.bytes,st.seconds,st.seconds ? st.bytes/st.seconds/1024 : 0,(unsigned long long)st.transfers,
+         st.avgLatencyUs,st.minLatencyUs,st.maxLatencyUs);
+}
+
+void setupReader(NandReader &pnr, t_ChipProtocol chipProtocol, uint32_t usbTransfersCnt, uint32_t usbTransferSize, const char *location = NULL){
+    if (usbTransfersCnt || usbTransferSize) {
+        pnr.setTransferConfig(usbTransfersCnt, usbTransferSize);
+    }
+    pnr.connectReader(location);
+    if (chipProtocol != kChipProtocolUndefined) {
+        debug("Setting chip protocol to %d",chipProtocol);
+        pnr.selectProtocol(chipProtocol);
     }
     
-    for (auto p : parts) {
-        ssize_t posCol1 = 0;
-        ssize_t posCol2 = 0;
-        posCol1 = p.find(":");
-        posCol2 = p.rfind(":");
-        retassure(posCol1 != std::string::npos, "parsePageStructure failed to find first ':' in codeword descriptor");
-        retassure(posCol2 != std::string::npos, "parsePageStructure failed to find second ':' in codeword descriptor");
-        retassure(posCol1 < posCol2, "parsePageStructure failed to two ':' in codeword descriptor");
-        
-        std::string str_tag  = p.substr(0,posCol1);
-        std::string str_len  = p.substr(posCol1+1,posCol2-posCol1-1);
-        std::string str_type = p.substr(posCol2+1);
-        
-        retassure(str_type.size() >= 1, "parsePageStructure type got invalid len");
-        
-        PageCodeword ps = {
-            .tag = static_cast<uint32_t>(atoi(str_tag.c_str())),
-            .len = static_cast<uint32_t>(atoi(str_len.c_str())),
-        };
-        
-        switch (str_type.at(0)) {
-            case 'd':
-            case 'D':
-                ps.type = kPageCodewordTypeData;
-                break;
+    debug("resetting chip");
+    pnr.resetChip();
+}
 
-            case 'e':
-            case 'E':
-                ps.type = kPageCodewordTypeECC;
-                break;
+/*
+    Dumps numPages pages of every CE with all readers into outFile, or into <outFile>.ce<N> for every CE with splitCE.
+    Every output keeps a journal, pages which are already listed in it are skipped.
+    With containerBlockPages set the outputs are containers instead, which can't be resumed.
+    progress needs a worker slot per reader.
+ */
+void parallelDump(const std::vector<NandReader*> &readers, const std::vector<uint8_t> &CEs, uint32_t pageAddress, uint16_t pageSize, uint32_t numPages, const char *outFile, bool splitCE, bool restart, int retries, ProgressReporter *progress, uint32_t containerBlockPages = 0){
+    std::vector<int> fds;
+    std::vector<std::unique_ptr<DumpJournal>> journals;
+    std::vector<std::unique_ptr<DumpContainer::Writer>> containers;
+    cleanup([&]{
+        for (auto &fd : fds) {
+            safeClose(fd);
+        }
+    });
 
-            case 's':
-            case 'S':
-                ps.type = kPageCodewordTypeServiceArea;
-                break;
+    std::vector<std::vector<uint8_t>> outputCEs;
+    if (splitCE) {
+        for (uint8_t CE : CEs) {
+            outputCEs.push_back({CE});
+        }
+    }else{
+        outputCEs.push_back(CEs);
+    }
 
-            default:
-                reterror("unexpected page structure type '%s'",str_type.c_str());
-                break;
+    /* small dumps still get a few slices per reader */
+    uint64_t slicePages = std::min<uint64_t>(DUMP_SLICE_PAGES, (uint64_t)numPages*CEs.size() / (readers.size()*4));
+    ParallelDump dump(readers, pageAddress, pageSize, retries, (uint32_t)std::max<uint64_t>(slicePages, 1));
+    for (auto &ces : outputCEs) {
+        std::string path = outFile;
+        if (splitCE) path += ".ce" + std::to_string(ces.front());
+        if (containerBlockPages) {
+            containers.push_back(std::make_unique<DumpContainer::Writer>(path.c_str(), pageSize, (uint64_t)numPages*ces.size(), containerBlockPages));
+            dump.addOutput(containers.back().get(), ces, numPages);
+            continue;
         }
-        ret.push_back(ps);
+        int fd = -1;
+        retassure((fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        fds.push_back(fd);
+
+        journals.push_back(std::make_unique<DumpJournal>((path + ".journal").c_str(), ces, pageAddress, pageSize, numPages, restart));
+        DumpJournal *journal = journals.back().get();
+        if (uint64_t donePages = journal->donePages()) {
+            info("Resuming '%s', %llu of %llu pages already done",path.c_str(),(unsigned long long)donePages,(unsigned long long)numPages*ces.size());
+        }else{
+            retassure(!ftruncate(fd, (off_t)numPages*ces.size()*pageSize), "Failed to resize '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        }
+        dump.addOutput(fd, journal, ces, numPages);
+    }
+
+    info("Dumping %zu CE(s) with %zu reader(s)",CEs.size(),readers.size());
+    dump.run(progress);
+    for (size_t i = 0; i < readers.size(); i++) {
+        std::string name = (readers.size() > 1) ? "USB reader " + std::to_string(i) : "USB";
+        printTransferStats(dump.transferStats(i), name.c_str());
+    }
+
+    for (auto &journal : journals) {
+        journal->remove();
+    }
+    for (auto &container : containers) {
+        container->finish();
     }
-    
-    return ret;
 }
 
 MAINFUNCTION
@@ -228,23 +357,57 @@ int main_r(int argc, const char * argv[]) {
     
     const char *inFile = NULL;
     const char *outFile = NULL;
+    const char *rawOutFile = NULL;
+    const char *dataOutFile = NULL;
+    const char *serviceOutFile = NULL;
+    const char *bitflipMapFile = NULL;
+    const char *blockSummaryFile = NULL;
+    const char *badBlocksFile = NULL;
+    const char *scanBadBlocksFile = NULL;
 
     uint32_t numThreads = 0;
     uint32_t numPages = 0;
     uint32_t seekPages = 0;
     uint32_t pageAddress = 0;
     uint16_t pageSize = 0;
+    uint32_t pagesPerBlock = DEFAULT_PAGES_PER_BLOCK;
+    std::vector<uint32_t> markerColumns;
+    uint32_t markerPages = 0;
     
     uint32_t readPagesNum = 0;
+    bool restartDump = false;
+    bool dumpContainer = false;
+    bool doListReaders = false;
+    bool splitCE = false;
+    std::vector<std::string> readerLocations;
+    std::vector<uint8_t> dumpCEs;
+    std::string simImage;
+    SimNandReader::Config simConfig = {};
+    uint32_t rereadCnt = 0;
+    int dumpRetries = DEFAULT_DUMP_RETRIES;
+    uint32_t usbTransfersCnt = 0;
+    uint32_t usbTransferSize = 0;
     bool doReadID = false;
     
     bool wantAltPageread = false;
     bool modifyFileInplace = false;
+    bool pinThreads = false;
+    double progressInterval = DEFAULT_PROGRESS_INTERVAL;
+    const char *progressJsonFile = NULL;
     
     RawNandCommand nandCmd = {};
     std::vector<RawNandCommand> multipleNandCmds;
 
     std::vector<std::string> eccargs;
+    bool doECCSearch = false;
+    bool doDetectLayout = false;
+    int erasedBitflips = INT_MIN;
+    int64_t mapWindow = -1; /* automatic */
+    bool streamInput = false;
+    bool directIO = false;
+    uint32_t ioDepth = DEFAULT_IO_DEPTH;
+    size_t ioSize = DEFAULT_IO_SIZE;
+    uint32_t mapFlags = FileMapping::kFlagNone;
     PageStructure pageStructure;
     NandStructure nandStructure;
 
@@ -255,6 +418,12 @@ int main_r(int argc, const char * argv[]) {
                 std::string curopt = longopts[optindex].name;
                 if (curopt == "alt-pageread") {
                     wantAltPageread = true;
+                }else if (curopt == "bitflip-map") {
+                    retassure(!bitflipMapFile, "Invalid command line arguments. bitflipMapFile already set!");
+                    bitflipMapFile = optarg;
+                }else if (curopt == "block-summary") {
+                    retassure(!blockSummaryFile, "Invalid command line arguments. blockSummaryFile already set!");
+                    blockSummaryFile = optarg;
                 }else if (curopt == "cmd-address") {
                     nandCmd.cmdAddress = parseHexdata(optarg);
                 }else if (curopt == "cmd-command") {
@@ -267,6 +436,9 @@ int main_r(int argc, const char * argv[]) {
                     nandCmd.cmdData = parseHexdata(optarg);
                 }else if (curopt == "cmd-read-size") {
                     nandCmd.cmdResponseSize = parseNumber(optarg);
+                }else if (curopt == "data-output") {
+                    retassure(!dataOutFile, "Invalid command line arguments. dataOutFile already set!");
+                    dataOutFile = optarg;
                 }else if (curopt == "ecc") {
                     std::string paramstring = optarg;
                     ssize_t commaPos = 0;
@@ -276,8 +448,55 @@ int main_r(int argc, const char * argv[]) {
                         paramstring = paramstring.substr(commaPos+1);
                     }
                     eccargs.push_back(paramstring);
+                }else if (curopt == "ecc-search") {
+                    doECCSearch = true;
+                }else if (curopt == "detect-layout") {
+                    doDetectLayout = true;
+                }else if (curopt == "direct") {
+                    directIO = true;
+                }else if (curopt == "erased-bitflips") {
+                    erasedBitflips = atoi(optarg);
+                }else if (curopt == "io-depth") {
+                    ioDepth = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "io-size") {
+                    ioSize = (size_t)parseNumber(optarg);
+                }else if (curopt == "map-hugepages") {
+                    mapFlags |= FileMapping::kFlagHugePages;
+                }else if (curopt == "map-populate") {
+                    mapFlags |= FileMapping::kFlagPopulate;
+                }else if (curopt == "map-window") {
+                    mapWindow = (int64_t)parseNumber(optarg);
                 }else if (curopt == "inplace") {
                     modifyFileInplace = true;
+                }else if (curopt == "pin-threads") {
+                    pinThreads = true;
+                }else if (curopt == "progress-interval") {
+                    progressInterval = atof(optarg);
+                }else if (curopt == "progress-json") {
+                    progressJsonFile = optarg;
+                }else if (curopt == "usb-transfers") {
+                    usbTransfersCnt = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "usb-transfer-size") {
+                    usbTransferSize = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "reread") {
+                    rereadCnt = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "restart") {
+                    restartDump = true;
+                }else if (curopt == "container") {
+                    dumpContainer = true;
+                }else if (curopt == "retries") {
+                    dumpRetries = atoi(optarg);
+                }else if (curopt == "list-readers") {
+                    doListReaders = true;
+                }else if (curopt == "reader") {
+                    readerLocations.push_back(optarg);
+                }else if (curopt == "simulate") {
+                    simConfig = parseSimConfig(optarg, simImage);
+                }else if (curopt == "split-ce") {
+                    splitCE = true;
+                }else if (curopt == "raw-output") {
+                    retassure(!rawOutFile, "Invalid command line arguments. rawOutFile already set!");
+                    rawOutFile = optarg;
                 }else if (curopt == "numPages") {
                     numPages = (uint32_t)parseNumber(optarg);
                 }else if (curopt == "page-structure") {
@@ -293,6 +512,30 @@ int main_r(int argc, const char * argv[]) {
                         numPages = 0;
                     }
                     pageStructure = parsePageStructure(optarg);
+                }else if (curopt == "pages-per-block") {
+                    pagesPerBlock = (uint32_t)parseNumber(optarg);
+                }else if (curopt == "bad-blocks") {
+                    retassure(!badBlocksFile, "Invalid command line arguments. badBlocksFile already set!");
+                    badBlocksFile = optarg;
+                }else if (curopt == "scan-bad-blocks") {
+                    retassure(!scanBadBlocksFile, "Invalid command line arguments. scanBadBlocksFile already set!");
+                    scanBadBlocksFile = optarg;
+                }else if (curopt == "bbm-columns") {
+                    markerColumns.clear();
+                    for (const char *col = optarg; *col; col++) {
+                        const char *start = col;
+                        markerColumns.push_back((uint32_t)strtoul(start, (char**)&col, 0));
+                        retassure(col != start, "Invalid marker column list '%s'",optarg);
+                        if (!*col) break;
+                        retassure(*col == ',', "Invalid marker column list '%s'",optarg);
+                    }
+                }else if (curopt == "bbm-pages") {
+                    markerPages = BadBlockTable::parseMarkerPages(optarg);
+                }else if (curopt == "service-output") {
+                    retassure(!serviceOutFile, "Invalid command line arguments. serviceOutFile already set!");
+                    serviceOutFile = optarg;
+                }else if (curopt == "stream") {
+                    streamInput = true;
                 }else if (curopt == "seekPages") {
                     seekPages = (uint32_t)parseNumber(optarg);
                 }else{
@@ -311,7 +554,14 @@ int main_r(int argc, const char * argv[]) {
                 break;
                 
             case 'c': //ce
-                CE = atoi(optarg);
+                dumpCEs.clear();
+                for (const char *ce = optarg; *ce; ce++) {
+                    dumpCEs.push_back((uint8_t)strtoul(ce, (char**)&ce, 0));
+                    if (!*ce) break;
+                    retassure(*ce == ',', "Invalid CE list '%s'",optarg);
+                }
+                retassure(dumpCEs.size(), "Empty CE list");
+                CE = dumpCEs.front();
                 debug("selecting CE %d",CE);
                 break;
 
@@ -365,132 +615,408 @@ int main_r(int argc, const char * argv[]) {
         }
     }
 
-    PicoNandReader pnr;
+    if (doListReaders) {
+        for (auto &ri : PicoNandReader::listReaders()) {
+            printf("%d:%d %s\n",ri.bus,ri.address,ri.serial.c_str());
+        }
+        return 0;
+    }
+
+    for (auto it = readerLocations.begin(); it != readerLocations.end(); it++) {
+        if (*it != "all") continue;
+        retassure(!simImage.size(), "Can't use all readers when simulating");
+        readerLocations.erase(it);
+        for (auto &ri : PicoNandReader::listReaders()) {
+            readerLocations.push_back(std::to_string(ri.bus) + ":" + std::to_string(ri.address));
+        }
+        retassure(readerLocations.size(), "No reader attached");
+        break;
+    }
+    if (readerLocations.size() > 1) {
+        /* "all" and explicit entries may name the same reader, by bus:address or by serial */
+        std::vector<PicoNandReader::ReaderInfo> attached;
+        std::vector<std::string> unique;
+        if (!simImage.size()) attached = PicoNandReader::listReaders();
+        for (std::string loc : readerLocations) {
+            for (auto &ri : attached) {
+                if (ri.serial.size() && ri.serial == loc) loc = std::to_string(ri.bus) + ":" + std::to_string(ri.address);
+            }
+            if (std::find(unique.begin(), unique.end(), loc) != unique.end()) {
+                debug("Reader '%s' was given more than once",loc.c_str());
+                continue;
+            }
+            unique.push_back(loc);
+        }
+        readerLocations = unique;
+    }
+    const char *firstReader = readerLocations.size() ? readerLocations.front().c_str() : NULL;
+    if (dumpCEs.size() > 1 || readerLocations.size() > 1) {
+        retassure(readPagesNum && outFile && strcmp(outFile, "-") && !inFile && !eccargs.size() && !wantAltPageread,
+                  "Multiple CEs or readers are only supported when dumping raw pages to a file");
+    }
+    if (!dumpCEs.size()) dumpCEs.push_back(CE);
+
+    int progressJsonFd = -1;
+    cleanup([&]{
+        safeClose(progressJsonFd);
+    });
+    if (progressJsonFile) {
+        retassure((progressJsonFd = open(progressJsonFile, O_WRONLY | O_CREAT | O_APPEND, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",progressJsonFile,errno,strerror(errno));
+    }
+    auto makeProgress = [&](const char *name, uint32_t workersCnt)->std::unique_ptr<ProgressReporter>{
+        std::unique_ptr<ProgressReporter> ret = std::make_unique<ProgressReporter>(name, workersCnt, progressInterval);
+        ret->setJSONOutput(progressJsonFd);
+        return ret;
+    };
+    const uint32_t workersCnt = (numThreads) ? numThreads : PageScheduler::defaultWorkersCnt();
+
+    /* marker scans only read a few bytes per page, the simulator needs the real page size to address them */
+    if (!simConfig.pageSize) simConfig.pageSize = pageSize;
+    uint32_t readersCnt = 0;
+    auto makeReader = [&]()->std::unique_ptr<NandReader>{
+        if (simImage.size()) {
+            SimNandReader::Config cfg = simConfig;
+            cfg.seed += readersCnt++;
+            return std::make_unique<SimNandReader>(simImage.c_str(), cfg);
+        }
+        return std::make_unique<PicoNandReader>();
+    };
+    std::unique_ptr<NandReader> reader = makeReader();
+    NandReader &pnr = *reader;
+
+    if (scanBadBlocksFile) {
+        DumpContainer::Header containerHdr = {};
+        if (!pageSize && inFile && DumpContainer::isContainer(inFile, &containerHdr)) pageSize = (uint16_t)containerHdr.pageSize;
+        retassure(pageSize, "Pagesize not set!");
+        BadBlockTable::MarkerConfig markerCfg = BadBlockTable::defaultMarkerConfig(pageSize);
+        if (markerColumns.size()) markerCfg.columns = markerColumns;
+        if (markerPages) markerCfg.pages = markerPages;
+
+        auto scan = [&]()->BadBlockTable{
+            if (inFile) {
+                FileMapping inmap(inFile);
+                return BadBlockTable::scanDump(&inmap, pageSize, pagesPerBlock, markerCfg, pageAddress, numThreads);
+            }
+            retassure(readPagesNum, "No input file and no pages to scan specified!");
+            setupReader(pnr, chipProtocol, usbTransfersCnt, usbTransferSize, firstReader);
+            return BadBlockTable::scanChip(pnr, CE, pageAddress, readPagesNum, pageSize, pagesPerBlock, markerCfg);
+        };
+        BadBlockTable bbt = scan();
+        bbt.write(scanBadBlocksFile);
+        std::vector<uint64_t> badBlocks = bbt.badBlocks();
+        info("Found %zu bad blocks in %llu blocks of %u pages",badBlocks.size(),(unsigned long long)bbt.blocksCnt(),pagesPerBlock);
+        for (uint64_t block : badBlocks) {
+            printf("bad block %llu (page 0x%llx)\n",(unsigned long long)block,(unsigned long long)block*pagesPerBlock);
+        }
+        return 0;
+    }
+
+    if (doDetectLayout) {
+        retassure(inFile, "No input file specified!");
+        retassure(pageSize, "Pagesize not set!");
+        FileMapping inmap(inFile);
+        LayoutDetect::PageStats stats = LayoutDetect::collectPageStats(&inmap, pageSize, numThreads);
+        LayoutDetect::printColumnMap(stats);
+        PageStructure ps = LayoutDetect::inferPageStructure(stats);
+        printf("--page-structure %s\n",pageStructureToString(ps).c_str());
+        return 0;
+    }
+
+    if (doECCSearch) {
+        ECCSearch::BCHConfig cfg = {};
+        retassure(inFile, "No input file specified!");
+        retassure(pageSize, "Pagesize not set!");
+        FileMapping inmap(inFile);
+        if (!ECCSearch::searchBCH(&inmap, pageSize, cfg, numThreads)) {
+            error("Failed to find a matching ECC configuration");
+            return -6;
+        }
+        info("Decoded %u/%u sampled codewords (%u bitflips) with poly 0x%x swapbits=%d inverse=%d",cfg.decodedCodewords,cfg.testedCodewords,cfg.bitflips,cfg.poly,cfg.swapBits,cfg.invert);
+        printf("--ecc bch,0x%x%s%s --page-structure %s\n",cfg.poly,cfg.swapBits ? ",r" : "",cfg.invert ? ",i" : "",pageStructureToString(cfg.pageStructure).c_str());
+        return 0;
+    }
 
     if (eccargs.size()){
-        std::string alg = eccargs.front();
-        eccargs.erase(eccargs.begin());
+        DumpContainer::Header containerHdr = {};
+        const bool containerInput = inFile && strcmp(inFile, "-") && DumpContainer::isContainer(inFile, &containerHdr);
+        if (containerInput) {
+            if (!pageSize) pageSize = (uint16_t)containerHdr.pageSize;
+            retassure(pageSize == containerHdr.pageSize, "Container has a pagesize of %u, but %u was specified",containerHdr.pageSize,pageSize);
+            retassure(!streamInput, "Containers can't be streamed");
+            retassure(!modifyFileInplace || outFile, "Containers can't be corrected inplace");
+        }
         
-        if (strcasecmp(alg.c_str(), "bch") == 0) {
-            info("Running BCH ECC");
-            uint32_t poly = 0;
-            bool swapbits = false;
-            bool inverse = false;
-            
-            if (eccargs.size() < 1) {
-                error("missing poly argument for BCH");
-                return -5;
+        std::unique_ptr<ECCEngine> eccEngine = ECCEngine::create(eccargs);
+        info("Running %s ECC",eccEngine->description().c_str());
+        int bitflipMapFd = -1;
+        cleanup([&]{
+            safeClose(bitflipMapFd);
+        });
+        CodewordStats cwStats(pagesPerBlock);
+        if (bitflipMapFile) {
+            retassure(pageSize, "Pagesize not set!");
+            retassure((bitflipMapFd = open(bitflipMapFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",bitflipMapFile,errno,strerror(errno));
+            cwStats.setBitflipMap(bitflipMapFd, pageSize);
+        }
+
+        cbPage eccCallback = makeECCCallback(*eccEngine, cwStats, erasedBitflips);
+
+        auto codewordCounts = [&]()->ProgressReporter::CodewordCounts{
+            CodewordStats::Totals t = cwStats.totals();
+            return {
+                .good = t.good,
+                .corrected = t.corrected,
+                .uncorrectable = t.uncorrectable,
+                .erased = t.erased,
+            };
+        };
+
+        std::vector<uint32_t> uncorrectablePages;
+        auto printReport = [&](uint64_t processedPages){
+            cwStats.flush();
+            uncorrectablePages = cwStats.uncorrectablePages();
+            if (blockSummaryFile) cwStats.writeBlockSummary(blockSummaryFile);
+
+            CodewordStats::Totals t = cwStats.totals();
+            double totalCodewords = t.good + t.corrected + t.uncorrectable + t.erased;
+            double percentGood = (t.good / totalCodewords)*100;
+            double percentErased = (t.erased / totalCodewords)*100;
+            double percentCorrected = (t.corrected / totalCodewords)*100;
+            double percentUncorrectable = (t.uncorrectable / totalCodewords)*100;
+            info("ECC Report:");
+            info("Processed     pages    : 0x%08llx | %10llu",(unsigned long long)processedPages,(unsigned long long)processedPages);
+            info("Good          codewords: 0x%08llx | %10llu [%5.2f%%]",(unsigned long long)t.good,(unsigned long long)t.good,percentGood);
+            info("Corrected     codewords: 0x%08llx | %10llu [%5.2f%%] corrected bitflips 0x%08llx (%llu)",(unsigned long long)t.corrected,(unsigned long long)t.corrected,percentCorrected,(unsigned long long)t.correctedBitflips,(unsigned long long)t.correctedBitflips);
+            info("Uncorrectable codewords: 0x%08llx | %10llu [%5.2f%%]",(unsigned long long)t.uncorrectable,(unsigned long long)t.uncorrectable, percentUncorrectable);
+            info("Erased        codewords: 0x%08llx | %10llu [%5.2f%%] cleaned bitflips 0x%08llx (%llu)",(unsigned long long)t.erased,(unsigned long long)t.erased,percentErased,(unsigned long long)t.erasedBitflips,(unsigned long long)t.erasedBitflips);
+            if (uncorrectablePages.size()) {
+                std::string pages;
+                for (size_t i = 0; i < uncorrectablePages.size() && i < MAX_LISTED_UNCORRECTABLE_PAGES; i++) {
+                    char buf[16];
+                    snprintf(buf, sizeof(buf), "%s0x%x",i ? "," : "",uncorrectablePages[i]);
+                    pages += buf;
+                }
+                if (uncorrectablePages.size() > MAX_LISTED_UNCORRECTABLE_PAGES) pages += ",...";
+                info("Uncorrectable pages    : %10zu (%s)",uncorrectablePages.size(),pages.c_str());
             }
-            {
-                std::string polystr = eccargs.front();
-                eccargs.erase(eccargs.begin());
-                poly = (uint32_t)parseNumber(polystr.c_str());
+        };
+
+        /*
+            Re-reads the uncorrectable pages from the chip and hands the ones which could be recovered to patchCB
+         */
+        auto recoverUncorrectable = [&](PageRecovery::cbPatch patchCB){
+            if (!rereadCnt || !uncorrectablePages.size()) return;
+
+            PageRecovery recovery(pageSize, nandStructure, [&eccEngine, erasedBitflips](uint8_t *codeword, size_t codewordSize, uint8_t *eccdata, size_t eccdataSize)->int{
+                int errbits = eccEngine->decode(codeword, codewordSize, eccdata, eccdataSize);
+                if (errbits >= 0) return errbits;
+                /* decoders leave codewords they can't correct untouched */
+                int threshold = (erasedBitflips != INT_MIN) ? erasedBitflips : (int)eccEngine->strength(eccdataSize);
+                int flips = checkErased(codeword, codewordSize, eccdata, eccdataSize, threshold);
+                if (flips >= 0) {
+                    memset(codeword, 0xFF, codewordSize);
+                    memset(eccdata, 0xFF, eccdataSize);
+                }
+                return flips;
+            });
+            recovery.recoverPages(pnr, CE, pageAddress, uncorrectablePages, rereadCnt, patchCB);
+            const PageRecovery::Stats &st = recovery.stats();
+            info("Recovery Report:");
+            info("Recovered     pages    : %10d of %d",st.recoveredPages,st.triedPages);
+            info("Voted         codewords: %10d",st.votedCodewords);
+            info("Soft decoded  codewords: %10d",st.softCodewords);
+        };
+
+        {
+            retassure(nandStructure.size() == 0 || nandStructure.back().pagesCnt != 0, "Cannot chain multiple page structures with implicit length");
+            nandStructure.push_back({
+                .pageStructure = pageStructure,
+                .startPage = seekPages,
+                .pagesCnt = numPages,
+            });
+            seekPages += numPages;
+            numPages = 0;
+        }
+        if (pageSize) {
+            for (auto &ns : nandStructure) {
+                for (auto &cp : compileCodewordPlan(ns.pageStructure, pageSize)) {
+                    eccEngine->checkGeometry(cp.cwSize, cp.eccSize);
+                }
+            }
+        }
+
+        if (!inFile) {
+            /* no input file, correct pages while they are being dumped */
+            int rawFd = -1;
+            int outFd = -1;
+            cleanup([&]{
+                safeClose(rawFd);
+                safeClose(outFd);
+            });
+            retassure(readPagesNum, "No input file and no pages to read specified!");
+            retassure(!dataOutFile && !serviceOutFile, "Linear outputs are only supported when processing a dump file");
+            retassure(!dumpContainer, "Containers are only supported for raw dumps");
+            retassure(!badBlocksFile, "Bad blocks can only be skipped when processing a dump file");
+            retassure(pageSize, "Pagesize not set!");
+            if (rawOutFile) {
+                retassure((rawFd = open(rawOutFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",rawOutFile,errno,strerror(errno));
+            }
+            if (outFile) {
+                retassure(strcmp(outFile, "-"), "Streaming ecc correction needs a seekable output file");
+                retassure(!rawOutFile || !FileMapping::isSameFile(rawOutFile, outFile), "Raw output '%s' and output '%s' are the same file",rawOutFile,outFile);
+                retassure((outFd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",outFile,errno,strerror(errno));
+            }
+            if (rawFd == -1 && outFd == -1) {
+                warning("No outputfile specified, dumped pages will only be checked!");
+            }
+
+            setupReader(pnr, chipProtocol, usbTransfersCnt, usbTransferSize, firstReader);
+            DumpPipeline pipeline(pageSize, nandStructure, eccCallback, NULL, numThreads, pinThreads);
+            pipeline.setRawOutput(rawFd);
+            pipeline.setOutput(outFd);
+
+            std::unique_ptr<ProgressReporter> progress = makeProgress("dump+ecc", workersCnt);
+            progress->setCodewordCounts(codewordCounts);
+            pipeline.setProgress(progress.get());
+
+            uint64_t processedPages = pipeline.run(pnr, CE, pageAddress, readPagesNum);
+            printTransferStats(pnr.lastDumpStats());
+            printReport(processedPages);
+            recoverUncorrectable([&](uint32_t pagenum, const uint8_t *page, size_t pageSize){
+                if (outFd == -1) return;
+                retassure(pwrite(outFd, page, pageSize, (off_t)pagenum*pageSize) == (ssize_t)pageSize, "Failed to patch page 0x%x with err=%d (%s)",pagenum,errno,strerror(errno));
+            });
+            return 0;
+        }
+
+        if (!streamInput) {
+            /* pipes and devices can't be mapped */
+            struct stat st = {};
+            streamInput = !strcmp(inFile, "-") || (!stat(inFile, &st) && !S_ISREG(st.st_mode));
+        }
+
+        if (streamInput) {
+            int outFd = -1;
+            cleanup([&]{
+                safeClose(outFd);
+            });
+            retassure(!dataOutFile && !serviceOutFile, "Linear outputs are not supported when streaming the input");
+            retassure(!modifyFileInplace, "Inplace correction is not supported when streaming the input");
+            retassure(!badBlocksFile, "Bad blocks can't be skipped when streaming the input");
+            retassure(pageSize, "Pagesize not set!");
+            if (outFile) {
+                retassure(strcmp(outFile, "-"), "Streaming ecc correction needs a seekable output file");
+                /* the output is truncated while the input is still being read */
+                retassure(!FileMapping::isSameFile(inFile, outFile), "Output '%s' is the input, streaming can't correct in place",outFile);
+                retassure((outFd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",outFile,errno,strerror(errno));
+            }else{
+                warning("No outputfile specified, pages will only be checked!");
+            }
+
+            StreamReader input(inFile, directIO, ioDepth, ioSize);
+            info("Streaming input with %s",StreamReader::backendName(input.backend()));
+            DumpPipeline pipeline(pageSize, nandStructure, eccCallback, NULL, numThreads, pinThreads);
+            pipeline.setOutput(outFd);
+
+            std::unique_ptr<ProgressReporter> progress = makeProgress("ecc", workersCnt);
+            progress->setCodewordCounts(codewordCounts);
+            pipeline.setProgress(progress.get());
+
+            uint64_t processedPages = pipeline.run(input);
+            printReport(processedPages);
+            if (rereadCnt && uncorrectablePages.size()) {
+                setupReader(pnr, chipProtocol, usbTransfersCnt, usbTransferSize, firstReader);
+                recoverUncorrectable([&](uint32_t pagenum, const uint8_t *page, size_t pageSize){
+                    if (outFd == -1) return;
+                    retassure(pwrite(outFd, page, pageSize, (off_t)pagenum*pageSize) == (ssize_t)pageSize, "Failed to patch page 0x%x with err=%d (%s)",pagenum,errno,strerror(errno));
+                });
             }
-            if (!poly) {
-                error("BCH polynom cannot be 0!");
-                return -5;
+            return 0;
+        }
+
+        {
+            if (outFile && FileMapping::isSameFile(inFile, outFile)) {
+                /* copying the input onto itself would truncate it first */
+                retassure(!DumpContainer::isContainer(inFile), "Output '%s' is the input container",outFile);
+                info("Output '%s' is the input file, correcting it in place",outFile);
+                outFile = NULL;
+                modifyFileInplace = true;
             }
+            FileMapping inmap(inFile, modifyFileInplace && !outFile, 0, mapFlags);
+            std::shared_ptr<FileMapping> outmapManaged = nullptr;
             
-            for (auto arg : eccargs) {
-                if (strcasecmp(arg.c_str(), "i") == 0) {
-                    inverse = true;
-                }else if (strcasecmp(arg.c_str(), "r") == 0) {
-                    swapbits = true;
+            FileMapping *outmap = nullptr;
+
+            if (outFile) {
+                retassure(strcmp(outFile, "-"), "ECC correction needs a seekable output file");
+                if (inmap.container()) {
+                    /* the counterpart of cloneFile, pages which are not corrected end up in the output as they are */
+                    retassure(!truncate(outFile, 0) || errno == ENOENT, "Failed to truncate '%s' with err=%d (%s)",outFile,errno,strerror(errno));
+                    outmapManaged = std::make_shared<FileMapping>(outFile, true, inmap.memSize(), mapFlags);
+                    inmap.container()->unpack(outmapManaged->mem(), numThreads);
                 }else{
-                    error("unexpected BCH arg '%s'",arg.c_str());
-                    return -5;
+                    FileMapping::cloneFile(inFile, outFile);
+                    outmapManaged = std::make_shared<FileMapping>(outFile, true, 0, mapFlags);
                 }
+                outmap = outmapManaged.get();
+            }else if (modifyFileInplace) {
+                outmap = &inmap;
+            }else if (!dataOutFile && !serviceOutFile) {
+                warning("No outputfile specified, in-ram ecc computation will be discraded!");
             }
-            info("poly: %d (0x%x) inverse=%d swapbits=%d",poly,poly,inverse,swapbits);
-            
-            std::atomic<uint32_t> goodCodewords = 0;
-            std::atomic<uint32_t> correctedCodewords = 0;
-            std::atomic<uint32_t> uncorrectableCodewords = 0;
 
-            std::atomic<uint32_t> correctedBitflips = 0;
-                    
-            
-            
-            {
-                FileMapping inmap(inFile, modifyFileInplace && !outFile);
-                std::shared_ptr<FileMapping> outmapManaged = nullptr;
-                
-                FileMapping *outmap = nullptr;
-
-                if (outFile) {
-                    reterror("TODO");
-                    outmapManaged = std::make_shared<FileMapping>(outFile, true);
-                    outmap = outmapManaged.get();
-                }else if (modifyFileInplace) {
-                    outmap = &inmap;
-                }else{
-                    warning("No outputfile specified, in-ram ecc computation will be discraded!");
+            if (mapWindow < 0) {
+                uint64_t physMem = FileMapping::physicalMemory();
+                mapWindow = (!(mapFlags & FileMapping::kFlagPopulate) && physMem && inmap.memSize() > physMem/2) ? DEFAULT_MAP_WINDOW : 0;
+                if (mapWindow) info("Dump is larger than half of the ram, processing with a 0x%llx byte window per thread",(unsigned long long)mapWindow);
+            }
+            inmap.setWindow((size_t)mapWindow);
+            if (outmapManaged) outmapManaged->setWindow((size_t)mapWindow);
+
+            std::shared_ptr<FileMapping> dataOutmap = nullptr;
+            std::shared_ptr<FileMapping> serviceOutmap = nullptr;
+            if (dataOutFile || serviceOutFile) {
+                uint64_t dataSize = 0;
+                uint64_t serviceSize = 0;
+                linearOutputSizes(inmap.memSize(), pageSize, nandStructure, dataSize, serviceSize);
+                if (dataOutFile) {
+                    retassure(dataSize, "Page structure has no data bytes");
+                    dataOutmap = std::make_shared<FileMapping>(dataOutFile, true, dataSize);
                 }
-                
-                {
-                    retassure(nandStructure.size() == 0 || nandStructure.back().pagesCnt != 0, "Cannot chain multiple page structures with implicit length");
-                    nandStructure.push_back({
-                        .pageStructure = pageStructure,
-                        .startPage = seekPages,
-                        .pagesCnt = numPages,
-                    });
-                    seekPages += numPages;
-                    numPages = 0;
+                if (serviceOutFile) {
+                    retassure(serviceSize, "Page structure has no service area bytes");
+                    serviceOutmap = std::make_shared<FileMapping>(serviceOutFile, true, serviceSize);
                 }
-                
-                uint32_t processedPages = processPages(&inmap, outmap, pageSize, nandStructure,
-                                                           [&goodCodewords, &correctedCodewords, &uncorrectableCodewords, &correctedBitflips, numPages, seekPages, poly, swapbits, inverse]
-                                                           (uint32_t pagenum, uint32_t cwnum, const uint8_t *codeword, size_t codewordSize, const uint8_t *eccdata, size_t eccdataSize, uint8_t *outCodeword, uint8_t *outECC, void *userarg){
-                    int errbits = 0;
-                    uint8_t cw[codewordSize];
-                    uint8_t ecc[eccdataSize];
-                    memcpy(cw, codeword, sizeof(cw));
-                    memcpy(ecc, eccdata, sizeof(ecc));
-
-                    errbits = eccBCH(cw, sizeof(cw), ecc, sizeof(ecc), poly, swapbits, inverse);
-
-                    if (errbits < 0) {
-                        uncorrectableCodewords++;
-                        fprintf(stderr,"Uncorrectable errors in Page 0x%x CW %d\n",pagenum,cwnum);
-                    }else{
-                        if (errbits > 0){
-                            correctedBitflips += errbits;
-                            correctedCodewords++;
-                            debug("Corrected %d bits in Page 0x%x CW %d",errbits,pagenum,cwnum);
-                        }else{
-                            goodCodewords++;
-                        }
-                        if (outCodeword) memcpy(outCodeword, cw, sizeof(cw));
-                        if (outECC) memcpy(outECC, ecc, sizeof(ecc));
-                    }
-                }, NULL, numThreads);
-                
-                double totalCodewords = goodCodewords.load() + correctedCodewords.load() + uncorrectableCodewords.load();
-                double percentGood = (goodCodewords.load() / totalCodewords)*100;
-                double percentCorrected = (correctedCodewords.load() / totalCodewords)*100;
-                double percentUncorrectable = (uncorrectableCodewords.load() / totalCodewords)*100;
-                info("ECC Report:");
-                info("Processed     pages    : 0x%08x | %10d",processedPages,processedPages);
-                info("Good          codewords: 0x%08x | %10d [%5.2f%%]",goodCodewords.load(),goodCodewords.load(),percentGood);
-                info("Corrected     codewords: 0x%08x | %10d [%5.2f%%] corrected bitflips 0x%08x (%d)",correctedCodewords.load(),correctedCodewords.load(),percentCorrected,correctedBitflips.load(),correctedBitflips.load());
-                info("Uncorrectable codewords: 0x%08x | %10d [%5.2f%%]",uncorrectableCodewords.load(),uncorrectableCodewords.load(), percentUncorrectable);
-                return 0;
             }
-        }else{
-            error("Unkown algorithm ECC '%s'",alg.c_str());
-            return -5;
+            
+            std::unique_ptr<BadBlockTable> badBlocks = nullptr;
+            if (badBlocksFile) {
+                badBlocks = std::make_unique<BadBlockTable>(badBlocksFile);
+                badBlocks->checkDump(pageAddress, inmap.memSize() / pageSize);
+                if (badBlocks->pagesPerBlock() != pagesPerBlock) warning("Bad block table has %u pages per block, but --pages-per-block is %u",badBlocks->pagesPerBlock(),pagesPerBlock);
+                info("Skipping %llu bad blocks of %u pages",(unsigned long long)badBlocks->badBlocksCnt(),badBlocks->pagesPerBlock());
+            }
+
+            std::unique_ptr<ProgressReporter> progress = makeProgress("ecc", workersCnt);
+            progress->setCodewordCounts(codewordCounts);
+            uint32_t processedPages = processPages(&inmap, outmap, pageSize, nandStructure, eccCallback, NULL, workersCnt, pinThreads, dataOutmap.get(), serviceOutmap.get(), progress.get(), badBlocks.get());
+            printReport(processedPages);
+            if (rereadCnt && uncorrectablePages.size()) {
+                if (!outmap) warning("No corrected output, recovered pages will only be reported!");
+                if (dataOutmap || serviceOutmap) warning("Recovered pages are not patched into linear outputs, rerun on the corrected output to update them");
+                setupReader(pnr, chipProtocol, usbTransfersCnt, usbTransferSize, firstReader);
+                recoverUncorrectable([&](uint32_t pagenum, const uint8_t *page, size_t pageSize){
+                    if (!outmap) return;
+                    retassure(((uint64_t)pagenum+1)*pageSize <= outmap->memSize(), "Page 0x%x out of bounds",pagenum);
+                    memcpy(&outmap->mem()[(uint64_t)pagenum*pageSize], page, pageSize);
+                });
+            }
+            return 0;
         }
     }
     
     
-    pnr.connectReader();
-    if (chipProtocol != kChipProtocolUndefined) {
-        debug("Setting chip protocol to %d",chipProtocol);
-        pnr.selectProtocol(chipProtocol);
-    }
-    
-    debug("resetting chip");
-    pnr.resetChip();
+    setupReader(pnr, chipProtocol, usbTransfersCnt, usbTransferSize, firstReader);
 
     if (doReadID) {
         for (int i=0; i<4; i++) {
@@ -507,6 +1033,21 @@ int main_r(int argc, const char * argv[]) {
             return -2;
         }
         
+        retassure(!dumpContainer || (outFile && strcmp(outFile, "-") && !wantAltPageread), "Containers need an output file and can't be written with alt pageread");
+        if (outFile && strcmp(outFile, "-") && !wantAltPageread) {
+            std::vector<std::unique_ptr<NandReader>> extraReaders;
+            std::vector<NandReader*> readers = {&pnr};
+            for (size_t i = 1; i < readerLocations.size(); i++) {
+                extraReaders.push_back(makeReader());
+                setupReader(*extraReaders.back(), chipProtocol, usbTransfersCnt, usbTransferSize, readerLocations[i].c_str());
+                readers.push_back(extraReaders.back().get());
+            }
+            std::unique_ptr<ProgressReporter> progress = makeProgress("dump", (uint32_t)readers.size());
+            parallelDump(readers, dumpCEs, pageAddress, pageSize, readPagesNum, outFile, splitCE, restartDump, dumpRetries, progress.get(), (dumpContainer) ? pagesPerBlock : 0);
+            info("Done");
+            return 0;
+        }
+
         int fd = -1;
         cleanup([&]{
             safeClose(fd);
@@ -515,21 +1056,33 @@ int main_r(int argc, const char * argv[]) {
             if (strcmp(outFile, "-") == 0) {
                 fd = dup(STDERR_FILENO);
             }else{
-                retassure((fd = open(outFile, O_WRONLY | O_CREAT, 0644)),"Failed to open '%s' with err=%d (%s)",outFile,errno,strerror(errno));
+                retassure((fd = open(outFile, O_WRONLY | O_CREAT, 0644)) != -1,"Failed to open '%s' with err=%d (%s)",outFile,errno,strerror(errno));
             }
         }
         
         if (wantAltPageread) {
-            for (uint32_t i=0; i<readPagesNum; i++) {
-                auto data = pnr.readPage(CE, pageAddress+i, pageSize);
+            uint32_t pageAddresses[ALT_PAGEREAD_BATCH_PAGES];
+            std::vector<uint8_t> data(ALT_PAGEREAD_BATCH_PAGES*pageSize);
+            for (uint32_t i=0; i<readPagesNum; i+=ALT_PAGEREAD_BATCH_PAGES) {
+                uint32_t batchPages = std::min(readPagesNum-i, ALT_PAGEREAD_BATCH_PAGES);
+                for (uint32_t j=0; j<batchPages; j++) {
+                    pageAddresses[j] = pageAddress+i+j;
+                }
+                pnr.readPages(CE, pageAddresses, batchPages, pageSize, data.data());
                 if (fd == -1) {
-                    DumpHex(data.data(), data.size(), i*pageSize);
+                    DumpHex(data.data(), batchPages*pageSize, i*pageSize);
                 }else{
-                    write(fd, data.data(), data.size());
+                    write(fd, data.data(), batchPages*pageSize);
                 }
             }
         }else{
             uint32_t curAddr = 0;
+            uint64_t received = 0;
+            /* hexdumps go to the terminal, don't mix progress into them */
+            std::unique_ptr<ProgressReporter> progress = (fd != -1) ? makeProgress("dump", 1) : nullptr;
+            ProgressReporter::Worker *pw = (progress) ? &progress->worker(0) : NULL;
+            auto activeSince = std::chrono::steady_clock::now();
+            if (progress) progress->start(readPagesNum);
             pnr.dumpPages(CE, pageAddress, pageSize, readPagesNum, [&](const void *chunk, size_t chunkSize, void *arg)->bool{
                 if (fd == -1) {
                     DumpHex(chunk, chunkSize, curAddr);
@@ -537,19 +1090,33 @@ int main_r(int argc, const char * argv[]) {
                 }else{
                     write(fd, chunk, chunkSize);
                 }
+                if (pw) {
+                    auto now = std::chrono::steady_clock::now();
+                    pw->add((received + chunkSize) / pageSize - received / pageSize, chunkSize);
+                    pw->addBusy(now - activeSince);
+                    activeSince = now;
+                }
+                received += chunkSize;
                 return true;
             }, NULL);
+            if (progress) progress->stop();
+            printTransferStats(pnr.lastDumpStats());
         }
     }else if (nandCmd.cmdCommand.size()) {
         multipleNandCmds.push_back(nandCmd);
         
-        int cmdNum = 0;
         size_t totalCommands = multipleNandCmds.size();
-        for (auto cmd : multipleNandCmds) {
-            tihmstar::Mem cmdResponse(cmd.cmdResponseSize);
-            pnr.sendNandCommand(CE, cmd.cmdCommand.data(), cmd.cmdCommand.size(), cmd.cmdAddress.data(), cmd.cmdAddress.size(), cmd.cmdData.data(), cmd.cmdData.size(), cmdResponse.data(), cmdResponse.size(),cmdNum+1 < totalCommands);
-            printf("\nCommand %d\n",cmdNum++);
-            DumpHex(cmdResponse.data(), cmdResponse.size());
+        std::vector<tihmstar::Mem> cmdResponses(totalCommands);
+        NandCommandBatch batch;
+        for (size_t i = 0; i < totalCommands; i++) {
+            auto &cmd = multipleNandCmds[i];
+            cmdResponses[i].resize(cmd.cmdResponseSize);
+            batch.addCommand(CE, cmd.cmdCommand.data(), cmd.cmdCommand.size(), cmd.cmdAddress.data(), cmd.cmdAddress.size(), cmd.cmdData.data(), cmd.cmdData.size(), cmdResponses[i].data(), cmdResponses[i].size(), i+1 < totalCommands);
+        }
+        pnr.executeBatch(batch);
+        for (size_t i = 0; i < totalCommands; i++) {
+            printf("\nCommand %zu\n",i);
+            DumpHex(cmdResponses[i].data(), cmdResponses[i].size());
         }
     }else{
         cmd_help();